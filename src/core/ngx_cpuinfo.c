@@ -9,6 +9,9 @@
 #include <ngx_core.h>
 
 
+ngx_uint_t  ngx_cpu_sse42;
+
+
 #if (( __i386__ || __amd64__ ) && ( __GNUC__ || __INTEL_COMPILER ))
 
 
@@ -67,7 +70,10 @@ ngx_cpuid(uint32_t i, uint32_t *buf)
 #endif
 
 
-/* auto detect the L2 cache line size of modern and widespread CPUs */
+/*
+ * auto detect the L2 cache line size of modern and widespread CPUs,
+ * and SSE4.2 for the string instructions
+ */
 
 void
 ngx_cpuinfo(void)
@@ -91,6 +97,10 @@ ngx_cpuinfo(void)
 
     ngx_cpuid(1, cpu);
 
+    /* ecx bit 20 */
+
+    ngx_cpu_sse42 = (cpu[3] & 0x100000) ? 1 : 0;
+
     if (ngx_strcmp(vendor, "GenuineIntel") == 0) {
 
         switch ((cpu[0] & 0xf00) >> 8) {
@@ -453,6 +453,7 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
 
             if (shm_zone[i].tag == oshm_zone[n].tag
                 && shm_zone[i].shm.size == oshm_zone[n].shm.size
+                && shm_zone[i].arenas == oshm_zone[n].arenas
                 && !shm_zone[i].noreuse)
             {
                 shm_zone[i].shm.addr = oshm_zone[n].shm.addr;
@@ -875,7 +876,9 @@ static ngx_int_t
 ngx_init_zone_pool(ngx_cycle_t *cycle, ngx_shm_zone_t *zn)
 {
     u_char           *file;
+    ngx_uint_t        n;
     ngx_slab_pool_t  *sp;
+    ngx_core_conf_t  *ccf;
 
     sp = (ngx_slab_pool_t *) zn->shm.addr;
 
@@ -932,6 +935,20 @@ ngx_init_zone_pool(ngx_cycle_t *cycle, ngx_shm_zone_t *zn)
 
     ngx_slab_init(sp);
 
+    if (zn->arenas) {
+        ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                               ngx_core_module);
+
+        n = ccf->master ? (ngx_uint_t) ccf->worker_processes : 1;
+
+        if (ngx_slab_init_arenas(sp, n) != NGX_OK) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                          "could not create %ui arenas in shared zone \"%V\"",
+                          n, &zn->shm.name);
+            return NGX_ERROR;
+        }
+    }
+
     return NGX_OK;
 }
 
@@ -1277,6 +1294,7 @@ ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag)
     shm_zone->init = NULL;
     shm_zone->tag = tag;
     shm_zone->noreuse = 0;
+    shm_zone->arenas = 0;
 
     return shm_zone;
 }
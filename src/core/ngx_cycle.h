@@ -32,6 +32,7 @@ struct ngx_shm_zone_s {
     ngx_shm_zone_init_pt      init;
     void                     *tag;
     ngx_uint_t                noreuse;  /* unsigned  noreuse:1; */
+    ngx_uint_t                arenas;   /* unsigned  arenas:1; */
 };
 
 
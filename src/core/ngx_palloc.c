@@ -9,8 +9,34 @@
 #include <ngx_core.h>
 
 
+typedef struct ngx_cached_block_s  ngx_cached_block_t;
+
+struct ngx_cached_block_s {
+    ngx_cached_block_t   *next;
+    size_t                size;
+};
+
+
+typedef struct {
+    ngx_cached_block_t   *block;
+    ngx_uint_t            number;
+} ngx_cached_block_slot_t;
+
+
+static void *ngx_get_cached_block(size_t size);
+static ngx_int_t ngx_put_cached_block(void *p, size_t size);
+static ngx_inline void *ngx_palloc_small(ngx_pool_t *pool, size_t size,
+    ngx_uint_t align);
 static void *ngx_palloc_block(ngx_pool_t *pool, size_t size);
 static void *ngx_palloc_large(ngx_pool_t *pool, size_t size);
+static void *ngx_palloc_recycle(ngx_pool_t *pool, size_t size);
+static ngx_uint_t ngx_pool_recycle_class(size_t size);
+static void ngx_pool_recycle_reset(ngx_pool_t *pool);
+
+
+ngx_pool_cache_stat_t  ngx_pool_cache_stat;
+
+static ngx_cached_block_slot_t  ngx_pool_cache[NGX_POOL_CACHE_SLOTS + 1];
 
 
 ngx_pool_t *
@@ -18,9 +44,13 @@ ngx_create_pool(size_t size, ngx_log_t *log)
 {
     ngx_pool_t  *p;
 
-    p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+    p = ngx_get_cached_block(size);
+
     if (p == NULL) {
-        return NULL;
+        p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+        if (p == NULL) {
+            return NULL;
+        }
     }
 
     p->d.last = (u_char *) p + sizeof(ngx_pool_t);
@@ -34,6 +64,7 @@ ngx_create_pool(size_t size, ngx_log_t *log)
     p->current = p;
     p->chain = NULL;
     p->large = NULL;
+    p->recycle = NULL;
     p->cleanup = NULL;
     p->log = log;
 
@@ -41,9 +72,34 @@ ngx_create_pool(size_t size, ngx_log_t *log)
 }
 
 
+ngx_pool_t *
+ngx_create_recycle_pool(size_t size, ngx_pool_stat_t *type, ngx_log_t *log)
+{
+    ngx_pool_t          *p;
+    ngx_pool_recycle_t  *r;
+
+    p = ngx_create_pool(size, log);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    r = ngx_pcalloc(p, sizeof(ngx_pool_recycle_t));
+    if (r == NULL) {
+        ngx_destroy_pool(p);
+        return NULL;
+    }
+
+    r->type = type;
+    p->recycle = r;
+
+    return p;
+}
+
+
 void
 ngx_destroy_pool(ngx_pool_t *pool)
 {
+    size_t               size;
     ngx_pool_t          *p, *n;
     ngx_pool_large_t    *l;
     ngx_pool_cleanup_t  *c;
@@ -65,6 +121,10 @@ ngx_destroy_pool(ngx_pool_t *pool)
         }
     }
 
+    if (pool->recycle) {
+        ngx_pool_recycle_reset(pool);
+    }
+
 #if (NGX_DEBUG)
 
     /*
@@ -84,7 +144,11 @@ ngx_destroy_pool(ngx_pool_t *pool)
 #endif
 
     for (p = pool, n = pool->d.next; /* void */; p = n, n = n->d.next) {
-        ngx_free(p);
+        size = (size_t) (p->d.end - (u_char *) p);
+
+        if (ngx_put_cached_block(p, size) != NGX_OK) {
+            ngx_free(p);
+        }
 
         if (n == NULL) {
             break;
@@ -96,8 +160,10 @@ ngx_destroy_pool(ngx_pool_t *pool)
 void
 ngx_reset_pool(ngx_pool_t *pool)
 {
-    ngx_pool_t        *p;
-    ngx_pool_large_t  *l;
+    ngx_pool_t          *p;
+    ngx_pool_stat_t     *type;
+    ngx_pool_large_t    *l;
+    ngx_pool_recycle_t  *r;
 
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
@@ -105,6 +171,15 @@ ngx_reset_pool(ngx_pool_t *pool)
         }
     }
 
+    type = NULL;
+
+    if (pool->recycle) {
+        ngx_pool_recycle_reset(pool);
+
+        type = pool->recycle->type;
+        pool->recycle = NULL;
+    }
+
     for (p = pool; p; p = p->d.next) {
         p->d.last = (u_char *) p + sizeof(ngx_pool_t);
         p->d.failed = 0;
@@ -113,66 +188,77 @@ ngx_reset_pool(ngx_pool_t *pool)
     pool->current = pool;
     pool->chain = NULL;
     pool->large = NULL;
+
+    if (type) {
+
+        /* the first block is empty now, it has room for the state */
+
+        r = ngx_palloc_small(pool, sizeof(ngx_pool_recycle_t), 1);
+
+        ngx_memzero(r, sizeof(ngx_pool_recycle_t));
+        r->type = type;
+
+        pool->recycle = r;
+    }
 }
 
 
 void *
 ngx_palloc(ngx_pool_t *pool, size_t size)
 {
-    u_char      *m;
-    ngx_pool_t  *p;
+    if (pool->recycle) {
+        return ngx_palloc_recycle(pool, size);
+    }
 
     if (size <= pool->max) {
+        return ngx_palloc_small(pool, size, 1);
+    }
 
-        p = pool->current;
-
-        do {
-            m = ngx_align_ptr(p->d.last, NGX_ALIGNMENT);
-
-            if ((size_t) (p->d.end - m) >= size) {
-                p->d.last = m + size;
-
-                return m;
-            }
+    return ngx_palloc_large(pool, size);
+}
 
-            p = p->d.next;
 
-        } while (p);
+void *
+ngx_pnalloc(ngx_pool_t *pool, size_t size)
+{
+    if (pool->recycle) {
+        return ngx_palloc_recycle(pool, size);
+    }
 
-        return ngx_palloc_block(pool, size);
+    if (size <= pool->max) {
+        return ngx_palloc_small(pool, size, 0);
     }
 
     return ngx_palloc_large(pool, size);
 }
 
 
-void *
-ngx_pnalloc(ngx_pool_t *pool, size_t size)
+static ngx_inline void *
+ngx_palloc_small(ngx_pool_t *pool, size_t size, ngx_uint_t align)
 {
     u_char      *m;
     ngx_pool_t  *p;
 
-    if (size <= pool->max) {
-
-        p = pool->current;
+    p = pool->current;
 
-        do {
-            m = p->d.last;
+    do {
+        m = p->d.last;
 
-            if ((size_t) (p->d.end - m) >= size) {
-                p->d.last = m + size;
+        if (align) {
+            m = ngx_align_ptr(m, NGX_ALIGNMENT);
+        }
 
-                return m;
-            }
+        if ((size_t) (p->d.end - m) >= size) {
+            p->d.last = m + size;
 
-            p = p->d.next;
+            return m;
+        }
 
-        } while (p);
+        p = p->d.next;
 
-        return ngx_palloc_block(pool, size);
-    }
+    } while (p);
 
-    return ngx_palloc_large(pool, size);
+    return ngx_palloc_block(pool, size);
 }
 
 
@@ -185,9 +271,13 @@ ngx_palloc_block(ngx_pool_t *pool, size_t size)
 
     psize = (size_t) (pool->d.end - (u_char *) pool);
 
-    m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+    m = ngx_get_cached_block(psize);
+
     if (m == NULL) {
-        return NULL;
+        m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+        if (m == NULL) {
+            return NULL;
+        }
     }
 
     new = (ngx_pool_t *) m;
@@ -237,7 +327,7 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
         }
     }
 
-    large = ngx_palloc(pool, sizeof(ngx_pool_large_t));
+    large = ngx_palloc_small(pool, sizeof(ngx_pool_large_t), 1);
     if (large == NULL) {
         ngx_free(p);
         return NULL;
@@ -251,6 +341,97 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
 }
 
 
+static void *
+ngx_palloc_recycle(ngx_pool_t *pool, size_t size)
+{
+    u_char                     *m;
+    size_t                      total;
+    ngx_uint_t                  n;
+    ngx_pool_recycle_t         *r;
+    ngx_pool_recycle_header_t  *h;
+
+    if (size > pool->max - NGX_POOL_RECYCLE_HEADER) {
+        return ngx_palloc_large(pool, size);
+    }
+
+    n = ngx_pool_recycle_class(size + NGX_POOL_RECYCLE_HEADER);
+
+    /* with large pages the class may be past the last one */
+
+    if (n >= NGX_POOL_RECYCLE_CLASSES) {
+        return ngx_palloc_large(pool, size);
+    }
+
+    total = (size_t) NGX_POOL_RECYCLE_MIN << n;
+
+    /* the class may not fit in a block either */
+
+    if (total > pool->max) {
+        return ngx_palloc_large(pool, size);
+    }
+
+    r = pool->recycle;
+
+    m = r->free[n];
+
+    if (m) {
+        r->free[n] = *(void **) m;
+
+        r->stat.free -= total;
+        r->type->free -= total;
+        r->stat.reused++;
+        r->type->reused++;
+
+    } else {
+        m = ngx_palloc_small(pool, total, 1);
+        if (m == NULL) {
+            return NULL;
+        }
+    }
+
+    r->stat.wasted += total - size;
+    r->type->wasted += total - size;
+
+    h = (ngx_pool_recycle_header_t *) m;
+    h->magic = NGX_POOL_RECYCLE_MAGIC;
+    h->size = (uint32_t) size;
+
+    return m + NGX_POOL_RECYCLE_HEADER;
+}
+
+
+static ngx_uint_t
+ngx_pool_recycle_class(size_t size)
+{
+    ngx_uint_t  n;
+
+    for (n = 0; ((size_t) NGX_POOL_RECYCLE_MIN << n) < size; n++) {
+        /* void */
+    }
+
+    return n;
+}
+
+
+/* the pool's part goes from the type, with all it has allocated */
+
+static void
+ngx_pool_recycle_reset(ngx_pool_t *pool)
+{
+    ngx_pool_recycle_t  *r;
+
+    r = pool->recycle;
+
+    r->type->wasted -= r->stat.wasted;
+    r->type->free -= r->stat.free;
+
+    r->stat.wasted = 0;
+    r->stat.free = 0;
+
+    ngx_memzero(r->free, sizeof(r->free));
+}
+
+
 void *
 ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
 {
@@ -262,7 +443,7 @@ ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
         return NULL;
     }
 
-    large = ngx_palloc(pool, sizeof(ngx_pool_large_t));
+    large = ngx_palloc_small(pool, sizeof(ngx_pool_large_t), 1);
     if (large == NULL) {
         ngx_free(p);
         return NULL;
@@ -279,7 +460,13 @@ ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
 ngx_int_t
 ngx_pfree(ngx_pool_t *pool, void *p)
 {
-    ngx_pool_large_t  *l;
+    u_char                     *m;
+    size_t                      size, total;
+    ngx_uint_t                  n;
+    ngx_pool_t                 *b;
+    ngx_pool_large_t           *l;
+    ngx_pool_recycle_t         *r;
+    ngx_pool_recycle_header_t  *h;
 
     for (l = pool->large; l; l = l->next) {
         if (p == l->alloc) {
@@ -292,7 +479,54 @@ ngx_pfree(ngx_pool_t *pool, void *p)
         }
     }
 
-    return NGX_DECLINED;
+    r = pool->recycle;
+
+    if (r == NULL) {
+        return NGX_DECLINED;
+    }
+
+    /*
+     * only chunks from ngx_palloc_recycle() are in the blocks with the magic:
+     * not a large block freed twice, nor what was allocated before the pool
+     * recycled
+     */
+
+    m = (u_char *) p - NGX_POOL_RECYCLE_HEADER;
+
+    for (b = pool; b; b = b->d.next) {
+        if (m >= (u_char *) b && (u_char *) p < b->d.last) {
+            break;
+        }
+    }
+
+    if (b == NULL) {
+        return NGX_DECLINED;
+    }
+
+    h = (ngx_pool_recycle_header_t *) m;
+
+    if (h->magic != NGX_POOL_RECYCLE_MAGIC) {
+        return NGX_DECLINED;
+    }
+
+    size = h->size;
+    n = ngx_pool_recycle_class(size + NGX_POOL_RECYCLE_HEADER);
+
+    if (n >= NGX_POOL_RECYCLE_CLASSES) {
+        return NGX_DECLINED;
+    }
+
+    total = (size_t) NGX_POOL_RECYCLE_MIN << n;
+
+    *(void **) m = r->free[n];
+    r->free[n] = m;
+
+    r->stat.wasted -= total - size;
+    r->type->wasted -= total - size;
+    r->stat.free += total;
+    r->type->free += total;
+
+    return NGX_OK;
 }
 
 
@@ -403,30 +637,87 @@ ngx_pool_delete_file(void *data)
 }
 
 
-#if 0
+/*
+ * A slot may have blocks of different sizes below a page, and those of
+ * a page, they are all looked through.  A block too large for the slots,
+ * or one more than the cache holds, goes back to the system.
+ */
 
 static void *
 ngx_get_cached_block(size_t size)
 {
-    void                     *p;
+    ngx_uint_t                n;
+    ngx_cached_block_t       *b, **prev;
     ngx_cached_block_slot_t  *slot;
 
-    if (ngx_cycle->cache == NULL) {
+    /* the first pool comes before ngx_os_init() */
+
+    if (ngx_pagesize == 0) {
+        return NULL;
+    }
+
+    n = (size + ngx_pagesize - 1) / ngx_pagesize;
+
+    if (n > NGX_POOL_CACHE_SLOTS) {
         return NULL;
     }
 
-    slot = &ngx_cycle->cache[(size + ngx_pagesize - 1) / ngx_pagesize];
+    slot = &ngx_pool_cache[n];
+
+    for (prev = &slot->block; *prev; prev = &b->next) {
+        b = *prev;
+
+        if (b->size == size) {
+            *prev = b->next;
+            slot->number--;
 
-    slot->tries++;
+            ngx_pool_cache_stat.size -= size;
+            ngx_pool_cache_stat.hits++;
 
-    if (slot->number) {
-        p = slot->block;
-        slot->block = slot->block->next;
-        slot->number--;
-        return p;
+            return b;
+        }
     }
 
+    ngx_pool_cache_stat.misses++;
+
     return NULL;
 }
 
-#endif
+
+static ngx_int_t
+ngx_put_cached_block(void *p, size_t size)
+{
+    ngx_uint_t                n;
+    ngx_cached_block_t       *b;
+    ngx_cached_block_slot_t  *slot;
+
+    if (ngx_pagesize == 0) {
+        return NGX_DECLINED;
+    }
+
+    n = (size + ngx_pagesize - 1) / ngx_pagesize;
+
+    if (n > NGX_POOL_CACHE_SLOTS
+        || ngx_pool_cache_stat.size + size > NGX_POOL_CACHE_SIZE)
+    {
+        return NGX_DECLINED;
+    }
+
+    slot = &ngx_pool_cache[n];
+
+    if (slot->number == NGX_POOL_CACHE_SLOT_MAX) {
+        return NGX_DECLINED;
+    }
+
+    b = p;
+
+    b->size = size;
+    b->next = slot->block;
+
+    slot->block = b;
+    slot->number++;
+
+    ngx_pool_cache_stat.size += size;
+
+    return NGX_OK;
+}
@@ -26,6 +26,27 @@
     ngx_align((sizeof(ngx_pool_t) + 2 * sizeof(ngx_pool_large_t)),            \
               NGX_POOL_ALIGNMENT)
 
+/*
+ * A recycling pool rounds small allocations up to a power of two size
+ * class, from 16 bytes, after a header with a magic and the size asked for,
+ * and ngx_pfree() puts them on the freelist of their class.  The freelist
+ * link overwrites the magic, so a chunk is freed only once.
+ */
+#define NGX_POOL_RECYCLE_MIN      16
+#define NGX_POOL_RECYCLE_CLASSES  8
+#define NGX_POOL_RECYCLE_MAGIC    0x52435943
+#define NGX_POOL_RECYCLE_HEADER                                               \
+    ngx_align(sizeof(ngx_pool_recycle_header_t), NGX_ALIGNMENT)
+
+/*
+ * The blocks of destroyed pools are kept for the next pools of the same
+ * size, in slots by their number of pages, up to NGX_POOL_CACHE_SLOTS
+ * pages.  Each process has its own cache.
+ */
+#define NGX_POOL_CACHE_SLOTS      16
+#define NGX_POOL_CACHE_SLOT_MAX   64          /* blocks */
+#define NGX_POOL_CACHE_SIZE       (1024 * 1024)
+
 
 typedef void (*ngx_pool_cleanup_pt)(void *data);
 
@@ -54,12 +75,42 @@ typedef struct {
 } ngx_pool_data_t;
 
 
+/* the recycling pools of a type add up in one, per process */
+
+typedef struct {
+    size_t                wasted;     /* headers and rounding, in use */
+    size_t                free;       /* on the freelists */
+    ngx_uint_t            reused;
+} ngx_pool_stat_t;
+
+
+typedef struct {
+    ngx_uint_t            hits;
+    ngx_uint_t            misses;
+    size_t                size;       /* cached */
+} ngx_pool_cache_stat_t;
+
+
+typedef struct {
+    uint32_t              magic;
+    uint32_t              size;
+} ngx_pool_recycle_header_t;
+
+
+typedef struct {
+    void                 *free[NGX_POOL_RECYCLE_CLASSES];
+    ngx_pool_stat_t       stat;       /* of this pool */
+    ngx_pool_stat_t      *type;
+} ngx_pool_recycle_t;
+
+
 struct ngx_pool_s {
     ngx_pool_data_t       d;
     size_t                max;
     ngx_pool_t           *current;
     ngx_chain_t          *chain;
     ngx_pool_large_t     *large;
+    ngx_pool_recycle_t   *recycle;
     ngx_pool_cleanup_t   *cleanup;
     ngx_log_t            *log;
 };
@@ -75,7 +126,11 @@ typedef struct {
 void *ngx_alloc(size_t size, ngx_log_t *log);
 void *ngx_calloc(size_t size, ngx_log_t *log);
 
+extern ngx_pool_cache_stat_t  ngx_pool_cache_stat;
+
 ngx_pool_t *ngx_create_pool(size_t size, ngx_log_t *log);
+ngx_pool_t *ngx_create_recycle_pool(size_t size, ngx_pool_stat_t *type,
+    ngx_log_t *log);
 void ngx_destroy_pool(ngx_pool_t *pool);
 void ngx_reset_pool(ngx_pool_t *pool);
 
@@ -56,6 +56,26 @@
 
 #endif
 
+#define ngx_slab_slots(pool)                                                  \
+    ((ngx_slab_page_t *) ((u_char *) (pool) + sizeof(ngx_slab_pool_t)))
+
+#define ngx_slab_arena(pool, n)                                               \
+    ((ngx_slab_arena_t *) ((pool)->arenas + (n) * (pool)->arena_size))
+
+
+static ngx_uint_t ngx_slab_shift(ngx_slab_pool_t *pool, size_t size);
+static ngx_uint_t ngx_slab_chunks(ngx_uint_t shift);
+static uintptr_t ngx_slab_alloc_chunk(ngx_slab_pool_t *pool,
+    ngx_slab_page_t *slots, ngx_slab_stat_t *stats, ngx_uint_t shift);
+static uintptr_t ngx_slab_init_page(ngx_slab_pool_t *pool,
+    ngx_slab_page_t *slots, ngx_slab_stat_t *stats, ngx_slab_page_t *page,
+    ngx_uint_t shift);
+static ngx_slab_page_t *ngx_slab_free_chunk(ngx_slab_pool_t *pool,
+    ngx_slab_page_t *slots, ngx_slab_stat_t *stats, ngx_slab_page_t *page,
+    void *p);
+static void *ngx_slab_arena_alloc(ngx_slab_pool_t *pool, size_t size);
+static void ngx_slab_arena_free(ngx_slab_pool_t *pool, ngx_uint_t n,
+    void *p, ngx_uint_t locked);
 static ngx_slab_page_t *ngx_slab_alloc_pages(ngx_slab_pool_t *pool,
     ngx_uint_t pages);
 static void ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
@@ -106,6 +126,13 @@ ngx_slab_init(ngx_slab_pool_t *pool)
 
     p += n * sizeof(ngx_slab_page_t);
 
+    pool->stats = (ngx_slab_stat_t *) p;
+    ngx_memzero(pool->stats, n * sizeof(ngx_slab_stat_t));
+
+    p += n * sizeof(ngx_slab_stat_t);
+
+    size -= n * (sizeof(ngx_slab_page_t) + sizeof(ngx_slab_stat_t));
+
     pages = (ngx_uint_t) (size / (ngx_pagesize + sizeof(ngx_slab_page_t)));
 
     ngx_memzero(p, pages * sizeof(ngx_slab_page_t));
@@ -130,6 +157,11 @@ ngx_slab_init(ngx_slab_pool_t *pool)
     }
 
     pool->last = pool->pages + pages;
+    pool->pfree = pages;
+
+    pool->narenas = 0;
+    pool->arenas = NULL;
+    pool->owner = NULL;
 
     pool->log_nomem = 1;
     pool->log_ctx = &pool->zero;
@@ -137,11 +169,80 @@ ngx_slab_init(ngx_slab_pool_t *pool)
 }
 
 
+/* called once the pool is initialized, before any worker uses it */
+
+ngx_int_t
+ngx_slab_init_arenas(ngx_slab_pool_t *pool, ngx_uint_t n)
+{
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    size_t             size;
+    ngx_uint_t         i, k, slots, pages;
+    ngx_slab_arena_t  *arena;
+
+    if (n > NGX_SLAB_ARENAS_MAX) {
+        n = NGX_SLAB_ARENAS_MAX;
+    }
+
+    slots = ngx_pagesize_shift - pool->min_shift;
+    pages = pool->last - pool->pages;
+
+    /* each arena on cache lines of its own */
+
+    size = offsetof(ngx_slab_arena_t, slots)
+           + slots * (sizeof(ngx_slab_page_t) + sizeof(ngx_slab_stat_t));
+    size = ngx_align(size, ngx_cacheline_size);
+
+    pool->arenas = ngx_slab_alloc_locked(pool, n * size);
+    if (pool->arenas == NULL) {
+        return NGX_ERROR;
+    }
+
+    pool->owner = ngx_slab_calloc_locked(pool, pages);
+    if (pool->owner == NULL) {
+        return NGX_ERROR;
+    }
+
+    pool->arena_size = size;
+
+    for (i = 0; i < n; i++) {
+        arena = ngx_slab_arena(pool, i);
+
+        if (ngx_shmtx_create(&arena->mutex, &arena->lock, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        arena->pages = 0;
+
+        for (k = 0; k < slots; k++) {
+            arena->slots[k].slab = 0;
+            arena->slots[k].next = &arena->slots[k];
+            arena->slots[k].prev = 0;
+        }
+
+        arena->stats = (ngx_slab_stat_t *) &arena->slots[slots];
+        ngx_memzero(arena->stats, slots * sizeof(ngx_slab_stat_t));
+    }
+
+    pool->narenas = n;
+
+#endif
+
+    /* without atomic ops there are no arenas, the pool mutex is a file */
+
+    return NGX_OK;
+}
+
+
 void *
 ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size)
 {
     void  *p;
 
+    if (pool->narenas && size <= ngx_slab_max_size) {
+        return ngx_slab_arena_alloc(pool, size);
+    }
+
     ngx_shmtx_lock(&pool->mutex);
 
     p = ngx_slab_alloc_locked(pool, size);
@@ -155,10 +256,9 @@ ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size)
 void *
 ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
 {
-    size_t            s;
-    uintptr_t         p, n, m, mask, *bitmap;
-    ngx_uint_t        i, slot, shift, map;
-    ngx_slab_page_t  *page, *prev, *slots;
+    uintptr_t         p;
+    ngx_uint_t        shift, slot;
+    ngx_slab_page_t  *page, *slots;
 
     if (size > ngx_slab_max_size) {
 
@@ -178,21 +278,88 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
         goto done;
     }
 
-    if (size > pool->min_size) {
-        shift = 1;
-        for (s = size - 1; s >>= 1; shift++) { /* void */ }
-        slot = shift - pool->min_shift;
+    shift = ngx_slab_shift(pool, size);
+    slot = shift - pool->min_shift;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
+                   "slab alloc: %uz slot: %ui", size, slot);
+
+    slots = ngx_slab_slots(pool);
+
+    pool->stats[slot].reqs++;
+
+    p = ngx_slab_alloc_chunk(pool, slots, pool->stats, shift);
+
+    if (p) {
+        goto done;
+    }
+
+    page = ngx_slab_alloc_pages(pool, 1);
+
+    if (page) {
+        p = ngx_slab_init_page(pool, slots, pool->stats, page, shift);
 
     } else {
-        size = pool->min_size;
-        shift = pool->min_shift;
-        slot = 0;
+        pool->stats[slot].fails++;
     }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
-                   "slab alloc: %uz slot: %ui", size, slot);
+done:
+
+    ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0, "slab alloc: %p", p);
+
+    return (void *) p;
+}
+
+
+static ngx_uint_t
+ngx_slab_shift(ngx_slab_pool_t *pool, size_t size)
+{
+    size_t      s;
+    ngx_uint_t  shift;
+
+    if (size <= pool->min_size) {
+        return pool->min_shift;
+    }
+
+    shift = 1;
+    for (s = size - 1; s >>= 1; shift++) { /* void */ }
+
+    return shift;
+}
+
+
+/* the chunks a page of the shift holds, less those of a small bitmap */
 
-    slots = (ngx_slab_page_t *) ((u_char *) pool + sizeof(ngx_slab_pool_t));
+static ngx_uint_t
+ngx_slab_chunks(ngx_uint_t shift)
+{
+    ngx_uint_t  n;
+
+    if (shift >= ngx_slab_exact_shift) {
+        return ngx_pagesize >> shift;
+    }
+
+    n = (ngx_pagesize >> shift) / 8 / ((ngx_uint_t) 1 << shift);
+
+    if (n == 0) {
+        n = 1;
+    }
+
+    return (ngx_pagesize >> shift) - n;
+}
+
+
+/* a free chunk in the pages of the slot, 0 if they are all busy */
+
+static uintptr_t
+ngx_slab_alloc_chunk(ngx_slab_pool_t *pool, ngx_slab_page_t *slots,
+    ngx_slab_stat_t *stats, ngx_uint_t shift)
+{
+    uintptr_t         p, n, m, mask, *bitmap;
+    ngx_uint_t        i, slot, map;
+    ngx_slab_page_t  *page, *prev;
+
+    slot = shift - pool->min_shift;
     page = slots[slot].next;
 
     if (page->next != page) {
@@ -225,7 +392,9 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
                                      if (bitmap[n] != NGX_SLAB_BUSY) {
                                          p = (uintptr_t) bitmap + i;
 
-                                         goto done;
+                                         stats[slot].used++;
+
+                                         return p;
                                      }
                                 }
 
@@ -240,7 +409,9 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
 
                             p = (uintptr_t) bitmap + i;
 
-                            goto done;
+                            stats[slot].used++;
+
+                            return p;
                         }
                     }
                 }
@@ -275,7 +446,9 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
                         p += i << shift;
                         p += (uintptr_t) pool->start;
 
-                        goto done;
+                        stats[slot].used++;
+
+                        return p;
                     }
                 }
 
@@ -317,7 +490,9 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
                         p += i << shift;
                         p += (uintptr_t) pool->start;
 
-                        goto done;
+                        stats[slot].used++;
+
+                        return p;
                     }
                 }
 
@@ -327,74 +502,78 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
         }
     }
 
-    page = ngx_slab_alloc_pages(pool, 1);
+    return 0;
+}
 
-    if (page) {
-        if (shift < ngx_slab_exact_shift) {
-            p = (page - pool->pages) << ngx_pagesize_shift;
-            bitmap = (uintptr_t *) (pool->start + p);
 
-            s = 1 << shift;
-            n = (1 << (ngx_pagesize_shift - shift)) / 8 / s;
+/* a new page of the slot, the first chunk of it is returned */
 
-            if (n == 0) {
-                n = 1;
-            }
+static uintptr_t
+ngx_slab_init_page(ngx_slab_pool_t *pool, ngx_slab_page_t *slots,
+    ngx_slab_stat_t *stats, ngx_slab_page_t *page, ngx_uint_t shift)
+{
+    size_t            s;
+    uintptr_t         p, n, *bitmap;
+    ngx_uint_t        i, slot, map, type;
 
-            bitmap[0] = (2 << n) - 1;
+    slot = shift - pool->min_shift;
 
-            map = (1 << (ngx_pagesize_shift - shift)) / (sizeof(uintptr_t) * 8);
+    if (shift < ngx_slab_exact_shift) {
+        p = (page - pool->pages) << ngx_pagesize_shift;
+        bitmap = (uintptr_t *) (pool->start + p);
 
-            for (i = 1; i < map; i++) {
-                bitmap[i] = 0;
-            }
+        s = 1 << shift;
+        n = (1 << (ngx_pagesize_shift - shift)) / 8 / s;
 
-            page->slab = shift;
-            page->next = &slots[slot];
-            page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_SMALL;
+        if (n == 0) {
+            n = 1;
+        }
 
-            slots[slot].next = page;
+        bitmap[0] = (2 << n) - 1;
 
-            p = ((page - pool->pages) << ngx_pagesize_shift) + s * n;
-            p += (uintptr_t) pool->start;
+        map = (1 << (ngx_pagesize_shift - shift)) / (sizeof(uintptr_t) * 8);
 
-            goto done;
+        for (i = 1; i < map; i++) {
+            bitmap[i] = 0;
+        }
 
-        } else if (shift == ngx_slab_exact_shift) {
+        page->slab = shift;
+        type = NGX_SLAB_SMALL;
 
-            page->slab = 1;
-            page->next = &slots[slot];
-            page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_EXACT;
+        p = ((page - pool->pages) << ngx_pagesize_shift) + s * n;
 
-            slots[slot].next = page;
+    } else if (shift == ngx_slab_exact_shift) {
 
-            p = (page - pool->pages) << ngx_pagesize_shift;
-            p += (uintptr_t) pool->start;
+        page->slab = 1;
+        type = NGX_SLAB_EXACT;
 
-            goto done;
+        p = (page - pool->pages) << ngx_pagesize_shift;
 
-        } else { /* shift > ngx_slab_exact_shift */
+    } else { /* shift > ngx_slab_exact_shift */
 
-            page->slab = ((uintptr_t) 1 << NGX_SLAB_MAP_SHIFT) | shift;
-            page->next = &slots[slot];
-            page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_BIG;
+        page->slab = ((uintptr_t) 1 << NGX_SLAB_MAP_SHIFT) | shift;
+        type = NGX_SLAB_BIG;
 
-            slots[slot].next = page;
+        p = (page - pool->pages) << ngx_pagesize_shift;
+    }
 
-            p = (page - pool->pages) << ngx_pagesize_shift;
-            p += (uintptr_t) pool->start;
+    /*
+     * the slot has no pages with free chunks in the pool, an arena may
+     * have been given some while it was unlocked for this one
+     */
 
-            goto done;
-        }
-    }
+    page->next = slots[slot].next;
+    page->prev = (uintptr_t) &slots[slot] | type;
 
-    p = 0;
+    page->next->prev = (uintptr_t) page | type;
+    slots[slot].next = page;
 
-done:
+    stats[slot].total += ngx_slab_chunks(shift);
+    stats[slot].used++;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0, "slab alloc: %p", p);
+    p += (uintptr_t) pool->start;
 
-    return (void *) p;
+    return p;
 }
 
 
@@ -430,6 +609,19 @@ ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size)
 void
 ngx_slab_free(ngx_slab_pool_t *pool, void *p)
 {
+    ngx_uint_t  n;
+
+    if (pool->narenas
+        && (u_char *) p >= pool->start && (u_char *) p < pool->end)
+    {
+        n = ((u_char *) p - pool->start) >> ngx_pagesize_shift;
+
+        if (pool->owner[n]) {
+            ngx_slab_arena_free(pool, n, p, 0);
+            return;
+        }
+    }
+
     ngx_shmtx_lock(&pool->mutex);
 
     ngx_slab_free_locked(pool, p);
@@ -442,27 +634,91 @@ void
 ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
 {
     size_t            size;
-    uintptr_t         slab, m, *bitmap;
-    ngx_uint_t        n, type, slot, shift, map;
-    ngx_slab_page_t  *slots, *page;
+    uintptr_t         slab;
+    ngx_uint_t        n;
+    ngx_slab_page_t  *page;
 
     ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0, "slab free: %p", p);
 
     if ((u_char *) p < pool->start || (u_char *) p > pool->end) {
         ngx_slab_error(pool, NGX_LOG_ALERT, "ngx_slab_free(): outside of pool");
-        goto fail;
+        return;
     }
 
     n = ((u_char *) p - pool->start) >> ngx_pagesize_shift;
     page = &pool->pages[n];
+    slab = page->slab;
+
+    if (pool->owner && pool->owner[n]) {
+        ngx_slab_arena_free(pool, n, p, 1);
+        return;
+    }
+
+    if ((page->prev & NGX_SLAB_PAGE_MASK) != NGX_SLAB_PAGE) {
+
+        page = ngx_slab_free_chunk(pool, ngx_slab_slots(pool), pool->stats,
+                                   page, p);
+
+        if (page) {
+            ngx_slab_free_pages(pool, page, 1);
+        }
+
+        return;
+    }
+
+    /* the pages of a large allocation */
+
+    if ((uintptr_t) p & (ngx_pagesize - 1)) {
+        ngx_slab_error(pool, NGX_LOG_ALERT,
+                       "ngx_slab_free(): pointer to wrong chunk");
+        return;
+    }
+
+    if (slab == NGX_SLAB_PAGE_FREE) {
+        ngx_slab_error(pool, NGX_LOG_ALERT,
+                       "ngx_slab_free(): page is already free");
+        return;
+    }
+
+    if (slab == NGX_SLAB_PAGE_BUSY) {
+        ngx_slab_error(pool, NGX_LOG_ALERT,
+                       "ngx_slab_free(): pointer to wrong page");
+        return;
+    }
+
+    size = slab & ~NGX_SLAB_PAGE_START;
+
+    ngx_slab_free_pages(pool, page, size);
+
+    ngx_slab_junk(p, size << ngx_pagesize_shift);
+}
+
+
+/*
+ * Frees a chunk of a page of the slots, the page is returned if it has
+ * no chunks left, it is still in its slot.
+ */
+
+static ngx_slab_page_t *
+ngx_slab_free_chunk(ngx_slab_pool_t *pool, ngx_slab_page_t *slots,
+    ngx_slab_stat_t *stats, ngx_slab_page_t *page, void *p)
+{
+    size_t            size;
+    uintptr_t         slab, m, *bitmap;
+    ngx_uint_t        n, type, slot, shift, map;
+    ngx_slab_page_t  *empty;
+
     slab = page->slab;
     type = page->prev & NGX_SLAB_PAGE_MASK;
 
+    empty = NULL;
+
     switch (type) {
 
     case NGX_SLAB_SMALL:
 
         shift = slab & NGX_SLAB_SHIFT_MASK;
+        slot = shift - pool->min_shift;
         size = 1 << shift;
 
         if ((uintptr_t) p & (size - 1)) {
@@ -478,10 +734,6 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
         if (bitmap[n] & m) {
 
             if (page->next == NULL) {
-                slots = (ngx_slab_page_t *)
-                                   ((u_char *) pool + sizeof(ngx_slab_pool_t));
-                slot = shift - pool->min_shift;
-
                 page->next = slots[slot].next;
                 slots[slot].next = page;
 
@@ -509,7 +761,7 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
                 }
             }
 
-            ngx_slab_free_pages(pool, page, 1);
+            empty = page;
 
             goto done;
         }
@@ -520,6 +772,8 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
 
         m = (uintptr_t) 1 <<
                 (((uintptr_t) p & (ngx_pagesize - 1)) >> ngx_slab_exact_shift);
+        shift = ngx_slab_exact_shift;
+        slot = shift - pool->min_shift;
         size = ngx_slab_exact_size;
 
         if ((uintptr_t) p & (size - 1)) {
@@ -528,10 +782,6 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
 
         if (slab & m) {
             if (slab == NGX_SLAB_BUSY) {
-                slots = (ngx_slab_page_t *)
-                                   ((u_char *) pool + sizeof(ngx_slab_pool_t));
-                slot = ngx_slab_exact_shift - pool->min_shift;
-
                 page->next = slots[slot].next;
                 slots[slot].next = page;
 
@@ -545,7 +795,7 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
                 goto done;
             }
 
-            ngx_slab_free_pages(pool, page, 1);
+            empty = page;
 
             goto done;
         }
@@ -555,6 +805,7 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
     case NGX_SLAB_BIG:
 
         shift = slab & NGX_SLAB_SHIFT_MASK;
+        slot = shift - pool->min_shift;
         size = 1 << shift;
 
         if ((uintptr_t) p & (size - 1)) {
@@ -567,10 +818,6 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
         if (slab & m) {
 
             if (page->next == NULL) {
-                slots = (ngx_slab_page_t *)
-                                   ((u_char *) pool + sizeof(ngx_slab_pool_t));
-                slot = shift - pool->min_shift;
-
                 page->next = slots[slot].next;
                 slots[slot].next = page;
 
@@ -584,66 +831,149 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
                 goto done;
             }
 
-            ngx_slab_free_pages(pool, page, 1);
+            empty = page;
 
             goto done;
         }
 
         goto chunk_already_free;
-
-    case NGX_SLAB_PAGE:
-
-        if ((uintptr_t) p & (ngx_pagesize - 1)) {
-            goto wrong_chunk;
-        }
-
-        if (slab == NGX_SLAB_PAGE_FREE) {
-            ngx_slab_error(pool, NGX_LOG_ALERT,
-                           "ngx_slab_free(): page is already free");
-            goto fail;
-        }
-
-        if (slab == NGX_SLAB_PAGE_BUSY) {
-            ngx_slab_error(pool, NGX_LOG_ALERT,
-                           "ngx_slab_free(): pointer to wrong page");
-            goto fail;
-        }
-
-        n = ((u_char *) p - pool->start) >> ngx_pagesize_shift;
-        size = slab & ~NGX_SLAB_PAGE_START;
-
-        ngx_slab_free_pages(pool, &pool->pages[n], size);
-
-        ngx_slab_junk(p, size << ngx_pagesize_shift);
-
-        return;
     }
 
     /* not reached */
 
-    return;
+    return NULL;
 
 done:
 
+    stats[slot].used--;
+
+    if (empty) {
+        stats[slot].total -= ngx_slab_chunks(shift);
+    }
+
     ngx_slab_junk(p, size);
 
-    return;
+    return empty;
 
 wrong_chunk:
 
     ngx_slab_error(pool, NGX_LOG_ALERT,
                    "ngx_slab_free(): pointer to wrong chunk");
 
-    goto fail;
+    return NULL;
 
 chunk_already_free:
 
     ngx_slab_error(pool, NGX_LOG_ALERT,
                    "ngx_slab_free(): chunk is already free");
 
-fail:
+    return NULL;
+}
+
+
+static void *
+ngx_slab_arena_alloc(ngx_slab_pool_t *pool, size_t size)
+{
+    uintptr_t          p;
+    ngx_uint_t         n, shift, slot;
+    ngx_slab_page_t   *page;
+    ngx_slab_arena_t  *arena;
+
+    shift = ngx_slab_shift(pool, size);
+    slot = shift - pool->min_shift;
+
+    n = ngx_worker % pool->narenas;
+    arena = ngx_slab_arena(pool, n);
+
+    ngx_shmtx_lock(&arena->mutex);
+
+    arena->stats[slot].reqs++;
+
+    p = ngx_slab_alloc_chunk(pool, arena->slots, arena->stats, shift);
+
+    ngx_shmtx_unlock(&arena->mutex);
+
+    if (p) {
+        return (void *) p;
+    }
+
+    /*
+     * a page of the pool, an arena is never locked while the pool is
+     * waited for, ngx_slab_free_locked() locks them the other way round
+     */
+
+    ngx_shmtx_lock(&pool->mutex);
 
-    return;
+    page = ngx_slab_alloc_pages(pool, 1);
+
+    if (page) {
+        pool->owner[page - pool->pages] = (u_char) (n + 1);
+    }
+
+    ngx_shmtx_unlock(&pool->mutex);
+
+    ngx_shmtx_lock(&arena->mutex);
+
+    if (page == NULL) {
+        arena->stats[slot].fails++;
+        ngx_shmtx_unlock(&arena->mutex);
+
+        return NULL;
+    }
+
+    p = ngx_slab_init_page(pool, arena->slots, arena->stats, page, shift);
+    arena->pages++;
+
+    ngx_shmtx_unlock(&arena->mutex);
+
+    return (void *) p;
+}
+
+
+static void
+ngx_slab_arena_free(ngx_slab_pool_t *pool, ngx_uint_t n, void *p,
+    ngx_uint_t locked)
+{
+    ngx_slab_page_t   *page, *prev;
+    ngx_slab_arena_t  *arena;
+
+    arena = ngx_slab_arena(pool, pool->owner[n] - 1);
+
+    ngx_shmtx_lock(&arena->mutex);
+
+    page = ngx_slab_free_chunk(pool, arena->slots, arena->stats,
+                               &pool->pages[n], p);
+
+    if (page) {
+
+        /* an empty page leaves the arena before it goes back to the pool */
+
+        prev = (ngx_slab_page_t *) (page->prev & ~NGX_SLAB_PAGE_MASK);
+        prev->next = page->next;
+        page->next->prev = page->prev;
+
+        page->next = NULL;
+
+        arena->pages--;
+    }
+
+    ngx_shmtx_unlock(&arena->mutex);
+
+    if (page == NULL) {
+        return;
+    }
+
+    if (!locked) {
+        ngx_shmtx_lock(&pool->mutex);
+    }
+
+    pool->owner[n] = 0;
+
+    ngx_slab_free_pages(pool, page, 1);
+
+    if (!locked) {
+        ngx_shmtx_unlock(&pool->mutex);
+    }
 }
 
 
@@ -677,6 +1007,8 @@ ngx_slab_alloc_pages(ngx_slab_pool_t *pool, ngx_uint_t pages)
             page->next = NULL;
             page->prev = NGX_SLAB_PAGE;
 
+            pool->pfree -= pages;
+
             if (--pages == 0) {
                 return page;
             }
@@ -708,6 +1040,8 @@ ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
     ngx_uint_t        type;
     ngx_slab_page_t  *prev, *join;
 
+    pool->pfree += pages;
+
     page->slab = pages--;
 
     if (pages) {
@@ -782,6 +1116,55 @@ ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
 }
 
 
+/*
+ * The slots of the pool and of its arenas summed up in "stats", it has
+ * room for ngx_pagesize_shift of them, and how the free pages lie.
+ */
+
+void
+ngx_slab_stats(ngx_slab_pool_t *pool, ngx_slab_pool_stat_t *ps,
+    ngx_slab_stat_t *stats)
+{
+    ngx_uint_t         i, n;
+    ngx_slab_page_t   *page;
+    ngx_slab_arena_t  *arena;
+
+    n = ngx_pagesize_shift - pool->min_shift;
+
+    ngx_shmtx_lock(&pool->mutex);
+
+    ngx_memcpy(stats, pool->stats, n * sizeof(ngx_slab_stat_t));
+
+    ps->pages = pool->last - pool->pages;
+    ps->free = pool->pfree;
+    ps->largest = 0;
+    ps->nslots = n;
+
+    for (page = pool->free.next; page != &pool->free; page = page->next) {
+        if (page->slab > ps->largest) {
+            ps->largest = page->slab;
+        }
+    }
+
+    ngx_shmtx_unlock(&pool->mutex);
+
+    for (i = 0; i < pool->narenas; i++) {
+        arena = ngx_slab_arena(pool, i);
+
+        ngx_shmtx_lock(&arena->mutex);
+
+        for (n = 0; n < ps->nslots; n++) {
+            stats[n].total += arena->stats[n].total;
+            stats[n].used += arena->stats[n].used;
+            stats[n].reqs += arena->stats[n].reqs;
+            stats[n].fails += arena->stats[n].fails;
+        }
+
+        ngx_shmtx_unlock(&arena->mutex);
+    }
+}
+
+
 static void
 ngx_slab_error(ngx_slab_pool_t *pool, ngx_uint_t level, char *text)
 {
@@ -22,6 +22,47 @@ struct ngx_slab_page_s {
 };
 
 
+typedef struct {
+    ngx_uint_t        total;          /* chunks in the pages of the slot */
+    ngx_uint_t        used;
+
+    ngx_uint_t        reqs;
+    ngx_uint_t        fails;
+} ngx_slab_stat_t;
+
+
+/* what ngx_slab_stats() finds in a pool */
+
+typedef struct {
+    ngx_uint_t        pages;
+    ngx_uint_t        free;
+    ngx_uint_t        largest;        /* free pages in one run */
+
+    ngx_uint_t        nslots;         /* of "stats" */
+} ngx_slab_pool_stat_t;
+
+
+/*
+ * An arena has chunk slots of its own, under its own mutex, and takes
+ * whole pages from the pool.  The workers of a pool with arenas allocate
+ * and free chunks with ngx_slab_alloc() and ngx_slab_free() in the arena
+ * of their ngx_worker, without the pool mutex.
+ */
+
+typedef struct {
+    ngx_shmtx_sh_t    lock;
+    ngx_shmtx_t       mutex;
+
+    ngx_uint_t        pages;          /* taken from the pool */
+    ngx_slab_stat_t  *stats;          /* after the slots */
+
+    ngx_slab_page_t   slots[1];
+} ngx_slab_arena_t;
+
+
+#define NGX_SLAB_ARENAS_MAX  255
+
+
 typedef struct {
     ngx_shmtx_sh_t    lock;
 
@@ -32,11 +73,19 @@ typedef struct {
     ngx_slab_page_t  *last;
     ngx_slab_page_t   free;
 
+    ngx_slab_stat_t  *stats;
+    ngx_uint_t        pfree;
+
     u_char           *start;
     u_char           *end;
 
     ngx_shmtx_t       mutex;
 
+    ngx_uint_t        narenas;
+    size_t            arena_size;
+    u_char           *arenas;
+    u_char           *owner;          /* the arena of a page, from 1 */
+
     u_char           *log_ctx;
     u_char            zero;
 
@@ -48,12 +97,15 @@ typedef struct {
 
 
 void ngx_slab_init(ngx_slab_pool_t *pool);
+ngx_int_t ngx_slab_init_arenas(ngx_slab_pool_t *pool, ngx_uint_t n);
 void *ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size);
 void *ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size);
 void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size);
 void *ngx_slab_calloc_locked(ngx_slab_pool_t *pool, size_t size);
 void ngx_slab_free(ngx_slab_pool_t *pool, void *p);
 void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p);
+void ngx_slab_stats(ngx_slab_pool_t *pool, ngx_slab_pool_stat_t *ps,
+    ngx_slab_stat_t *stats);
 
 
 #endif /* _NGX_SLAB_H_INCLUDED_ */
@@ -0,0 +1,497 @@
+
+/*
+ * Copyright (C) agent
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * slab_bench: workers allocating from one shared zone, with the pool
+ * mutex and with an arena each.
+ *
+ * A process per worker, as nginx runs them, keeps a set of chunks of
+ * random sizes and replaces one at random each operation, a free and an
+ * alloc with ngx_slab_free() and ngx_slab_alloc().  Each chunk is marked
+ * with its owner and checked when it is freed, and all the pages must
+ * be back in the pool at the end, with no chunk counted as used in the
+ * slot statistics, else the run fails.
+ *
+ *     make slab_bench
+ *     objs/slab_bench [-w workers] [-n ops] [-m max size] [-k chunks]
+ *                     [-z zone MB]
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+
+typedef struct {
+    ngx_atomic_t           ready;
+    ngx_atomic_t           go;
+    ngx_atomic_t           failed;
+    uint64_t               ns[1];       /* of each worker */
+} slab_bench_shared_t;
+
+
+typedef struct {
+    double                 mops;        /* all workers, per second */
+    double                 ns;          /* per op, the slowest worker */
+} slab_bench_result_t;
+
+
+static ngx_int_t slab_bench_run(ngx_uint_t workers, ngx_uint_t arenas,
+    slab_bench_result_t *r);
+static void slab_bench_worker(ngx_slab_pool_t *sp, slab_bench_shared_t *sh,
+    ngx_uint_t n);
+static ngx_uint_t slab_bench_free_pages(ngx_slab_pool_t *sp);
+static ngx_int_t slab_bench_stats(ngx_slab_pool_t *sp,
+    ngx_slab_stat_t *before, ngx_uint_t free);
+static uint64_t slab_bench_ns(void);
+static uint32_t slab_bench_rand(void);
+
+
+/* what the slab allocator needs of nginx */
+
+static ngx_log_t               slab_bench_log;
+static ngx_cycle_t             slab_bench_cycle;
+volatile ngx_cycle_t          *ngx_cycle = &slab_bench_cycle;
+ngx_uint_t                     ngx_worker;
+ngx_pid_t                      ngx_pid;
+ngx_int_t                      ngx_ncpu;
+
+static uint64_t                slab_bench_rand_state;
+static ngx_uint_t              slab_bench_ops = 1000000;
+static ngx_uint_t              slab_bench_max = 256;
+static ngx_uint_t              slab_bench_chunks = 1000;
+static size_t                  slab_bench_zone = 64;
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    ngx_int_t            i;
+    ngx_uint_t           n, workers[6], nworkers, w;
+    slab_bench_result_t  pool, arenas;
+
+    workers[0] = 1;
+    workers[1] = 2;
+    workers[2] = 4;
+    workers[3] = 8;
+    workers[4] = 16;
+    workers[5] = 32;
+    nworkers = 6;
+
+    for (i = 1; i < argc; i++) {
+
+        if (argv[i][0] != '-' || argv[i][2] != '\0' || i + 1 == argc) {
+            goto usage;
+        }
+
+        switch (argv[i][1]) {
+
+        case 'w':
+            workers[0] = (ngx_uint_t) strtoul(argv[++i], NULL, 10);
+            nworkers = 1;
+            break;
+
+        case 'n':
+            slab_bench_ops = (ngx_uint_t) strtoul(argv[++i], NULL, 10);
+            break;
+
+        case 'm':
+            slab_bench_max = (ngx_uint_t) strtoul(argv[++i], NULL, 10);
+            break;
+
+        case 'k':
+            slab_bench_chunks = (ngx_uint_t) strtoul(argv[++i], NULL, 10);
+            break;
+
+        case 'z':
+            slab_bench_zone = (size_t) strtoul(argv[++i], NULL, 10);
+            break;
+
+        default:
+            goto usage;
+        }
+    }
+
+    if (workers[0] == 0 || workers[0] > NGX_SLAB_ARENAS_MAX
+        || slab_bench_ops == 0 || slab_bench_chunks == 0
+        || slab_bench_max < sizeof(uintptr_t) || slab_bench_zone == 0)
+    {
+        goto usage;
+    }
+
+    ngx_pagesize = getpagesize();
+    for (n = ngx_pagesize; n >>= 1; ngx_pagesize_shift++) { /* void */ }
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+    ngx_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    slab_bench_log.log_level = NGX_LOG_WARN;
+    slab_bench_cycle.log = &slab_bench_log;
+
+    printf("%lu cpus, zone %lu MB, %lu ops per worker, "
+           "chunks %lu..%lu bytes, %lu each\n\n",
+           (unsigned long) ngx_ncpu, (unsigned long) slab_bench_zone,
+           (unsigned long) slab_bench_ops, (unsigned long) sizeof(uintptr_t),
+           (unsigned long) slab_bench_max, (unsigned long) slab_bench_chunks);
+
+    printf("%8s %12s %10s %12s %10s\n",
+           "workers", "pool Mops/s", "ns/op", "arena Mops/s", "ns/op");
+
+    for (w = 0; w < nworkers; w++) {
+
+        if (slab_bench_run(workers[w], 0, &pool) != NGX_OK
+            || slab_bench_run(workers[w], 1, &arenas) != NGX_OK)
+        {
+            return 1;
+        }
+
+        printf("%8lu %12.2f %10.1f %12.2f %10.1f\n",
+               (unsigned long) workers[w], pool.mops, pool.ns,
+               arenas.mops, arenas.ns);
+    }
+
+    return 0;
+
+usage:
+
+    fprintf(stderr,
+            "usage: slab_bench [-w workers] [-n ops] [-m max size] "
+            "[-k chunks] [-z zone MB]\n");
+
+    return 1;
+}
+
+
+static ngx_int_t
+slab_bench_run(ngx_uint_t workers, ngx_uint_t arenas, slab_bench_result_t *r)
+{
+    int                   status;
+    size_t                size;
+    uint64_t              ns;
+    ngx_uint_t            i, free;
+    ngx_pid_t             pid;
+    ngx_slab_stat_t       stats[sizeof(uintptr_t) * 8];
+    ngx_slab_pool_t      *sp;
+    ngx_slab_pool_stat_t  ps;
+    slab_bench_shared_t  *sh;
+
+    size = slab_bench_zone * 1024 * 1024;
+
+    sp = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED, -1, 0);
+    if (sp == MAP_FAILED) {
+        fprintf(stderr, "slab_bench: mmap() failed\n");
+        return NGX_ERROR;
+    }
+
+    sh = mmap(NULL, sizeof(slab_bench_shared_t) + workers * sizeof(uint64_t),
+              PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED, -1, 0);
+    if (sh == MAP_FAILED) {
+        fprintf(stderr, "slab_bench: mmap() failed\n");
+        return NGX_ERROR;
+    }
+
+    /* as ngx_init_zone_pool() makes it */
+
+    ngx_pid = getpid();
+
+    sp->end = (u_char *) sp + size;
+    sp->min_shift = 3;
+    sp->addr = sp;
+
+    if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_slab_init(sp);
+
+    if (arenas && ngx_slab_init_arenas(sp, workers) != NGX_OK) {
+        fprintf(stderr, "slab_bench: no arenas\n");
+        return NGX_ERROR;
+    }
+
+    free = slab_bench_free_pages(sp);
+
+    /* the arenas are allocated in the pool too */
+
+    ngx_slab_stats(sp, &ps, stats);
+
+    /* or the workers print it again as they exit */
+
+    fflush(stdout);
+
+    for (i = 0; i < workers; i++) {
+
+        pid = fork();
+
+        if (pid == -1) {
+            fprintf(stderr, "slab_bench: fork() failed\n");
+            return NGX_ERROR;
+        }
+
+        if (pid == 0) {
+            slab_bench_worker(sp, sh, i);
+            exit(0);
+        }
+    }
+
+    while (sh->ready != workers) {
+        ngx_sched_yield();
+    }
+
+    sh->go = 1;
+
+    for (i = 0; i < workers; i++) {
+        if (wait(&status) == -1 || status != 0) {
+            sh->failed = 1;
+        }
+    }
+
+    if (sh->failed) {
+        fprintf(stderr, "slab_bench: %lu workers%s failed\n",
+                (unsigned long) workers, arenas ? " with arenas" : "");
+        return NGX_ERROR;
+    }
+
+    if (slab_bench_free_pages(sp) != free) {
+        fprintf(stderr, "slab_bench: %lu workers%s: %lu of %lu pages free "
+                "at the end\n", (unsigned long) workers,
+                arenas ? " with arenas" : "",
+                (unsigned long) slab_bench_free_pages(sp),
+                (unsigned long) free);
+        return NGX_ERROR;
+    }
+
+    if (slab_bench_stats(sp, stats, free) != NGX_OK) {
+        fprintf(stderr, "slab_bench: %lu workers%s: wrong statistics\n",
+                (unsigned long) workers, arenas ? " with arenas" : "");
+        return NGX_ERROR;
+    }
+
+    ns = 0;
+
+    for (i = 0; i < workers; i++) {
+        ns = ngx_max(ns, sh->ns[i]);
+    }
+
+    r->mops = (double) slab_bench_ops * workers * 1000 / ns;
+    r->ns = (double) ns / slab_bench_ops;
+
+    munmap(sh, sizeof(slab_bench_shared_t) + workers * sizeof(uint64_t));
+    munmap(sp, size);
+
+    return NGX_OK;
+}
+
+
+static void
+slab_bench_worker(ngx_slab_pool_t *sp, slab_bench_shared_t *sh, ngx_uint_t n)
+{
+    size_t      size;
+    uint64_t    t0;
+    uintptr_t  *p, **chunks;
+    ngx_uint_t  i, k;
+
+    ngx_worker = n;
+    ngx_pid = getpid();
+
+    slab_bench_rand_state = n + 1;
+
+    chunks = calloc(slab_bench_chunks, sizeof(uintptr_t *));
+    if (chunks == NULL) {
+        exit(1);
+    }
+
+    (void) ngx_atomic_fetch_add(&sh->ready, 1);
+
+    while (!sh->go) {
+        ngx_sched_yield();
+    }
+
+    t0 = slab_bench_ns();
+
+    for (i = 0; i < slab_bench_ops + slab_bench_chunks; i++) {
+
+        /* the last ones free all that is left */
+
+        k = (i < slab_bench_ops) ? slab_bench_rand() % slab_bench_chunks
+                                 : i - slab_bench_ops;
+
+        p = chunks[k];
+
+        if (p) {
+            if (*p != n * slab_bench_chunks + k) {
+                fprintf(stderr, "slab_bench: worker %lu: chunk %lu "
+                        "overwritten\n", (unsigned long) n, (unsigned long) k);
+                sh->failed = 1;
+                exit(1);
+            }
+
+            ngx_slab_free(sp, p);
+            chunks[k] = NULL;
+        }
+
+        if (i >= slab_bench_ops) {
+            continue;
+        }
+
+        size = sizeof(uintptr_t)
+               + slab_bench_rand() % (slab_bench_max - sizeof(uintptr_t) + 1);
+
+        p = ngx_slab_alloc(sp, size);
+        if (p == NULL) {
+            fprintf(stderr, "slab_bench: worker %lu: zone is full\n",
+                    (unsigned long) n);
+            sh->failed = 1;
+            exit(1);
+        }
+
+        *p = n * slab_bench_chunks + k;
+        chunks[k] = p;
+    }
+
+    sh->ns[n] = slab_bench_ns() - t0;
+
+    free(chunks);
+}
+
+
+static ngx_uint_t
+slab_bench_free_pages(ngx_slab_pool_t *sp)
+{
+    ngx_uint_t        n;
+    ngx_slab_page_t  *page;
+
+    n = 0;
+
+    for (page = sp->free.next; page != &sp->free; page = page->next) {
+        n += page->slab;
+    }
+
+    return n;
+}
+
+
+static ngx_int_t
+slab_bench_stats(ngx_slab_pool_t *sp, ngx_slab_stat_t *before, ngx_uint_t free)
+{
+    ngx_uint_t            i;
+    ngx_slab_stat_t       stats[sizeof(uintptr_t) * 8];
+    ngx_slab_pool_stat_t  ps;
+
+    ngx_slab_stats(sp, &ps, stats);
+
+    if (ps.free != free || ps.largest > free) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < ps.nslots; i++) {
+        if (stats[i].used != before[i].used
+            || stats[i].total != before[i].total
+            || stats[i].fails)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static uint64_t
+slab_bench_ns(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* xorshift64*, the same sizes every run */
+
+static uint32_t
+slab_bench_rand(void)
+{
+    slab_bench_rand_state ^= slab_bench_rand_state >> 12;
+    slab_bench_rand_state ^= slab_bench_rand_state << 25;
+    slab_bench_rand_state ^= slab_bench_rand_state >> 27;
+
+    return (uint32_t) ((slab_bench_rand_state * 2685821657736338717ULL)
+                       >> 32);
+}
+
+
+#if (NGX_HAVE_VARIADIC_MACROS)
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+
+#else
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, va_list args)
+
+#endif
+{
+#if (NGX_HAVE_VARIADIC_MACROS)
+    va_list  args;
+#endif
+    u_char   errstr[NGX_MAX_ERROR_STR], *p, *last;
+
+    last = errstr + NGX_MAX_ERROR_STR - 2;
+
+    p = ngx_slprintf(errstr, last, "slab_bench: [%ui] ", level);
+
+#if (NGX_HAVE_VARIADIC_MACROS)
+    va_start(args, fmt);
+    p = ngx_vslprintf(p, last, fmt, args);
+    va_end(args);
+#else
+    p = ngx_vslprintf(p, last, fmt, args);
+#endif
+
+    if (err) {
+        p = ngx_slprintf(p, last, " (%d: %s)", err, strerror(err));
+    }
+
+    *p++ = '\n';
+
+    (void) fwrite(errstr, 1, p - errstr, stderr);
+}
+
+
+#if !(NGX_HAVE_VARIADIC_MACROS)
+
+void ngx_cdecl
+ngx_log_error(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+{
+    va_list  args;
+
+    if (log->log_level >= level) {
+        va_start(args, fmt);
+        ngx_log_error_core(level, log, err, fmt, args);
+        va_end(args);
+    }
+}
+
+
+void ngx_cdecl
+ngx_log_debug_core(ngx_log_t *log, ngx_err_t err, const char *fmt, ...)
+{
+    va_list  args;
+
+    va_start(args, fmt);
+    ngx_log_error_core(NGX_LOG_DEBUG, log, err, fmt, args);
+    va_end(args);
+}
+
+#endif
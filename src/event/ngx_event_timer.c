@@ -10,6 +10,116 @@
 #include <ngx_event.h>
 
 
+#if (NGX_TIMER_WHEEL)
+
+ngx_event_timer_wheel_t   ngx_event_timer_wheel;
+
+
+static void ngx_event_cancel_timer(ngx_event_timer_wheel_t *wheel,
+    ngx_rbtree_node_t *node);
+
+
+ngx_int_t
+ngx_event_timer_init(ngx_log_t *log)
+{
+    ngx_event_timer_wheel_init(&ngx_event_timer_wheel, ngx_current_msec);
+
+    return NGX_OK;
+}
+
+
+ngx_msec_t
+ngx_event_find_timer(void)
+{
+    ngx_msec_int_t  timer;
+
+    if (ngx_event_timer_wheel.n == 0) {
+        return NGX_TIMER_INFINITE;
+    }
+
+    timer = (ngx_msec_int_t)
+                (ngx_event_timer_wheel_next(&ngx_event_timer_wheel)
+                 - ngx_current_msec);
+
+    return (ngx_msec_t) (timer > 0 ? timer : 0);
+}
+
+
+void
+ngx_event_expire_timers(void)
+{
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *node;
+
+    for ( ;; ) {
+        node = ngx_event_timer_wheel_expired(&ngx_event_timer_wheel,
+                                             ngx_current_msec);
+
+        if (node == NULL) {
+            return;
+        }
+
+        ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "event timer del: %d: %M",
+                       ngx_event_ident(ev->data), ev->timer.key);
+
+        ngx_event_timer_wheel_delete(&ngx_event_timer_wheel, &ev->timer);
+
+#if (NGX_DEBUG)
+        ev->timer.left = NULL;
+        ev->timer.right = NULL;
+        ev->timer.parent = NULL;
+#endif
+
+        ev->timer_set = 0;
+
+        ev->timedout = 1;
+
+        ev->handler(ev);
+    }
+}
+
+
+void
+ngx_event_cancel_timers(void)
+{
+    ngx_event_timer_wheel_drain(&ngx_event_timer_wheel,
+                                ngx_event_cancel_timer);
+}
+
+
+static void
+ngx_event_cancel_timer(ngx_event_timer_wheel_t *wheel,
+    ngx_rbtree_node_t *node)
+{
+    ngx_event_t  *ev;
+
+    ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+    if (!ev->cancelable) {
+        ngx_event_timer_wheel_insert(wheel, node);
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "event timer cancel: %d: %M",
+                   ngx_event_ident(ev->data), ev->timer.key);
+
+#if (NGX_DEBUG)
+    ev->timer.left = NULL;
+    ev->timer.right = NULL;
+    ev->timer.parent = NULL;
+#endif
+
+    ev->timer_set = 0;
+
+    ev->handler(ev);
+}
+
+#else
+
 ngx_rbtree_t              ngx_event_timer_rbtree;
 static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 
@@ -136,3 +246,5 @@ ngx_event_cancel_timers(void)
         ev->handler(ev);
     }
 }
+
+#endif
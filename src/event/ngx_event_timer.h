@@ -12,6 +12,7 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_event.h>
+#include <ngx_event_timer_wheel.h>
 
 
 #define NGX_TIMER_INFINITE  (ngx_msec_t) -1
@@ -25,8 +26,31 @@ void ngx_event_expire_timers(void);
 void ngx_event_cancel_timers(void);
 
 
+#if (NGX_TIMER_WHEEL)
+
+extern ngx_event_timer_wheel_t  ngx_event_timer_wheel;
+
+#define ngx_event_timer_empty()  (ngx_event_timer_wheel.n == 0)
+
+#define ngx_event_timer_insert(node)                                          \
+    ngx_event_timer_wheel_insert(&ngx_event_timer_wheel, node)
+#define ngx_event_timer_delete(node)                                          \
+    ngx_event_timer_wheel_delete(&ngx_event_timer_wheel, node)
+
+#else
+
 extern ngx_rbtree_t  ngx_event_timer_rbtree;
 
+#define ngx_event_timer_empty()                                               \
+    (ngx_event_timer_rbtree.root == ngx_event_timer_rbtree.sentinel)
+
+#define ngx_event_timer_insert(node)                                          \
+    ngx_rbtree_insert(&ngx_event_timer_rbtree, node)
+#define ngx_event_timer_delete(node)                                          \
+    ngx_rbtree_delete(&ngx_event_timer_rbtree, node)
+
+#endif
+
 
 static ngx_inline void
 ngx_event_del_timer(ngx_event_t *ev)
@@ -35,7 +59,7 @@ ngx_event_del_timer(ngx_event_t *ev)
                    "event timer del: %d: %M",
                     ngx_event_ident(ev->data), ev->timer.key);
 
-    ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
+    ngx_event_timer_delete(&ev->timer);
 
 #if (NGX_DEBUG)
     ev->timer.left = NULL;
@@ -60,7 +84,7 @@ ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer)
         /*
          * Use a previous timer value if difference between it and a new
          * value is less than NGX_TIMER_LAZY_DELAY milliseconds: this allows
-         * to minimize the rbtree operations for fast connections.
+         * to minimize the timer operations for fast connections.
          */
 
         diff = (ngx_msec_int_t) (key - ev->timer.key);
@@ -81,7 +105,7 @@ ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer)
                    "event timer add: %d: %M:%M",
                     ngx_event_ident(ev->data), timer, ev->timer.key);
 
-    ngx_rbtree_insert(&ngx_event_timer_rbtree, &ev->timer);
+    ngx_event_timer_insert(&ev->timer);
 
     ev->timer_set = 1;
 }
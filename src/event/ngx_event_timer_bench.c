@@ -0,0 +1,408 @@
+
+/*
+ * Copyright (C) agent
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * timer_bench: the event timers in the rbtree and in the timing wheel,
+ * at 10k, 100k and 1M timers.
+ *
+ * The timers are all added, with a timeout up to the keepalive one,
+ * then as many are re-armed, a delete and an add, picked at random as
+ * connections that read or write are.  Then the time moves to the next
+ * timer the backend finds, as the event loop sleeps, until all of them
+ * expired.  A timer that expires later than it is due fails the run, a
+ * wakeup with none due is counted, the wheel may find a time early when
+ * a higher level comes down.  The keys are the same for both backends.
+ *
+ *     make timer_bench
+ *     objs/timer_bench [-n timers] [-t max timeout ms] [-s seed]
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+#define TIMER_BENCH_START       1000000     /* ms, the time at 0 */
+
+
+typedef struct {
+    const char            *name;
+    void                 (*init)(ngx_msec_t now);
+    void                 (*add)(ngx_rbtree_node_t *node);
+    void                 (*del)(ngx_rbtree_node_t *node);
+    ngx_msec_t           (*find)(ngx_msec_t now);
+    ngx_rbtree_node_t   *(*expired)(ngx_msec_t now);
+} timer_bench_backend_t;
+
+
+typedef struct {
+    double                 add;         /* ns per timer */
+    double                 rearm;
+    double                 expire;
+    ngx_uint_t             wakeups;     /* with no timer due */
+} timer_bench_result_t;
+
+
+static ngx_int_t timer_bench_run(timer_bench_backend_t *be,
+    ngx_rbtree_node_t *nodes, ngx_uint_t n, timer_bench_result_t *r);
+static uint64_t timer_bench_ns(void);
+static uint32_t timer_bench_rand(void);
+
+static void timer_bench_rbtree_init(ngx_msec_t now);
+static void timer_bench_rbtree_add(ngx_rbtree_node_t *node);
+static void timer_bench_rbtree_del(ngx_rbtree_node_t *node);
+static ngx_msec_t timer_bench_rbtree_find(ngx_msec_t now);
+static ngx_rbtree_node_t *timer_bench_rbtree_expired(ngx_msec_t now);
+
+static void timer_bench_wheel_init(ngx_msec_t now);
+static void timer_bench_wheel_add(ngx_rbtree_node_t *node);
+static void timer_bench_wheel_del(ngx_rbtree_node_t *node);
+static ngx_msec_t timer_bench_wheel_find(ngx_msec_t now);
+static ngx_rbtree_node_t *timer_bench_wheel_expired(ngx_msec_t now);
+
+
+static ngx_rbtree_t             timer_bench_rbtree;
+static ngx_rbtree_node_t        timer_bench_sentinel;
+static ngx_event_timer_wheel_t  timer_bench_wheel;
+
+static uint64_t                 timer_bench_rand_state;
+static uint64_t                 timer_bench_seed = 1;
+static ngx_msec_t               timer_bench_max = 75000;
+
+static timer_bench_backend_t    timer_bench_backends[] = {
+    { "rbtree",
+      timer_bench_rbtree_init, timer_bench_rbtree_add,
+      timer_bench_rbtree_del, timer_bench_rbtree_find,
+      timer_bench_rbtree_expired },
+
+    { "wheel",
+      timer_bench_wheel_init, timer_bench_wheel_add,
+      timer_bench_wheel_del, timer_bench_wheel_find,
+      timer_bench_wheel_expired },
+
+    { NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    ngx_int_t              i;
+    ngx_uint_t             n, sizes[3], nsizes, s, b;
+    ngx_rbtree_node_t     *nodes;
+    timer_bench_result_t   r;
+
+    sizes[0] = 10000;
+    sizes[1] = 100000;
+    sizes[2] = 1000000;
+    nsizes = 3;
+
+    for (i = 1; i < argc; i++) {
+
+        if (argv[i][0] != '-' || argv[i][2] != '\0' || i + 1 == argc) {
+            goto usage;
+        }
+
+        switch (argv[i][1]) {
+
+        case 'n':
+            sizes[0] = (ngx_uint_t) strtoul(argv[++i], NULL, 10);
+            nsizes = 1;
+            break;
+
+        case 't':
+            timer_bench_max = (ngx_msec_t) strtoul(argv[++i], NULL, 10);
+            break;
+
+        case 's':
+            timer_bench_seed = (uint64_t) strtoull(argv[++i], NULL, 10);
+            break;
+
+        default:
+            goto usage;
+        }
+    }
+
+    if (sizes[0] == 0 || timer_bench_max == 0 || timer_bench_seed == 0) {
+        goto usage;
+    }
+
+    n = sizes[nsizes - 1];
+
+    nodes = malloc(n * sizeof(ngx_rbtree_node_t));
+    if (nodes == NULL) {
+        fprintf(stderr, "timer_bench: no memory for %lu timers\n",
+                (unsigned long) n);
+        return 1;
+    }
+
+    printf("timeouts 1..%lu ms, seed %llu\n\n",
+           (unsigned long) timer_bench_max,
+           (unsigned long long) timer_bench_seed);
+
+    printf("%8s %-7s %10s %10s %10s %9s\n",
+           "timers", "backend", "add ns", "rearm ns", "expire ns",
+           "wakeups");
+
+    for (s = 0; s < nsizes; s++) {
+        for (b = 0; timer_bench_backends[b].name; b++) {
+
+            if (timer_bench_run(&timer_bench_backends[b], nodes, sizes[s], &r)
+                != NGX_OK)
+            {
+                return 1;
+            }
+
+            printf("%8lu %-7s %10.1f %10.1f %10.1f %9lu\n",
+                   (unsigned long) sizes[s], timer_bench_backends[b].name,
+                   r.add, r.rearm, r.expire, (unsigned long) r.wakeups);
+        }
+    }
+
+    free(nodes);
+
+    return 0;
+
+usage:
+
+    fprintf(stderr,
+            "usage: timer_bench [-n timers] [-t max timeout ms] [-s seed]\n");
+
+    return 1;
+}
+
+
+static ngx_int_t
+timer_bench_run(timer_bench_backend_t *be, ngx_rbtree_node_t *nodes,
+    ngx_uint_t n, timer_bench_result_t *r)
+{
+    uint64_t            t0, t1;
+    ngx_uint_t          i, left;
+    ngx_msec_t          now, prev, from, wait;
+    ngx_rbtree_node_t  *node;
+
+    timer_bench_rand_state = timer_bench_seed;
+
+    now = TIMER_BENCH_START;
+
+    be->init(now);
+
+    t0 = timer_bench_ns();
+
+    for (i = 0; i < n; i++) {
+        nodes[i].key = now + 1 + timer_bench_rand() % timer_bench_max;
+        be->add(&nodes[i]);
+    }
+
+    t1 = timer_bench_ns();
+
+    r->add = (double) (t1 - t0) / n;
+
+    /* a millisecond on, or all would be re-armed at the same time */
+
+    now++;
+
+    t0 = timer_bench_ns();
+
+    for (i = 0; i < n; i++) {
+        node = &nodes[timer_bench_rand() % n];
+
+        be->del(node);
+
+        node->key = now + 1 + timer_bench_rand() % timer_bench_max;
+        be->add(node);
+    }
+
+    t1 = timer_bench_ns();
+
+    r->rearm = (double) (t1 - t0) / n;
+
+    r->wakeups = 0;
+    left = n;
+
+    /* the last time the timers expired, none was due when they were added */
+
+    prev = TIMER_BENCH_START;
+
+    t0 = timer_bench_ns();
+
+    while (left) {
+        wait = be->find(now);
+
+        now += wait;
+
+        /*
+         * after a sleep only those due now expire, any earlier one was
+         * slept past, without one those since the last time may
+         */
+
+        from = wait ? now : prev + 1;
+
+        i = left;
+
+        while ((node = be->expired(now)) != NULL) {
+
+            if ((ngx_msec_int_t) (node->key - from) < 0
+                || (ngx_msec_int_t) (node->key - now) > 0)
+            {
+                fprintf(stderr, "timer_bench: %s: timer of %lu expired "
+                        "at %lu, %s\n", be->name,
+                        (unsigned long) node->key, (unsigned long) now,
+                        (ngx_msec_int_t) (node->key - now) > 0 ? "early"
+                                                                : "late");
+                return NGX_ERROR;
+            }
+
+            be->del(node);
+            left--;
+        }
+
+        prev = now;
+
+        if (i == left) {
+            r->wakeups++;
+        }
+    }
+
+    t1 = timer_bench_ns();
+
+    r->expire = (double) (t1 - t0) / n;
+
+    return NGX_OK;
+}
+
+
+static uint64_t
+timer_bench_ns(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* xorshift64*, the same keys every run */
+
+static uint32_t
+timer_bench_rand(void)
+{
+    timer_bench_rand_state ^= timer_bench_rand_state >> 12;
+    timer_bench_rand_state ^= timer_bench_rand_state << 25;
+    timer_bench_rand_state ^= timer_bench_rand_state >> 27;
+
+    return (uint32_t) ((timer_bench_rand_state * 2685821657736338717ULL)
+                       >> 32);
+}
+
+
+/* the rbtree, as ngx_event_timer.c keeps it */
+
+static void
+timer_bench_rbtree_init(ngx_msec_t now)
+{
+    ngx_rbtree_init(&timer_bench_rbtree, &timer_bench_sentinel,
+                    ngx_rbtree_insert_timer_value);
+}
+
+
+static void
+timer_bench_rbtree_add(ngx_rbtree_node_t *node)
+{
+    ngx_rbtree_insert(&timer_bench_rbtree, node);
+}
+
+
+static void
+timer_bench_rbtree_del(ngx_rbtree_node_t *node)
+{
+    ngx_rbtree_delete(&timer_bench_rbtree, node);
+}
+
+
+static ngx_msec_t
+timer_bench_rbtree_find(ngx_msec_t now)
+{
+    ngx_msec_int_t      timer;
+    ngx_rbtree_node_t  *node;
+
+    if (timer_bench_rbtree.root == &timer_bench_sentinel) {
+        return NGX_TIMER_INFINITE;
+    }
+
+    node = ngx_rbtree_min(timer_bench_rbtree.root, &timer_bench_sentinel);
+
+    timer = (ngx_msec_int_t) (node->key - now);
+
+    return (ngx_msec_t) (timer > 0 ? timer : 0);
+}
+
+
+static ngx_rbtree_node_t *
+timer_bench_rbtree_expired(ngx_msec_t now)
+{
+    ngx_rbtree_node_t  *node;
+
+    if (timer_bench_rbtree.root == &timer_bench_sentinel) {
+        return NULL;
+    }
+
+    node = ngx_rbtree_min(timer_bench_rbtree.root, &timer_bench_sentinel);
+
+    if ((ngx_msec_int_t) (node->key - now) > 0) {
+        return NULL;
+    }
+
+    return node;
+}
+
+
+/* the timing wheel */
+
+static void
+timer_bench_wheel_init(ngx_msec_t now)
+{
+    ngx_event_timer_wheel_init(&timer_bench_wheel, now);
+}
+
+
+static void
+timer_bench_wheel_add(ngx_rbtree_node_t *node)
+{
+    ngx_event_timer_wheel_insert(&timer_bench_wheel, node);
+}
+
+
+static void
+timer_bench_wheel_del(ngx_rbtree_node_t *node)
+{
+    ngx_event_timer_wheel_delete(&timer_bench_wheel, node);
+}
+
+
+static ngx_msec_t
+timer_bench_wheel_find(ngx_msec_t now)
+{
+    ngx_msec_int_t  timer;
+
+    if (timer_bench_wheel.n == 0) {
+        return NGX_TIMER_INFINITE;
+    }
+
+    timer = (ngx_msec_int_t) (ngx_event_timer_wheel_next(&timer_bench_wheel)
+                              - now);
+
+    return (ngx_msec_t) (timer > 0 ? timer : 0);
+}
+
+
+static ngx_rbtree_node_t *
+timer_bench_wheel_expired(ngx_msec_t now)
+{
+    return ngx_event_timer_wheel_expired(&timer_bench_wheel, now);
+}
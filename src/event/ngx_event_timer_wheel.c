@@ -0,0 +1,364 @@
+
+/*
+ * Copyright (C) agent
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/*
+ * Level 0 is the wheel's millisecond slots, a timer in level n > 0 is
+ * in the slot of its key's unit of 1 << shift milliseconds.  As the wheel
+ * turns into a unit of level 1, its slot there goes down into level 0,
+ * and so on up while the unit is the first of the level above.  A slot
+ * of level n holds the unit that comes next by its index: the units in
+ * it are past the one the wheel is in, and no more than 64 ahead.
+ */
+
+#define ngx_event_timer_wheel_shift(level)                                    \
+    (NGX_TIMER_WHEEL_BITS0 + ((level) - 1) * NGX_TIMER_WHEEL_BITS)
+
+#define ngx_event_timer_wheel_base(level)                                     \
+    (NGX_TIMER_WHEEL_SLOTS0 + ((level) - 1) * NGX_TIMER_WHEEL_SLOTSN)
+
+/* the longest time left the levels hold */
+#define NGX_TIMER_WHEEL_SPAN                                                  \
+    ((uint64_t) 1 << ngx_event_timer_wheel_shift(NGX_TIMER_WHEEL_LEVELS))
+
+#define ngx_event_timer_wheel_bit(i)     ((uint64_t) 1 << ((i) & 63))
+
+
+#if (__GNUC__ >= 4)
+#define ngx_event_timer_wheel_ctz(x)     ((ngx_uint_t) __builtin_ctzll(x))
+#else
+static ngx_uint_t ngx_event_timer_wheel_ctz(uint64_t x);
+#endif
+
+static ngx_int_t ngx_event_timer_wheel_scan(uint64_t *map, ngx_uint_t nwords,
+    ngx_uint_t from);
+static void ngx_event_timer_wheel_cascade(ngx_event_timer_wheel_t *wheel);
+static void ngx_event_timer_wheel_take(ngx_event_timer_wheel_t *wheel,
+    ngx_uint_t i, ngx_rbtree_node_t *list);
+
+
+void
+ngx_event_timer_wheel_init(ngx_event_timer_wheel_t *wheel, ngx_msec_t now)
+{
+    ngx_uint_t  i;
+
+    wheel->last = now;
+    wheel->n = 0;
+
+    ngx_memzero(wheel->map, sizeof(wheel->map));
+
+    for (i = 0; i < NGX_TIMER_WHEEL_SLOTS; i++) {
+        wheel->slot[i].left = &wheel->slot[i];
+        wheel->slot[i].right = &wheel->slot[i];
+    }
+}
+
+
+void
+ngx_event_timer_wheel_insert(ngx_event_timer_wheel_t *wheel,
+    ngx_rbtree_node_t *node)
+{
+    uint64_t            left;
+    ngx_msec_t          key;
+    ngx_uint_t          i, level;
+    ngx_rbtree_node_t  *head;
+
+    key = node->key;
+
+    if ((ngx_msec_int_t) (key - wheel->last) < 0) {
+
+        /* due already, it goes with those due now */
+
+        key = wheel->last;
+    }
+
+    left = (ngx_msec_t) (key - wheel->last);
+
+    if (left < NGX_TIMER_WHEEL_SLOTS0) {
+        i = key & (NGX_TIMER_WHEEL_SLOTS0 - 1);
+
+    } else {
+        if (left >= NGX_TIMER_WHEEL_SPAN) {
+            left = NGX_TIMER_WHEEL_SPAN - 1;
+            key = wheel->last + (ngx_msec_t) left;
+        }
+
+        for (level = 1;
+             left >= (uint64_t) 1 << ngx_event_timer_wheel_shift(level + 1);
+             level++)
+        {
+            /* void */
+        }
+
+        i = ngx_event_timer_wheel_base(level)
+            + ((key >> ngx_event_timer_wheel_shift(level))
+               & (NGX_TIMER_WHEEL_SLOTSN - 1));
+    }
+
+    head = &wheel->slot[i];
+
+    node->left = head->left;
+    node->right = head;
+    head->left->right = node;
+    head->left = node;
+
+    wheel->map[i >> 6] |= ngx_event_timer_wheel_bit(i);
+    wheel->n++;
+}
+
+
+void
+ngx_event_timer_wheel_delete(ngx_event_timer_wheel_t *wheel,
+    ngx_rbtree_node_t *node)
+{
+    ngx_uint_t          i;
+    ngx_rbtree_node_t  *prev, *next;
+
+    prev = node->left;
+    next = node->right;
+
+    prev->right = next;
+    next->left = prev;
+
+    /* the last one of a slot leaves the head alone */
+
+    if (prev == next
+        && prev >= wheel->slot && prev < wheel->slot + NGX_TIMER_WHEEL_SLOTS)
+    {
+        i = prev - wheel->slot;
+        wheel->map[i >> 6] &= ~ngx_event_timer_wheel_bit(i);
+    }
+
+    wheel->n--;
+}
+
+
+ngx_msec_t
+ngx_event_timer_wheel_next(ngx_event_timer_wheel_t *wheel)
+{
+    ngx_int_t    d;
+    ngx_uint_t   level, shift, found;
+    ngx_msec_t   last, next, first, t;
+
+    last = wheel->last;
+
+    d = ngx_event_timer_wheel_scan(wheel->map, NGX_TIMER_WHEEL_SLOTS0 / 64,
+                                   last & (NGX_TIMER_WHEEL_SLOTS0 - 1));
+
+    found = (d != -1);
+    next = found ? last + d : 0;
+
+    /* a higher level comes down at the start of its slot's unit */
+
+    for (level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+        shift = ngx_event_timer_wheel_shift(level);
+        first = (last >> shift) + 1;
+
+        d = ngx_event_timer_wheel_scan(
+                 &wheel->map[ngx_event_timer_wheel_base(level) >> 6], 1,
+                 first & (NGX_TIMER_WHEEL_SLOTSN - 1));
+
+        if (d == -1) {
+            continue;
+        }
+
+        t = (first + d) << shift;
+
+        if (!found || (ngx_msec_int_t) (t - next) < 0) {
+            next = t;
+            found = 1;
+        }
+    }
+
+    return next;
+}
+
+
+ngx_rbtree_node_t *
+ngx_event_timer_wheel_expired(ngx_event_timer_wheel_t *wheel, ngx_msec_t now)
+{
+    ngx_msec_t          next;
+    ngx_rbtree_node_t  *head;
+
+    for ( ;; ) {
+
+        if ((ngx_msec_int_t) (now - wheel->last) < 0) {
+            return NULL;
+        }
+
+        head = &wheel->slot[wheel->last & (NGX_TIMER_WHEEL_SLOTS0 - 1)];
+
+        if (head->right != head) {
+            return head->right;
+        }
+
+        if (wheel->n == 0) {
+            wheel->last = now;
+            return NULL;
+        }
+
+        next = ngx_event_timer_wheel_next(wheel);
+
+        if ((ngx_msec_int_t) (next - now) > 0) {
+
+            /* the slots up to now are empty, those of all levels */
+
+            wheel->last = now;
+            return NULL;
+        }
+
+        wheel->last = next;
+
+        if ((next & (NGX_TIMER_WHEEL_SLOTS0 - 1)) == 0) {
+            ngx_event_timer_wheel_cascade(wheel);
+        }
+    }
+}
+
+
+void
+ngx_event_timer_wheel_drain(ngx_event_timer_wheel_t *wheel,
+    ngx_event_timer_wheel_pt handler)
+{
+    ngx_uint_t          i;
+    ngx_rbtree_node_t   list, *node;
+
+    for (i = 0; i < NGX_TIMER_WHEEL_SLOTS; i++) {
+
+        if (!(wheel->map[i >> 6] & ngx_event_timer_wheel_bit(i))) {
+            continue;
+        }
+
+        /* what the handler inserts again does not come round here */
+
+        ngx_event_timer_wheel_take(wheel, i, &list);
+
+        while (list.right != &list) {
+            node = list.right;
+
+            ngx_event_timer_wheel_delete(wheel, node);
+
+            handler(wheel, node);
+        }
+    }
+}
+
+
+static void
+ngx_event_timer_wheel_cascade(ngx_event_timer_wheel_t *wheel)
+{
+    ngx_uint_t          level, idx;
+    ngx_rbtree_node_t   list, *node;
+
+    for (level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+        idx = (wheel->last >> ngx_event_timer_wheel_shift(level))
+              & (NGX_TIMER_WHEEL_SLOTSN - 1);
+
+        ngx_event_timer_wheel_take(wheel,
+                                   ngx_event_timer_wheel_base(level) + idx,
+                                   &list);
+
+        while (list.right != &list) {
+            node = list.right;
+
+            ngx_event_timer_wheel_delete(wheel, node);
+            ngx_event_timer_wheel_insert(wheel, node);
+        }
+
+        if (idx != 0) {
+            break;
+        }
+    }
+}
+
+
+/* moves the timers of the slot to the list */
+
+static void
+ngx_event_timer_wheel_take(ngx_event_timer_wheel_t *wheel, ngx_uint_t i,
+    ngx_rbtree_node_t *list)
+{
+    ngx_rbtree_node_t  *head;
+
+    head = &wheel->slot[i];
+
+    if (head->right == head) {
+        list->left = list;
+        list->right = list;
+        return;
+    }
+
+    list->left = head->left;
+    list->right = head->right;
+    list->left->right = list;
+    list->right->left = list;
+
+    head->left = head;
+    head->right = head;
+
+    wheel->map[i >> 6] &= ~ngx_event_timer_wheel_bit(i);
+}
+
+
+/* the distance from "from" to the next slot in use, round the map */
+
+static ngx_int_t
+ngx_event_timer_wheel_scan(uint64_t *map, ngx_uint_t nwords, ngx_uint_t from)
+{
+    uint64_t    bits;
+    ngx_uint_t  w, b, i, d;
+
+    w = from >> 6;
+    b = from & 63;
+
+    bits = map[w] >> b;
+
+    if (bits) {
+        return ngx_event_timer_wheel_ctz(bits);
+    }
+
+    d = 64 - b;
+
+    for (i = 1; i < nwords; i++) {
+        bits = map[(w + i) % nwords];
+
+        if (bits) {
+            return d + ngx_event_timer_wheel_ctz(bits);
+        }
+
+        d += 64;
+    }
+
+    bits = map[w] & (ngx_event_timer_wheel_bit(b) - 1);
+
+    if (bits) {
+        return d + ngx_event_timer_wheel_ctz(bits);
+    }
+
+    return -1;
+}
+
+
+#if !(__GNUC__ >= 4)
+
+static ngx_uint_t
+ngx_event_timer_wheel_ctz(uint64_t x)
+{
+    ngx_uint_t  n;
+
+    for (n = 0; !(x & 1); n++) {
+        x >>= 1;
+    }
+
+    return n;
+}
+
+#endif
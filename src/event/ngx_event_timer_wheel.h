@@ -0,0 +1,73 @@
+
+/*
+ * Copyright (C) agent
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_EVENT_TIMER_WHEEL_H_INCLUDED_
+#define _NGX_EVENT_TIMER_WHEEL_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/*
+ * A hierarchical timing wheel of the event timers: 256 slots of one
+ * millisecond, then four levels of 64 slots, each slot as long as the
+ * whole level below.  A timer goes into the level its time left falls
+ * in and moves down as the wheel turns to its slot, adding and deleting
+ * a timer is O(1).  The nodes are those of the events, left and right
+ * link them in their slot, key is the time they are due.  A timer due
+ * later than the top level reaches, some 49 days, waits in its last slot
+ * and is placed again from there.
+ */
+
+#define NGX_TIMER_WHEEL_BITS0     8
+#define NGX_TIMER_WHEEL_BITS      6
+#define NGX_TIMER_WHEEL_LEVELS    5
+
+#define NGX_TIMER_WHEEL_SLOTS0    (1 << NGX_TIMER_WHEEL_BITS0)
+#define NGX_TIMER_WHEEL_SLOTSN    (1 << NGX_TIMER_WHEEL_BITS)
+#define NGX_TIMER_WHEEL_SLOTS                                                 \
+    (NGX_TIMER_WHEEL_SLOTS0                                                   \
+     + (NGX_TIMER_WHEEL_LEVELS - 1) * NGX_TIMER_WHEEL_SLOTSN)
+
+
+typedef struct ngx_event_timer_wheel_s  ngx_event_timer_wheel_t;
+
+typedef void (*ngx_event_timer_wheel_pt) (ngx_event_timer_wheel_t *wheel,
+    ngx_rbtree_node_t *node);
+
+struct ngx_event_timer_wheel_s {
+    ngx_msec_t             last;          /* the wheel has turned to */
+    ngx_uint_t             n;             /* timers */
+    uint64_t               map[NGX_TIMER_WHEEL_SLOTS / 64];  /* not empty */
+    ngx_rbtree_node_t      slot[NGX_TIMER_WHEEL_SLOTS];
+};
+
+
+void ngx_event_timer_wheel_init(ngx_event_timer_wheel_t *wheel,
+    ngx_msec_t now);
+void ngx_event_timer_wheel_insert(ngx_event_timer_wheel_t *wheel,
+    ngx_rbtree_node_t *node);
+void ngx_event_timer_wheel_delete(ngx_event_timer_wheel_t *wheel,
+    ngx_rbtree_node_t *node);
+
+/* the earliest time a timer may be due, the wheel must not be empty */
+ngx_msec_t ngx_event_timer_wheel_next(ngx_event_timer_wheel_t *wheel);
+
+/* turns the wheel to now, a timer due by then is returned but not deleted */
+ngx_rbtree_node_t *ngx_event_timer_wheel_expired(
+    ngx_event_timer_wheel_t *wheel, ngx_msec_t now);
+
+/*
+ * Takes every timer off the wheel and passes it to the handler, which may
+ * insert it again, or delete any other.
+ */
+void ngx_event_timer_wheel_drain(ngx_event_timer_wheel_t *wheel,
+    ngx_event_timer_wheel_pt handler);
+
+
+#endif /* _NGX_EVENT_TIMER_WHEEL_H_INCLUDED_ */
@@ -0,0 +1,351 @@
+
+/*
+ * Copyright (C) agent
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/*
+ * "slab_status [text|json]" in a location lists the shared zones with
+ * the pages of their slab pools, free ones and the largest free run, and
+ * per chunk size the chunks the slot has in its pages, those in use, the
+ * allocations asked for and those failed.  A zone that fails allocations
+ * with many free pages, none of them in a long enough run, or with slots
+ * holding far more chunks than used, is fragmented rather than full.
+ *
+ * With them go the hits and misses of the pool block cache of the worker
+ * that serves the request, and the bytes it has cached.
+ */
+
+#define NGX_HTTP_SLAB_STATUS_TEXT    0
+#define NGX_HTTP_SLAB_STATUS_JSON    1
+
+/* the most a zone, less its name, or a slot prints */
+#define NGX_HTTP_SLAB_STATUS_ZONE_LEN  (128 + 4 * NGX_INT_T_LEN)
+#define NGX_HTTP_SLAB_STATUS_SLOT_LEN  (80 + 5 * NGX_INT_T_LEN)
+#define NGX_HTTP_SLAB_STATUS_CACHE_LEN (96 + 5 * NGX_INT_T_LEN)
+
+
+typedef struct {
+    ngx_uint_t                 format;
+} ngx_http_slab_status_loc_conf_t;
+
+
+static ngx_int_t ngx_http_slab_status_handler(ngx_http_request_t *r);
+static u_char *ngx_http_slab_status_text(u_char *p, ngx_shm_zone_t *zone,
+    ngx_slab_pool_stat_t *ps, ngx_slab_stat_t *stats);
+static u_char *ngx_http_slab_status_json(u_char *p, ngx_shm_zone_t *zone,
+    ngx_slab_pool_stat_t *ps, ngx_slab_stat_t *stats);
+static void *ngx_http_slab_status_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_slab_status(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_slab_status_commands[] = {
+
+    { ngx_string("slab_status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_slab_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_slab_status_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_slab_status_create_loc_conf,  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_slab_status_module = {
+    NGX_MODULE_V1,
+    &ngx_http_slab_status_module_ctx,      /* module context */
+    ngx_http_slab_status_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_slab_status_handler(ngx_http_request_t *r)
+{
+    size_t                            size;
+    ngx_int_t                         rc;
+    ngx_buf_t                        *b;
+    ngx_uint_t                        i, n;
+    ngx_chain_t                       out;
+    ngx_list_part_t                  *part;
+    ngx_shm_zone_t                   *zone;
+    ngx_slab_stat_t                  *stats;
+    ngx_slab_pool_stat_t              ps;
+    ngx_http_slab_status_loc_conf_t  *sscf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    sscf = ngx_http_get_module_loc_conf(r, ngx_http_slab_status_module);
+
+    if (sscf->format == NGX_HTTP_SLAB_STATUS_JSON) {
+        r->headers_out.content_type_len = sizeof("application/json") - 1;
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+
+    } else {
+        r->headers_out.content_type_len = sizeof("text/plain") - 1;
+        ngx_str_set(&r->headers_out.content_type, "text/plain");
+    }
+
+    r->headers_out.content_type_lowcase = NULL;
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+    }
+
+    size = sizeof("{\"zones\":[]}\n") + NGX_HTTP_SLAB_STATUS_CACHE_LEN;
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            zone = part->elts;
+            i = 0;
+        }
+
+        size += NGX_HTTP_SLAB_STATUS_ZONE_LEN + zone[i].shm.name.len
+                + ngx_pagesize_shift * NGX_HTTP_SLAB_STATUS_SLOT_LEN;
+
+        if (sscf->format == NGX_HTTP_SLAB_STATUS_JSON) {
+            size += ngx_escape_json(NULL, zone[i].shm.name.data,
+                                    zone[i].shm.name.len);
+        }
+    }
+
+    stats = ngx_palloc(r->pool, ngx_pagesize_shift * sizeof(ngx_slab_stat_t));
+    if (stats == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    n = ngx_pool_cache_stat.hits + ngx_pool_cache_stat.misses;
+    n = n ? ngx_pool_cache_stat.hits * 100 / n : 0;
+
+    if (sscf->format == NGX_HTTP_SLAB_STATUS_JSON) {
+        b->last = ngx_sprintf(b->last, "{\"pool_cache\":{\"pid\":%P,"
+                              "\"hits\":%ui,\"misses\":%ui,\"size\":%uz},"
+                              "\"zones\":[",
+                              ngx_pid, ngx_pool_cache_stat.hits,
+                              ngx_pool_cache_stat.misses,
+                              ngx_pool_cache_stat.size);
+
+    } else {
+        b->last = ngx_sprintf(b->last, "pool cache of worker %P: hits %ui, "
+                              "misses %ui, ratio %ui%%, cached %uz\n",
+                              ngx_pid, ngx_pool_cache_stat.hits,
+                              ngx_pool_cache_stat.misses, n,
+                              ngx_pool_cache_stat.size);
+    }
+
+    n = 0;
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            zone = part->elts;
+            i = 0;
+        }
+
+        ngx_slab_stats((ngx_slab_pool_t *) zone[i].shm.addr, &ps, stats);
+
+        if (sscf->format == NGX_HTTP_SLAB_STATUS_JSON) {
+            if (n++) {
+                *b->last++ = ',';
+            }
+
+            b->last = ngx_http_slab_status_json(b->last, &zone[i], &ps, stats);
+
+        } else {
+            b->last = ngx_http_slab_status_text(b->last, &zone[i], &ps, stats);
+        }
+    }
+
+    if (sscf->format == NGX_HTTP_SLAB_STATUS_JSON) {
+        b->last = ngx_cpymem(b->last, "]}\n", sizeof("]}\n") - 1);
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static u_char *
+ngx_http_slab_status_text(u_char *p, ngx_shm_zone_t *zone,
+    ngx_slab_pool_stat_t *ps, ngx_slab_stat_t *stats)
+{
+    ngx_uint_t        i;
+    ngx_slab_pool_t  *sp;
+
+    sp = (ngx_slab_pool_t *) zone->shm.addr;
+
+    p = ngx_sprintf(p, "zone \"%V\": size %uz, pages %ui, free %ui, "
+                    "largest free run %ui\n",
+                    &zone->shm.name, zone->shm.size,
+                    ps->pages, ps->free, ps->largest);
+
+    for (i = 0; i < ps->nslots; i++) {
+        p = ngx_sprintf(p, " chunk %uz: total %ui, used %ui, "
+                        "requests %ui, failed %ui\n",
+                        (size_t) 1 << (sp->min_shift + i),
+                        stats[i].total, stats[i].used,
+                        stats[i].reqs, stats[i].fails);
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_slab_status_json(u_char *p, ngx_shm_zone_t *zone,
+    ngx_slab_pool_stat_t *ps, ngx_slab_stat_t *stats)
+{
+    ngx_uint_t        i;
+    ngx_slab_pool_t  *sp;
+
+    sp = (ngx_slab_pool_t *) zone->shm.addr;
+
+    p = ngx_cpymem(p, "{\"name\":\"", sizeof("{\"name\":\"") - 1);
+    p = (u_char *) ngx_escape_json(p, zone->shm.name.data, zone->shm.name.len);
+
+    p = ngx_sprintf(p, "\",\"size\":%uz,\"pages\":%ui,"
+                    "\"free\":%ui,\"largest_free\":%ui,\"slots\":[",
+                    zone->shm.size, ps->pages, ps->free, ps->largest);
+
+    for (i = 0; i < ps->nslots; i++) {
+        p = ngx_sprintf(p, "%s{\"chunk\":%uz,\"total\":%ui,\"used\":%ui,"
+                        "\"reqs\":%ui,\"fails\":%ui}",
+                        i ? "," : "",
+                        (size_t) 1 << (sp->min_shift + i),
+                        stats[i].total, stats[i].used,
+                        stats[i].reqs, stats[i].fails);
+    }
+
+    return ngx_cpymem(p, "]}", 2);
+}
+
+
+static void *
+ngx_http_slab_status_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_slab_status_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_slab_status_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->format = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_slab_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_slab_status_loc_conf_t *sscf = conf;
+
+    ngx_str_t                 *value;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    if (sscf->format != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    sscf->format = NGX_HTTP_SLAB_STATUS_TEXT;
+
+    if (cf->args->nelts == 2) {
+        if (ngx_strcmp(value[1].data, "json") == 0) {
+            sscf->format = NGX_HTTP_SLAB_STATUS_JSON;
+
+        } else if (ngx_strcmp(value[1].data, "text") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid value \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_slab_status_handler;
+
+    return NGX_CONF_OK;
+}
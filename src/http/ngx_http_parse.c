@@ -9,6 +9,49 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if (NGX_HAVE_X86_SIMD)
+#include <nmmintrin.h>
+#endif
+
+
+#if (NGX_HAVE_X86_SIMD)
+
+static u_char *ngx_http_parse_skip_sse42(u_char *p, u_char *last,
+    const u_char *ranges);
+
+/*
+ * The bytes a state has to look at, as pairs of the first and the last
+ * of a range, the rest of the 16 bytes are "\0\0", NUL stops all of them.
+ * The state machine goes on from the byte found, which may be one it
+ * lets through, as the control characters in URIs are.
+ */
+
+/* sw_check_uri: "/", ".", "%", "?", "#", "+", spaces and CR, LF */
+static const u_char  ngx_http_parse_uri_ranges[16] =
+    "\0\r" " #" "%%" "++" "./" "??"
+#if (NGX_WIN32)
+    "\\\\"
+#endif
+    ;
+
+/* sw_uri, the arguments: "#", spaces and CR, LF */
+static const u_char  ngx_http_parse_args_ranges[16] = "\0\r" "  " "##";
+
+/* sw_value: spaces, CR, LF and the control characters */
+static const u_char  ngx_http_parse_value_ranges[16] = "\0 ";
+
+#define ngx_http_parse_skip(p, last, ranges)                                  \
+    if (ngx_cpu_sse42 && (last) - (p) > 16) {                                 \
+        p = ngx_http_parse_skip_sse42(p, last, ranges);                       \
+        ch = *p;                                                              \
+    }
+
+#else
+
+#define ngx_http_parse_skip(p, last, ranges)
+
+#endif
+
 
 static uint32_t  usual[] = {
     0xffffdbfe, /* 1111 1111 1111 1111  1101 1011 1111 1110 */
@@ -540,6 +583,8 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         /* check "/", "%" and "\" (Win32) in URI */
         case sw_check_uri:
 
+            ngx_http_parse_skip(p, b->last, ngx_http_parse_uri_ranges);
+
             if (usual[ch >> 5] & (1 << (ch & 0x1f))) {
                 break;
             }
@@ -626,6 +671,8 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         /* URI */
         case sw_uri:
 
+            ngx_http_parse_skip(p, b->last, ngx_http_parse_args_ranges);
+
             if (usual[ch >> 5] & (1 << (ch & 0x1f))) {
                 break;
             }
@@ -998,6 +1045,9 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
 
         /* header value */
         case sw_value:
+
+            ngx_http_parse_skip(p, b->last, ngx_http_parse_value_ranges);
+
             switch (ch) {
             case ' ':
                 r->header_end = p;
@@ -2361,3 +2411,41 @@ invalid:
 
     return NGX_ERROR;
 }
+
+
+#if (NGX_HAVE_X86_SIMD)
+
+/*
+ * Skips 16 bytes at a time to the first byte in the ranges, as
+ * picohttpparser does with SSE4.2.  Only whole blocks are looked at, and
+ * at least the last byte is left to the state machine, so the pointer
+ * returned is always before "last".
+ */
+
+__attribute__((target("sse4.2")))
+static u_char *
+ngx_http_parse_skip_sse42(u_char *p, u_char *last, const u_char *ranges)
+{
+    int      n;
+    __m128i  r, v;
+
+    r = _mm_loadu_si128((const __m128i *) ranges);
+
+    while (last - p > 16) {
+        v = _mm_loadu_si128((const __m128i *) p);
+
+        n = _mm_cmpestri(r, 16, v, 16,
+                         _SIDD_UBYTE_OPS|_SIDD_CMP_RANGES
+                         |_SIDD_LEAST_SIGNIFICANT);
+
+        if (n != 16) {
+            return p + n;
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+#endif
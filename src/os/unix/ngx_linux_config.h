@@ -98,6 +98,10 @@ extern ssize_t sendfile(int s, int fd, int32_t *offset, size_t size);
 typedef struct iocb  ngx_aiocb_t;
 #endif
 
+#if (NGX_HAVE_REUSEPORT_CBPF)
+#include <linux/filter.h>
+#endif
+
 
 #define NGX_LISTEN_BACKLOG        511
 
@@ -5,6 +5,15 @@
 
 #define MAX_MEM_CACHE_SIZE  256*1024
 
+#define ALG_RING_PAD        ((size_t)-1)
+#define alg_ring_align(n)                                               \
+    (((n) + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1))
+
+static int alg_cache_ring_push(alg_cache_t *cache, const void *data, size_t size);
+static int alg_cache_ring_flushall(alg_cache_t *cache);
+static int alg_cache_list_push(alg_cache_t *cache, const void *data, size_t size);
+static int alg_cache_list_flushall(alg_cache_t *cache);
+
 alg_cache_t *
 alg_cache_create(alg_cache_flush_handler_pt h,
                  void *(*alloc)(void *alloc_ctx, size_t size),
@@ -18,24 +27,63 @@ alg_cache_create(alg_cache_flush_handler_pt h,
         return NULL;
     }
 
+    cache->type = ALG_CACHE_LIST;
+
     cache->alloc = alloc;
     cache->dealloc = dealloc;
     cache->alloc_ctx = alloc_ctx;
-    
+
     INIT_LIST_HEAD(&cache->memcache);
 
-    cache->dcache.file = NULL;
+    alg_disk_cache_init(&cache->dcache, NULL, 0, NULL);
+
+    cache->ring = NULL;
+    cache->ring_mask = 0;
+    cache->ring_head = 0;
+    cache->ring_tail = 0;
 
     cache->memcache_size = 0;
     cache->dcache_size = 0;
 
-    cache->handler = h; 
+    cache->handler = h;
 
     cache->memcache_maxsize = MAX_MEM_CACHE_SIZE;
 
     return cache;
 }
 
+alg_cache_t *
+alg_cache_create_ring(alg_cache_flush_handler_pt h, size_t size,
+                      void *(*alloc)(void *alloc_ctx, size_t size),
+                      void (*dealloc)(void *alloc_ctx, void *m),
+                      void *alloc_ctx)
+{
+    alg_cache_t *cache;
+    size_t       cap;
+
+    cache = alg_cache_create(h, alloc, dealloc, alloc_ctx);
+    if (NULL == cache) {
+        return NULL;
+    }
+
+    /* the ring itself is allocated by the first push */
+
+    for (cap = 64; cap < size; cap <<= 1) { /* void */ }
+
+    cache->type = ALG_CACHE_RING;
+    cache->ring_mask = cap - 1;
+    cache->memcache_maxsize = cap;
+
+    return cache;
+}
+
+void
+alg_cache_set_spill(alg_cache_t *cache, const char *dir, size_t max_size,
+                    ngx_log_t *log)
+{
+    alg_disk_cache_init(&cache->dcache, dir, max_size, log);
+}
+
 void
 alg_cache_destroy(alg_cache_t *cache)
 {
@@ -48,7 +96,7 @@ alg_cache_destroy(alg_cache_t *cache)
     alloc = cache->alloc;
     dealloc = cache->dealloc;
     alloc_ctx = cache->alloc_ctx;
-    
+
     list_for_each_safe(pos, tmp, &cache->memcache)
     {
         seg = list_entry(pos, alg_cache_seg_t, node);
@@ -58,6 +106,10 @@ alg_cache_destroy(alg_cache_t *cache)
         dealloc(alloc_ctx, seg);
     }
 
+    if (cache->ring) {
+        dealloc(alloc_ctx, cache->ring);
+    }
+
     alg_disk_cache_close(&cache->dcache);
 
     dealloc(alloc_ctx, cache);
@@ -66,25 +118,76 @@ alg_cache_destroy(alg_cache_t *cache)
 int
 alg_cache_push(alg_cache_t *cache, const void *data, size_t size)
 {
-    alg_cache_seg_t     *seg;
     ssize_t              rv;
 
-    /* cache in file */
+    /* cache in memory, unless older data is already in file */
 
-    if (cache->memcache_size + size > cache->memcache_maxsize
-        || cache->dcache_size) {
-        
-        rv = alg_disk_cache_write(&cache->dcache, data, size);
+    if (0 == cache->dcache_size) {
+        if (ALG_CACHE_RING == cache->type) {
+            if (alg_cache_ring_push(cache, data, size)) {
+                return 1;
+            }
 
-        if (rv == (ssize_t)size) {
-            cache->dcache_size += size;
-            return 1;
+        } else if (cache->memcache_size + size <= cache->memcache_maxsize) {
+            return alg_cache_list_push(cache, data, size);
         }
+    }
+
+    /* cache in file */
+
+    rv = alg_disk_cache_write(&cache->dcache, data, size);
+
+    if (rv == (ssize_t)size) {
+        cache->dcache_size += size;
+        return 1;
+    }
+
+    return 0;
+}
+
+int
+alg_cache_flushall(alg_cache_t *cache)
+{
+    size_t               sz;
+    char                *ptr;
+    int                  rc;
 
+    /* flush data in memory */
+
+    if (ALG_CACHE_RING == cache->type) {
+        rc = alg_cache_ring_flushall(cache);
+    } else {
+        rc = alg_cache_list_flushall(cache);
+    }
+
+    if (!rc) {
         return 0;
     }
 
-    /* cache in memory */
+    /* flush data in file, straight from the mapping */
+
+    while ((ptr = alg_disk_cache_peek(&cache->dcache, &sz))) {
+        if (!cache->handler(cache, ptr, sz)) {
+            return 0;
+        }
+
+        alg_disk_cache_consume(&cache->dcache);
+        cache->dcache_size -= sz;
+    }
+
+    return 1;
+}
+
+int
+alg_cache_empty(alg_cache_t *cache)
+{
+    return 0 == cache->memcache_size && 0 == cache->dcache_size;
+}
+
+static int
+alg_cache_list_push(alg_cache_t *cache, const void *data, size_t size)
+{
+    alg_cache_seg_t     *seg;
 
     seg = (alg_cache_seg_t *)cache->alloc(cache->alloc_ctx, sizeof(alg_cache_seg_t));
     if (NULL == seg) {
@@ -101,54 +204,113 @@ alg_cache_push(alg_cache_t *cache, const void *data, size_t size)
     seg->size = size;
     list_add_tail(&seg->node, &cache->memcache);
 
+    cache->memcache_size += size;
+
     return 1;
 }
 
-int
-alg_cache_flushall(alg_cache_t *cache)
+static int
+alg_cache_list_flushall(alg_cache_t *cache)
 {
     struct list_head    *pos, *tmp;
     alg_cache_seg_t     *seg;
-    size_t               sz;
-    char                *ptr;
-
-    /* flush data in memory */
 
     list_for_each_safe(pos, tmp, &cache->memcache)
     {
         seg = list_entry(pos, alg_cache_seg_t, node);
 
         if (cache->handler(cache, seg->data, seg->size)) {
+            cache->memcache_size -= seg->size;
+
             list_del(&seg->node);
-            cache->dealloc(cache->alloc_ctx, seg->data);            
+            cache->dealloc(cache->alloc_ctx, seg->data);
             cache->dealloc(cache->alloc_ctx, seg);
         } else {
             return 0;
-        }            
+        }
     }
 
-    /* flush data in file */
+    return 1;
+}
 
-    while ((sz = alg_disk_cache_peeksize(&cache->dcache))) {
-        ptr = (char *)cache->alloc(cache->alloc_ctx, sz);
-        
-        assert(ptr && "alg_cache_flushall()  alloc failed!");
-        assert(alg_disk_cache_read(&cache->dcache, ptr, sz) == (ssize_t)sz);
+/*
+ * Records are a size_t length followed by the data, aligned to size_t.
+ * A record never wraps: when it does not fit before the end of the ring,
+ * the rest of the ring is marked with ALG_RING_PAD and it goes to the start.
+ */
 
-        if (cache->handler(cache, ptr, sz)) {          
-            cache->dcache_size -= sz;
-            cache->dealloc(cache->alloc_ctx, ptr);
-        } else {
-            cache->dealloc(cache->alloc_ctx, ptr);
-            alg_disk_cache_rollback(&cache->dcache, sz);
+static int
+alg_cache_ring_push(alg_cache_t *cache, const void *data, size_t size)
+{
+    size_t   cap, need, off, room;
+
+    cap = cache->ring_mask + 1;
+    need = alg_ring_align(sizeof(size_t) + size);
+
+    if (need > cap) {
+        return 0;
+    }
+
+    off = cache->ring_tail & cache->ring_mask;
+    room = cap - off;
+
+    if (need > room) {
+        if (cache->ring_tail - cache->ring_head + room + need > cap) {
+            return 0;
+        }
+
+    } else if (cache->ring_tail - cache->ring_head + need > cap) {
+        return 0;
+    }
+
+    if (NULL == cache->ring) {
+        cache->ring = (char *)cache->alloc(cache->alloc_ctx, cap);
+        if (NULL == cache->ring) {
+            return 0;
         }
-    }   
+    }
+
+    if (need > room) {
+        *(size_t *)(cache->ring + off) = ALG_RING_PAD;
+        cache->ring_tail += room;
+        off = 0;
+    }
+
+    *(size_t *)(cache->ring + off) = size;
+    memcpy(cache->ring + off + sizeof(size_t), data, size);
+
+    cache->ring_tail += need;
+    cache->memcache_size += size;
 
     return 1;
 }
 
-int
-alg_cache_empty(alg_cache_t *cache)
+static int
+alg_cache_ring_flushall(alg_cache_t *cache)
 {
-    return 0 == cache->memcache_size && 0 == cache->dcache_size;
+    size_t   off, size;
+
+    while (cache->ring_head != cache->ring_tail) {
+        off = cache->ring_head & cache->ring_mask;
+        size = *(size_t *)(cache->ring + off);
+
+        if (ALG_RING_PAD == size) {
+            cache->ring_head += cache->ring_mask + 1 - off;
+            continue;
+        }
+
+        if (!cache->handler(cache, cache->ring + off + sizeof(size_t), size)) {
+            return 0;
+        }
+
+        cache->ring_head += alg_ring_align(sizeof(size_t) + size);
+        cache->memcache_size -= size;
+    }
+
+    /* start over from the beginning, so records wrap less often */
+
+    cache->ring_head = 0;
+    cache->ring_tail = 0;
+
+    return 1;
 }
@@ -13,6 +13,10 @@ typedef struct alg_cache_s      alg_cache_t;
 
 typedef int (*alg_cache_flush_handler_pt)(alg_cache_t *t, const void *data, size_t size);
 
+/* memory backend */
+#define ALG_CACHE_LIST  0   /* list of allocated segments */
+#define ALG_CACHE_RING  1   /* length-prefixed records in a fixed ring */
+
 struct alg_cache_seg_s {
     struct list_head    node;
     
@@ -21,9 +25,17 @@ struct alg_cache_seg_s {
 };
 
 struct alg_cache_s {
+    int                         type;
+
     struct list_head            memcache;
     alg_disk_cache_t            dcache;
 
+    /* ring backend, head and tail run free and wrap by ring_mask */
+    char                       *ring;
+    size_t                      ring_mask;
+    size_t                      ring_head;
+    size_t                      ring_tail;
+
     void                       *data;
 
     size_t                      memcache_size;
@@ -43,6 +55,15 @@ alg_cache_t *alg_cache_create(alg_cache_flush_handler_pt h,
                               void (*dealloc)(void *alloc_ctx, void *m),
                               void *alloc_ctx);
 
+alg_cache_t *alg_cache_create_ring(alg_cache_flush_handler_pt h, size_t size,
+                                   void *(*alloc)(void *alloc_ctx, size_t size),
+                                   void (*dealloc)(void *alloc_ctx, void *m),
+                                   void *alloc_ctx);
+
+/* where and how much to spill once the memory part is full */
+void alg_cache_set_spill(alg_cache_t *cache, const char *dir, size_t max_size,
+                         ngx_log_t *log);
+
 void alg_cache_destroy(alg_cache_t *cache);
 
 int alg_cache_push(alg_cache_t *cache, const void *data, size_t size);
@@ -1,94 +1,292 @@
 #include "alg_disk_cache.h"
 
-int
-alg_disk_cache_open(alg_disk_cache_t *dcache)
+#include <sys/mman.h>
+
+#define ALG_DISK_SEG_SIZE   (1024*1024)
+
+#define alg_disk_align(n, a)    (((n) + (a) - 1) & ~((size_t)(a) - 1))
+#define alg_disk_rec_size(n)    alg_disk_align(sizeof(size_t) + (n), sizeof(size_t))
+
+static alg_disk_seg_t *alg_disk_seg_get(alg_disk_cache_t *dcache, size_t need);
+static int alg_disk_seg_reserve(alg_disk_cache_t *dcache, alg_disk_seg_t *seg);
+static void alg_disk_seg_put(alg_disk_cache_t *dcache, alg_disk_seg_t *seg);
+static void alg_disk_seg_free(alg_disk_cache_t *dcache, alg_disk_seg_t *seg);
+
+void
+alg_disk_cache_init(alg_disk_cache_t *dcache, const char *dir,
+                    size_t max_size, ngx_log_t *log)
 {
-    dcache->file = tmpfile();
-    
-    return dcache->file != NULL;
+    dcache->head = NULL;
+    dcache->tail = NULL;
+    dcache->spare = NULL;
+    dcache->roff = 0;
+
+    dcache->size = 0;
+    dcache->max_size = max_size;
+    dcache->dir = dir;
+    dcache->log = log ? log : ngx_cycle->log;
 }
 
 void
 alg_disk_cache_close(alg_disk_cache_t *dcache)
 {
-    if (dcache->file) {
-        fclose(dcache->file);
+    alg_disk_seg_t *seg, *next;
+
+    for (seg = dcache->head; seg; seg = next) {
+        next = seg->next;
+        alg_disk_seg_free(dcache, seg);
+    }
+
+    if (dcache->spare) {
+        alg_disk_seg_free(dcache, dcache->spare);
     }
+
+    dcache->head = NULL;
+    dcache->tail = NULL;
+    dcache->spare = NULL;
+    dcache->roff = 0;
 }
 
 ssize_t
 alg_disk_cache_write(alg_disk_cache_t *dcache, const void *data, size_t size)
 {
-    long curpos;
-    
-    if (NULL == dcache->file &&
-        !alg_disk_cache_open(dcache)) {
-        return -1;
+    alg_disk_seg_t *seg;
+    size_t          need;
+
+    need = alg_disk_rec_size(size);
+    seg = dcache->tail;
+
+    if (NULL == seg || seg->size - seg->used < need) {
+        seg = alg_disk_seg_get(dcache, need);
+        if (NULL == seg) {
+            return -1;
+        }
+
+        if (dcache->tail) {
+            dcache->tail->next = seg;
+        } else {
+            dcache->head = seg;
+            dcache->roff = 0;
+        }
+
+        dcache->tail = seg;
     }
 
-    curpos = ftell(dcache->file);
-    if (curpos < 0) {
-        return -10;
+    *(size_t *)(seg->base + seg->used) = size;
+    memcpy(seg->base + seg->used + sizeof(size_t), data, size);
+
+    seg->used += need;
+
+    return size;
+}
+
+void *
+alg_disk_cache_peek(alg_disk_cache_t *dcache, size_t *size)
+{
+    alg_disk_seg_t *seg;
+
+    for (;;) {
+        seg = dcache->head;
+
+        if (NULL == seg) {
+            return NULL;
+        }
+
+        if (dcache->roff < seg->used) {
+            *size = *(size_t *)(seg->base + dcache->roff);
+            return seg->base + dcache->roff + sizeof(size_t);
+        }
+
+        if (seg == dcache->tail) {
+
+            /* drained, both cursors go back to the start of the segment */
+
+            seg->used = 0;
+            dcache->roff = 0;
+
+            return NULL;
+        }
+
+        dcache->head = seg->next;
+        dcache->roff = 0;
+
+        alg_disk_seg_put(dcache, seg);
+    }
+}
+
+void
+alg_disk_cache_consume(alg_disk_cache_t *dcache)
+{
+    alg_disk_seg_t *seg;
+    size_t          size;
+
+    seg = dcache->head;
+
+    if (NULL == seg || dcache->roff >= seg->used) {
+        return;
     }
-    if (fseek(dcache->file, 0, SEEK_END)) {
-        return -11;
+
+    size = *(size_t *)(seg->base + dcache->roff);
+    dcache->roff += alg_disk_rec_size(size);
+}
+
+static alg_disk_seg_t *
+alg_disk_seg_get(alg_disk_cache_t *dcache, size_t need)
+{
+    alg_disk_seg_t *seg;
+    u_char          path[NGX_MAX_PATH], *p;
+    size_t          size;
+    int             fd;
+
+    size = alg_disk_align(need, ngx_pagesize);
+    if (size < ALG_DISK_SEG_SIZE) {
+        size = ALG_DISK_SEG_SIZE;
     }
 
-    if (fwrite(&size, 1, sizeof(size), dcache->file) != sizeof(size)) {
-		return -2;
-	}
-	if (fwrite(data, 1, size, dcache->file) != size) {
-		return -3;
-	}
+    seg = dcache->spare;
 
-	fseek(dcache->file, curpos, SEEK_SET);
+    if (seg && seg->size >= size) {
+        dcache->spare = NULL;
 
-	return size;
+        /* its blocks were given back, a write to a hole may fault */
+
+        if (alg_disk_seg_reserve(dcache, seg) == -1) {
+            alg_disk_seg_free(dcache, seg);
+            return NULL;
+        }
+
+        seg->next = NULL;
+        seg->used = 0;
+        return seg;
+    }
+
+    if (dcache->max_size && dcache->size + size > dcache->max_size) {
+        return NULL;
+    }
+
+    seg = ngx_alloc(sizeof(alg_disk_seg_t), dcache->log);
+    if (NULL == seg) {
+        return NULL;
+    }
+
+    /*
+     * the file is unlinked right away, the mapping keeps it alive;
+     * the spill path is checked to leave room for the template
+     */
+
+    p = ngx_snprintf(path, sizeof(path) - 1, "%s" ALG_DISK_SPILL_NAME,
+                     dcache->dir ? dcache->dir : "/tmp");
+    *p = '\0';
+
+    fd = mkstemp((char *)path);
+    if (-1 == fd) {
+        ngx_log_error(NGX_LOG_CRIT, dcache->log, ngx_errno,
+                      "mkstemp(\"%s\") failed", path);
+        ngx_free(seg);
+        return NULL;
+    }
+
+    unlink((char *)path);
+
+    if (ftruncate(fd, size) == -1) {
+        ngx_log_error(NGX_LOG_CRIT, dcache->log, ngx_errno,
+                      "ftruncate() of spill file in \"%s\" failed",
+                      dcache->dir ? dcache->dir : "/tmp");
+        close(fd);
+        ngx_free(seg);
+        return NULL;
+    }
+
+    seg->base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (MAP_FAILED == seg->base) {
+        ngx_log_error(NGX_LOG_CRIT, dcache->log, ngx_errno,
+                      "mmap(%uz) of spill file failed", size);
+        close(fd);
+        ngx_free(seg);
+        return NULL;
+    }
+
+    seg->next = NULL;
+    seg->size = size;
+    seg->used = 0;
+    seg->fd = fd;
+
+    dcache->size += size;
+
+    /*
+     * the file is sparse, a write to the mapping that finds no room
+     * on the file system would fault, so its blocks are taken now
+     */
+
+    if (alg_disk_seg_reserve(dcache, seg) == -1) {
+        alg_disk_seg_free(dcache, seg);
+        return NULL;
+    }
+
+    return seg;
 }
 
-ssize_t
-alg_disk_cache_read(alg_disk_cache_t *dcache, void *data, size_t size)
+static int
+alg_disk_seg_reserve(alg_disk_cache_t *dcache, alg_disk_seg_t *seg)
 {
-	size_t peeksz;
-	
-	if (NULL == dcache->file) {
-		return 0;
-	}
-
-	peeksz = alg_disk_cache_peeksize(dcache);
-	if (0 == peeksz) {
-		return 0;
-	}
-	if (size < peeksz) {
-		return -2;
-	}
-
-	fseek(dcache->file, sizeof(peeksz), SEEK_CUR);
-	return fread(data, 1, peeksz, dcache->file);
+#if (NGX_HAVE_POSIX_FALLOCATE)
+    int      err;
+
+    err = posix_fallocate(seg->fd, 0, seg->size);
+
+    if (err) {
+        ngx_log_error(NGX_LOG_ERR, dcache->log, err,
+                      "posix_fallocate(%uz) of spill file in \"%s\" failed",
+                      seg->size, dcache->dir ? dcache->dir : "/tmp");
+        return -1;
+    }
+
+#else
+    u_char   zero[4096];
+    size_t   off;
+
+    ngx_memzero(zero, sizeof(zero));
+
+    for (off = 0; off < seg->size; off += sizeof(zero)) {
+        if (pwrite(seg->fd, zero, sizeof(zero), off) != sizeof(zero)) {
+            ngx_log_error(NGX_LOG_ERR, dcache->log, ngx_errno,
+                          "pwrite() of spill file in \"%s\" failed",
+                          dcache->dir ? dcache->dir : "/tmp");
+            return -1;
+        }
+    }
+#endif
+
+    return 0;
 }
 
-size_t
-alg_disk_cache_peeksize(alg_disk_cache_t *dcache)
+static void
+alg_disk_seg_put(alg_disk_cache_t *dcache, alg_disk_seg_t *seg)
 {
-	size_t peeksz;
-	
-	if (NULL == dcache->file) {
-		return 0;
-	}
-
-	peeksz = 0;
-	if (fread(&peeksz, 1, sizeof(peeksz), dcache->file) != sizeof(peeksz)) {
-		return 0;
-	}
-
-	fseek(dcache->file, -sizeof(peeksz), SEEK_CUR);
-	return peeksz;
+    if (NULL == dcache->spare && ALG_DISK_SEG_SIZE == seg->size) {
+
+#ifdef MADV_REMOVE
+        /* give the blocks back, the segment is rewritten before it's read */
+        madvise(seg->base, seg->size, MADV_REMOVE);
+#endif
+
+        seg->next = NULL;
+        seg->used = 0;
+        dcache->spare = seg;
+
+        return;
+    }
+
+    alg_disk_seg_free(dcache, seg);
 }
 
-void
-alg_disk_cache_rollback(alg_disk_cache_t *dcache, size_t n)
+static void
+alg_disk_seg_free(alg_disk_cache_t *dcache, alg_disk_seg_t *seg)
 {
-	if (dcache->file) {
-		fseek(dcache->file, -(n+sizeof(size_t)), SEEK_CUR);
-	}
+    munmap(seg->base, seg->size);
+    close(seg->fd);
+    dcache->size -= seg->size;
+
+    ngx_free(seg);
 }
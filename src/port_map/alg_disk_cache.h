@@ -1,27 +1,52 @@
 #ifndef __ALG_DISK_CACHE_H__
 #define __ALG_DISK_CACHE_H__
 
-#include <stdio.h>
+#include <ngx_config.h>
+#include <ngx_core.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* the spill files are made from this template in the spill directory */
+#define ALG_DISK_SPILL_NAME     "/alg_spill.XXXXXX"
+#define ALG_DISK_DIR_MAX        (NGX_MAX_PATH - sizeof(ALG_DISK_SPILL_NAME))
+
+typedef struct alg_disk_seg_s       alg_disk_seg_t;
 typedef struct alg_disk_cache_s     alg_disk_cache_t;
 
+/* a memory-mapped spill file, records never cross segments */
+struct alg_disk_seg_s {
+    alg_disk_seg_t  *next;
+
+    char            *base;
+    size_t           size;      /* mapped size */
+    size_t           used;      /* write cursor */
+
+    int              fd;        /* of the unlinked file */
+};
+
 struct alg_disk_cache_s {
-    FILE    *file;
+    alg_disk_seg_t  *head;      /* read segment */
+    alg_disk_seg_t  *tail;      /* write segment */
+    alg_disk_seg_t  *spare;     /* consumed segment kept for reuse */
+    size_t           roff;      /* read cursor in head */
+
+    size_t           size;      /* bytes mapped by all segments */
+    size_t           max_size;  /* 0 for no limit */
+    const char      *dir;
+    ngx_log_t       *log;
 };
 
-int alg_disk_cache_open(alg_disk_cache_t *dcache);
+void alg_disk_cache_init(alg_disk_cache_t *dcache, const char *dir,
+                         size_t max_size, ngx_log_t *log);
 void alg_disk_cache_close(alg_disk_cache_t *dcache);
 
 ssize_t alg_disk_cache_write(alg_disk_cache_t *dcache, const void *data, size_t size);
-ssize_t alg_disk_cache_read(alg_disk_cache_t *dcache, void *data, size_t size);
-
-size_t alg_disk_cache_peeksize(alg_disk_cache_t *dcache);
 
-void alg_disk_cache_rollback(alg_disk_cache_t *dcache, size_t n);
+/* the oldest record stays valid until it's consumed */
+void *alg_disk_cache_peek(alg_disk_cache_t *dcache, size_t *size);
+void alg_disk_cache_consume(alg_disk_cache_t *dcache);
 
 #ifdef __cplusplus
 }
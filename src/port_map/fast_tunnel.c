@@ -5,8 +5,69 @@
 #include "fast_tunnel.h"
 
 
+#define FT_MAGIC                0x46544e4c  /* "FTNL" */
+#define FT_VERSION              2
+
+/* hello is magic(4) 0(1) version(1) 0(2), the reply magic(4) conv(4) token */
+#define FT_HELLO_SIZE           8
+#define FT_REPLY_SIZE           (8 + KCP_PATH_TOKEN_SIZE)
+
+#define FT_HANDSHAKE_TIMEOUT    10000
+#define FT_CONNECT_TIMEOUT      10000
+
+#define ft_get_u32(p)                                                   \
+    ((uint32_t) (p)[0] << 24 | (uint32_t) (p)[1] << 16                  \
+     | (uint32_t) (p)[2] << 8 | (uint32_t) (p)[3])
+
+#define ft_put_u32(p, v)                                                \
+    (p)[0] = (u_char) ((v) >> 24); (p)[1] = (u_char) ((v) >> 16);       \
+    (p)[2] = (u_char) ((v) >> 8); (p)[3] = (u_char) (v)
+
+#define fast_tunnel_data_max(ft)                                        \
+    ngx_min(FT_DATA_MAX, kcp_msg_max((ft)->kcp_tun) - FT_HDR_SIZE)
+
+
+static ngx_int_t fast_tunnel_init(fast_tunnel_t *ft);
+static ngx_int_t fast_tunnel_test_connect(ngx_connection_t *c);
+
+/* handshake and control connection */
 static void fast_tunnel_on_recv(ngx_event_t *rev);
 static void fast_tunnel_on_connected(ngx_event_t *wev);
+static void fast_tunnel_on_hello(ngx_event_t *rev);
+static void fast_tunnel_on_ctrl(ngx_event_t *rev);
+static ngx_int_t fast_tunnel_read_hs(fast_tunnel_t *ft, size_t size);
+static ngx_int_t fast_tunnel_establish(fast_tunnel_t *ft, IUINT32 conv,
+    u_char *token);
+
+/* frames */
+static void fast_tunnel_on_pressure(kcp_tunnel_t *t, ngx_uint_t pause);
+static void fast_tunnel_on_close(kcp_tunnel_t *t);
+static void fast_tunnel_on_message(kcp_tunnel_t *t, const ikcpvec *vec,
+    int n, size_t size);
+static ngx_uint_t fast_tunnel_payload(fast_tunnel_t *ft, const ikcpvec *vec,
+    int n, size_t skip);
+static ngx_int_t fast_tunnel_send_frame(fast_tunnel_t *ft, ngx_uint_t cmd,
+    uint32_t id, uint32_t credit);
+
+/* streams */
+static fast_stream_t *fast_stream_create(fast_tunnel_t *ft, uint32_t id);
+static fast_stream_t *fast_stream_find(fast_tunnel_t *ft, uint32_t id);
+static void fast_stream_bind(fast_stream_t *st, ngx_connection_t *c);
+static void fast_stream_start(fast_stream_t *st);
+static void fast_stream_on_read(ngx_event_t *rev);
+static void fast_stream_on_write(ngx_event_t *wev);
+static void fast_stream_on_data(fast_stream_t *st, ngx_uint_t niovs,
+    size_t size);
+static ngx_int_t fast_stream_buffer(fast_stream_t *st, struct iovec *iovs,
+    ngx_uint_t niovs, size_t size);
+static ngx_int_t fast_stream_flush(fast_stream_t *st);
+static ngx_int_t fast_stream_consumed(fast_stream_t *st, size_t n);
+static void fast_stream_finalize(fast_stream_t *st);
+static void fast_tunnel_send_rst(fast_tunnel_t *ft, uint32_t id);
+static ngx_int_t fast_tunnel_flush_resets(fast_tunnel_t *ft);
+static void fast_stream_reset(fast_stream_t *st);
+static void fast_stream_close(fast_stream_t *st);
+static void fast_stream_stop_reading(fast_stream_t *st);
 
 
 ngx_int_t
@@ -20,9 +81,13 @@ fast_tunnel_connect(fast_tunnel_t *ft, const struct sockaddr *addr, socklen_t ad
     ngx_event_t       *rev, *wev;
     ngx_connection_t  *c;
 
+    if (fast_tunnel_init(ft) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     /* create socket and get connection */
 
-    s = ngx_socket(AF_INET, SOCK_STREAM, 0);
+    s = ngx_socket(addr->sa_family, SOCK_STREAM, 0);
 
     ngx_log_error(NGX_LOG_DEBUG, ft->log, 0,
                   "fast_tunnel_connect() TCP socket %d", s);
@@ -51,6 +116,11 @@ fast_tunnel_connect(fast_tunnel_t *ft, const struct sockaddr *addr, socklen_t ad
         goto failed;
     }
 
+    c->recv = ngx_recv;
+    c->send = ngx_send;
+    c->recv_chain = ngx_recv_chain;
+    c->send_chain = ngx_send_chain;
+
     /* set event handler */
 
     rev = c->read;
@@ -63,8 +133,8 @@ fast_tunnel_connect(fast_tunnel_t *ft, const struct sockaddr *addr, socklen_t ad
     wev->handler = fast_tunnel_on_connected;
     
     ft->ctrl_con = c;
-    ft->pool     = c->pool;
 
+    c->pool   = ft->pool;
     c->data   = ft;
     c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
 
@@ -74,6 +144,10 @@ fast_tunnel_connect(fast_tunnel_t *ft, const struct sockaddr *addr, socklen_t ad
         }
     }
 
+    /* the handshake must end in time, connect() included */
+
+    ngx_add_timer(rev, FT_HANDSHAKE_TIMEOUT);
+
     /* connect */
 
     rc = connect(s, addr, addrlen);
@@ -125,6 +199,7 @@ fast_tunnel_connect(fast_tunnel_t *ft, const struct sockaddr *addr, socklen_t ad
         }
 
         wev->ready = 1;
+        ngx_post_event(wev, &ngx_posted_events);
 
         return NGX_OK;
     }
@@ -158,6 +233,7 @@ fast_tunnel_connect(fast_tunnel_t *ft, const struct sockaddr *addr, socklen_t ad
     }
 
     wev->ready = 1;
+    ngx_post_event(wev, &ngx_posted_events);
 
     return NGX_OK;
 
@@ -172,9 +248,1212 @@ failed:
 ngx_int_t
 fast_tunnel_accept(fast_tunnel_t *ft, ngx_connection_t *c)
 {
+    ngx_event_t  *rev;
+
+    ft->ctrl_con = c;
+    ft->pool = c->pool;
+    ft->log = c->log;
+
+    if (fast_tunnel_init(ft) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    c->data = ft;
+
+    rev = c->read;
+    rev->handler = fast_tunnel_on_hello;
+    c->write->handler = ngx_pmap_empty_write_handler;
+
+    ngx_add_timer(rev, FT_HANDSHAKE_TIMEOUT);
+
+    if (rev->ready) {
+        ngx_post_event(rev, &ngx_posted_events);
+        return NGX_OK;
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+void
+fast_tunnel_close(fast_tunnel_t *ft)
+{
+    ngx_rbtree_node_t  *node, *sentinel;
+
+    if (ft->closing) {
+        return;
+    }
+
+    ft->closing = 1;
+
+    ngx_log_error(NGX_LOG_INFO, ft->log, 0,
+                  "close fast tunnel! conv=%uD",
+                  ft->kcp_tun ? ft->kcp_tun->conv : 0);
+
+    /* the streams die with the tunnel, there's nobody to tell */
+
+    sentinel = ft->streams.sentinel;
+
+    while (ft->streams.root != sentinel) {
+        node = ngx_rbtree_min(ft->streams.root, sentinel);
+        fast_stream_close((fast_stream_t *) node);
+    }
+
+    if (ft->kcp_tun) {
+        kcp_destroy_tunnel(ft->kcp_group, ft->kcp_tun);
+        ft->kcp_tun = NULL;
+    }
+
+    if (ft->disconnect_handler) {
+        ft->disconnect_handler(ft);
+    }
+
+    /* ft lives in the pool of the control connection */
+
+    ngx_pmap_close_connection(ft->ctrl_con);
 }
 
 ssize_t
 fast_tunnel_send(fast_tunnel_t *ft, const void *data, size_t size)
 {
+    if (NULL == ft->kcp_tun) {
+        return NGX_ERROR;
+    }
+
+    if (!kcp_send(ft->kcp_tun, data, size)) {
+        return NGX_ERROR;
+    }
+
+    return size;
+}
+
+ngx_int_t
+fast_tunnel_open_stream(fast_tunnel_t *ft, ngx_connection_t *c)
+{
+    fast_stream_t  *st;
+
+    if (ft->nstreams >= FT_STREAMS_MAX) {
+        ngx_log_error(NGX_LOG_WARN, ft->log, 0,
+                      "fast tunnel has %ui streams already", ft->nstreams);
+        return NGX_ERROR;
+    }
+
+    st = fast_stream_create(ft, ft->next_id);
+    if (NULL == st) {
+        return NGX_ERROR;
+    }
+
+    /* client streams are odd, even ids are left to the server */
+
+    ft->next_id += 2;
+
+    fast_stream_bind(st, c);
+
+    if (!ft->established) {
+        st->waiting = 1;
+        ngx_queue_insert_tail(&ft->waiting, &st->queue);
+        return NGX_OK;
+    }
+
+    fast_stream_start(st);
+
+    return NGX_OK;
+}
+
+void
+fast_stream_attach(fast_stream_t *st, ngx_connection_t *c,
+    ngx_uint_t connecting)
+{
+    fast_stream_bind(st, c);
+
+    if (connecting) {
+        st->connecting = 1;
+        ngx_add_timer(c->write, FT_CONNECT_TIMEOUT);
+        return;
+    }
+
+    ngx_post_event(c->read, &ngx_posted_events);
+}
+
+static ngx_int_t
+fast_tunnel_init(fast_tunnel_t *ft)
+{
+    ngx_rbtree_init(&ft->streams, &ft->sentinel, ngx_rbtree_insert_value);
+    ngx_queue_init(&ft->waiting);
+    ngx_queue_init(&ft->stalled);
+
+    ft->next_id = 1;
+    ft->nstreams = 0;
+    ft->resets = NULL;
+    ft->hs_len = 0;
+
+    ft->sbuf = ngx_palloc(ft->pool, FT_HDR_SIZE + FT_DATA_MAX);
+    ft->iovs = ngx_palloc(ft->pool, IKCP_FRG_MAX * sizeof(struct iovec));
+
+    if (NULL == ft->sbuf || NULL == ft->iovs) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+fast_tunnel_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+    err = 0;
+    len = sizeof(int);
+
+    /*
+     * BSDs and Linux return 0 and set a pending error in err,
+     * Solaris returns -1 and sets errno
+     */
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        c->log->action = "connecting";
+        (void) ngx_connection_error(c, err, "connect() failed");
+        c->log->action = NULL;
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/* handshake and control connection */
+
+static void
+fast_tunnel_on_connected(ngx_event_t *wev)
+{
+    ngx_connection_t  *c;
+    fast_tunnel_t     *ft;
+    u_char             hello[FT_HELLO_SIZE];
+
+    c = wev->data;
+    ft = c->data;
+
+    wev->handler = ngx_pmap_empty_write_handler;
+
+    if (fast_tunnel_test_connect(c) != NGX_OK) {
+        fast_tunnel_close(ft);
+        return;
+    }
+
+    ft_put_u32(hello, FT_MAGIC);
+    hello[4] = 0;
+    hello[5] = FT_VERSION;
+    hello[6] = 0;
+    hello[7] = 0;
+
+    /* a fresh connection takes 8 bytes at once */
+
+    if (c->send(c, hello, sizeof(hello)) != sizeof(hello)) {
+        fast_tunnel_close(ft);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        fast_tunnel_close(ft);
+        return;
+    }
+}
+
+static void
+fast_tunnel_on_recv(ngx_event_t *rev)
+{
+    ngx_connection_t  *c;
+    fast_tunnel_t     *ft;
+    ngx_int_t          rc;
+
+    c = rev->data;
+    ft = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "fast tunnel handshake timed out");
+        fast_tunnel_close(ft);
+        return;
+    }
+
+    rc = fast_tunnel_read_hs(ft, FT_REPLY_SIZE);
+
+    if (NGX_AGAIN == rc) {
+        return;
+    }
+
+    if (NGX_ERROR == rc || ft_get_u32(ft->hs) != FT_MAGIC) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "fast tunnel handshake failed");
+        fast_tunnel_close(ft);
+        return;
+    }
+
+    if (fast_tunnel_establish(ft, ft_get_u32(ft->hs + 4), ft->hs + 8)
+        != NGX_OK)
+    {
+        fast_tunnel_close(ft);
+        return;
+    }
+}
+
+static void
+fast_tunnel_on_hello(ngx_event_t *rev)
+{
+    ngx_connection_t  *c;
+    fast_tunnel_t     *ft;
+    ngx_int_t          rc;
+    IUINT32            conv;
+
+    c = rev->data;
+    ft = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "fast tunnel handshake timed out");
+        fast_tunnel_close(ft);
+        return;
+    }
+
+    rc = fast_tunnel_read_hs(ft, FT_HELLO_SIZE);
+
+    if (NGX_AGAIN == rc) {
+        return;
+    }
+
+    if (NGX_ERROR == rc
+        || ft_get_u32(ft->hs) != FT_MAGIC
+        || ft->hs[5] != FT_VERSION)
+    {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "invalid fast tunnel hello");
+        fast_tunnel_close(ft);
+        return;
+    }
+
+    /*
+     * the reply is the magic, the conv of the tunnel, and the token that
+     * lets the tunnel move to another client address
+     */
+
+    conv = kcp_group_new_conv(ft->kcp_group);
+
+    if (fast_tunnel_establish(ft, conv, NULL) != NGX_OK) {
+        fast_tunnel_close(ft);
+        return;
+    }
+
+    ft_put_u32(ft->hs + 4, conv);
+    ngx_memcpy(ft->hs + 8, ft->kcp_tun->path.token, KCP_PATH_TOKEN_SIZE);
+
+    if (c->send(c, ft->hs, FT_REPLY_SIZE) != FT_REPLY_SIZE) {
+        fast_tunnel_close(ft);
+        return;
+    }
+}
+
+static void
+fast_tunnel_on_ctrl(ngx_event_t *rev)
+{
+    ngx_connection_t  *c;
+    fast_tunnel_t     *ft;
+    ssize_t            n;
+    u_char             buf[64];
+
+    c = rev->data;
+    ft = c->data;
+
+    /* nothing follows the handshake, the connection only bounds the tunnel */
+
+    for ( ;; ) {
+        n = c->recv(c, buf, sizeof(buf));
+
+        if (NGX_AGAIN == n) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                fast_tunnel_close(ft);
+            }
+
+            return;
+        }
+
+        if (NGX_ERROR == n || 0 == n) {
+            fast_tunnel_close(ft);
+            return;
+        }
+    }
+}
+
+static ngx_int_t
+fast_tunnel_read_hs(fast_tunnel_t *ft, size_t size)
+{
+    ngx_connection_t  *c;
+    ssize_t            n;
+
+    c = ft->ctrl_con;
+
+    while (ft->hs_len < size) {
+        n = c->recv(c, ft->hs + ft->hs_len, size - ft->hs_len);
+
+        if (NGX_AGAIN == n) {
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            return NGX_AGAIN;
+        }
+
+        if (NGX_ERROR == n || 0 == n) {
+            return NGX_ERROR;
+        }
+
+        ft->hs_len += n;
+    }
+
+    return NGX_OK;
+}
+
+/* token is the one the server sent, NULL on the server */
+
+static ngx_int_t
+fast_tunnel_establish(fast_tunnel_t *ft, IUINT32 conv, u_char *token)
+{
+    ngx_connection_t  *c;
+    kcp_tunnel_t      *t;
+    ngx_queue_t       *q;
+    fast_stream_t     *st;
+
+    t = kcp_create_tunnel(ft->kcp_group, conv);
+    if (NULL == t) {
+        return NGX_ERROR;
+    }
+
+    t->data = ft;
+    t->recvv_handler = fast_tunnel_on_message;
+    t->pressure_handler = fast_tunnel_on_pressure;
+    t->close_handler = fast_tunnel_on_close;
+
+    ft->kcp_tun = t;
+
+    /* before the first datagram, it's sealed with keys of the token */
+
+    if (token && kcp_tunnel_set_token(t, token) != NGX_OK) {
+        return NGX_ERROR;
+    }
+    ft->established = 1;
+
+    c = ft->ctrl_con;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    c->read->handler = fast_tunnel_on_ctrl;
+    ngx_post_event(c->read, &ngx_posted_events);
+
+    /* the first datagram tells the server where we are */
+
+    if (!ft->kcp_group->is_server) {
+        if (fast_tunnel_send_frame(ft, FT_CMD_PING, 0, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    while (!ngx_queue_empty(&ft->waiting)) {
+        q = ngx_queue_head(&ft->waiting);
+        ngx_queue_remove(q);
+
+        st = ngx_queue_data(q, fast_stream_t, queue);
+        st->waiting = 0;
+
+        fast_stream_start(st);
+    }
+
+    if (ft->connect_handler) {
+        ft->connect_handler(ft);
+    }
+
+    return NGX_OK;
+}
+
+
+/* the kcp tunnel can't go on, the control connection goes with it */
+
+static void
+fast_tunnel_on_close(kcp_tunnel_t *t)
+{
+    fast_tunnel_close(t->data);
+}
+
+
+/*
+ * The streams stop reading while the kcp send cache is over its high
+ * water, they find out in fast_stream_on_read(), and are all woken up
+ * again when it drains.
+ */
+
+static void
+fast_tunnel_on_pressure(kcp_tunnel_t *t, ngx_uint_t pause)
+{
+    fast_tunnel_t  *ft;
+    fast_stream_t  *st;
+    ngx_queue_t    *q;
+
+    ft = t->data;
+
+    if (pause) {
+        return;
+    }
+
+    (void) fast_tunnel_flush_resets(ft);
+
+    while (!ngx_queue_empty(&ft->stalled)) {
+        q = ngx_queue_head(&ft->stalled);
+        ngx_queue_remove(q);
+
+        st = ngx_queue_data(q, fast_stream_t, queue);
+        st->stalled = 0;
+
+        ngx_post_event(st->c->read, &ngx_posted_events);
+    }
+}
+
+
+/* frames */
+
+static void
+fast_tunnel_on_message(kcp_tunnel_t *t, const ikcpvec *vec, int n,
+    size_t size)
+{
+    fast_tunnel_t  *ft;
+    fast_stream_t  *st;
+    u_char          h[FT_HDR_SIZE + 4], *p;
+    size_t          len, k;
+    ngx_uint_t      cmd, niovs;
+    uint32_t        id;
+    int             i;
+
+    ft = t->data;
+
+    if (size < FT_HDR_SIZE) {
+        ngx_log_error(NGX_LOG_INFO, ft->log, 0,
+                      "short fast tunnel frame, size:%uz", size);
+        return;
+    }
+
+    /* the header is nearly always in the first fragment */
+
+    if ((size_t) vec[0].len >= sizeof(h) || (size_t) vec[0].len == size) {
+        p = (u_char *) vec[0].data;
+
+    } else {
+        p = h;
+        len = 0;
+
+        for (i = 0; i < n && len < sizeof(h); i++) {
+            k = ngx_min((size_t) vec[i].len, sizeof(h) - len);
+            ngx_memcpy(h + len, vec[i].data, k);
+            len += k;
+        }
+    }
+
+    cmd = p[0];
+    id = ft_get_u32(p + 4);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ft->log, 0,
+                   "fast tunnel frame: cmd:%ui id:%uD size:%uz",
+                   cmd, id, size);
+
+    if (FT_CMD_PING == cmd) {
+        return;
+    }
+
+    st = fast_stream_find(ft, id);
+
+    switch (cmd) {
+
+    case FT_CMD_OPEN:
+
+        if (st || NULL == ft->open_handler) {
+            fast_tunnel_send_rst(ft, id);
+            return;
+        }
+
+        if (ft->nstreams >= FT_STREAMS_MAX) {
+            ngx_log_error(NGX_LOG_INFO, ft->log, 0,
+                          "fast tunnel has %ui streams already, "
+                          "stream %uD refused", ft->nstreams, id);
+            fast_tunnel_send_rst(ft, id);
+            return;
+        }
+
+        st = fast_stream_create(ft, id);
+        if (NULL == st) {
+            fast_tunnel_send_rst(ft, id);
+            return;
+        }
+
+        if (ft->open_handler(ft, st) != NGX_OK) {
+            fast_stream_reset(st);
+        }
+
+        return;
+
+    case FT_CMD_DATA:
+
+        /* a stream we have already reset may still have data in flight */
+
+        if (NULL == st || st->remote_eof) {
+            return;
+        }
+
+        niovs = fast_tunnel_payload(ft, vec, n, FT_HDR_SIZE);
+        fast_stream_on_data(st, niovs, size - FT_HDR_SIZE);
+
+        return;
+
+    case FT_CMD_WINDOW:
+
+        if (NULL == st || size < FT_HDR_SIZE + 4) {
+            return;
+        }
+
+        st->send_window += ft_get_u32(p + FT_HDR_SIZE);
+
+        if (st->blocked) {
+            st->blocked = 0;
+            ngx_post_event(st->c->read, &ngx_posted_events);
+        }
+
+        return;
+
+    case FT_CMD_FIN:
+
+        if (NULL == st) {
+            return;
+        }
+
+        st->remote_eof = 1;
+
+        if (st->connecting) {
+            return;
+        }
+
+        if (fast_stream_flush(st) == NGX_ERROR) {
+            fast_stream_reset(st);
+            return;
+        }
+
+        fast_stream_finalize(st);
+
+        return;
+
+    case FT_CMD_RST:
+
+        if (st) {
+            fast_stream_close(st);
+        }
+
+        return;
+
+    default:
+        ngx_log_error(NGX_LOG_INFO, ft->log, 0,
+                      "unknown fast tunnel frame, cmd:%ui", cmd);
+    }
+}
+
+static ngx_uint_t
+fast_tunnel_payload(fast_tunnel_t *ft, const ikcpvec *vec, int n, size_t skip)
+{
+    ngx_uint_t  niovs;
+    size_t      len;
+    int         i;
+
+    niovs = 0;
+
+    for (i = 0; i < n; i++) {
+        len = vec[i].len;
+
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+
+        ft->iovs[niovs].iov_base = (u_char *) vec[i].data + skip;
+        ft->iovs[niovs].iov_len = len - skip;
+        niovs++;
+
+        skip = 0;
+    }
+
+    return niovs;
+}
+
+static ngx_int_t
+fast_tunnel_send_frame(fast_tunnel_t *ft, ngx_uint_t cmd, uint32_t id,
+    uint32_t credit)
+{
+    u_char  frame[FT_HDR_SIZE + 4];
+    size_t  size;
+
+    frame[0] = (u_char) cmd;
+    frame[1] = 0;
+    frame[2] = 0;
+    frame[3] = 0;
+    ft_put_u32(frame + 4, id);
+
+    size = FT_HDR_SIZE;
+
+    if (FT_CMD_WINDOW == cmd) {
+        ft_put_u32(frame + FT_HDR_SIZE, credit);
+        size += 4;
+    }
+
+    if (fast_tunnel_send(ft, frame, size) != (ssize_t) size) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * The peer must learn that a stream is gone even if the send cache did
+ * not take the RST, it's sent again when the cache drains.
+ */
+
+static void
+fast_tunnel_send_rst(fast_tunnel_t *ft, uint32_t id)
+{
+    uint32_t  *p;
+
+    if (fast_tunnel_flush_resets(ft) == NGX_OK
+        && fast_tunnel_send_frame(ft, FT_CMD_RST, id, 0) == NGX_OK)
+    {
+        return;
+    }
+
+    if (ft->closing) {
+        return;
+    }
+
+    if (NULL == ft->resets) {
+        ft->resets = ngx_array_create(ft->pool, 4, sizeof(uint32_t));
+        if (NULL == ft->resets) {
+            return;
+        }
+    }
+
+    if (ft->resets->nelts >= FT_STREAMS_MAX) {
+        ngx_log_error(NGX_LOG_INFO, ft->log, 0,
+                      "fast tunnel dropped the RST of stream %uD", id);
+        return;
+    }
+
+    p = ngx_array_push(ft->resets);
+    if (p) {
+        *p = id;
+    }
+}
+
+static ngx_int_t
+fast_tunnel_flush_resets(fast_tunnel_t *ft)
+{
+    uint32_t    *ids;
+    ngx_uint_t   i;
+
+    if (NULL == ft->resets || 0 == ft->resets->nelts) {
+        return NGX_OK;
+    }
+
+    ids = ft->resets->elts;
+
+    for (i = 0; i < ft->resets->nelts; i++) {
+        if (fast_tunnel_send_frame(ft, FT_CMD_RST, ids[i], 0) != NGX_OK) {
+            break;
+        }
+    }
+
+    ft->resets->nelts -= i;
+
+    if (ft->resets->nelts) {
+        ngx_memmove(ids, ids + i, ft->resets->nelts * sizeof(uint32_t));
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/* streams */
+
+static fast_stream_t *
+fast_stream_create(fast_tunnel_t *ft, uint32_t id)
+{
+    fast_stream_t  *st;
+
+    st = ngx_calloc(sizeof(fast_stream_t), ft->log);
+    if (NULL == st) {
+        return NULL;
+    }
+
+    st->node.key = id;
+    st->id = id;
+    st->ft = ft;
+
+    st->send_window = FT_STREAM_WINDOW;
+    st->recv_window = FT_STREAM_WINDOW;
+
+    ngx_rbtree_insert(&ft->streams, &st->node);
+    ft->nstreams++;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ft->log, 0,
+                   "fast stream %uD created", id);
+
+    return st;
+}
+
+static fast_stream_t *
+fast_stream_find(fast_tunnel_t *ft, uint32_t id)
+{
+    ngx_rbtree_node_t  *node, *sentinel;
+
+    node = ft->streams.root;
+    sentinel = ft->streams.sentinel;
+
+    while (node != sentinel && node->key != id) {
+        node = id < node->key ? node->left : node->right;
+    }
+
+    if (node != sentinel) {
+        return (fast_stream_t *) node;
+    }
+
+    return NULL;
+}
+
+static void
+fast_stream_bind(fast_stream_t *st, ngx_connection_t *c)
+{
+    st->c = c;
+
+    c->data = st;
+    c->read->handler = fast_stream_on_read;
+    c->write->handler = fast_stream_on_write;
+}
+
+static void
+fast_stream_start(fast_stream_t *st)
+{
+    if (fast_tunnel_send_frame(st->ft, FT_CMD_OPEN, st->id, 0) != NGX_OK) {
+        fast_stream_close(st);
+        return;
+    }
+
+    ngx_post_event(st->c->read, &ngx_posted_events);
+}
+
+/*
+ * Local data goes straight behind the frame header in ft->sbuf, so the only
+ * copy on the way out is the one into the kcp segments.
+ */
+
+static void
+fast_stream_on_read(ngx_event_t *rev)
+{
+    ngx_connection_t  *c;
+    fast_stream_t     *st;
+    fast_tunnel_t     *ft;
+    ssize_t            n;
+    size_t             size;
+
+    c = rev->data;
+    st = c->data;
+    ft = st->ft;
+
+    if (st->waiting || st->connecting || st->local_eof) {
+        return;
+    }
+
+    for ( ;; ) {
+
+        if (0 == st->send_window) {
+            st->blocked = 1;
+            fast_stream_stop_reading(st);
+            return;
+        }
+
+        if (ft->kcp_tun->paused) {
+            if (!st->stalled) {
+                st->stalled = 1;
+                ngx_queue_insert_tail(&ft->stalled, &st->queue);
+            }
+
+            fast_stream_stop_reading(st);
+            return;
+        }
+
+        size = ngx_min(st->send_window, fast_tunnel_data_max(ft));
+
+        n = c->recv(c, ft->sbuf + FT_HDR_SIZE, size);
+
+        if (NGX_AGAIN == n) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                fast_stream_reset(st);
+            }
+
+            return;
+        }
+
+        if (NGX_ERROR == n) {
+            fast_stream_reset(st);
+            return;
+        }
+
+        if (0 == n) {
+            st->local_eof = 1;
+
+            if (fast_tunnel_send_frame(ft, FT_CMD_FIN, st->id, 0) != NGX_OK) {
+                fast_stream_reset(st);
+                return;
+            }
+
+            fast_stream_finalize(st);
+            return;
+        }
+
+        ft->sbuf[0] = FT_CMD_DATA;
+        ft->sbuf[1] = 0;
+        ft->sbuf[2] = 0;
+        ft->sbuf[3] = 0;
+        ft_put_u32(ft->sbuf + 4, st->id);
+
+        if (fast_tunnel_send(ft, ft->sbuf, FT_HDR_SIZE + n) == NGX_ERROR) {
+            fast_stream_reset(st);
+            return;
+        }
+
+        st->send_window -= n;
+
+        if (!rev->ready) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                fast_stream_reset(st);
+            }
+
+            return;
+        }
+    }
+}
+
+static void
+fast_stream_on_write(ngx_event_t *wev)
+{
+    ngx_connection_t  *c;
+    fast_stream_t     *st;
+
+    c = wev->data;
+    st = c->data;
+
+    if (st->connecting) {
+
+        if (wev->timedout) {
+            ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                          "fast stream %uD connect timed out", st->id);
+            fast_stream_reset(st);
+            return;
+        }
+
+        if (fast_tunnel_test_connect(c) != NGX_OK) {
+            fast_stream_reset(st);
+            return;
+        }
+
+        if (wev->timer_set) {
+            ngx_del_timer(wev);
+        }
+
+        st->connecting = 0;
+
+        ngx_post_event(c->read, &ngx_posted_events);
+    }
+
+    if (fast_stream_flush(st) == NGX_ERROR) {
+        fast_stream_reset(st);
+        return;
+    }
+
+    fast_stream_finalize(st);
+}
+
+/*
+ * The payload is written from the kcp segments with one writev(), only what
+ * the socket does not take is copied.  The window bounds the copy.
+ */
+
+static void
+fast_stream_on_data(fast_stream_t *st, ngx_uint_t niovs, size_t size)
+{
+    ngx_connection_t  *c;
+    ngx_iovec_t        vec;
+    ssize_t            n;
+    size_t             skip;
+    ngx_uint_t         i;
+    struct iovec      *iovs;
+
+    c = st->c;
+    iovs = st->ft->iovs;
+
+    if (size > st->recv_window) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "fast stream %uD exceeds its window", st->id);
+        fast_stream_reset(st);
+        return;
+    }
+
+    st->recv_window -= size;
+
+    if (0 == size) {
+        return;
+    }
+
+    if (!st->connecting
+        && st->out.pos == st->out.last
+        && c->write->ready)
+    {
+        vec.iovs = iovs;
+        vec.count = niovs;
+        vec.size = size;
+        vec.nalloc = IKCP_FRG_MAX;
+
+        n = ngx_writev(c, &vec);
+
+        if (NGX_ERROR == n) {
+            fast_stream_reset(st);
+            return;
+        }
+
+        if (NGX_AGAIN == n) {
+            n = 0;
+        }
+
+        if ((size_t) n < size) {
+            c->write->ready = 0;
+        }
+
+        if (fast_stream_consumed(st, n) != NGX_OK) {
+            fast_stream_reset(st);
+            return;
+        }
+
+        if ((size_t) n == size) {
+            return;
+        }
+
+        /* skip what was written */
+
+        skip = n;
+        size -= n;
+
+        for (i = 0; skip >= iovs[i].iov_len; i++) {
+            skip -= iovs[i].iov_len;
+        }
+
+        iovs[i].iov_base = (u_char *) iovs[i].iov_base + skip;
+        iovs[i].iov_len -= skip;
+
+        iovs += i;
+        niovs -= i;
+    }
+
+    if (fast_stream_buffer(st, iovs, niovs, size) != NGX_OK) {
+        fast_stream_reset(st);
+        return;
+    }
+
+    if (!st->connecting) {
+        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+            fast_stream_reset(st);
+            return;
+        }
+    }
+}
+
+static ngx_int_t
+fast_stream_buffer(fast_stream_t *st, struct iovec *iovs, ngx_uint_t niovs,
+    size_t size)
+{
+    ngx_buf_t   *b;
+    size_t       len;
+    ngx_uint_t   i;
+
+    b = &st->out;
+
+    if (NULL == b->start) {
+        b->start = ngx_alloc(FT_STREAM_WINDOW, st->ft->log);
+        if (NULL == b->start) {
+            return NGX_ERROR;
+        }
+
+        b->pos = b->start;
+        b->last = b->start;
+        b->end = b->start + FT_STREAM_WINDOW;
+    }
+
+    /* the window guarantees the data fits once the buffer is compacted */
+
+    if ((size_t) (b->end - b->last) < size) {
+        len = b->last - b->pos;
+
+        ngx_memmove(b->start, b->pos, len);
+        b->pos = b->start;
+        b->last = b->start + len;
+
+        if ((size_t) (b->end - b->last) < size) {
+            return NGX_ERROR;
+        }
+    }
+
+    for (i = 0; i < niovs; i++) {
+        b->last = ngx_cpymem(b->last, iovs[i].iov_base, iovs[i].iov_len);
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+fast_stream_flush(fast_stream_t *st)
+{
+    ngx_connection_t  *c;
+    ngx_buf_t         *b;
+    ssize_t            n;
+
+    c = st->c;
+    b = &st->out;
+
+    while (b->pos < b->last) {
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        if (NGX_ERROR == n) {
+            return NGX_ERROR;
+        }
+
+        if (NGX_AGAIN == n) {
+            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            return NGX_AGAIN;
+        }
+
+        b->pos += n;
+
+        if (fast_stream_consumed(st, n) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    b->pos = b->start;
+    b->last = b->start;
+
+    if (st->remote_eof && !st->shut_wr) {
+        if (ngx_shutdown_socket(c->fd, NGX_WRITE_SHUTDOWN) == -1) {
+            ngx_connection_error(c, ngx_socket_errno,
+                                 ngx_shutdown_socket_n " failed");
+            return NGX_ERROR;
+        }
+
+        st->shut_wr = 1;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+fast_stream_consumed(fast_stream_t *st, size_t n)
+{
+    st->consumed += n;
+
+    /* credit the peer in chunks, not for every write */
+
+    if (st->consumed < FT_STREAM_WINDOW / 4 || st->remote_eof) {
+        return NGX_OK;
+    }
+
+    if (fast_tunnel_send_frame(st->ft, FT_CMD_WINDOW, st->id, st->consumed)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    st->recv_window += st->consumed;
+    st->consumed = 0;
+
+    return NGX_OK;
+}
+
+static void
+fast_stream_finalize(fast_stream_t *st)
+{
+    /* both directions are done and everything is written */
+
+    if (st->local_eof && st->shut_wr) {
+        fast_stream_close(st);
+    }
+}
+
+static void
+fast_stream_reset(fast_stream_t *st)
+{
+    if (!st->waiting) {
+        fast_tunnel_send_rst(st->ft, st->id);
+    }
+
+    fast_stream_close(st);
+}
+
+static void
+fast_stream_close(fast_stream_t *st)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, st->ft->log, 0,
+                   "fast stream %uD closed", st->id);
+
+    if (st->waiting || st->stalled) {
+        ngx_queue_remove(&st->queue);
+    }
+
+    ngx_rbtree_delete(&st->ft->streams, &st->node);
+    st->ft->nstreams--;
+
+    if (st->c) {
+        ngx_pmap_close_connection(st->c);
+    }
+
+    if (st->out.start) {
+        ngx_free(st->out.start);
+    }
+
+    ngx_free(st);
+}
+
+/* level-triggered events would fire until the stream may read again */
+
+static void
+fast_stream_stop_reading(fast_stream_t *st)
+{
+    ngx_event_t  *rev;
+
+    rev = st->c->read;
+
+    if (!(ngx_event_flags & NGX_USE_CLEAR_EVENT) && rev->active) {
+        if (ngx_del_event(rev, NGX_READ_EVENT, 0) != NGX_OK) {
+            fast_stream_reset(st);
+        }
+    }
 }
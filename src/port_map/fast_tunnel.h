@@ -8,31 +8,111 @@
 
 
 typedef struct fast_tunnel_s    fast_tunnel_t;
+typedef struct fast_stream_s    fast_stream_t;
+
+
+/*
+ * A fast tunnel is a TCP control connection, which carries the handshake
+ * and bounds the life of the tunnel, and one kcp conversation, which
+ * carries the frames of all streams.  Every kcp message is one frame:
+ *
+ *     cmd(1) reserved(3) stream id(4) payload
+ *
+ * The stream id and the credit of a window frame are in network order.
+ */
+
+#define FT_HDR_SIZE             8
+
+#define FT_CMD_OPEN             1   /* client opens a stream */
+#define FT_CMD_DATA             2
+#define FT_CMD_WINDOW           3   /* payload is a 4 byte credit */
+#define FT_CMD_FIN              4   /* sender has no more data */
+#define FT_CMD_RST              5   /* stream is aborted */
+#define FT_CMD_PING             6   /* stream 0, settles the peer address */
+
+#define FT_STREAM_WINDOW        (256 * 1024)
+#define FT_DATA_MAX             (16 * 1024)
+
+/* streams of a tunnel at once, each may have a window buffered */
+#define FT_STREAMS_MAX          1024
+
+
+/* a TCP connection multiplexed into the tunnel */
+struct fast_stream_s {
+    ngx_rbtree_node_t    node;      /* key is the stream id */
+    ngx_queue_t          queue;     /* in ft->waiting or ft->stalled */
+
+    fast_tunnel_t       *ft;
+    ngx_connection_t    *c;
+
+    uint32_t             id;
+
+    size_t               send_window;   /* we may send without credit */
+    size_t               recv_window;   /* the peer may send */
+    size_t               consumed;      /* written to c, not credited yet */
+
+    ngx_buf_t            out;       /* tunnel data c was not ready for */
+
+    unsigned             waiting:1;     /* tunnel is not established */
+    unsigned             connecting:1;
+    unsigned             blocked:1;     /* out of send window */
+    unsigned             stalled:1;     /* the kcp send cache is full */
+    unsigned             local_eof:1;   /* FIN sent */
+    unsigned             remote_eof:1;  /* FIN received */
+    unsigned             shut_wr:1;
+};
 
 
 struct fast_tunnel_s {
     void                *data;
 
-    ngx_pool_t          *pool;
+    ngx_pool_t          *pool;      /* the pool of ctrl_con */
     ngx_log_t           *log;
 
     kcp_tunnel_group_t  *kcp_group; /* used to create kcp tunnel */
-    
+
     kcp_tunnel_t        *kcp_tun;
     ngx_connection_t    *ctrl_con;
 
+    /* streams by id */
+    ngx_rbtree_t         streams;
+    ngx_rbtree_node_t    sentinel;
+    ngx_queue_t          waiting;   /* opened before the handshake ended */
+    ngx_queue_t          stalled;   /* stopped reading, see kcp_send() */
+    uint32_t             next_id;
+    ngx_uint_t           nstreams;
+
+    /* ids of the streams whose RST kcp_send() did not take yet */
+    ngx_array_t         *resets;
+
+    u_char               hs[8 + KCP_PATH_TOKEN_SIZE];  /* handshake */
+    size_t               hs_len;
+
+    u_char              *sbuf;      /* a frame, filled straight by recv() */
+    struct iovec        *iovs;      /* IKCP_FRG_MAX, for writev() */
+
+    unsigned             established:1;
+    unsigned             closing:1;
+
     /* handler */
 
     void               (*connect_handler)(fast_tunnel_t *ft);
     void               (*disconnect_handler)(fast_tunnel_t *ft);
-    void               (*err_handler)(fast_tunnel_t *ft, ngx_int_t errcode);
-    void               (*recv_handler)(fast_tunnel_t *ft, const void *data, size_t size);
+
+    /* server: connect the stream the peer opened, see fast_stream_attach() */
+    ngx_int_t          (*open_handler)(fast_tunnel_t *ft, fast_stream_t *st);
 };
 
 
 ngx_int_t fast_tunnel_connect(fast_tunnel_t *ft, const struct sockaddr *addr, socklen_t addrlen);
 ngx_int_t fast_tunnel_accept(fast_tunnel_t *ft, ngx_connection_t *c);
+void fast_tunnel_close(fast_tunnel_t *ft);
 
 ssize_t fast_tunnel_send(fast_tunnel_t *ft, const void *data, size_t size);
 
+/* on success the stream owns c */
+ngx_int_t fast_tunnel_open_stream(fast_tunnel_t *ft, ngx_connection_t *c);
+void fast_stream_attach(fast_stream_t *st, ngx_connection_t *c,
+    ngx_uint_t connecting);
+
 #endif /* _FAST_TUNNEL_H_INCLUDED_ */
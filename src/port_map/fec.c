@@ -0,0 +1,355 @@
+#include "fec.h"
+
+#if (NGX_HAVE_X86_SIMD)
+#include <immintrin.h>
+#endif
+
+
+#define FEC_POLY            0x11d   /* x^8 + x^4 + x^3 + x^2 + 1 */
+
+static void fec_mul_add_generic(u_char *dst, const u_char *src, u_char c,
+    size_t len);
+#if (NGX_HAVE_X86_SIMD)
+static void fec_mul_add_ssse3(u_char *dst, const u_char *src, u_char c,
+    size_t len);
+static void fec_mul_add_avx2(u_char *dst, const u_char *src, u_char c,
+    size_t len);
+#endif
+static ngx_int_t fec_invert(u_char *a, ngx_uint_t n);
+
+static u_char  fec_exp[510];
+static u_char  fec_log[256];
+
+/* c * x, all of it for the generic kernel, by nibble for pshufb */
+static u_char  fec_mul_tbl[256][256];
+static u_char  fec_mul_lo[256][16];
+static u_char  fec_mul_hi[256][16];
+
+static ngx_uint_t  fec_inited;
+
+/* dst ^= c * src */
+static void (*fec_mul_add)(u_char *dst, const u_char *src, u_char c,
+    size_t len) = fec_mul_add_generic;
+static const char  *fec_kernel = "generic";
+
+
+#define fec_mul(a, b)                                                       \
+    (((a) && (b)) ? fec_exp[fec_log[a] + fec_log[b]] : 0)
+
+#define fec_inv(a)          fec_exp[255 - fec_log[a]]
+
+#define fec_coef(j, i)      fec_inv((u_char) ((FEC_DATA_MAX + (j)) ^ (i)))
+
+
+void
+fec_init(void)
+{
+    ngx_uint_t  i, c, x;
+
+    if (fec_inited) {
+        return;
+    }
+
+    x = 1;
+
+    for (i = 0; i < 255; i++) {
+        fec_exp[i] = (u_char) x;
+        fec_exp[i + 255] = (u_char) x;
+        fec_log[x] = (u_char) i;
+
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= FEC_POLY;
+        }
+    }
+
+    for (c = 0; c < 256; c++) {
+        for (x = 0; x < 256; x++) {
+            fec_mul_tbl[c][x] = fec_mul(c, x);
+        }
+
+        for (x = 0; x < 16; x++) {
+            fec_mul_lo[c][x] = fec_mul(c, x);
+            fec_mul_hi[c][x] = fec_mul(c, x << 4);
+        }
+    }
+
+#if (NGX_HAVE_X86_SIMD)
+
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        fec_mul_add = fec_mul_add_avx2;
+        fec_kernel = "avx2";
+
+    } else if (__builtin_cpu_supports("ssse3")) {
+        fec_mul_add = fec_mul_add_ssse3;
+        fec_kernel = "ssse3";
+    }
+
+#endif
+
+    fec_inited = 1;
+}
+
+
+const char *
+fec_kernel_name(void)
+{
+    return fec_kernel;
+}
+
+
+void
+fec_encode(u_char **data, ngx_uint_t n, u_char **parity, ngx_uint_t m,
+    size_t len)
+{
+    ngx_uint_t  i, j;
+
+    for (j = 0; j < m; j++) {
+        ngx_memzero(parity[j], len);
+
+        for (i = 0; i < n; i++) {
+            fec_mul_add(parity[j], data[i], fec_coef(j, i), len);
+        }
+    }
+}
+
+
+ngx_int_t
+fec_decode(u_char **data, const u_char *have_data, ngx_uint_t n,
+    u_char **parity, const u_char *have_parity, ngx_uint_t m, size_t len)
+{
+    u_char      a[FEC_PARITY_MAX * FEC_PARITY_MAX];
+    ngx_uint_t  miss[FEC_PARITY_MAX], rows[FEC_PARITY_MAX];
+    ngx_uint_t  i, j, k, r;
+
+    r = 0;
+
+    for (i = 0; i < n; i++) {
+        if (!have_data[i]) {
+            if (r == FEC_PARITY_MAX) {
+                return NGX_DECLINED;
+            }
+
+            miss[r++] = i;
+        }
+    }
+
+    if (r == 0) {
+        return NGX_OK;
+    }
+
+    k = 0;
+
+    for (j = 0; j < m && k < r; j++) {
+        if (have_parity[j]) {
+            rows[k++] = j;
+        }
+    }
+
+    if (k < r) {
+        return NGX_DECLINED;
+    }
+
+    /* take the data we have out of the parity, what is left is C' * miss */
+
+    for (k = 0; k < r; k++) {
+        j = rows[k];
+
+        for (i = 0; i < n; i++) {
+            if (have_data[i]) {
+                fec_mul_add(parity[j], data[i], fec_coef(j, i), len);
+            }
+        }
+
+        for (i = 0; i < r; i++) {
+            a[k * r + i] = fec_coef(j, miss[i]);
+        }
+    }
+
+    if (fec_invert(a, r) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    for (i = 0; i < r; i++) {
+        ngx_memzero(data[miss[i]], len);
+
+        for (k = 0; k < r; k++) {
+            fec_mul_add(data[miss[i]], parity[rows[k]], a[i * r + k], len);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/* Gauss-Jordan, in place, a is n x n by rows */
+
+static ngx_int_t
+fec_invert(u_char *a, ngx_uint_t n)
+{
+    u_char      b[FEC_PARITY_MAX * FEC_PARITY_MAX];
+    u_char      t, inv, f;
+    ngx_uint_t  row, col, i;
+
+    ngx_memzero(b, n * n);
+
+    for (i = 0; i < n; i++) {
+        b[i * n + i] = 1;
+    }
+
+    for (col = 0; col < n; col++) {
+
+        for (row = col; row < n && a[row * n + col] == 0; row++) {
+            /* void */
+        }
+
+        if (row == n) {
+            return NGX_ERROR;
+        }
+
+        if (row != col) {
+            for (i = 0; i < n; i++) {
+                t = a[row * n + i];
+                a[row * n + i] = a[col * n + i];
+                a[col * n + i] = t;
+
+                t = b[row * n + i];
+                b[row * n + i] = b[col * n + i];
+                b[col * n + i] = t;
+            }
+        }
+
+        inv = fec_inv(a[col * n + col]);
+
+        for (i = 0; i < n; i++) {
+            a[col * n + i] = fec_mul(a[col * n + i], inv);
+            b[col * n + i] = fec_mul(b[col * n + i], inv);
+        }
+
+        for (row = 0; row < n; row++) {
+            f = a[row * n + col];
+
+            if (row == col || f == 0) {
+                continue;
+            }
+
+            for (i = 0; i < n; i++) {
+                a[row * n + i] ^= fec_mul(f, a[col * n + i]);
+                b[row * n + i] ^= fec_mul(f, b[col * n + i]);
+            }
+        }
+    }
+
+    ngx_memcpy(a, b, n * n);
+
+    return NGX_OK;
+}
+
+
+/* kernels */
+
+static void
+fec_mul_add_generic(u_char *dst, const u_char *src, u_char c, size_t len)
+{
+    const u_char  *t;
+    size_t         i;
+
+    if (c == 0) {
+        return;
+    }
+
+    if (c == 1) {
+        for (i = 0; i < len; i++) {
+            dst[i] ^= src[i];
+        }
+
+        return;
+    }
+
+    t = fec_mul_tbl[c];
+
+    for (i = 0; i < len; i++) {
+        dst[i] ^= t[src[i]];
+    }
+}
+
+
+#if (NGX_HAVE_X86_SIMD)
+
+/*
+ * c * x = c * (x & 0x0f) ^ c * (x & 0xf0), each half is a 16 entry table
+ * lookup, and pshufb does 16 or 32 of them at once
+ */
+
+__attribute__((target("ssse3")))
+static void
+fec_mul_add_ssse3(u_char *dst, const u_char *src, u_char c, size_t len)
+{
+    __m128i  lo, hi, mask, x, l, h;
+
+    if (c == 0) {
+        return;
+    }
+
+    lo = _mm_loadu_si128((const __m128i *) fec_mul_lo[c]);
+    hi = _mm_loadu_si128((const __m128i *) fec_mul_hi[c]);
+    mask = _mm_set1_epi8(0x0f);
+
+    while (len >= 16) {
+        x = _mm_loadu_si128((const __m128i *) src);
+
+        l = _mm_shuffle_epi8(lo, _mm_and_si128(x, mask));
+        h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask));
+
+        x = _mm_loadu_si128((const __m128i *) dst);
+        _mm_storeu_si128((__m128i *) dst,
+                         _mm_xor_si128(x, _mm_xor_si128(l, h)));
+
+        src += 16;
+        dst += 16;
+        len -= 16;
+    }
+
+    fec_mul_add_generic(dst, src, c, len);
+}
+
+
+__attribute__((target("avx2")))
+static void
+fec_mul_add_avx2(u_char *dst, const u_char *src, u_char c, size_t len)
+{
+    __m256i  lo, hi, mask, x, l, h;
+
+    if (c == 0) {
+        return;
+    }
+
+    lo = _mm256_broadcastsi128_si256(
+             _mm_loadu_si128((const __m128i *) fec_mul_lo[c]));
+    hi = _mm256_broadcastsi128_si256(
+             _mm_loadu_si128((const __m128i *) fec_mul_hi[c]));
+    mask = _mm256_set1_epi8(0x0f);
+
+    while (len >= 32) {
+        x = _mm256_loadu_si256((const __m256i *) src);
+
+        l = _mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask));
+        h = _mm256_shuffle_epi8(hi,
+                                _mm256_and_si256(_mm256_srli_epi64(x, 4),
+                                                 mask));
+
+        x = _mm256_loadu_si256((const __m256i *) dst);
+        _mm256_storeu_si256((__m256i *) dst,
+                            _mm256_xor_si256(x, _mm256_xor_si256(l, h)));
+
+        src += 32;
+        dst += 32;
+        len -= 32;
+    }
+
+    fec_mul_add_generic(dst, src, c, len);
+}
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef _FEC_H_INCLUDED_
+#define _FEC_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/*
+ * Systematic Reed-Solomon erasure code over GF(2^8).  The data shards go
+ * out as they are, parity shard j is  sum C[j][i] * data[i]  with the
+ * Cauchy matrix  C[j][i] = 1 / (x_j + y_i),  x_j = FEC_DATA_MAX + j,
+ * y_i = i.  Every square submatrix of a Cauchy matrix is invertible, so
+ * any n of the data and parity shards of a block rebuild its n data
+ * shards.  A block may be short, the missing data shards are zeroes.
+ */
+
+#define FEC_DATA_MAX        128
+#define FEC_PARITY_MAX      32
+
+
+void fec_init(void);
+const char *fec_kernel_name(void);
+
+void fec_encode(u_char **data, ngx_uint_t n, u_char **parity, ngx_uint_t m,
+    size_t len);
+
+/*
+ * Rebuilds the data shards not in have_data from the parity shards in
+ * have_parity, those are overwritten.  NGX_DECLINED if there are too few.
+ */
+ngx_int_t fec_decode(u_char **data, const u_char *have_data, ngx_uint_t n,
+    u_char **parity, const u_char *have_parity, ngx_uint_t m, size_t len);
+
+#endif /* _FEC_H_INCLUDED_ */
@@ -168,16 +168,30 @@ void ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*))
     ikcp_free_hook = new_free;
 }
 
+// redefine segment allocator of one kcp object
+void ikcp_segment_allocator(ikcpcb *kcp,
+    void* (*new_malloc)(ikcpcb *, size_t), void (*new_free)(ikcpcb *, void *))
+{
+    kcp->segment_malloc = new_malloc;
+    kcp->segment_free = new_free;
+}
+
 // allocate a new kcp segment
 static IKCPSEG* ikcp_segment_new(ikcpcb *kcp, int size)
 {
+    if (kcp->segment_malloc)
+        return (IKCPSEG*)kcp->segment_malloc(kcp, sizeof(IKCPSEG) + size);
     return (IKCPSEG*)ikcp_malloc(sizeof(IKCPSEG) + size);
 }
 
 // delete a segment
 static void ikcp_segment_delete(ikcpcb *kcp, IKCPSEG *seg)
 {
-    ikcp_free(seg);
+    if (kcp->segment_free) {
+        kcp->segment_free(kcp, seg);
+    }   else {
+        ikcp_free(seg);
+    }
 }
 
 // write log
@@ -287,6 +301,12 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
     kcp->dead_link = IKCP_DEADLINK;
     kcp->output = NULL;
     kcp->writelog = NULL;
+    kcp->segment_malloc = NULL;
+    kcp->segment_free = NULL;
+    kcp->out_segs = 0;
+    kcp->in_segs = 0;
+    kcp->fast_xmit = 0;
+    kcp->dup_acks = 0;
 
     return kcp;
 }
@@ -423,6 +443,90 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 }
 
 
+//---------------------------------------------------------------------
+// zero-copy recv: returns the number of fragments of next message
+//---------------------------------------------------------------------
+int ikcp_recvv(const ikcpcb *kcp, ikcpvec *vec, int nvec)
+{
+    struct IQUEUEHEAD *p;
+    IKCPSEG *seg;
+    int n = 0;
+
+    assert(kcp);
+
+    if (iqueue_is_empty(&kcp->rcv_queue)) return -1;
+
+    seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
+    if (kcp->nrcv_que < seg->frg + 1) return -1;
+    if (nvec < (int)seg->frg + 1) return -3;
+
+    for (p = kcp->rcv_queue.next; p != &kcp->rcv_queue; p = p->next) {
+        seg = iqueue_entry(p, IKCPSEG, node);
+        vec[n].data = seg->data;
+        vec[n].len = (int)seg->len;
+        n++;
+        if (seg->frg == 0) break;
+    }
+
+    return n;
+}
+
+
+//---------------------------------------------------------------------
+// release the message returned by ikcp_recvv
+//---------------------------------------------------------------------
+void ikcp_recv_done(ikcpcb *kcp)
+{
+    struct IQUEUEHEAD *p;
+    IKCPSEG *seg;
+    int recover = 0;
+    int fragment;
+
+    assert(kcp);
+
+    if (iqueue_is_empty(&kcp->rcv_queue)) return;
+
+    if (kcp->nrcv_que >= kcp->rcv_wnd)
+        recover = 1;
+
+    for (p = kcp->rcv_queue.next; p != &kcp->rcv_queue; ) {
+        seg = iqueue_entry(p, IKCPSEG, node);
+        p = p->next;
+        fragment = seg->frg;
+
+        if (ikcp_canlog(kcp, IKCP_LOG_RECV)) {
+            ikcp_log(kcp, IKCP_LOG_RECV, "recv sn=%lu", seg->sn);
+        }
+
+        iqueue_del(&seg->node);
+        ikcp_segment_delete(kcp, seg);
+        kcp->nrcv_que--;
+
+        if (fragment == 0)
+            break;
+    }
+
+    // move available data from rcv_buf -> rcv_queue
+    while (! iqueue_is_empty(&kcp->rcv_buf)) {
+        seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
+        if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
+            iqueue_del(&seg->node);
+            kcp->nrcv_buf--;
+            iqueue_add_tail(&seg->node, &kcp->rcv_queue);
+            kcp->nrcv_que++;
+            kcp->rcv_nxt++;
+        }   else {
+            break;
+        }
+    }
+
+    // fast recover
+    if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
+        kcp->probe |= IKCP_ASK_TELL;
+    }
+}
+
+
 //---------------------------------------------------------------------
 // peek data size
 //---------------------------------------------------------------------
@@ -526,12 +630,13 @@ static void ikcp_shrink_buf(ikcpcb *kcp)
     }
 }
 
-static void ikcp_parse_ack(ikcpcb *kcp, IUINT32 sn)
+// returns 1 if sn was in flight
+static int ikcp_parse_ack(ikcpcb *kcp, IUINT32 sn)
 {
     struct IQUEUEHEAD *p, *next;
 
     if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0)
-        return;
+        return 0;
 
     for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
         IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
@@ -540,12 +645,14 @@ static void ikcp_parse_ack(ikcpcb *kcp, IUINT32 sn)
             iqueue_del(p);
             ikcp_segment_delete(kcp, seg);
             kcp->nsnd_buf--;
-            break;
+            return 1;
         }
         else {
             seg->fastack++;
         }
     }
+
+    return 0;
 }
 
 static void ikcp_parse_una(ikcpcb *kcp, IUINT32 una)
@@ -696,6 +803,7 @@ int ikcp_get_conv(const char *data, long size, IUINT32* conv_out)
 int ikcp_input(ikcpcb *kcp, const char *data, long size)
 {
     IUINT32 una = kcp->snd_una;
+    IUINT32 prev_una = kcp->snd_una;
 
     if (ikcp_canlog(kcp, IKCP_LOG_INPUT)) {
         ikcp_log(kcp, IKCP_LOG_INPUT, "[RI] %d bytes", size);
@@ -738,7 +846,12 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
             if (_itimediff(kcp->current, ts) >= 0) {
                 ikcp_update_ack(kcp, _itimediff(kcp->current, ts));
             }
-            ikcp_parse_ack(kcp, sn);
+            // not a dup if an una of this very input took it
+            if (!ikcp_parse_ack(kcp, sn) &&
+                (_itimediff(sn, prev_una) < 0 ||
+                 _itimediff(sn, kcp->snd_una) >= 0)) {
+                kcp->dup_acks++;
+            }
             ikcp_shrink_buf(kcp);
             if (ikcp_canlog(kcp, IKCP_LOG_IN_ACK)) {
                 ikcp_log(kcp, IKCP_LOG_IN_DATA, 
@@ -748,6 +861,7 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size)
             }
         }
         else if (cmd == IKCP_CMD_PUSH) {
+            kcp->in_segs++;
             if (ikcp_canlog(kcp, IKCP_LOG_IN_DATA)) {
                 ikcp_log(kcp, IKCP_LOG_IN_DATA, 
                     "input psh: sn=%lu ts=%lu", sn, ts);
@@ -845,6 +959,46 @@ static int ikcp_wnd_unused(const ikcpcb *kcp)
 }
 
 
+//---------------------------------------------------------------------
+// ikcp_flush_ack
+//---------------------------------------------------------------------
+void ikcp_flush_ack(ikcpcb *kcp)
+{
+    char *buffer = kcp->buffer;
+    char *ptr = buffer;
+    IUINT32 per, full, i;
+    IKCPSEG seg;
+
+    if (kcp->updated == 0) return;
+
+    per = kcp->mtu / IKCP_OVERHEAD;
+    full = kcp->ackcount - kcp->ackcount % per;
+
+    if (full == 0) return;
+
+    seg.conv = kcp->conv;
+    seg.cmd = IKCP_CMD_ACK;
+    seg.frg = 0;
+    seg.wnd = ikcp_wnd_unused(kcp);
+    seg.una = kcp->rcv_nxt;
+    seg.len = 0;
+
+    for (i = 0; i < full; i++) {
+        ikcp_ack_get(kcp, i, &seg.sn, &seg.ts);
+        ptr = ikcp_encode_seg(ptr, &seg);
+        if ((i + 1) % per == 0) {
+            ikcp_output(kcp, buffer, (int)(ptr - buffer));
+            ptr = buffer;
+        }
+    }
+
+    // the tail waits for ikcp_flush, to go out with the data
+    memmove(kcp->acklist, kcp->acklist + full * 2,
+        (kcp->ackcount - full) * 2 * sizeof(IUINT32));
+    kcp->ackcount -= full;
+}
+
+
 //---------------------------------------------------------------------
 // ikcp_flush
 //---------------------------------------------------------------------
@@ -992,11 +1146,13 @@ void ikcp_flush(ikcpcb *kcp)
             segment->xmit++;
             segment->fastack = 0;
             segment->resendts = current + segment->rto;
+            kcp->fast_xmit++;
             change++;
         }
 
         if (needsend) {
             int size, need;
+            kcp->out_segs++;
             segment->ts = current;
             segment->wnd = seg.wnd;
             segment->una = kcp->rcv_nxt;
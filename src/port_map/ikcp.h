@@ -302,11 +302,29 @@ struct IKCPCB
 	int logmask;
 	int (*output)(const char *buf, int len, struct IKCPCB *kcp, void *user);
 	void (*writelog)(const char *log, struct IKCPCB *kcp, void *user);
+	void* (*segment_malloc)(struct IKCPCB *kcp, size_t size);
+	void (*segment_free)(struct IKCPCB *kcp, void *ptr);
+	IUINT32 out_segs, in_segs;		// data segments sent, received
+	IUINT32 fast_xmit, dup_acks;	// fast retransmits, acks of nothing in flight
 };
 
 
 typedef struct IKCPCB ikcpcb;
 
+
+//---------------------------------------------------------------------
+// IKCPVEC: one fragment of a received message, see ikcp_recvv
+//---------------------------------------------------------------------
+struct IKCPVEC
+{
+	const char *data;
+	int len;
+};
+
+typedef struct IKCPVEC ikcpvec;
+
+#define IKCP_FRG_MAX			256
+
 #define IKCP_LOG_OUTPUT			1
 #define IKCP_LOG_INPUT			2
 #define IKCP_LOG_SEND			4
@@ -368,9 +386,22 @@ int ikcp_input(ikcpcb *kcp, const char *data, long size);
 // flush pending data
 void ikcp_flush(ikcpcb *kcp);
 
+// send the acknowledges that fill whole mtu sized packets, the rest
+// stays for the next ikcp_flush
+void ikcp_flush_ack(ikcpcb *kcp);
+
 // check the size of next message in the recv queue
 int ikcp_peeksize(const ikcpcb *kcp);
 
+// zero-copy recv: point 'vec' at the fragments of the next message in
+// the recv queue, in order. returns the number of fragments (at most
+// IKCP_FRG_MAX), below zero for EAGAIN or if 'nvec' is too small.
+// the data stays valid until ikcp_recv_done() is called.
+int ikcp_recvv(const ikcpcb *kcp, ikcpvec *vec, int nvec);
+
+// release the message returned by ikcp_recvv
+void ikcp_recv_done(ikcpcb *kcp);
+
 // change MTU size, default is 1400
 int ikcp_setmtu(ikcpcb *kcp, int mtu);
 
@@ -395,6 +426,11 @@ void ikcp_log(ikcpcb *kcp, int mask, const char *fmt, ...);
 // setup allocator
 void ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*));
 
+// setup segment allocator of one kcp object, overrides ikcp_allocator
+// for segments only. must be called before any data is sent or input.
+void ikcp_segment_allocator(ikcpcb *kcp,
+	void* (*new_malloc)(ikcpcb *, size_t), void (*new_free)(ikcpcb *, void *));
+
 
 #ifdef __cplusplus
 }
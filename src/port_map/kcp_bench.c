@@ -0,0 +1,1348 @@
+/*
+ * kcp_bench: one kcp tunnel over a simulated lossy link, in virtual time.
+ *
+ * The two tunnel groups are the real ones, kcp_tunnel.c and ikcp.c as
+ * nginx runs them, their UDP sockets are on the loopback.  Between them
+ * sit the two sockets of the link, which hold each datagram back until
+ * it is due by the link model: the bottleneck rate and its buffer, one
+ * way delay and jitter, random loss, and reordering, where a datagram
+ * is held back another delay.  Time is ngx_current_msec and only moves
+ * when the bench says so, one millisecond a step, and the randomness
+ * is seeded, so a run is the same every time but for the cpu time.
+ *
+ * The client sends numbered, timestamped messages to the server as
+ * fast as the send window lets it, or at the offered rate.  For every
+ * profile of kcp_prefab_args it reports the goodput, the latency of the
+ * messages from kcp_send() to the receive handler, the retransmitted
+ * share of the data segments put on the link, the bytes on the link
+ * per payload byte, and the cpu time per MB delivered.
+ *
+ * With -e the datagrams are sealed, and as the link can't read them
+ * then the retransmits are kcp's own count.  -P paces the tunnels, at
+ * most at the rate given, 0 for no cap.
+ *
+ *     make kcp_bench
+ *     objs/kcp_bench -l 5 -d 40 -j 10 -b 20000
+ */
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#include "kcp_tunnel.h"
+#include "kcp_status.h"
+#include "ngx_pmap_server_module.h"
+
+
+#define KCP_BENCH_START         1000000     /* ms, ngx_current_msec at 0 */
+#define KCP_BENCH_LAT_MAX       60000       /* ms, the histogram range */
+#define KCP_BENCH_DGRAM_MAX     2048
+#define KCP_BENCH_BURST         64          /* delivered before a read */
+#define KCP_BENCH_RCVBUF        (8 * 1024 * 1024)
+#define KCP_BENCH_MSG_HDR       8           /* seq(4) sent(4) */
+#define KCP_BENCH_CONV          0x10203
+
+/* on the wire, see ikcp.c and kcp_tunnel.c */
+#define KCP_BENCH_KCP_HDR       24
+#define KCP_BENCH_CMD_PUSH      81
+#define KCP_BENCH_CMD_WINS      84
+#define KCP_BENCH_CMD_FEC_DATA  92
+#define KCP_BENCH_CMD_FEC_PAR   93
+#define KCP_BENCH_FEC_HDR       12
+
+#define kcp_bench_le16(p)       ((p)[0] | ((p)[1] << 8))
+#define kcp_bench_le32(p)                                               \
+    ((p)[0] | ((p)[1] << 8) | ((p)[2] << 16) | ((uint32_t) (p)[3] << 24))
+
+
+typedef struct {
+    double                 loss;        /* % */
+    ngx_msec_t             delay;       /* one way */
+    ngx_msec_t             jitter;      /* up to, added to the delay */
+    double                 reorder;     /* %, held back another delay */
+    uint64_t               rate;        /* bit/s, 0 for no bottleneck */
+    ngx_msec_t             queue;       /* bottleneck buffer */
+    uint64_t               seed;
+} kcp_bench_link_t;
+
+
+typedef struct {
+    uint64_t               arrive;      /* us */
+    uint64_t               seq;         /* equal arrivals keep their order */
+    size_t                 len;
+    u_char                 data[KCP_BENCH_DGRAM_MAX];
+} kcp_bench_dgram_t;
+
+
+/* one direction of the link */
+typedef struct {
+    ngx_socket_t           in;          /* the sender sends here */
+    ngx_socket_t           out;         /* the receiver gets it from here */
+    struct sockaddr_in     to;
+    ngx_uint_t             to_known;
+
+    kcp_bench_dgram_t    **heap;        /* by arrival */
+    ngx_uint_t             n;
+    ngx_uint_t             nalloc;
+
+    uint64_t               busy;        /* us, the bottleneck is busy till */
+    uint64_t               seq;
+
+    uint64_t               bytes;       /* put on the link */
+    ngx_uint_t             sent;
+    ngx_uint_t             lost;
+    ngx_uint_t             dropped;     /* bottleneck buffer was full */
+    ngx_uint_t             delivered;
+} kcp_bench_pipe_t;
+
+
+typedef struct {
+    kcp_bench_link_t       link;
+    ngx_msec_t             duration;
+    size_t                 msg_size;
+    uint64_t               offered;     /* bit/s, 0 to fill the window */
+
+    ngx_log_t              log;
+
+    kcp_bench_pipe_t       up;          /* client to server */
+    kcp_bench_pipe_t       down;
+
+    kcp_tunnel_group_t    *client;
+    kcp_tunnel_group_t    *server;
+    kcp_tunnel_t          *sender;
+    kcp_tunnel_t          *receiver;
+
+    u_char                *msg;
+    uint32_t               next_send;
+    uint32_t               next_recv;
+    double                 credit;      /* bytes the offered rate allows */
+
+    uint64_t               goodput;     /* payload bytes delivered */
+    ngx_uint_t             misordered;
+    ngx_uint_t            *hist;        /* latency, by ms */
+    ngx_uint_t             nlat;
+
+    uint64_t               pushes;      /* data segments put on the link */
+    uint32_t               next_sn;
+} kcp_bench_t;
+
+
+static ngx_int_t kcp_bench_options(kcp_bench_t *b, int argc, char *const *argv,
+    ngx_int_t *profile);
+static ngx_int_t kcp_bench_run(kcp_bench_t *b, ngx_uint_t profile);
+static ngx_int_t kcp_bench_setup(kcp_bench_t *b, ngx_uint_t profile);
+static void kcp_bench_teardown(kcp_bench_t *b);
+static kcp_tunnel_group_t *kcp_bench_group(kcp_bench_t *b, ngx_int_t endpoint,
+    struct sockaddr_in *addr);
+static void kcp_bench_close_group(kcp_tunnel_group_t *g);
+static void kcp_bench_report(kcp_bench_t *b, ngx_uint_t profile,
+    struct rusage *ru0, struct rusage *ru1);
+
+static void kcp_bench_produce(kcp_bench_t *b);
+static void kcp_bench_recv(kcp_tunnel_t *t, const void *data, size_t size);
+static void kcp_bench_count_pushes(kcp_bench_t *b, const u_char *p,
+    size_t len);
+static ngx_msec_t kcp_bench_percentile(kcp_bench_t *b, double p);
+
+static void kcp_bench_read(kcp_tunnel_group_t *g);
+
+static ngx_socket_t kcp_bench_socket(void);
+static void kcp_bench_link_poll(kcp_bench_t *b, kcp_bench_pipe_t *p);
+static void kcp_bench_link_deliver(kcp_bench_t *b, kcp_bench_pipe_t *p,
+    kcp_tunnel_group_t *g);
+static ngx_int_t kcp_bench_heap_push(kcp_bench_pipe_t *p,
+    kcp_bench_dgram_t *d);
+static kcp_bench_dgram_t *kcp_bench_heap_pop(kcp_bench_pipe_t *p);
+static void kcp_bench_pipe_reset(kcp_bench_pipe_t *p);
+
+static uint32_t kcp_bench_rand(void);
+static double kcp_bench_uniform(void);
+
+static ngx_int_t kcp_bench_add_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t kcp_bench_del_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+
+
+/*
+ * What the tunnels need of nginx, in place of the event loop, the cycle
+ * and the pmap modules.
+ */
+
+volatile ngx_msec_t     ngx_current_msec;
+static ngx_time_t       kcp_bench_time;
+volatile ngx_time_t    *ngx_cached_time = &kcp_bench_time;
+ngx_uint_t              ngx_worker;
+ngx_uint_t              ngx_event_flags = NGX_USE_CLEAR_EVENT;
+ngx_event_actions_t     ngx_event_actions;
+
+static ngx_atomic_t     kcp_bench_connection_counter = 1;
+ngx_atomic_t           *ngx_connection_counter = &kcp_bench_connection_counter;
+
+ngx_module_t            ngx_pmap_module;
+ngx_module_t            ngx_pmap_core_module;
+ngx_module_t            ngx_pmap_server_module;
+
+static ngx_pmap_conf_t         kcp_bench_pcf;
+static ngx_pmap_server_conf_t  kcp_bench_scf;
+static void                   *kcp_bench_confs[2];
+static void                  **kcp_bench_pmap_ctx = kcp_bench_confs;
+static void                   *kcp_bench_conf_ctx[1];
+static ngx_cycle_t             kcp_bench_cycle;
+volatile ngx_cycle_t          *ngx_cycle = &kcp_bench_cycle;
+
+static uint64_t                kcp_bench_rand_state;
+static char                   *kcp_bench_crypt;
+#if (NGX_OPENSSL)
+static u_char                  kcp_bench_key[KCP_CRYPT_KEY_MAX];
+#endif
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    kcp_bench_t  b;
+    ngx_int_t    profile;
+    ngx_uint_t   i;
+
+    ngx_memzero(&b, sizeof(kcp_bench_t));
+
+    b.link.delay = 20;
+    b.link.queue = 100;
+    b.link.seed = 1;
+    b.duration = 10000;
+    b.msg_size = 1024;
+
+    b.log.log_level = NGX_LOG_WARN;
+
+    kcp_bench_pcf.kcp_batch = 64;
+    kcp_bench_pcf.kcp_crypt = NGX_ERROR;
+
+    profile = -1;
+
+    if (kcp_bench_options(&b, argc, argv, &profile) != NGX_OK) {
+        return 1;
+    }
+
+    ngx_pagesize = getpagesize();
+
+    kcp_bench_time.sec = time(NULL);
+
+    ngx_pmap_module.index = 0;
+    ngx_pmap_core_module.ctx_index = 0;
+    ngx_pmap_server_module.ctx_index = 1;
+
+    kcp_bench_confs[0] = &kcp_bench_pcf;
+    kcp_bench_confs[1] = &kcp_bench_scf;
+    kcp_bench_conf_ctx[0] = &kcp_bench_pmap_ctx;
+    kcp_bench_cycle.conf_ctx = (void ****) kcp_bench_conf_ctx;
+
+    ngx_event_actions.add = kcp_bench_add_event;
+    ngx_event_actions.del = kcp_bench_del_event;
+
+    b.hist = ngx_alloc((KCP_BENCH_LAT_MAX + 1) * sizeof(ngx_uint_t), &b.log);
+    b.msg = ngx_alloc(b.msg_size, &b.log);
+
+    if (b.hist == NULL || b.msg == NULL) {
+        return 1;
+    }
+
+    b.up.in = kcp_bench_socket();
+    b.up.out = kcp_bench_socket();
+
+    if (b.up.in == (ngx_socket_t) -1 || b.up.out == (ngx_socket_t) -1) {
+        return 1;
+    }
+
+    /* the link's two sockets serve both directions */
+
+    b.down.in = b.up.out;
+    b.down.out = b.up.in;
+
+    printf("link: loss %.2f%%, delay %ums, jitter %ums, reorder %.2f%%, "
+           "rate %llu kbit/s, queue %ums, seed %llu\n"
+           "load: %s, %lu byte messages, %u s, adaptive %s, fec %lu:%lu, "
+           "crypt %s, pacing %s\n\n",
+           b.link.loss, (unsigned) b.link.delay, (unsigned) b.link.jitter,
+           b.link.reorder, (unsigned long long) (b.link.rate / 1000),
+           (unsigned) b.link.queue, (unsigned long long) b.link.seed,
+           b.offered ? "offered" : "window",
+           (unsigned long) b.msg_size, (unsigned) (b.duration / 1000),
+           kcp_bench_pcf.kcp_adaptive ? "on" : "off",
+           (unsigned long) kcp_bench_pcf.kcp_fec_data,
+           (unsigned long) kcp_bench_pcf.kcp_fec_parity,
+           kcp_bench_crypt ? kcp_bench_crypt : "off",
+           kcp_bench_pcf.kcp_pacing ? "on" : "off");
+
+    printf("%-26s %10s %7s %7s %7s %8s %6s %9s\n",
+           "profile", "KB/s", "p50", "p99", "p999", "retrans", "wire",
+           "cpu ms/MB");
+
+    for (i = 0; i < KCP_PREFAB_ARGS; i++) {
+        if (profile != -1 && (ngx_uint_t) profile != i) {
+            continue;
+        }
+
+        if (kcp_bench_run(&b, i) != NGX_OK) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static ngx_int_t
+kcp_bench_options(kcp_bench_t *b, int argc, char *const *argv,
+    ngx_int_t *profile)
+{
+    char        *p, *v;
+    ngx_int_t    i;
+    ngx_uint_t   n, m;
+#if (NGX_OPENSSL)
+    size_t       len;
+#endif
+
+    for (i = 1; i < argc; i++) {
+
+        p = argv[i];
+
+        if (p[0] != '-' || p[1] == '\0' || p[2] != '\0') {
+            goto usage;
+        }
+
+        if (p[1] == 'a') {
+            kcp_bench_pcf.kcp_adaptive = 1;
+            continue;
+        }
+
+        if (p[1] == 'v') {
+            b->log.log_level = NGX_LOG_DEBUG_ALL;
+            continue;
+        }
+
+        if (++i == argc) {
+            goto usage;
+        }
+
+        v = argv[i];
+
+        switch (p[1]) {
+
+        case 'l':
+            b->link.loss = strtod(v, NULL);
+            break;
+
+        case 'd':
+            b->link.delay = (ngx_msec_t) strtoul(v, NULL, 10);
+            break;
+
+        case 'j':
+            b->link.jitter = (ngx_msec_t) strtoul(v, NULL, 10);
+            break;
+
+        case 'r':
+            b->link.reorder = strtod(v, NULL);
+            break;
+
+        case 'b':
+            b->link.rate = (uint64_t) strtoull(v, NULL, 10) * 1000;
+            break;
+
+        case 'q':
+            b->link.queue = (ngx_msec_t) strtoul(v, NULL, 10);
+            break;
+
+        case 's':
+            b->link.seed = (uint64_t) strtoull(v, NULL, 10);
+            break;
+
+        case 't':
+            b->duration = (ngx_msec_t) strtoul(v, NULL, 10) * 1000;
+            break;
+
+        case 'm':
+            b->msg_size = (size_t) strtoul(v, NULL, 10);
+            break;
+
+        case 'o':
+            b->offered = (uint64_t) strtoull(v, NULL, 10) * 1000;
+            break;
+
+        case 'p':
+            *profile = (ngx_int_t) strtol(v, NULL, 10);
+            break;
+
+        case 'P':
+            kcp_bench_pcf.kcp_pacing = 1;
+            kcp_bench_pcf.kcp_pacing_max = (size_t) strtoull(v, NULL, 10)
+                                           * 1000 / 8;
+            break;
+
+        case 'f':
+            n = (ngx_uint_t) strtoul(v, &p, 10);
+            m = (*p == ':') ? (ngx_uint_t) strtoul(p + 1, NULL, 10) : 0;
+
+            if (n < 1 || n > FEC_DATA_MAX - FEC_PARITY_MAX
+                || m < 1 || m > FEC_PARITY_MAX)
+            {
+                fprintf(stderr, "kcp_bench: invalid fec \"%s\"\n", v);
+                return NGX_ERROR;
+            }
+
+            kcp_bench_pcf.kcp_fec_data = n;
+            kcp_bench_pcf.kcp_fec_parity = m;
+            break;
+
+#if (NGX_OPENSSL)
+        case 'e':
+            kcp_bench_pcf.kcp_crypt_key.len = ngx_strlen(v);
+            kcp_bench_pcf.kcp_crypt_key.data = (u_char *) v;
+
+            kcp_bench_pcf.kcp_crypt = kcp_crypt_cipher(
+                                          &kcp_bench_pcf.kcp_crypt_key, &len);
+
+            if (kcp_bench_pcf.kcp_crypt == NGX_ERROR) {
+                fprintf(stderr, "kcp_bench: unknown cipher \"%s\"\n", v);
+                return NGX_ERROR;
+            }
+
+            /* any key does, both ends have it */
+
+            for (n = 0; n < len; n++) {
+                kcp_bench_key[n] = (u_char) n;
+            }
+
+            kcp_bench_pcf.kcp_crypt_key.len = len;
+            kcp_bench_pcf.kcp_crypt_key.data = kcp_bench_key;
+
+            kcp_bench_crypt = v;
+            break;
+#endif
+
+        default:
+            goto usage;
+        }
+    }
+
+    if (b->msg_size < KCP_BENCH_MSG_HDR || b->duration == 0
+        || *profile >= KCP_PREFAB_ARGS)
+    {
+        goto usage;
+    }
+
+    if (b->link.seed == 0) {
+        b->link.seed = 1;
+    }
+
+    return NGX_OK;
+
+usage:
+
+    fprintf(stderr,
+            "usage: kcp_bench [-l loss%%] [-d delay ms] [-j jitter ms] "
+            "[-r reorder%%]\n"
+            "                 [-b rate kbit/s] [-q queue ms] [-s seed] "
+            "[-t seconds]\n"
+            "                 [-m message size] [-o offered kbit/s] "
+            "[-p profile]\n"
+            "                 [-a] [-f data:parity] [-e cipher] "
+            "[-P max kbit/s] [-v]\n");
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+kcp_bench_run(kcp_bench_t *b, ngx_uint_t profile)
+{
+    struct rusage  ru0, ru1;
+    ngx_msec_t     step;
+
+    if (kcp_bench_setup(b, profile) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    getrusage(RUSAGE_SELF, &ru0);
+
+    for (step = 0; step < b->duration; step++) {
+        ngx_current_msec = KCP_BENCH_START + step;
+
+        kcp_bench_produce(b);
+
+        ngx_event_expire_timers();
+
+        kcp_bench_link_poll(b, &b->up);
+        kcp_bench_link_poll(b, &b->down);
+
+        kcp_bench_link_deliver(b, &b->up, b->server);
+        kcp_bench_link_poll(b, &b->down);
+
+        kcp_bench_link_deliver(b, &b->down, b->client);
+        kcp_bench_link_poll(b, &b->up);
+    }
+
+    getrusage(RUSAGE_SELF, &ru1);
+
+    kcp_bench_report(b, profile, &ru0, &ru1);
+
+    kcp_bench_teardown(b);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+kcp_bench_setup(kcp_bench_t *b, ngx_uint_t profile)
+{
+    struct sockaddr_in  sin;
+    socklen_t           len;
+
+    ngx_current_msec = KCP_BENCH_START;
+    kcp_bench_rand_state = b->link.seed;
+
+    /* time starts over, the timers with it */
+
+    ngx_event_timer_init(&b->log);
+
+    kcp_bench_pipe_reset(&b->up);
+    kcp_bench_pipe_reset(&b->down);
+
+    b->next_send = 0;
+    b->next_recv = 0;
+    b->credit = 0;
+    b->goodput = 0;
+    b->misordered = 0;
+    b->nlat = 0;
+    b->pushes = 0;
+    b->next_sn = 0;
+
+    ngx_memzero(b->hist, (KCP_BENCH_LAT_MAX + 1) * sizeof(ngx_uint_t));
+
+    ngx_memzero(&sin, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    b->server = kcp_bench_group(b, NGX_PMAP_ENDPOINT_SERVER, &sin);
+    if (b->server == NULL) {
+        return NGX_ERROR;
+    }
+
+    len = sizeof(struct sockaddr_in);
+    getsockname(b->server->udp_conn->fd, (struct sockaddr *) &b->up.to, &len);
+    b->up.to_known = 1;
+
+    len = sizeof(struct sockaddr_in);
+    getsockname(b->up.in, (struct sockaddr *) &sin, &len);
+
+    b->client = kcp_bench_group(b, NGX_PMAP_ENDPOINT_CLIENT, &sin);
+    if (b->client == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the groups were sized for karg.mtu, the prefabs all have the same */
+
+    b->server->karg = kcp_prefab_args[profile];
+    b->client->karg = kcp_prefab_args[profile];
+
+    b->receiver = kcp_create_tunnel(b->server, KCP_BENCH_CONV);
+    b->sender = kcp_create_tunnel(b->client, KCP_BENCH_CONV);
+
+    if (b->receiver == NULL || b->sender == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* what the handshake does, the sender gets the receiver's token */
+
+    if (kcp_tunnel_set_token(b->sender, b->receiver->path.token) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    b->receiver->data = b;
+    b->receiver->recv_handler = kcp_bench_recv;
+
+    return NGX_OK;
+}
+
+
+static void
+kcp_bench_teardown(kcp_bench_t *b)
+{
+    kcp_destroy_tunnel(b->client, b->sender);
+    kcp_destroy_tunnel(b->server, b->receiver);
+
+    kcp_bench_close_group(b->client);
+    kcp_bench_close_group(b->server);
+
+    /* what is still on the link */
+
+    kcp_bench_link_poll(b, &b->up);
+    kcp_bench_link_poll(b, &b->down);
+
+    kcp_bench_pipe_reset(&b->up);
+    kcp_bench_pipe_reset(&b->down);
+}
+
+
+static kcp_tunnel_group_t *
+kcp_bench_group(kcp_bench_t *b, ngx_int_t endpoint, struct sockaddr_in *addr)
+{
+    kcp_tunnel_group_t  *g;
+    ngx_pool_t          *pool;
+
+    pool = ngx_create_recycle_pool(KCP_GROUP_POOL_SIZE, &kcp_group_pool_stat,
+                                   &b->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    g = ngx_pcalloc(pool, sizeof(kcp_tunnel_group_t));
+    if (g == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    g->cycle = &kcp_bench_cycle;
+    g->pool = pool;
+    g->log = &b->log;
+
+    ngx_memcpy(&g->addr.u.sockaddr_in, addr, sizeof(struct sockaddr_in));
+    g->addr.socklen = sizeof(struct sockaddr_in);
+    ngx_str_set(&g->addr.name, "127.0.0.1");
+
+    kcp_bench_pcf.endpoint = endpoint;
+
+    if (kcp_group_init(g) != NGX_OK) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    return g;
+}
+
+
+static void
+kcp_bench_close_group(kcp_tunnel_group_t *g)
+{
+    if (g->udp_conn->read->timer_set) {
+        ngx_del_timer(g->udp_conn->read);
+    }
+
+    ngx_close_connection(g->udp_conn);
+    ngx_destroy_pool(g->pool);
+}
+
+
+static void
+kcp_bench_report(kcp_bench_t *b, ngx_uint_t profile, struct rusage *ru0,
+    struct rusage *ru1)
+{
+    kcp_arg_t  *arg;
+    u_char      name[64], *last;
+    double      cpu, mb, retrans, wire;
+
+    arg = &kcp_prefab_args[profile];
+
+    last = ngx_snprintf(name, sizeof(name) - 1,
+                        "%ui nodelay:%d int:%d rs:%d nc:%d",
+                        profile, arg->nodelay, arg->interval, arg->resend,
+                        arg->nc);
+    *last = '\0';
+
+    cpu = (ru1->ru_utime.tv_sec - ru0->ru_utime.tv_sec
+           + ru1->ru_stime.tv_sec - ru0->ru_stime.tv_sec) * 1000.0
+          + (ru1->ru_utime.tv_usec - ru0->ru_utime.tv_usec
+             + ru1->ru_stime.tv_usec - ru0->ru_stime.tv_usec) / 1000.0;
+
+    mb = b->goodput / (1024.0 * 1024.0);
+
+    if (b->client->crypt) {
+        b->pushes = b->sender->kcp->out_segs;
+        b->next_sn = b->sender->kcp->snd_nxt;
+    }
+
+    retrans = b->next_sn
+              ? (b->pushes - b->next_sn) * 100.0 / b->next_sn : 0;
+
+    wire = b->goodput ? (double) b->up.bytes / b->goodput : 0;
+
+    printf("%-26s %10.1f %7u %7u %7u %7.2f%% %6.3f %9.1f\n",
+           name, b->goodput * 1000.0 / 1024.0 / b->duration,
+           (unsigned) kcp_bench_percentile(b, 0.5),
+           (unsigned) kcp_bench_percentile(b, 0.99),
+           (unsigned) kcp_bench_percentile(b, 0.999),
+           retrans, wire, mb ? cpu / mb : 0);
+
+    if (b->misordered) {
+        printf("    %lu messages out of order\n",
+               (unsigned long) b->misordered);
+    }
+
+    ngx_log_error(NGX_LOG_INFO, &b->log, 0,
+                  "link up: sent:%ui lost:%ui dropped:%ui, "
+                  "down: sent:%ui lost:%ui dropped:%ui, fec rebuilt:%ui",
+                  b->up.sent, b->up.lost, b->up.dropped,
+                  b->down.sent, b->down.lost, b->down.dropped,
+                  b->server->fec_recovered);
+}
+
+
+/* the sender and the receiver */
+
+static void
+kcp_bench_produce(kcp_bench_t *b)
+{
+    ikcpcb  *kcp;
+    u_char  *p;
+
+    kcp = b->sender->kcp;
+
+    if (b->offered) {
+        b->credit += b->offered / 8000.0;
+
+        if (b->credit > (double) kcp->snd_wnd * b->msg_size) {
+            b->credit = (double) kcp->snd_wnd * b->msg_size;
+        }
+    }
+
+    while (ikcp_waitsnd(kcp) < (int) kcp->snd_wnd) {
+
+        if (b->offered) {
+            if (b->credit < b->msg_size) {
+                break;
+            }
+
+            b->credit -= b->msg_size;
+        }
+
+        p = b->msg;
+
+        p[0] = (u_char) (b->next_send >> 24);
+        p[1] = (u_char) (b->next_send >> 16);
+        p[2] = (u_char) (b->next_send >> 8);
+        p[3] = (u_char) b->next_send;
+
+        p[4] = (u_char) (ngx_current_msec >> 24);
+        p[5] = (u_char) (ngx_current_msec >> 16);
+        p[6] = (u_char) (ngx_current_msec >> 8);
+        p[7] = (u_char) ngx_current_msec;
+
+        if (!kcp_send(b->sender, b->msg, b->msg_size)) {
+            break;
+        }
+
+        b->next_send++;
+    }
+}
+
+
+static void
+kcp_bench_recv(kcp_tunnel_t *t, const void *data, size_t size)
+{
+    kcp_bench_t   *b;
+    const u_char  *p;
+    uint32_t       seq, sent;
+    ngx_msec_t     lat;
+
+    b = t->data;
+    p = data;
+
+    if (size < KCP_BENCH_MSG_HDR) {
+        b->misordered++;
+        return;
+    }
+
+    seq = ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    sent = ((uint32_t) p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+
+    if (seq != b->next_recv) {
+        b->misordered++;
+    }
+
+    b->next_recv = seq + 1;
+    b->goodput += size;
+
+    lat = (ngx_msec_t) ((uint32_t) ngx_current_msec - sent);
+    if (lat > KCP_BENCH_LAT_MAX) {
+        lat = KCP_BENCH_LAT_MAX;
+    }
+
+    b->hist[lat]++;
+    b->nlat++;
+}
+
+
+/* data segments, sn is the first send, the rest are retransmits */
+
+static void
+kcp_bench_count_pushes(kcp_bench_t *b, const u_char *p, size_t len)
+{
+    size_t    size;
+    uint32_t  sn;
+
+    if (len >= KCP_BENCH_FEC_HDR) {
+
+        if (p[4] == KCP_BENCH_CMD_FEC_PAR) {
+            return;
+        }
+
+        if (p[4] == KCP_BENCH_CMD_FEC_DATA) {
+            size = kcp_bench_le16(p + 10);
+
+            p += KCP_BENCH_FEC_HDR;
+            len -= KCP_BENCH_FEC_HDR;
+
+            if (size < len) {
+                len = size;
+            }
+        }
+    }
+
+    while (len >= KCP_BENCH_KCP_HDR) {
+
+        /* mtu probes are not kcp, and neither is what follows them */
+
+        if (p[4] < KCP_BENCH_CMD_PUSH || p[4] > KCP_BENCH_CMD_WINS) {
+            return;
+        }
+
+        size = kcp_bench_le32(p + 20);
+
+        if (p[4] == KCP_BENCH_CMD_PUSH) {
+            sn = kcp_bench_le32(p + 12);
+
+            b->pushes++;
+
+            if (sn >= b->next_sn) {
+                b->next_sn = sn + 1;
+            }
+        }
+
+        if (size > len - KCP_BENCH_KCP_HDR) {
+            return;
+        }
+
+        p += KCP_BENCH_KCP_HDR + size;
+        len -= KCP_BENCH_KCP_HDR + size;
+    }
+}
+
+
+static ngx_msec_t
+kcp_bench_percentile(kcp_bench_t *b, double p)
+{
+    ngx_uint_t  i, n, want;
+
+    if (b->nlat == 0) {
+        return 0;
+    }
+
+    want = (ngx_uint_t) (p * b->nlat);
+    if (want < p * b->nlat) {
+        want++;
+    }
+
+    n = 0;
+
+    for (i = 0; i < KCP_BENCH_LAT_MAX; i++) {
+        n += b->hist[i];
+
+        if (n >= want) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+
+/* the event loop */
+
+static void
+kcp_bench_read(kcp_tunnel_group_t *g)
+{
+    ngx_event_t  *rev;
+
+    rev = g->udp_conn->read;
+
+    rev->ready = 1;
+    rev->handler(rev);
+}
+
+
+/* the link */
+
+static ngx_socket_t
+kcp_bench_socket(void)
+{
+    struct sockaddr_in  sin;
+    ngx_socket_t        s;
+    int                 size;
+    socklen_t           len;
+
+    s = ngx_socket(AF_INET, SOCK_DGRAM, 0);
+    if (s == (ngx_socket_t) -1) {
+        perror("socket()");
+        return s;
+    }
+
+    ngx_memzero(&sin, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(s, (struct sockaddr *) &sin, sizeof(struct sockaddr_in)) == -1)
+    {
+        perror("bind()");
+        close(s);
+        return (ngx_socket_t) -1;
+    }
+
+    /*
+     * A full window may be sent at once, the kernel must not drop any of
+     * it, that would be loss the link did not make.  Forcing the size
+     * past rmem_max needs CAP_NET_ADMIN.
+     */
+
+    size = KCP_BENCH_RCVBUF;
+
+#ifdef SO_RCVBUFFORCE
+    if (setsockopt(s, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(int)) == -1)
+#endif
+    {
+        (void) setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(int));
+    }
+
+    len = sizeof(int);
+    if (getsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, &len) == 0
+        && size < KCP_BENCH_RCVBUF)
+    {
+        fprintf(stderr, "kcp_bench: the link's receive buffer is only %d "
+                        "bytes, the loopback may drop large windows\n", size);
+    }
+
+    if (ngx_nonblocking(s) == -1) {
+        perror(ngx_nonblocking_n);
+        close(s);
+        return (ngx_socket_t) -1;
+    }
+
+    return s;
+}
+
+
+/* takes what was sent to the link, and decides when and if it arrives */
+
+static void
+kcp_bench_link_poll(kcp_bench_t *b, kcp_bench_pipe_t *p)
+{
+    kcp_bench_link_t    *link;
+    kcp_bench_dgram_t   *d;
+    struct sockaddr_in   from;
+    socklen_t            len;
+    ssize_t              n;
+    uint64_t             now, start;
+    kcp_bench_pipe_t    *back;
+
+    link = &b->link;
+    now = (uint64_t) ngx_current_msec * 1000;
+    back = (p == &b->up) ? &b->down : &b->up;
+
+    for ( ;; ) {
+        d = ngx_alloc(sizeof(kcp_bench_dgram_t), &b->log);
+        if (d == NULL) {
+            return;
+        }
+
+        len = sizeof(struct sockaddr_in);
+
+        n = recvfrom(p->in, d->data, KCP_BENCH_DGRAM_MAX, 0,
+                     (struct sockaddr *) &from, &len);
+
+        if (n <= 0) {
+            ngx_free(d);
+            return;
+        }
+
+        /* replies go back where the first datagram came from */
+
+        if (!back->to_known) {
+            back->to = from;
+            back->to_known = 1;
+        }
+
+        d->len = n;
+
+        p->sent++;
+        p->bytes += n;
+
+        if (p == &b->up && b->client->crypt == NULL) {
+            kcp_bench_count_pushes(b, d->data, d->len);
+        }
+
+        if (link->loss && kcp_bench_uniform() * 100 < link->loss) {
+            p->lost++;
+            ngx_free(d);
+            continue;
+        }
+
+        start = now;
+
+        if (link->rate) {
+            if (p->busy > now
+                && p->busy - now > (uint64_t) link->queue * 1000)
+            {
+                p->dropped++;
+                ngx_free(d);
+                continue;
+            }
+
+            start = ngx_max(p->busy, now);
+            p->busy = start + d->len * 8 * 1000000 / link->rate;
+            start = p->busy;
+        }
+
+        d->arrive = start + (uint64_t) link->delay * 1000;
+
+        if (link->jitter) {
+            d->arrive += (uint64_t) (kcp_bench_uniform() * link->jitter
+                                     * 1000);
+        }
+
+        if (link->reorder && kcp_bench_uniform() * 100 < link->reorder) {
+            d->arrive += (uint64_t) link->delay * 1000;
+        }
+
+        d->seq = p->seq++;
+
+        if (kcp_bench_heap_push(p, d) != NGX_OK) {
+            ngx_free(d);
+            return;
+        }
+    }
+}
+
+
+static void
+kcp_bench_link_deliver(kcp_bench_t *b, kcp_bench_pipe_t *p,
+    kcp_tunnel_group_t *g)
+{
+    kcp_bench_dgram_t  *d;
+    uint64_t            now;
+    ngx_uint_t          n;
+
+    now = (uint64_t) ngx_current_msec * 1000;
+    n = 0;
+
+    while (p->n && p->heap[0]->arrive <= now + 999) {
+        d = kcp_bench_heap_pop(p);
+
+        (void) sendto(p->out, d->data, d->len, 0,
+                      (struct sockaddr *) &p->to, sizeof(struct sockaddr_in));
+
+        ngx_free(d);
+
+        p->delivered++;
+
+        if (++n == KCP_BENCH_BURST) {
+            kcp_bench_read(g);
+            n = 0;
+        }
+    }
+
+    if (n) {
+        kcp_bench_read(g);
+    }
+}
+
+
+static ngx_int_t
+kcp_bench_heap_push(kcp_bench_pipe_t *p, kcp_bench_dgram_t *d)
+{
+    kcp_bench_dgram_t  **heap, *t;
+    ngx_uint_t           i, parent, n;
+
+    if (p->n == p->nalloc) {
+        n = p->nalloc ? p->nalloc * 2 : 1024;
+
+        heap = realloc(p->heap, n * sizeof(kcp_bench_dgram_t *));
+        if (heap == NULL) {
+            return NGX_ERROR;
+        }
+
+        p->heap = heap;
+        p->nalloc = n;
+    }
+
+    heap = p->heap;
+    i = p->n++;
+    heap[i] = d;
+
+    while (i) {
+        parent = (i - 1) / 2;
+
+        if (heap[parent]->arrive < d->arrive
+            || (heap[parent]->arrive == d->arrive
+                && heap[parent]->seq < d->seq))
+        {
+            break;
+        }
+
+        t = heap[parent];
+        heap[parent] = heap[i];
+        heap[i] = t;
+
+        i = parent;
+    }
+
+    return NGX_OK;
+}
+
+
+static kcp_bench_dgram_t *
+kcp_bench_heap_pop(kcp_bench_pipe_t *p)
+{
+    kcp_bench_dgram_t  **heap, *d, *t;
+    ngx_uint_t           i, l, r, min;
+
+    heap = p->heap;
+    d = heap[0];
+
+    heap[0] = heap[--p->n];
+    i = 0;
+
+    for ( ;; ) {
+        l = 2 * i + 1;
+        r = l + 1;
+        min = i;
+
+        if (l < p->n
+            && (heap[l]->arrive < heap[min]->arrive
+                || (heap[l]->arrive == heap[min]->arrive
+                    && heap[l]->seq < heap[min]->seq)))
+        {
+            min = l;
+        }
+
+        if (r < p->n
+            && (heap[r]->arrive < heap[min]->arrive
+                || (heap[r]->arrive == heap[min]->arrive
+                    && heap[r]->seq < heap[min]->seq)))
+        {
+            min = r;
+        }
+
+        if (min == i) {
+            break;
+        }
+
+        t = heap[min];
+        heap[min] = heap[i];
+        heap[i] = t;
+
+        i = min;
+    }
+
+    return d;
+}
+
+
+static void
+kcp_bench_pipe_reset(kcp_bench_pipe_t *p)
+{
+    while (p->n) {
+        ngx_free(p->heap[--p->n]);
+    }
+
+    p->to_known = 0;
+    p->busy = 0;
+    p->seq = 0;
+    p->bytes = 0;
+    p->sent = 0;
+    p->lost = 0;
+    p->dropped = 0;
+    p->delivered = 0;
+}
+
+
+/* xorshift64*, seeded, so that every run sees the same link */
+
+static uint32_t
+kcp_bench_rand(void)
+{
+    uint64_t  x;
+
+    x = kcp_bench_rand_state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+
+    kcp_bench_rand_state = x;
+
+    return (uint32_t) ((x * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+
+static double
+kcp_bench_uniform(void)
+{
+    return kcp_bench_rand() / 4294967296.0;
+}
+
+
+/* the connection and the log functions the tunnels call */
+
+ngx_connection_t *
+ngx_get_connection(ngx_socket_t s, ngx_log_t *log)
+{
+    ngx_connection_t  *c;
+
+    c = ngx_calloc(sizeof(ngx_connection_t) + 2 * sizeof(ngx_event_t), log);
+    if (c == NULL) {
+        return NULL;
+    }
+
+    c->read = (ngx_event_t *) (c + 1);
+    c->write = c->read + 1;
+
+    c->fd = s;
+    c->log = log;
+
+    c->read->data = c;
+    c->write->data = c;
+    c->write->write = 1;
+
+    return c;
+}
+
+
+void
+ngx_close_connection(ngx_connection_t *c)
+{
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    (void) ngx_close_socket(c->fd);
+
+    ngx_free(c);
+}
+
+
+ngx_int_t
+ngx_connection_error(ngx_connection_t *c, ngx_err_t err, char *text)
+{
+    ngx_log_error(NGX_LOG_ERR, c->log, err, text);
+
+    return NGX_ERROR;
+}
+
+
+void *
+ngx_pmap_cache_alloc(void *ctx, size_t size)
+{
+    return ngx_palloc(ctx, size);
+}
+
+
+void
+ngx_pmap_cache_dealloc(void *ctx, void *p)
+{
+    ngx_pfree(ctx, p);
+}
+
+
+/* there is no status zone here */
+
+void
+kcp_status_attach(kcp_tunnel_group_t *g, ngx_shm_zone_t *shm_zone)
+{
+}
+
+
+#if (NGX_HAVE_VARIADIC_MACROS)
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+
+#else
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, va_list args)
+
+#endif
+{
+#if (NGX_HAVE_VARIADIC_MACROS)
+    va_list  args;
+#endif
+    u_char   errstr[NGX_MAX_ERROR_STR], *p, *last;
+
+    last = errstr + NGX_MAX_ERROR_STR - 2;
+
+    p = ngx_slprintf(errstr, last, "kcp_bench: [%ui] ", level);
+
+#if (NGX_HAVE_VARIADIC_MACROS)
+    va_start(args, fmt);
+    p = ngx_vslprintf(p, last, fmt, args);
+    va_end(args);
+#else
+    p = ngx_vslprintf(p, last, fmt, args);
+#endif
+
+    if (err) {
+        p = ngx_slprintf(p, last, " (%d: %s)", err, strerror(err));
+    }
+
+    *p++ = '\n';
+
+    (void) fwrite(errstr, 1, p - errstr, stderr);
+}
+
+
+#if !(NGX_HAVE_VARIADIC_MACROS)
+
+void ngx_cdecl
+ngx_log_error(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+{
+    va_list  args;
+
+    if (log->log_level >= level) {
+        va_start(args, fmt);
+        ngx_log_error_core(level, log, err, fmt, args);
+        va_end(args);
+    }
+}
+
+
+void ngx_cdecl
+ngx_log_debug_core(ngx_log_t *log, ngx_err_t err, const char *fmt, ...)
+{
+    va_list  args;
+
+    va_start(args, fmt);
+    ngx_log_error_core(NGX_LOG_DEBUG, log, err, fmt, args);
+    va_end(args);
+}
+
+#endif
+
+
+static ngx_int_t
+kcp_bench_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    ev->active = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+kcp_bench_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    ev->active = 0;
+
+    return NGX_OK;
+}
@@ -0,0 +1,344 @@
+#include "kcp_crypt.h"
+
+#if (NGX_OPENSSL)
+
+#include <openssl/kdf.h>
+
+
+typedef struct {
+    ngx_str_t               name;
+    size_t                  key_size;
+    const EVP_CIPHER     *(*cipher)(void);
+} kcp_crypt_cipher_t;
+
+
+static kcp_crypt_cipher_t  kcp_crypt_ciphers[] = {
+    { ngx_string("aes-128-gcm"), 16, EVP_aes_128_gcm },
+    { ngx_string("aes-256-gcm"), 32, EVP_aes_256_gcm },
+#ifndef OPENSSL_NO_CHACHA
+    { ngx_string("chacha20-poly1305"), 32, EVP_chacha20_poly1305 },
+#endif
+    { ngx_null_string, 0, NULL }
+};
+
+
+#define kcp_crypt_get_be32(p)                                           \
+    ((uint32_t) (p)[0] << 24 | (p)[1] << 16 | (p)[2] << 8 | (p)[3])
+
+#define kcp_crypt_put_be32(p, v)                                        \
+    (p)[0] = (u_char) ((v) >> 24); (p)[1] = (u_char) ((v) >> 16);       \
+    (p)[2] = (u_char) ((v) >> 8); (p)[3] = (u_char) (v)
+
+
+static ngx_int_t kcp_crypt_derive(kcp_crypt_t *c, u_char dir, uint32_t conv,
+    const u_char *token, size_t len, u_char *key);
+static void kcp_crypt_new_epoch(kcp_crypt_t *c, kcp_crypt_tx_t *tx);
+
+
+ngx_int_t
+kcp_crypt_cipher(ngx_str_t *name, size_t *key_size)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; kcp_crypt_ciphers[i].name.len; i++) {
+        if (kcp_crypt_ciphers[i].name.len == name->len
+            && ngx_strncmp(kcp_crypt_ciphers[i].name.data, name->data,
+                           name->len) == 0)
+        {
+            *key_size = kcp_crypt_ciphers[i].key_size;
+            return i;
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+kcp_crypt_init(kcp_crypt_t *c, ngx_uint_t cipher, ngx_str_t *key,
+    ngx_log_t *log)
+{
+    if (key->len > KCP_CRYPT_KEY_MAX) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      "kcp \"%V\" key is too long",
+                      &kcp_crypt_ciphers[cipher].name);
+        return NGX_ERROR;
+    }
+
+    c->cipher = kcp_crypt_ciphers[cipher].cipher();
+
+    ngx_memcpy(c->key, key->data, key->len);
+    c->key_size = key->len;
+
+    c->failed = 0;
+
+    return NGX_OK;
+}
+
+
+/*
+ * The key schedule of a stream is done here, once, a datagram only sets
+ * its nonce.
+ */
+
+ngx_int_t
+kcp_crypt_tunnel_init(kcp_crypt_t *c, kcp_crypt_tx_t *tx, kcp_crypt_rx_t *rx,
+    uint32_t conv, const u_char *token, size_t len, ngx_log_t *log)
+{
+    u_char  key[KCP_CRYPT_KEY_MAX];
+
+    tx->ctx = EVP_CIPHER_CTX_new();
+    rx->ctx = EVP_CIPHER_CTX_new();
+
+    if (NULL == tx->ctx || NULL == rx->ctx) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0, "EVP_CIPHER_CTX_new() failed");
+        goto failed;
+    }
+
+    /* the server sends with the 'S' key, the client with the 'C' one */
+
+    if (kcp_crypt_derive(c, c->is_server ? 'S' : 'C', conv, token, len, key)
+        != NGX_OK
+        || EVP_EncryptInit_ex(tx->ctx, c->cipher, NULL, key, NULL) != 1
+        || kcp_crypt_derive(c, c->is_server ? 'C' : 'S', conv, token, len,
+                            key)
+           != NGX_OK
+        || EVP_DecryptInit_ex(rx->ctx, c->cipher, NULL, key, NULL) != 1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      "kcp conv=%uD cipher init failed", conv);
+        goto failed;
+    }
+
+    OPENSSL_cleanse(key, sizeof(key));
+
+    ngx_memzero(tx->epoch, sizeof(tx->epoch));
+
+    kcp_crypt_new_epoch(c, tx);
+
+    return NGX_OK;
+
+failed:
+
+    OPENSSL_cleanse(key, sizeof(key));
+
+    kcp_crypt_tunnel_cleanup(tx, rx);
+
+    return NGX_ERROR;
+}
+
+
+void
+kcp_crypt_tunnel_cleanup(kcp_crypt_tx_t *tx, kcp_crypt_rx_t *rx)
+{
+    if (tx->ctx) {
+        EVP_CIPHER_CTX_free(tx->ctx);
+        tx->ctx = NULL;
+    }
+
+    if (rx->ctx) {
+        EVP_CIPHER_CTX_free(rx->ctx);
+        rx->ctx = NULL;
+    }
+}
+
+
+/* HKDF-SHA256 of the key, info is  "kcp" dir conv token */
+
+static ngx_int_t
+kcp_crypt_derive(kcp_crypt_t *c, u_char dir, uint32_t conv,
+    const u_char *token, size_t len, u_char *key)
+{
+    size_t         n;
+    u_char         info[4 + 4 + KCP_CRYPT_TOKEN_MAX];
+    EVP_PKEY_CTX  *pctx;
+    ngx_int_t      rc;
+
+    if (len > KCP_CRYPT_TOKEN_MAX) {
+        return NGX_ERROR;
+    }
+
+    info[0] = 'k';
+    info[1] = 'c';
+    info[2] = 'p';
+    info[3] = dir;
+    kcp_crypt_put_be32(info + 4, conv);
+    ngx_memcpy(info + 8, token, len);
+
+    pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    if (NULL == pctx) {
+        return NGX_ERROR;
+    }
+
+    n = c->key_size;
+
+    rc = (EVP_PKEY_derive_init(pctx) > 0
+          && EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()) > 0
+          && EVP_PKEY_CTX_set1_hkdf_key(pctx, c->key, (int) c->key_size) > 0
+          && EVP_PKEY_CTX_add1_hkdf_info(pctx, info, (int) (8 + len)) > 0
+          && EVP_PKEY_derive(pctx, key, &n) > 0
+          && n == c->key_size)
+         ? NGX_OK : NGX_ERROR;
+
+    EVP_PKEY_CTX_free(pctx);
+
+    return rc;
+}
+
+
+static void
+kcp_crypt_new_epoch(kcp_crypt_t *c, kcp_crypt_tx_t *tx)
+{
+    uint32_t  now, last;
+
+    /* later than the one before, whatever the clock does meanwhile */
+
+    now = (uint32_t) ngx_time();
+    last = kcp_crypt_get_be32(tx->epoch);
+
+    if (now <= last) {
+        now = last + 1;
+    }
+
+    kcp_crypt_put_be32(tx->epoch, now);
+
+    if (RAND_bytes(tx->epoch + 4, 4) != 1) {
+
+        /* no entropy, the epochs of both ends still differ by the bit */
+
+        ngx_memzero(tx->epoch + 4, 4);
+    }
+
+    tx->epoch[4] = (u_char) ((tx->epoch[4] & 0x7f) | (c->is_server << 7));
+    tx->counter = 0;
+}
+
+
+ssize_t
+kcp_crypt_seal(kcp_crypt_t *c, kcp_crypt_tx_t *tx, u_char *out,
+    const u_char *in, size_t size)
+{
+    u_char  *nonce, *ct;
+    int      n, m;
+
+    if (size < 4 || NULL == tx->ctx) {
+        return NGX_ERROR;
+    }
+
+    if (tx->counter == 0xffffffff) {
+        kcp_crypt_new_epoch(c, tx);
+    }
+
+    ngx_memcpy(out, in, 4);
+
+    nonce = out + 4;
+    ngx_memcpy(nonce, tx->epoch, 8);
+    kcp_crypt_put_be32(nonce + 8, tx->counter);
+
+    tx->counter++;
+
+    ct = nonce + KCP_CRYPT_NONCE_SIZE;
+
+    if (EVP_EncryptInit_ex(tx->ctx, NULL, NULL, NULL, nonce) != 1
+        || EVP_EncryptUpdate(tx->ctx, NULL, &n, out, 4) != 1
+        || EVP_EncryptUpdate(tx->ctx, ct, &n, in + 4, (int) size - 4) != 1
+        || EVP_EncryptFinal_ex(tx->ctx, ct + n, &m) != 1
+        || EVP_CIPHER_CTX_ctrl(tx->ctx, EVP_CTRL_AEAD_GET_TAG,
+                               KCP_CRYPT_TAG_SIZE, ct + n + m) != 1)
+    {
+        return NGX_ERROR;
+    }
+
+    return size + KCP_CRYPT_OVERHEAD;
+}
+
+
+ngx_int_t
+kcp_crypt_open(kcp_crypt_t *c, kcp_crypt_rx_t *rx, u_char **buf,
+    size_t *size, u_char *nonce)
+{
+    u_char  *p, *ct;
+    size_t   len;
+    int      n, m;
+
+    p = *buf;
+
+    if (*size < 4 + KCP_CRYPT_OVERHEAD || NULL == rx->ctx) {
+        c->failed++;
+        return NGX_DECLINED;
+    }
+
+    len = *size - 4 - KCP_CRYPT_OVERHEAD;
+
+    ngx_memcpy(nonce, p + 4, KCP_CRYPT_NONCE_SIZE);
+
+    ct = p + 4 + KCP_CRYPT_NONCE_SIZE;
+
+    if (EVP_DecryptInit_ex(rx->ctx, NULL, NULL, NULL, nonce) != 1
+        || EVP_DecryptUpdate(rx->ctx, NULL, &n, p, 4) != 1
+        || EVP_DecryptUpdate(rx->ctx, ct, &n, ct, (int) len) != 1
+        || EVP_CIPHER_CTX_ctrl(rx->ctx, EVP_CTRL_AEAD_SET_TAG,
+                               KCP_CRYPT_TAG_SIZE, ct + len) != 1
+        || EVP_DecryptFinal_ex(rx->ctx, ct + n, &m) != 1)
+    {
+        c->failed++;
+        return NGX_DECLINED;
+    }
+
+    /* conv goes right before the plaintext, the datagram kcp sent */
+
+    ngx_memcpy(ct - 4, p, 4);
+
+    *buf = ct - 4;
+    *size = len + 4;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+kcp_crypt_replay(kcp_crypt_rx_t *rx, const u_char *nonce)
+{
+    uint32_t  counter, d;
+
+    counter = kcp_crypt_get_be32(nonce + 8);
+
+    if (!rx->started || ngx_memcmp(nonce, rx->epoch, 8) != 0) {
+
+        /* a newer epoch, the peer's counter wrapped or it is a new peer */
+
+        if (rx->started
+            && kcp_crypt_get_be32(nonce) <= kcp_crypt_get_be32(rx->epoch))
+        {
+            return NGX_DECLINED;
+        }
+
+        ngx_memcpy(rx->epoch, nonce, 8);
+        rx->top = counter;
+        rx->window = 1;
+        rx->started = 1;
+
+        return NGX_OK;
+    }
+
+    if (counter > rx->top) {
+        d = counter - rx->top;
+
+        rx->window = (d < KCP_CRYPT_WINDOW) ? (rx->window << d) | 1 : 1;
+        rx->top = counter;
+
+        return NGX_OK;
+    }
+
+    d = rx->top - counter;
+
+    if (d >= KCP_CRYPT_WINDOW || (rx->window & ((uint64_t) 1 << d))) {
+        return NGX_DECLINED;
+    }
+
+    rx->window |= (uint64_t) 1 << d;
+
+    return NGX_OK;
+}
+
+#endif
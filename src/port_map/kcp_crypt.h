@@ -0,0 +1,104 @@
+#ifndef _KCP_CRYPT_H_INCLUDED_
+#define _KCP_CRYPT_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/*
+ * AEAD sealing of kcp datagrams with a key both ends have.  conv stays in
+ * the clear for the lookup and the reuseport steering, it's the
+ * associated data, the rest of the datagram is encrypted:
+ *
+ *     conv(4) nonce(12) ciphertext tag(16)
+ *
+ * Each direction of a tunnel has a key of its own, HKDF-SHA256 of the
+ * configured key with the direction, conv and the random token the
+ * server gave the tunnel in the handshake, so no two streams share one.
+ * The nonce is  epoch(8) counter(4),  the epoch is the second the sender
+ * started the stream and 4 random bytes, the top bit of those tells the
+ * server from the client.  A new epoch starts when the counter wraps.
+ * The receiver follows the newest epoch of the peer and keeps a window
+ * of the counters it has seen, anything older or seen is a replay.
+ */
+
+#define KCP_CRYPT_NONCE_SIZE    12
+#define KCP_CRYPT_TAG_SIZE      16
+#define KCP_CRYPT_OVERHEAD      (KCP_CRYPT_NONCE_SIZE + KCP_CRYPT_TAG_SIZE)
+
+#define KCP_CRYPT_KEY_MAX       32
+#define KCP_CRYPT_TOKEN_MAX     16
+#define KCP_CRYPT_WINDOW        64
+
+
+typedef struct kcp_crypt_s          kcp_crypt_t;
+typedef struct kcp_crypt_tx_s       kcp_crypt_tx_t;
+typedef struct kcp_crypt_rx_s       kcp_crypt_rx_t;
+
+
+/* the sending stream of a tunnel */
+struct kcp_crypt_tx_s {
+#if (NGX_OPENSSL)
+    EVP_CIPHER_CTX         *ctx;        /* keyed for the stream */
+#endif
+    u_char                  epoch[8];
+    uint32_t                counter;
+};
+
+
+/* what a tunnel has seen of the peer's stream */
+struct kcp_crypt_rx_s {
+#if (NGX_OPENSSL)
+    EVP_CIPHER_CTX         *ctx;
+#endif
+    u_char                  epoch[8];
+    uint32_t                top;        /* highest counter */
+    uint64_t                window;     /* bit n is top - n */
+    unsigned                started:1;
+};
+
+
+/* a group's cipher and the key its tunnels' keys are derived from */
+struct kcp_crypt_s {
+#if (NGX_OPENSSL)
+    const EVP_CIPHER       *cipher;
+#endif
+    u_char                  key[KCP_CRYPT_KEY_MAX];
+    size_t                  key_size;
+    ngx_uint_t              is_server;
+    ngx_uint_t              failed;     /* datagrams that didn't open */
+};
+
+
+#if (NGX_OPENSSL)
+
+/* the cipher by name, its key size, NGX_ERROR if there's none such */
+ngx_int_t kcp_crypt_cipher(ngx_str_t *name, size_t *key_size);
+
+ngx_int_t kcp_crypt_init(kcp_crypt_t *c, ngx_uint_t cipher, ngx_str_t *key,
+    ngx_log_t *log);
+
+/* keys both streams of tunnel conv with its token, and starts the tx one */
+ngx_int_t kcp_crypt_tunnel_init(kcp_crypt_t *c, kcp_crypt_tx_t *tx,
+    kcp_crypt_rx_t *rx, uint32_t conv, const u_char *token, size_t len,
+    ngx_log_t *log);
+void kcp_crypt_tunnel_cleanup(kcp_crypt_tx_t *tx, kcp_crypt_rx_t *rx);
+
+/* out has room for size + KCP_CRYPT_OVERHEAD, returns what's there */
+ssize_t kcp_crypt_seal(kcp_crypt_t *c, kcp_crypt_tx_t *tx, u_char *out,
+    const u_char *in, size_t size);
+
+/*
+ * Opens the datagram in place, it's moved to *buf then, and keeps the
+ * nonce for kcp_crypt_replay().  NGX_DECLINED if it's not authentic.
+ */
+ngx_int_t kcp_crypt_open(kcp_crypt_t *c, kcp_crypt_rx_t *rx, u_char **buf,
+    size_t *size, u_char *nonce);
+
+/* NGX_DECLINED for a nonce seen already, or of an older epoch */
+ngx_int_t kcp_crypt_replay(kcp_crypt_rx_t *rx, const u_char *nonce);
+
+#endif
+
+#endif /* _KCP_CRYPT_H_INCLUDED_ */
@@ -0,0 +1,292 @@
+#include "kcp_status.h"
+
+
+/* a reader gives up on a worker that keeps writing */
+#define KCP_STATUS_READ_TRIES   16
+
+
+static void kcp_status_publish(ngx_event_t *ev);
+static void kcp_status_tunnel(kcp_status_tunnel_t *st, kcp_tunnel_t *t);
+static size_t kcp_status_cache_size(alg_cache_t *c, ngx_uint_t spilled);
+
+
+/*
+ * The zone is sized by "kcp_status_zone", what is left after the header
+ * is split evenly between the workers and decides how many tunnels each
+ * of them lists.
+ */
+
+ngx_int_t
+kcp_status_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_cycle_t          *cycle = shm_zone->data;
+    ngx_core_conf_t      *ccf;
+    ngx_slab_pool_t      *shpool;
+    kcp_status_shm_t     *sh;
+    kcp_status_worker_t  *w;
+    ngx_uint_t            i, n;
+    size_t                size;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    n = ccf->master ? (ngx_uint_t) ccf->worker_processes : 1;
+
+    /* all the pages of the slab pool, in one piece */
+
+    size = (shpool->end - shpool->start) & ~(ngx_pagesize - 1);
+
+    sh = ngx_slab_alloc(shpool, size);
+    if (NULL == sh) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "no memory in kcp status zone \"%V\"",
+                      &shm_zone->shm.name);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(sh, size);
+
+    sh->workers = ngx_align_ptr((u_char *) sh + sizeof(kcp_status_shm_t),
+                                NGX_ALIGNMENT);
+
+    size -= sh->workers - (u_char *) sh;
+    size = (size / n) & ~(NGX_ALIGNMENT - 1);
+
+    if (size < kcp_status_worker_size(1)) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "kcp status zone \"%V\" is too small for %ui workers",
+                      &shm_zone->shm.name, n);
+        return NGX_ERROR;
+    }
+
+    sh->nworkers = n;
+    sh->worker_size = size;
+    sh->max_tunnels = (size - kcp_status_worker_size(0))
+                      / sizeof(kcp_status_tunnel_t);
+
+    for (i = 0; i < n; i++) {
+        w = kcp_status_worker(sh, i);
+        w->nalloc = sh->max_tunnels;
+    }
+
+    shpool->data = sh;
+
+    return NGX_OK;
+}
+
+
+void
+kcp_status_attach(kcp_tunnel_group_t *g, ngx_shm_zone_t *shm_zone)
+{
+    ngx_slab_pool_t   *shpool;
+    kcp_status_shm_t  *sh;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    sh = shpool->data;
+
+    if (ngx_worker >= sh->nworkers) {
+        return;
+    }
+
+    g->status = kcp_status_worker(sh, ngx_worker);
+
+    ngx_memzero(&g->status_event, sizeof(ngx_event_t));
+
+    g->status_event.handler = kcp_status_publish;
+    g->status_event.data = g;
+    g->status_event.log = g->log;
+    g->status_event.cancelable = 1;
+
+    kcp_status_publish(&g->status_event);
+}
+
+
+ngx_int_t
+kcp_status_read(kcp_status_shm_t *sh, ngx_uint_t n, kcp_status_worker_t *w)
+{
+    kcp_status_worker_t  *src;
+    ngx_atomic_uint_t     gen;
+    ngx_uint_t            i, nlisted;
+
+    src = kcp_status_worker(sh, n);
+
+    for (i = 0; i < KCP_STATUS_READ_TRIES; i++) {
+
+        gen = src->gen;
+
+        if (gen & 1) {
+            ngx_cpu_pause();
+            continue;
+        }
+
+        ngx_memory_barrier();
+
+        ngx_memcpy(w, src, kcp_status_worker_size(0));
+
+        nlisted = ngx_min(w->nlisted, sh->max_tunnels);
+
+        ngx_memcpy(w->tunnels, src->tunnels,
+                   nlisted * sizeof(kcp_status_tunnel_t));
+
+        ngx_memory_barrier();
+
+        if (src->gen == gen) {
+            w->nlisted = nlisted;
+            return NGX_OK;
+        }
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static void
+kcp_status_publish(ngx_event_t *ev)
+{
+    kcp_tunnel_group_t   *g = ev->data;
+    kcp_status_worker_t  *w;
+    kcp_tunnel_t         *t;
+    ngx_queue_t          *q;
+    ngx_uint_t            n;
+
+    w = g->status;
+
+    w->gen++;
+    ngx_memory_barrier();
+
+    w->pid = ngx_pid;
+    w->updated = ngx_time();
+    w->is_server = g->is_server;
+    w->ntunnels = g->ntunnels;
+
+    w->bytes_in = g->bytes_in;
+    w->bytes_out = g->bytes_out;
+    w->dgrams_in = g->dgrams_in;
+    w->dgrams_out = g->dgrams_out;
+    w->syscalls = g->syscalls;
+    w->syscalls_saved = g->saved_total;
+    w->send_errors = g->send_errors;
+    w->send_dropped = g->send_dropped;
+    w->fec_recovered = g->fec_recovered;
+    w->seg_hits = g->segpool.hits;
+    w->seg_misses = g->segpool.misses;
+    w->crypt_failed = g->crypt ? g->crypt->failed : 0;
+    w->pool_wasted = kcp_group_pool_stat.wasted;
+    w->pool_free = kcp_group_pool_stat.free;
+    w->pool_reused = kcp_group_pool_stat.reused;
+    w->pool_cache_hits = ngx_pool_cache_stat.hits;
+    w->pool_cache_misses = ngx_pool_cache_stat.misses;
+    w->pool_cache_size = ngx_pool_cache_stat.size;
+
+    n = 0;
+
+    for (q = ngx_queue_head(&g->tunnels);
+         q != ngx_queue_sentinel(&g->tunnels) && n < w->nalloc;
+         q = ngx_queue_next(q))
+    {
+        t = ngx_queue_data(q, kcp_tunnel_t, queue);
+        kcp_status_tunnel(&w->tunnels[n++], t);
+    }
+
+    w->nlisted = n;
+
+    ngx_memory_barrier();
+    w->gen++;
+
+    ngx_add_timer(ev, KCP_STATUS_PERIOD);
+}
+
+
+static void
+kcp_status_tunnel(kcp_status_tunnel_t *st, kcp_tunnel_t *t)
+{
+    ikcpcb           *kcp = t->kcp;
+    ngx_pmap_addr_t  *addr;
+    IUINT32           wnd;
+
+    st->conv = t->conv;
+
+    /* a client sends all its tunnels to the server */
+
+    addr = t->group->is_server ? &t->addr : &t->group->addr;
+
+    if (addr->socklen) {
+        st->peer_len = ngx_sock_ntop(&addr->u.sockaddr, addr->socklen,
+                                     st->peer, NGX_SOCKADDR_STRLEN, 1);
+    } else {
+        st->peer_len = 0;
+    }
+
+    st->bytes_in = t->stat.bytes_in;
+    st->bytes_out = t->stat.bytes_out;
+    st->dgrams_in = t->stat.dgrams_in;
+    st->dgrams_out = t->stat.dgrams_out;
+    st->msgs_in = t->recv_count;
+    st->msgs_out = t->sent_count;
+    st->segs_in = kcp->in_segs;
+    st->segs_out = kcp->out_segs;
+    st->retrans = kcp->xmit;
+    st->fast_retrans = kcp->fast_xmit;
+    st->dup_acks = kcp->dup_acks;
+    st->send_errors = t->stat.send_errors;
+    st->zip_in = t->stat.zip_in;
+    st->zip_out = t->stat.zip_out;
+    st->zip_bypassed = t->stat.zip_bypassed;
+    st->replayed = t->stat.replayed;
+    st->migrations = t->stat.migrations;
+
+    st->srtt = kcp->rx_srtt;
+    st->rttvar = kcp->rx_rttval;
+    st->rto = kcp->rx_rto;
+    st->cwnd = kcp->cwnd;
+    st->snd_wnd = kcp->snd_wnd;
+    st->rmt_wnd = kcp->rmt_wnd;
+    st->mtu = kcp->mtu;
+    st->snd_que = kcp->nsnd_que;
+    st->snd_buf = kcp->nsnd_buf;
+    st->rcv_que = kcp->nrcv_que;
+    st->rcv_buf = kcp->nrcv_buf;
+
+    /* the window ikcp_flush() stops at, as it computes it */
+
+    wnd = ngx_min(kcp->snd_wnd, kcp->rmt_wnd);
+
+    if (!kcp->nocwnd) {
+        wnd = ngx_min(kcp->cwnd, wnd);
+    }
+
+    if (kcp->nsnd_que == 0 || kcp->nsnd_buf < wnd) {
+        st->limit = KCP_STATUS_LIMIT_NONE;
+
+    } else if (!kcp->nocwnd && wnd == kcp->cwnd) {
+        st->limit = KCP_STATUS_LIMIT_CWND;
+
+    } else if (wnd == kcp->rmt_wnd) {
+        st->limit = KCP_STATUS_LIMIT_RMT;
+
+    } else {
+        st->limit = KCP_STATUS_LIMIT_SND;
+    }
+
+    st->cache_mem = kcp_status_cache_size(t->sndcache, 0)
+                    + kcp_status_cache_size(t->output_cache, 0)
+                    + kcp_status_cache_size(t->pace.queue, 0);
+    st->cache_spill = kcp_status_cache_size(t->sndcache, 1)
+                      + kcp_status_cache_size(t->output_cache, 1)
+                      + kcp_status_cache_size(t->pace.queue, 1);
+    st->send_paused = t->stat.send_paused;
+    st->pace_rate = t->group->pacing ? t->pace.rate : 0;
+    st->paced = t->stat.paced;
+}
+
+
+static size_t
+kcp_status_cache_size(alg_cache_t *c, ngx_uint_t spilled)
+{
+    if (NULL == c) {
+        return 0;
+    }
+
+    return spilled ? c->dcache_size : c->memcache_size;
+}
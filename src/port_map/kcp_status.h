@@ -0,0 +1,139 @@
+#ifndef _KCP_STATUS_H_INCLUDED_
+#define _KCP_STATUS_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include "kcp_tunnel.h"
+
+
+/*
+ * The status zone has a part for each worker, a snapshot of its kcp
+ * tunnel group which the worker rewrites every KCP_STATUS_PERIOD.  Any
+ * worker reads all of them for the kcp_status location.  gen is odd
+ * while the worker is writing, a reader that sees it change retries.
+ */
+
+#define KCP_STATUS_PERIOD       1000    /* ms */
+
+#define KCP_STATUS_ZONE_NAME    "kcp_status"
+
+/* the window a tunnel with queued data is waiting for */
+#define KCP_STATUS_LIMIT_NONE   0
+#define KCP_STATUS_LIMIT_CWND   1
+#define KCP_STATUS_LIMIT_RMT    2
+#define KCP_STATUS_LIMIT_SND    3
+
+
+typedef struct kcp_status_tunnel_s  kcp_status_tunnel_t;
+typedef struct kcp_status_worker_s  kcp_status_worker_t;
+typedef struct kcp_status_shm_s     kcp_status_shm_t;
+
+
+struct kcp_status_tunnel_s {
+    IUINT32                 conv;
+    u_char                  peer[NGX_SOCKADDR_STRLEN];
+    size_t                  peer_len;       /* 0 until it is known */
+
+    uint64_t                bytes_in;
+    uint64_t                bytes_out;
+    ngx_uint_t              dgrams_in;
+    ngx_uint_t              dgrams_out;
+    ngx_uint_t              msgs_in;
+    ngx_uint_t              msgs_out;
+    ngx_uint_t              segs_in;        /* kcp data segments */
+    ngx_uint_t              segs_out;
+    ngx_uint_t              retrans;        /* on timeout */
+    ngx_uint_t              fast_retrans;
+    ngx_uint_t              dup_acks;
+    ngx_uint_t              send_errors;
+
+    ngx_int_t               srtt;
+    ngx_int_t               rttvar;
+    ngx_int_t               rto;
+    ngx_uint_t              cwnd;
+    ngx_uint_t              snd_wnd;
+    ngx_uint_t              rmt_wnd;
+    ngx_uint_t              mtu;
+    ngx_uint_t              snd_que;
+    ngx_uint_t              snd_buf;
+    ngx_uint_t              rcv_que;
+    ngx_uint_t              rcv_buf;
+    ngx_uint_t              limit;
+
+    size_t                  cache_mem;      /* waiting in the alg caches */
+    size_t                  cache_spill;
+    ngx_uint_t              send_paused;
+    uint64_t                pace_rate;      /* bytes/s, 0 if not paced */
+    ngx_uint_t              paced;
+
+    uint64_t                zip_in;         /* before and after deflate */
+    uint64_t                zip_out;
+    ngx_uint_t              zip_bypassed;
+
+    ngx_uint_t              replayed;
+    ngx_uint_t              migrations;
+};
+
+
+struct kcp_status_worker_s {
+    ngx_atomic_t            gen;
+    ngx_pid_t               pid;
+    time_t                  updated;        /* 0 if there is no group */
+    ngx_uint_t              is_server;
+
+    ngx_uint_t              ntunnels;
+    ngx_uint_t              nlisted;        /* in tunnels[], they may not
+                                               all fit */
+    ngx_uint_t              nalloc;         /* room in tunnels[] */
+
+    uint64_t                bytes_in;
+    uint64_t                bytes_out;
+    ngx_uint_t              dgrams_in;
+    ngx_uint_t              dgrams_out;
+    ngx_uint_t              syscalls;
+    ngx_uint_t              syscalls_saved;
+    ngx_uint_t              send_errors;
+    ngx_uint_t              send_dropped;   /* socket buffer full */
+    ngx_uint_t              fec_recovered;
+    ngx_uint_t              seg_hits;
+    ngx_uint_t              seg_misses;
+    ngx_uint_t              crypt_failed;   /* datagrams that didn't open */
+
+    size_t                  pool_wasted;    /* kcp_group_pool_stat */
+    size_t                  pool_free;
+    ngx_uint_t              pool_reused;
+    ngx_uint_t              pool_cache_hits;    /* ngx_pool_cache_stat */
+    ngx_uint_t              pool_cache_misses;
+    size_t                  pool_cache_size;
+
+    kcp_status_tunnel_t     tunnels[1];
+};
+
+
+struct kcp_status_shm_s {
+    ngx_uint_t              nworkers;
+    ngx_uint_t              max_tunnels;    /* per worker */
+    size_t                  worker_size;
+    u_char                 *workers;
+};
+
+
+#define kcp_status_worker(sh, n)                                        \
+    ((kcp_status_worker_t *) ((sh)->workers + (n) * (sh)->worker_size))
+
+#define kcp_status_worker_size(ntunnels)                                \
+    (offsetof(kcp_status_worker_t, tunnels)                             \
+     + (ntunnels) * sizeof(kcp_status_tunnel_t))
+
+
+ngx_int_t kcp_status_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+/* the group publishes to the zone from now on */
+void kcp_status_attach(kcp_tunnel_group_t *g, ngx_shm_zone_t *shm_zone);
+
+/* a consistent copy of worker n, w has room for max_tunnels */
+ngx_int_t kcp_status_read(kcp_status_shm_t *sh, ngx_uint_t n,
+    kcp_status_worker_t *w);
+
+#endif /* _KCP_STATUS_H_INCLUDED_ */
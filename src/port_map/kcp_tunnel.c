@@ -1,20 +1,166 @@
 #include "kcp_tunnel.h"
+#include "kcp_status.h"
+#include "ngx_pmap_server_module.h"
 
 #include <ngx_socket.h>
 #include <ngx_event.h>
+#include <ngx_md5.h>
 
-static kcp_arg_t kcp_prefab_args[] = {
+kcp_arg_t kcp_prefab_args[KCP_PREFAB_ARGS] = {
     {0, 30, 2, 0, 1400,},
     {0, 20, 2, 1, 1400,},
     {1, 20, 2, 1, 1400,},
     {1, 10, 2, 1, 1400,},
 };
 
-#define KCP_STACK_SIZE  32
+ngx_pool_stat_t kcp_group_pool_stat;
+
+#define KCP_SEG_POOL_MAX_FREE   1024
+
+/* adaptive mode */
+#define KCP_TUNE_PERIOD         1000    /* ms */
+#define KCP_TUNE_MIN_SAMPLES    16      /* segments acked or lost a period */
+#define KCP_TUNE_CLEAN          2       /* loss %, below is a good link */
+#define KCP_TUNE_LOSSY          10      /* loss %, from here on it's lossy */
+#define KCP_TUNE_INTERVAL_MIN   10
+#define KCP_TUNE_INTERVAL_MAX   40
+#define KCP_TUNE_WND_MIN        32
+#define KCP_TUNE_WND_MAX        1024
+
+/*
+ * Path mtu probes are zero padded datagrams with a kcp header, the cmd
+ * is none of ikcp's and sn is the probed size.  The peer echoes the
+ * header back with KCP_CMD_PROBE_ACK.
+ */
+#define KCP_HDR_SIZE            24      /* IKCP_OVERHEAD */
+#define KCP_CMD_PROBE           90
+#define KCP_CMD_PROBE_ACK       91
+
+#define KCP_PMTU_STEP           8       /* search precision */
+#define KCP_PMTU_TRIES          2       /* lost probes before a size fails */
+#define KCP_PMTU_RESEARCH       600000  /* ms, the path may have changed */
+#define KCP_PMTU_BLACKHOLE      50      /* loss %, falls back to karg.mtu */
+
+/*
+ * With fec every datagram is a shard and gets a header in place of the
+ * kcp one, conv still first for the lookup and the reuseport steering:
+ *
+ *     conv(4) cmd(1) shard(1) seq(4) size(2)
+ *
+ * A data shard carries a kcp datagram of size bytes, size and datagram
+ * zero padded to the longest of the block is what the code works on.
+ * A parity shard carries the parity, size is the number of data shards
+ * of its block.  Blocks are per tunnel, the seq counts them.
+ */
+#define KCP_CMD_FEC_DATA        92
+#define KCP_CMD_FEC_PARITY      93
+
+#define KCP_FEC_HDR_SIZE        12
+#define KCP_FEC_OVERHEAD        14      /* the header and a parity's size */
+#define KCP_FEC_BLOCKS          4       /* received at once */
+
+#define kcp_fec_slot(g, b, i)   ((b)->slots + (i) * (g)->mtu_max)
+#define kcp_fec_shard(slot)     ((slot) + KCP_FEC_HDR_SIZE - 2)
+
+/*
+ * Path validation: a server tunnel that gets a datagram from another
+ * address than its peer's goes on sending to the old one, and challenges
+ * the new one with a bare header:
+ *
+ *     conv(4) cmd(1) 0(3) nonce(8) mac(8)
+ *
+ * The client answers with the mac, the start of md5 over the response
+ * command, the token of the handshake, the nonce and conv.  The tunnel
+ * moves, with its kcp state and all it has queued, when the answer comes
+ * from the address challenged.  Only a client answers, and only the
+ * server's address, so neither side makes a mac for a nonce someone
+ * else picked and sends it elsewhere.
+ */
+#define KCP_CMD_PATH_CHALLENGE  94
+#define KCP_CMD_PATH_RESPONSE   95
+
+#define KCP_PATH_RETRY          200     /* ms, between challenges */
+#define KCP_PATH_SETTLE         1000    /* ms, the old path may still
+                                           deliver meanwhile */
+
+#define kcp_cmd(buf)            ((const u_char *)(buf))[4]
+
+#define kcp_get_le16(p)         ((p)[0] | ((p)[1] << 8))
+#define kcp_get_le32(p)                                                 \
+    ((p)[0] | ((p)[1] << 8) | ((p)[2] << 16) | ((IUINT32) (p)[3] << 24))
+
+#define kcp_put_le16(p, v)                                              \
+    (p)[0] = (u_char) (v); (p)[1] = (u_char) ((v) >> 8)
+#define kcp_put_le32(p, v)                                              \
+    (p)[0] = (u_char) (v); (p)[1] = (u_char) ((v) >> 8);                \
+    (p)[2] = (u_char) ((v) >> 16); (p)[3] = (u_char) ((v) >> 24)
+
+/*
+ * With compression every message starts with a flag.  After
+ * KCP_ZIP_DEFLATE comes what deflate() made of the message with
+ * Z_SYNC_FLUSH, less the 00 00 ff ff such a flush ends with, the receiver
+ * puts it back.  Each direction is one raw deflate stream for the life
+ * of the tunnel, kcp delivers in order, so the history carries over from
+ * message to message.  Messages sent as they are don't go through it.
+ */
+#define KCP_ZIP_RAW             0
+#define KCP_ZIP_DEFLATE         1
+
+#define KCP_ZIP_LEVEL           1
+#define KCP_ZIP_WBITS           13      /* 8k window, 64k of deflate state */
+#define KCP_ZIP_MEMLEVEL        6
+#define KCP_ZIP_MIN             64      /* smaller messages go as they are */
+#define KCP_ZIP_SAMPLE          256     /* bytes looked at for the entropy */
+#define KCP_ZIP_GAIN            15      /* in 16ths, worse doesn't pay */
+#define KCP_ZIP_BACKOFF_MAX     64      /* messages */
+#define KCP_ZIP_RTT             20      /* ms, "auto" compresses above */
+#define KCP_ZIP_RBUF_MAX        (1024 * 1024)
+
+/*
+ * Pacing: ikcp_flush() sends what the window allows at once, every
+ * interval, a burst the buffer at the bottleneck may not hold.  Paced, a
+ * tunnel sends its window over the rtt, a little faster so that pacing
+ * doesn't hold kcp back, and the group timer sends what had to wait.
+ * The rtt is the least srtt of a while, what waits here adds to srtt,
+ * and the rate would fall with it.
+ * Datagrams of acks only go at once, the peer's rtt would grow else.
+ */
+#define KCP_PACE_GAIN           125     /* %, of the window an rtt */
+#define KCP_PACE_BURST          2       /* datagrams, the least in a go */
+#define KCP_PACE_RTT_WINDOW     10000   /* ms, the least srtt seen is kept */
+
+#define KCP_CMD_ACK             82      /* IKCP_CMD_ACK */
+#define kcp_seg_len(p)          kcp_get_le32((p) + 20)
+
+/* sealing, a datagram too large for a slot, at most what udp takes */
+#define KCP_CRYPT_BUF_SIZE      65536
+
+/* where datagrams of the tunnel go */
+#define kcp_tunnel_peer(t)                                              \
+    ((t)->group->is_server ? &(t)->addr : &(t)->group->addr)
+
+/* what fec and sealing add to a kcp datagram */
+#define kcp_wire_overhead(g)    ((g)->fec_overhead + (g)->crypt_overhead)
+
+/* the datagram size the kcp mtu makes */
+#define kcp_wire_mtu(t)         ((t)->kcp->mtu + kcp_wire_overhead((t)->group))
+#define KCP_SEG_UNPOOLED        ((ngx_uint_t)-1)
+
+/* conv table, kept at most half full */
+#define KCP_CONV_SLOTS_MIN      64
+
+#define kcp_conv_hash(conv, mask)                                       \
+    ((((IUINT32) (conv) * 0x9e3779b1) >> 16 ^ (IUINT32) (conv)) & (mask))
+
+#define kcp_timer_tunnel(node)                                          \
+    (kcp_tunnel_t *)((u_char *)(node) - offsetof(kcp_tunnel_t, timer))
 
 
 /* static function declaration */
 
+static alg_cache_t *kcp_cache_create(kcp_tunnel_group_t *g,
+    alg_cache_flush_handler_pt h);
+
 /* output cache is used to store sent data when the peer address is unknown */
 static int kcp_obuf_cache(kcp_tunnel_t *t, const void *data, size_t size);
 static int kcp_obuf_flushall(kcp_tunnel_t *t);
@@ -23,19 +169,123 @@ static int kcp_obuf_flush(alg_cache_t *c, const void *data, size_t size);
 static int kcp_sndbuf_flushall(kcp_tunnel_t *t);
 static int kcp_sndbuf_flush(alg_cache_t *c, const void *data, size_t size);
 static int kcp_sndbuf_canflush(kcp_tunnel_t *t);
+static void kcp_send_pressure(kcp_tunnel_t *t);
 
 static int kcp_input(kcp_tunnel_t *t, const void *data, size_t size);
 
-static ngx_msec_t kcp_update(kcp_tunnel_t *t, ngx_msec_t curtime);
+static void kcp_update(kcp_tunnel_t *t, ngx_msec_t curtime);
+static void kcp_tunnel_fail(kcp_tunnel_t *t);
+static void kcp_tunnel_close(kcp_tunnel_t *t);
+static void kcp_deliver(kcp_tunnel_t *t, ikcpvec *vec, int n);
+static int kcp_send_msg(kcp_tunnel_t *t, const void *data, size_t size);
+
+/* pacing */
+static int kcp_pace_output(kcp_tunnel_t *t, const void *data, size_t size);
+static int kcp_pace_flush(alg_cache_t *c, const void *data, size_t size);
+static ngx_uint_t kcp_pace_exempt(const u_char *p, size_t size);
+static void kcp_pace_fill(kcp_tunnel_t *t, ngx_msec_t now);
+static ngx_msec_t kcp_pace_next(kcp_tunnel_t *t, ngx_msec_t now);
+
+/* adaptive mode */
+static void kcp_tune(kcp_tunnel_t *t, ngx_msec_t curtime);
+static void kcp_pmtu_search(kcp_tunnel_t *t, ngx_msec_t curtime);
+static void kcp_pmtu_send(kcp_tunnel_t *t, IUINT32 cmd, IUINT32 size,
+    ngx_pmap_addr_t *addr);
+static void kcp_pmtu_input(kcp_tunnel_t *t, const u_char *buf, size_t size,
+    ngx_pmap_addr_t *addr);
+static void kcp_group_set_df(kcp_tunnel_group_t *g, ngx_socket_t s,
+    int family);
+
+/* path validation */
+static void kcp_path_check(kcp_tunnel_t *t, ngx_pmap_addr_t *addr);
+static void kcp_path_input(kcp_tunnel_t *t, const u_char *buf, size_t size,
+    ngx_pmap_addr_t *addr);
+static void kcp_path_send(kcp_tunnel_t *t, ngx_uint_t cmd,
+    const u_char *nonce, ngx_pmap_addr_t *addr);
+static void kcp_path_mac(kcp_tunnel_t *t, ngx_uint_t cmd, const u_char *nonce,
+    u_char *mac);
+static void kcp_path_random(u_char *p);
+static ngx_uint_t kcp_addr_equal(ngx_pmap_addr_t *a, ngx_pmap_addr_t *b);
+
+/* forward error correction */
+static int kcp_tunnel_output(kcp_tunnel_t *t, const void *data, size_t size);
+static ngx_int_t kcp_fec_create(kcp_tunnel_t *t);
+static void kcp_fec_header(kcp_tunnel_t *t, u_char *p, u_char cmd,
+    ngx_uint_t shard, IUINT32 seq, size_t size);
+static int kcp_fec_output(kcp_tunnel_t *t, const void *data, size_t size);
+static void kcp_fec_flush(kcp_tunnel_t *t);
+static void kcp_fec_input(kcp_tunnel_t *t, const u_char *buf, size_t size);
+static void kcp_fec_recover(kcp_tunnel_t *t, kcp_fec_block_t *b);
+
+#if (NGX_ZLIB)
+/* compression */
+static ngx_int_t kcp_zip_create(kcp_tunnel_t *t);
+static void kcp_zip_destroy(kcp_tunnel_t *t);
+static int kcp_zip_send(kcp_tunnel_t *t, const u_char *data, size_t size);
+static int kcp_zip_frame(kcp_tunnel_t *t, const u_char *data, size_t size);
+static ngx_uint_t kcp_zip_pays(kcp_tunnel_t *t, const u_char *data,
+    size_t size);
+static ikcpvec *kcp_zip_recv(kcp_tunnel_t *t, ikcpvec *vec, int *n);
+#endif
+
+/* segment allocator */
+static void kcp_seg_pool_init(kcp_seg_pool_t *sp, size_t max);
+static void *kcp_seg_alloc(ikcpcb *kcp, size_t size);
+static void kcp_seg_free(ikcpcb *kcp, void *p);
+
+/* batched UDP I/O */
+static ngx_int_t kcp_batch_init(kcp_tunnel_group_t *g, kcp_batch_t *b,
+    ngx_uint_t n, size_t size);
+static int kcp_batch_queue(kcp_tunnel_t *t, const void *data,
+    size_t size, ngx_pmap_addr_t *addr);
+static void kcp_batch_flush(kcp_tunnel_group_t *g);
+static ngx_int_t kcp_batch_recv(kcp_tunnel_group_t *g);
 
 /* kcp group function */
 static void kcp_group_on_event(ngx_event_t *ev);
+static void kcp_group_end_tick(kcp_tunnel_group_t *g);
 static void kcp_group_reset_timer(kcp_tunnel_t *t);
+static void kcp_group_schedule(kcp_tunnel_t *t, ngx_msec_t curtime);
+static void kcp_group_arm_timer(kcp_tunnel_group_t *g);
 static void kcp_group_update(kcp_tunnel_group_t *g);
+static void kcp_group_shutdown(kcp_tunnel_group_t *g);
+static void kcp_group_end_burst(kcp_tunnel_group_t *g);
+static void kcp_group_cleanup(void *data);
+static ngx_int_t kcp_group_crypt_init(kcp_tunnel_group_t *g,
+    ngx_pmap_conf_t *pcf);
+
+/* conv table */
+static ngx_int_t kcp_conv_resize(kcp_tunnel_group_t *g, ngx_uint_t nslots);
+static ngx_int_t kcp_conv_insert(kcp_tunnel_group_t *g, kcp_tunnel_t *t);
+static void kcp_conv_delete(kcp_tunnel_group_t *g, kcp_tunnel_t *t);
 
 
 /* function for kcp tunnel */
 
+static alg_cache_t *
+kcp_cache_create(kcp_tunnel_group_t *g, alg_cache_flush_handler_pt h)
+{
+    alg_cache_t  *c;
+
+    if (g->cache_ring) {
+        c = alg_cache_create_ring(h, g->cache_ring,
+                                  ngx_pmap_cache_alloc,
+                                  ngx_pmap_cache_dealloc,
+                                  g->pool);
+    } else {
+        c = alg_cache_create(h,
+                             ngx_pmap_cache_alloc,
+                             ngx_pmap_cache_dealloc,
+                             g->pool);
+    }
+
+    if (c) {
+        alg_cache_set_spill(c, g->spill_path, g->spill_max, g->log);
+    }
+
+    return c;
+}
+
 static int
 kcp_output_handler(const char *buf, int len, ikcpcb *kcp, void *user)
 {
@@ -50,22 +300,12 @@ kcp_output_handler(const char *buf, int len, ikcpcb *kcp, void *user)
             
             kcp_obuf_flushall(t);
 
-            if (sendto(g->udp_conn->fd, buf, (size_t)len, 0,
-                       &t->addr.u.sockaddr, t->addr.socklen) != len) {
-            
-                ngx_log_error(NGX_LOG_ERR, g->log, ngx_socket_errno,
-                              "send error!");
-            }
+            kcp_pace_output(t, buf, (size_t)len);
         } else {
             kcp_obuf_cache(t, buf, (size_t)len);
         }
     } else {
-        if (sendto(g->udp_conn->fd, buf, (size_t)len, 0,
-                   &g->addr.u.sockaddr, g->addr.socklen) != len) {
-            
-            ngx_log_error(NGX_LOG_ERR, g->log, ngx_socket_errno,
-                          "send error!");
-        }
+        kcp_pace_output(t, buf, (size_t)len);
     }
     
     return 0;
@@ -81,14 +321,11 @@ kcp_obuf_cache(kcp_tunnel_t *t, const void *data, size_t size)
     c = t->output_cache;
 
     if (NULL == c) {
-        c = alg_cache_create(kcp_obuf_flush,
-                             ngx_pmap_cache_alloc,
-                             ngx_pmap_cache_dealloc,
-                             g->pool);
+        c = kcp_cache_create(g, kcp_obuf_flush);
         
         if (NULL == c) {
             ngx_log_error(NGX_LOG_ALERT, g->log, 0,
-                          "create output cache failed! conv=%u", t->conv);
+                          "create output cache failed! conv=%uD", t->conv);
 
             return False;
         }
@@ -113,37 +350,269 @@ kcp_obuf_flushall(kcp_tunnel_t *t)
 static int
 kcp_obuf_flush(alg_cache_t *c, const void *data, size_t size)
 {
-    kcp_tunnel_t        *t;
+    return kcp_tunnel_output(c->data, data, size);
+}
+
+static int
+kcp_pace_output(kcp_tunnel_t *t, const void *data, size_t size)
+{
     kcp_tunnel_group_t  *g;
+    kcp_pace_t          *pc;
+    alg_cache_t         *c;
 
-    t = c->data;
     g = t->group;
+    pc = &t->pace;
 
-    if (sendto(g->udp_conn->fd, data, size, 0,
-               &t->addr.u.sockaddr, t->addr.socklen) != (ssize_t)size) {
-        
-        ngx_log_error(NGX_LOG_ERR, g->log, ngx_socket_errno,
-                      "send error");
+    if (!g->pacing || kcp_pace_exempt(data, size)) {
+        return kcp_tunnel_output(t, data, size);
+    }
+
+    kcp_pace_fill(t, ngx_current_msec);
+
+    c = pc->queue;
+
+    if (0 == pc->rate) {
+        return kcp_tunnel_output(t, data, size);
+    }
+
+    if ((NULL == c || alg_cache_empty(c)) && pc->tokens >= size) {
+        pc->tokens -= size;
+        return kcp_tunnel_output(t, data, size);
+    }
+
+    if (NULL == c) {
+        c = kcp_cache_create(g, kcp_pace_flush);
+
+        if (NULL == c) {
+            ngx_log_error(NGX_LOG_ALERT, g->log, 0,
+                          "create pace queue failed! conv=%uD", t->conv);
+
+            return kcp_tunnel_output(t, data, size);
+        }
+
+        c->data = t;
+        pc->queue = c;
+    }
+
+    t->stat.paced++;
+
+    return alg_cache_push(c, data, size);
+}
+
+/* the queue stops at the first datagram there are no tokens for */
+
+static int
+kcp_pace_flush(alg_cache_t *c, const void *data, size_t size)
+{
+    kcp_tunnel_t  *t;
+
+    t = c->data;
 
+    if (t->pace.tokens < size) {
         return False;
     }
 
+    t->pace.tokens -= size;
+
+    /* a datagram the socket refused is lost, as on the wire */
+
+    kcp_tunnel_output(t, data, size);
+
     return True;
 }
 
+static ngx_uint_t
+kcp_pace_exempt(const u_char *p, size_t size)
+{
+    const u_char  *last;
+
+    last = p + size;
+
+    while (last - p >= KCP_HDR_SIZE) {
+        if (kcp_cmd(p) != KCP_CMD_ACK) {
+            return 0;
+        }
+
+        p += KCP_HDR_SIZE + kcp_seg_len(p);
+    }
+
+    return 1;
+}
+
+/*
+ * The rate the window goes around the rtt at, as ikcp_flush() computes
+ * the window, and the bucket holds a timer tick of it, or a few
+ * datagrams at a slow rate.
+ */
+
+static void
+kcp_pace_fill(kcp_tunnel_t *t, ngx_msec_t now)
+{
+    kcp_tunnel_group_t  *g;
+    kcp_pace_t          *pc;
+    ikcpcb              *kcp;
+    IUINT32              wnd;
+    uint64_t             add, burst;
+
+    g = t->group;
+    pc = &t->pace;
+    kcp = t->kcp;
+
+    if (kcp->rx_srtt <= 0) {
+        pc->rate = 0;
+        pc->last = now;
+        return;
+    }
+
+    wnd = ngx_min(kcp->snd_wnd, kcp->rmt_wnd);
+
+    if (!kcp->nocwnd) {
+        wnd = ngx_min(kcp->cwnd, wnd);
+    }
+
+    wnd = ngx_max(wnd, 1);
+
+    if (0 == pc->rtt_min || (IUINT32) kcp->rx_srtt <= pc->rtt_min
+        || (ngx_msec_int_t) (now - pc->rtt_stamp) >= KCP_PACE_RTT_WINDOW)
+    {
+        pc->rtt_min = kcp->rx_srtt;
+        pc->rtt_stamp = now;
+    }
+
+    pc->rate = (uint64_t) wnd * kcp->mtu * 1000 * KCP_PACE_GAIN
+               / ((uint64_t) pc->rtt_min * 100);
+
+    if (g->pacing_max && pc->rate > g->pacing_max) {
+        pc->rate = g->pacing_max;
+    }
+
+    burst = ngx_max(pc->rate / 1000, (uint64_t) KCP_PACE_BURST * g->mtu_max);
+
+    add = pc->rate * (ngx_msec_t) (now - pc->last) / 1000;
+
+    /* at a slow rate the milliseconds add up until there's a byte */
+
+    if (add == 0 && pc->tokens < burst) {
+        return;
+    }
+
+    pc->tokens = (size_t) ngx_min(pc->tokens + add, burst);
+    pc->last = now;
+}
+
+/* when there are the tokens for a datagram of the mtu */
+
+static ngx_msec_t
+kcp_pace_next(kcp_tunnel_t *t, ngx_msec_t now)
+{
+    kcp_pace_t  *pc;
+    uint64_t     need;
+
+    pc = &t->pace;
+
+    if (0 == pc->rate || pc->tokens >= t->kcp->mtu) {
+        return now;
+    }
+
+    need = t->kcp->mtu - pc->tokens;
+
+    return pc->last + (ngx_msec_t) ((need * 1000 + pc->rate - 1) / pc->rate);
+}
+
+static int
+kcp_tunnel_output(kcp_tunnel_t *t, const void *data, size_t size)
+{
+    if (t->fec_enc) {
+        return kcp_fec_output(t, data, size);
+    }
+
+    return kcp_batch_queue(t, data, size, kcp_tunnel_peer(t));
+}
+
 int
 kcp_send(kcp_tunnel_t *t, const void *data, size_t size)
+{
+    if (t->failed) {
+        return False;
+    }
+
+#if (NGX_ZLIB)
+    if (t->zip) {
+        return kcp_zip_send(t, data, size);
+    }
+#endif
+
+    return kcp_send_msg(t, data, size);
+}
+
+static int
+kcp_send_msg(kcp_tunnel_t *t, const void *data, size_t size)
 {
     if (kcp_sndbuf_canflush(t) &&
         kcp_sndbuf_flushall(t) &&
         kcp_sndbuf_flush(t->sndcache, data, size)) {
 
         kcp_group_reset_timer(t);
+
+        kcp_send_pressure(t);
         
         return True;
     }
-    
-    return alg_cache_push(t->sndcache, data, size);
+
+    if (!alg_cache_push(t->sndcache, data, size)) {
+        t->stat.send_errors++;
+        return False;
+    }
+
+    kcp_send_pressure(t);
+
+    return True;
+}
+
+size_t
+kcp_send_queued(kcp_tunnel_t *t)
+{
+    return t->sndcache->memcache_size + t->sndcache->dcache_size;
+}
+
+/*
+ * The send cache only grows in kcp_send(), and only shrinks as kcp takes
+ * from it, the sender is paused and resumed there, not on every datagram.
+ */
+
+static void
+kcp_send_pressure(kcp_tunnel_t *t)
+{
+    kcp_tunnel_group_t  *g;
+    size_t               queued;
+
+    g = t->group;
+
+    if (0 == g->send_high || NULL == t->pressure_handler) {
+        return;
+    }
+
+    queued = kcp_send_queued(t);
+
+    if (!t->paused && queued >= g->send_high) {
+        t->paused = 1;
+        t->stat.send_paused++;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, g->log, 0,
+                       "kcp conv=%uD paused, %uz bytes queued",
+                       t->conv, queued);
+
+        t->pressure_handler(t, 1);
+
+    } else if (t->paused && queued <= g->send_low) {
+        t->paused = 0;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, g->log, 0,
+                       "kcp conv=%uD resumed, %uz bytes queued",
+                       t->conv, queued);
+
+        t->pressure_handler(t, 0);
+    }
 }
 
 static int
@@ -172,7 +641,7 @@ kcp_sndbuf_flush(alg_cache_t *c, const void *data, size_t size)
     }
     
     ptr = (const char *)data;
-    maxlen = kcp->mss<<4;
+    maxlen = (size_t) kcp->mss << 4;
     for (;;)
     {
         if (size <= maxlen) // in most case
@@ -208,232 +677,2504 @@ kcp_input(kcp_tunnel_t *t, const void *data, size_t size)
     return 0 == ret;
 }
 
-static ngx_msec_t
+static void
 kcp_update(kcp_tunnel_t *t, ngx_msec_t curtime)
 {
     ikcpcb       *kcp;
-    ngx_pool_t   *pool;
-    char         *buf;
-    int           size;
-    ngx_msec_t    nxt_call_time;
+    ikcpvec      *vec;
+    int           n;
+
+    if (t->failed) {
+        kcp_tunnel_close(t);
+        return;
+    }
 
-    kcp  = t->kcp;
-    pool = t->group->pool;
+    kcp = t->kcp;
+    vec = t->group->rvec;
+
+    /* what waited goes before what this update sends */
+
+    if (t->pace.queue && !alg_cache_empty(t->pace.queue)) {
+        kcp_pace_fill(t, curtime);
+        alg_cache_flushall(t->pace.queue);
+    }
     
     ikcp_update(kcp, curtime);
+
+    if (t->group->adaptive
+        && (ngx_msec_int_t)(curtime - t->tune.next) >= 0)
+    {
+        kcp_tune(t, curtime);
+    }
     
     kcp_sndbuf_flushall(t);
-    
-    size = ikcp_peeksize(kcp);
-    if (size > 0)
-    {
-        buf = (char *)ngx_palloc(pool, size);
-        
-        assert(buf != NULL && "ikcp_recv() malloc failed!");
-        assert(ikcp_recv(kcp, buf, size) == size);
 
+    if (t->paused) {
+        kcp_send_pressure(t);
+    }
+
+    /* deliver straight out of the kcp segments */
+
+    while ((n = ikcp_recvv(kcp, vec, IKCP_FRG_MAX)) > 0) {
         ++t->recv_count;
-        if (t->recv_handler) {
-            t->recv_handler(t, buf, size);
-        }
 
-        ngx_pfree(pool, buf);
+        kcp_deliver(t, vec, n);
+
+        ikcp_recv_done(kcp);
     }
 
-    nxt_call_time = ikcp_check(kcp, curtime);
-    return nxt_call_time > curtime ? nxt_call_time - curtime : 0;
-}
+    /* what this update sent gets its parity now, not a block later */
 
+    if (t->fec_enc) {
+        kcp_fec_flush(t);
+    }
 
-/* function for kcp tunnel group */
+    kcp_group_schedule(t, curtime);
+}
 
-int
-kcp_group_init(kcp_tunnel_group_t *g)
+/*
+ * The tunnel can't go on, what it has is not what the peer sent or will
+ * be sent.  It's closed by the update that's scheduled right away, out of
+ * the call stack of whoever found it out.
+ */
+
+static void
+kcp_tunnel_fail(kcp_tunnel_t *t)
 {
-    ngx_connection_t    *c;
-    ngx_event_t         *rev, *wev;
-    ngx_pmap_conf_t     *pcf;
-    ngx_socket_t         s;
-    ngx_int_t            event;
+    if (t->failed) {
+        return;
+    }
 
-    s = ngx_socket(AF_INET, SOCK_DGRAM, 0);
+    t->failed = 1;
 
-    ngx_log_error(NGX_LOG_INFO, g->log, 0,
-                  "create kcp tunnel group! UDP socket %d", s);
+    kcp_group_reset_timer(t);
+}
 
-    if ((ngx_socket_t)-1 == s) {
-        ngx_log_error(NGX_LOG_ERR, g->log, ngx_socket_errno,
-                      ngx_socket_n " failed");
-        return NGX_ERROR;
+static void
+kcp_tunnel_close(kcp_tunnel_t *t)
+{
+    if (t->close_handler) {
+        t->close_handler(t);
+
+    } else {
+        kcp_destroy_tunnel(t->group, t);
     }
+}
 
-    /* get connection */
+static void
+kcp_deliver(kcp_tunnel_t *t, ikcpvec *vec, int n)
+{
+    kcp_tunnel_group_t *g;
+    u_char             *p;
+    size_t              size;
+    int                 i;
 
-    c = ngx_get_connection(s, g->log);
+    g = t->group;
 
-    if (NULL == c) {
-        if (ngx_close_socket(s) == -1) {
-            ngx_log_error(NGX_LOG_ERR, g->log, ngx_socket_errno,
-                          ngx_close_socket_n "failed");
-        }
+    if (t->failed) {
+        return;
+    }
 
-        return NGX_ERROR;
+#if (NGX_ZLIB)
+    if (t->zip) {
+        vec = kcp_zip_recv(t, vec, &n);
+        if (NULL == vec) {
+            return;
+        }
     }
+#endif
 
-    if (ngx_nonblocking(s) == -1) {
-        ngx_log_error(NGX_LOG_ERR, g->log, ngx_socket_errno,
-                      ngx_nonblocking_n " failed");
+    size = 0;
+    for (i = 0; i < n; i++) {
+        size += vec[i].len;
+    }
 
-        goto failed;
+    if (t->recvv_handler) {
+        t->recvv_handler(t, vec, n, size);
+        return;
     }
 
-    g->udp_conn = c;
+    if (NULL == t->recv_handler) {
+        return;
+    }
 
-    /* bind address for server */
-    
-    pcf = ngx_pmap_get_conf(g->cycle->conf_ctx, ngx_pmap_core_module);
-    g->is_server = (NGX_PMAP_ENDPOINT_SERVER == pcf->endpoint);
-    if (g->is_server) {
-        
-        if (bind(s, &g->addr.u.sockaddr, g->addr.socklen) < 0) {
-            
-            ngx_log_error(NGX_LOG_ERR, g->log, ngx_socket_errno,
-                          ngx_close_socket_n "failed");
-            
-            goto failed;
-        }
+    if (1 == n) { /* in most case */
+        t->recv_handler(t, vec[0].data, size);
+        return;
     }
 
-    /* register read event */
+    /* reassemble into the group buffer, it's reused by later messages */
 
-    rev = c->read;    
-    wev = c->write;
-    
-    rev->log = g->log;
-    rev->handler = kcp_group_on_event;
-            
-    wev->ready = 1; /* UDP sockets are always ready to write */
-    wev->log = g->log;
+    if (size > g->rbuf_size) {
+        if (g->rbuf) {
+            ngx_pfree(g->pool, g->rbuf);
+        }
 
-    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
-    c->data = g;
+        g->rbuf = ngx_palloc(g->pool, size);
+        if (NULL == g->rbuf) {
+            g->rbuf_size = 0;
 
-    event = (ngx_event_flags & NGX_USE_CLEAR_EVENT) ?
-            NGX_CLEAR_EVENT: /* kqueue, epoll */
-            NGX_LEVEL_EVENT; /* select, poll, /dev/poll */
+            ngx_log_error(NGX_LOG_ALERT, g->log, 0,
+                          "alloc recv buffer failed! conv=%uD", t->conv);
+            return;
+        }
 
-    if (ngx_add_event(rev, NGX_READ_EVENT, event) != NGX_OK) {
-        goto failed;
+        g->rbuf_size = size;
     }
 
-    /* init rbtree(it's used to store kcp tunnel) */
+    p = g->rbuf;
+    for (i = 0; i < n; i++) {
+        p = ngx_cpymem(p, vec[i].data, vec[i].len);
+    }
+
+    t->recv_handler(t, g->rbuf, size);
+}
+
+
+/*
+ * Adaptive mode, once a period: the interval follows the rtt, and the
+ * share of timed out segments picks the resend, congestion control and
+ * the send window.  The mtu is searched for between karg.mtu and mtu_max
+ * with probes the kernel sends with DF set.
+ */
+
+static void
+kcp_tune(kcp_tunnel_t *t, ngx_msec_t curtime)
+{
+    kcp_tunnel_group_t  *g;
+    kcp_tune_t          *tn;
+    ikcpcb              *kcp;
+    IUINT32              acked, lost, wnd;
+    int                  interval;
+
+    g = t->group;
+    tn = &t->tune;
+    kcp = t->kcp;
+
+    tn->next = curtime + KCP_TUNE_PERIOD;
+
+    acked = kcp->snd_una - tn->last_una;
+    lost = kcp->xmit - tn->last_xmit;
+    tn->last_una = kcp->snd_una;
+    tn->last_xmit = kcp->xmit;
+
+    /* flush about four times a rtt, fast links get the short interval */
+
+    if (kcp->rx_srtt > 0) {
+        interval = kcp->rx_srtt / 4;
+        interval = ngx_max(interval, KCP_TUNE_INTERVAL_MIN);
+        interval = ngx_min(interval, KCP_TUNE_INTERVAL_MAX);
+
+        ikcp_nodelay(kcp, -1, interval, -1, -1);
+    }
+
+    if (acked + lost >= KCP_TUNE_MIN_SAMPLES) {
+        tn->loss = lost * 100 / (acked + lost);
+
+        if (tn->loss >= KCP_TUNE_LOSSY) {
+
+            /*
+             * congestion control back on, fast resend waits for one more
+             * ack to skip the segment, and the window shrinks: a lossy
+             * link is not made better by sending more into it
+             */
+
+            wnd = ngx_max(kcp->snd_wnd * 3 / 4, KCP_TUNE_WND_MIN);
+            ikcp_nodelay(kcp, -1, -1, g->karg.resend + 1, 0);
+            ikcp_wndsize(kcp, wnd, 0);
+
+        } else if (tn->loss < KCP_TUNE_CLEAN) {
+
+            /* the window only grows while it is what limits the sender */
+
+            wnd = kcp->snd_wnd;
+            if (kcp->nsnd_que > 0) {
+                wnd = ngx_min(wnd * 2, KCP_TUNE_WND_MAX);
+            }
+
+            ikcp_nodelay(kcp, -1, -1, g->karg.resend, g->karg.nc);
+            ikcp_wndsize(kcp, wnd, 0);
+        }
+
+    } else {
+        tn->loss = 0;
+    }
+
+    ngx_log_debug6(NGX_LOG_DEBUG_EVENT, g->log, 0,
+                   "kcp tune conv=%uD srtt:%d loss:%ui%% "
+                   "interval:%uD snd_wnd:%uD mtu:%uD",
+                   t->conv, kcp->rx_srtt, tn->loss,
+                   kcp->interval, kcp->snd_wnd, kcp->mtu);
+
+    kcp_pmtu_search(t, curtime);
+}
+
+static void
+kcp_pmtu_search(kcp_tunnel_t *t, ngx_msec_t curtime)
+{
+    kcp_tunnel_group_t  *g;
+    kcp_tune_t          *tn;
+    ngx_pmap_addr_t     *addr;
+
+    g = t->group;
+    tn = &t->tune;
+
+    if (g->is_server && !t->addr_settled) {
+        return;
+    }
+
+    addr = g->is_server ? &t->addr : &g->addr;
+
+    /* a raised mtu that stopped getting through, a black hole */
+
+    if (kcp_wire_mtu(t) > (IUINT32)g->karg.mtu
+        && tn->loss >= KCP_PMTU_BLACKHOLE)
+    {
+        ngx_log_error(NGX_LOG_INFO, g->log, 0,
+                      "kcp conv=%uD mtu %uD lost %ui%%, back to %d",
+                      t->conv, kcp_wire_mtu(t), tn->loss, g->karg.mtu);
+
+        ikcp_setmtu(t->kcp, g->karg.mtu - kcp_wire_overhead(g));
+
+        tn->mtu_lo = g->karg.mtu;
+        tn->mtu_hi = tn->mtu_lo;
+        tn->probe = 0;
+        tn->search = curtime + KCP_PMTU_RESEARCH;
+
+        return;
+    }
+
+    if (tn->probe) {
+
+        /* lost for a whole period */
+
+        if (++tn->probe_tries < KCP_PMTU_TRIES) {
+            kcp_pmtu_send(t, KCP_CMD_PROBE, tn->probe, addr);
+            return;
+        }
+
+        tn->mtu_hi = tn->probe - 1;
+        tn->probe = 0;
+
+        if (tn->mtu_hi - tn->mtu_lo < KCP_PMTU_STEP) {
+            tn->search = curtime + KCP_PMTU_RESEARCH;
+        }
+    }
+
+    if (tn->mtu_hi - tn->mtu_lo < KCP_PMTU_STEP) {
+
+        if ((ngx_msec_int_t)(curtime - tn->search) < 0
+            || tn->mtu_lo >= g->mtu_max)
+        {
+            return;
+        }
+
+        tn->mtu_hi = g->mtu_max;
+    }
+
+    tn->probe = tn->mtu_lo + (tn->mtu_hi - tn->mtu_lo + 1) / 2;
+    tn->probe_tries = 0;
+
+    kcp_pmtu_send(t, KCP_CMD_PROBE, tn->probe, addr);
+}
+
+static void
+kcp_pmtu_send(kcp_tunnel_t *t, IUINT32 cmd, IUINT32 size,
+    ngx_pmap_addr_t *addr)
+{
+    kcp_tunnel_group_t  *g;
+    u_char              *p;
+
+    g = t->group;
+
+    /* conv and sn are little endian, as ikcp encodes them */
+
+    p = g->probe;
+
+    kcp_put_le32(p, t->conv);
+    p[4] = (u_char) cmd;
+    kcp_put_le32(p + 12, size);
+
+    /* the ack is a bare header, size is the probe as sealed */
+
+    kcp_batch_queue(t, p, cmd == KCP_CMD_PROBE ? size - g->crypt_overhead
+                                               : KCP_HDR_SIZE, addr);
+}
+
+static void
+kcp_pmtu_input(kcp_tunnel_t *t, const u_char *buf, size_t size,
+    ngx_pmap_addr_t *addr)
+{
+    kcp_tunnel_group_t  *g;
+    kcp_tune_t          *tn;
+    IUINT32              sn;
+
+    g = t->group;
+    tn = &t->tune;
+
+    sn = kcp_get_le32(buf + 12);
+
+    if (kcp_cmd(buf) == KCP_CMD_PROBE) {
+
+        /* answered in any mode, the datagram must have come whole */
+
+        if (sn == size + g->crypt_overhead && sn <= g->mtu_max) {
+            kcp_pmtu_send(t, KCP_CMD_PROBE_ACK, sn, addr);
+        }
+
+        return;
+    }
+
+    if (!g->adaptive || 0 == tn->probe || sn != tn->probe) {
+        return;
+    }
+
+    tn->probe = 0;
+    tn->mtu_lo = sn;
+
+    if (tn->mtu_hi - tn->mtu_lo < KCP_PMTU_STEP) {
+        tn->search = ngx_current_msec + KCP_PMTU_RESEARCH;
+    }
+
+    if (sn > kcp_wire_mtu(t)
+        && ikcp_setmtu(t->kcp, sn - kcp_wire_overhead(g)) == 0)
+    {
+        ngx_log_error(NGX_LOG_INFO, g->log, 0,
+                      "kcp conv=%uD mtu raised to %uD", t->conv, sn);
+    }
+}
+
+
+ngx_int_t
+kcp_tunnel_set_token(kcp_tunnel_t *t, const u_char *token)
+{
+#if (NGX_OPENSSL)
+    kcp_tunnel_group_t  *g;
+#endif
+
+    ngx_memcpy(t->path.token, token, KCP_PATH_TOKEN_SIZE);
+    t->path.token_set = 1;
+
+#if (NGX_OPENSSL)
+    g = t->group;
+
+    if (g->crypt) {
+        kcp_crypt_tunnel_cleanup(&t->crypt_tx, &t->crypt_rx);
+
+        return kcp_crypt_tunnel_init(g->crypt, &t->crypt_tx, &t->crypt_rx,
+                                     t->conv, token, KCP_PATH_TOKEN_SIZE,
+                                     g->log);
+    }
+#endif
+
+    return NGX_OK;
+}
+
+/* server, a datagram of t came from addr */
+
+static void
+kcp_path_check(kcp_tunnel_t *t, ngx_pmap_addr_t *addr)
+{
+    kcp_path_t  *path;
+
+    path = &t->path;
+
+    if (!path->token_set || kcp_addr_equal(&t->addr, addr)) {
+        return;
+    }
+
+    /* late datagrams of the path it moved from */
+
+    if (t->stat.migrations
+        && ngx_current_msec - path->moved < KCP_PATH_SETTLE)
+    {
+        return;
+    }
+
+    if (path->validating
+        && kcp_addr_equal(&path->addr, addr)
+        && ngx_current_msec - path->sent < KCP_PATH_RETRY)
+    {
+        return;
+    }
+
+    path->addr = *addr;
+    path->sent = ngx_current_msec;
+    path->validating = 1;
+
+    kcp_path_random(path->nonce);
+
+    kcp_path_send(t, KCP_CMD_PATH_CHALLENGE, path->nonce, addr);
+}
+
+static void
+kcp_path_input(kcp_tunnel_t *t, const u_char *buf, size_t size,
+    ngx_pmap_addr_t *addr)
+{
+    kcp_tunnel_group_t  *g;
+    kcp_path_t          *path;
+    kcp_tune_t          *tn;
+    u_char               mac[KCP_PATH_TOKEN_SIZE];
+    u_char               text[NGX_SOCKADDR_STRLEN];
+    size_t               len;
+
+    g = t->group;
+    path = &t->path;
+
+    if (size < KCP_HDR_SIZE || !path->token_set) {
+        return;
+    }
+
+    if (kcp_cmd(buf) == KCP_CMD_PATH_CHALLENGE) {
+
+        /*
+         * the client answers the server only, the server sends the
+         * challenge from its address to the one the client moved to
+         */
+
+        if (!g->is_server && kcp_addr_equal(&g->addr, addr)) {
+            kcp_path_send(t, KCP_CMD_PATH_RESPONSE, buf + 8, addr);
+        }
+
+        return;
+    }
+
+    kcp_path_mac(t, KCP_CMD_PATH_RESPONSE, buf + 8, mac);
+
+    if (!g->is_server || !path->validating
+        || !kcp_addr_equal(&path->addr, addr)
+        || ngx_memcmp(buf + 8, path->nonce, KCP_PATH_TOKEN_SIZE) != 0
+        || ngx_memcmp(buf + 16, mac, KCP_PATH_TOKEN_SIZE) != 0)
+    {
+        return;
+    }
+
+    path->validating = 0;
+    path->moved = ngx_current_msec;
+
+    t->addr = path->addr;
+    t->stat.migrations++;
+
+    len = ngx_sock_ntop(&addr->u.sockaddr, addr->socklen, text,
+                        NGX_SOCKADDR_STRLEN, 1);
+
+    ngx_log_error(NGX_LOG_INFO, g->log, 0,
+                  "kcp conv=%uD moved to %*s", t->conv, len, text);
+
+    /* the new path may not take the mtu the old one did */
+
+    tn = &t->tune;
+
+    if (g->adaptive && kcp_wire_mtu(t) > (IUINT32) g->karg.mtu) {
+        ikcp_setmtu(t->kcp, g->karg.mtu - kcp_wire_overhead(g));
+
+        tn->mtu_lo = g->karg.mtu;
+        tn->mtu_hi = g->mtu_max;
+        tn->probe = 0;
+    }
+}
+
+static void
+kcp_path_send(kcp_tunnel_t *t, ngx_uint_t cmd, const u_char *nonce,
+    ngx_pmap_addr_t *addr)
+{
+    u_char  p[KCP_HDR_SIZE];
+
+    ngx_memzero(p, KCP_HDR_SIZE);
+
+    kcp_put_le32(p, t->conv);
+    p[4] = (u_char) cmd;
+    ngx_memcpy(p + 8, nonce, KCP_PATH_TOKEN_SIZE);
+
+    if (KCP_CMD_PATH_RESPONSE == cmd) {
+        kcp_path_mac(t, cmd, nonce, p + 16);
+    }
+
+    kcp_batch_queue(t, p, KCP_HDR_SIZE, addr);
+}
+
+static void
+kcp_path_mac(kcp_tunnel_t *t, ngx_uint_t cmd, const u_char *nonce,
+    u_char *mac)
+{
+    ngx_md5_t  md5;
+    u_char     label, conv[4], hash[16];
+
+    label = (u_char) cmd;
+    kcp_put_le32(conv, t->conv);
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, &label, 1);
+    ngx_md5_update(&md5, t->path.token, KCP_PATH_TOKEN_SIZE);
+    ngx_md5_update(&md5, nonce, KCP_PATH_TOKEN_SIZE);
+    ngx_md5_update(&md5, conv, 4);
+    ngx_md5_final(hash, &md5);
+
+    ngx_memcpy(mac, hash, KCP_PATH_TOKEN_SIZE);
+}
+
+static void
+kcp_path_random(u_char *p)
+{
+#if (NGX_OPENSSL)
+    if (RAND_bytes(p, KCP_PATH_TOKEN_SIZE) == 1) {
+        return;
+    }
+#endif
+
+    kcp_put_le32(p, (uint32_t) ngx_random());
+    kcp_put_le32(p + 4, (uint32_t) ngx_random() ^ (uint32_t) ngx_time());
+}
+
+static ngx_uint_t
+kcp_addr_equal(ngx_pmap_addr_t *a, ngx_pmap_addr_t *b)
+{
+    struct sockaddr_in   *sin1, *sin2;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6  *sin61, *sin62;
+#endif
+
+    if (a->socklen != b->socklen
+        || a->u.sockaddr.sa_family != b->u.sockaddr.sa_family)
+    {
+        return 0;
+    }
+
+    switch (a->u.sockaddr.sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin61 = &a->u.sockaddr_in6;
+        sin62 = &b->u.sockaddr_in6;
+
+        return sin61->sin6_port == sin62->sin6_port
+               && ngx_memcmp(&sin61->sin6_addr, &sin62->sin6_addr, 16) == 0;
+#endif
+
+    case AF_INET:
+        sin1 = &a->u.sockaddr_in;
+        sin2 = &b->u.sockaddr_in;
+
+        return sin1->sin_port == sin2->sin_port
+               && sin1->sin_addr.s_addr == sin2->sin_addr.s_addr;
+
+    default:
+        return ngx_memcmp(&a->u.sockaddr, &b->u.sockaddr, a->socklen) == 0;
+    }
+}
+
+
+/*
+ * Forward error correction: the datagrams of a tunnel are grouped in
+ * blocks of fec_data, each block is followed by fec_parity shards of
+ * Reed-Solomon parity, see fec.h.  A block is also closed at the end of
+ * every kcp_update(), a short one gets its share of the parity.  The
+ * receiver inputs the data shards at once, and the ones it rebuilds when
+ * enough of a block has come.
+ */
+
+static ngx_int_t
+kcp_fec_create(kcp_tunnel_t *t)
+{
+    kcp_tunnel_group_t  *g;
+    kcp_fec_block_t     *b;
+    ngx_uint_t           i, n, nshards;
+    u_char              *p;
+
+    g = t->group;
+
+    nshards = g->fec_data + g->fec_parity;
+    n = 1 + KCP_FEC_BLOCKS;
+
+    p = ngx_alloc(n * (sizeof(kcp_fec_block_t) + nshards * (1 + g->mtu_max)),
+                  g->log);
+    if (NULL == p) {
+        return NGX_ERROR;
+    }
+
+    b = (kcp_fec_block_t *) p;
+    ngx_memzero(b, n * sizeof(kcp_fec_block_t));
+
+    p += n * sizeof(kcp_fec_block_t);
+
+    for (i = 0; i < n; i++) {
+        b[i].have = p;
+        p += nshards;
+
+        b[i].slots = p;
+        p += nshards * g->mtu_max;
+    }
+
+    t->fec_enc = &b[0];
+    t->fec_dec = &b[1];
+
+    return NGX_OK;
+}
+
+static void
+kcp_fec_header(kcp_tunnel_t *t, u_char *p, u_char cmd, ngx_uint_t shard,
+    IUINT32 seq, size_t size)
+{
+    kcp_put_le32(p, t->conv);
+    p[4] = cmd;
+    p[5] = (u_char) shard;
+    kcp_put_le32(p + 6, seq);
+    kcp_put_le16(p + 10, size);
+}
+
+static int
+kcp_fec_output(kcp_tunnel_t *t, const void *data, size_t size)
+{
+    kcp_tunnel_group_t  *g;
+    kcp_fec_block_t     *b;
+    u_char              *p;
+    int                  rc;
+
+    g = t->group;
+    b = t->fec_enc;
+
+    if (size + KCP_FEC_OVERHEAD > g->mtu_max) {
+
+        /*
+         * the kcp mtu leaves room for the header and the parity's size,
+         * not to happen; sent raw the peer would not take it either
+         */
+
+        ngx_log_error(NGX_LOG_ALERT, g->log, 0,
+                      "kcp conv=%uD fec dropped %uz bytes over the mtu",
+                      t->conv, size);
+
+        t->stat.send_errors++;
+        g->send_errors++;
+
+        return False;
+    }
+
+    p = kcp_fec_slot(g, b, b->ndata);
+
+    kcp_fec_header(t, p, KCP_CMD_FEC_DATA, b->ndata, b->seq, size);
+    ngx_memcpy(p + KCP_FEC_HDR_SIZE, data, size);
+
+    if (b->len < size + 2) {
+        b->len = size + 2;
+    }
+
+    b->ndata++;
+
+    rc = kcp_batch_queue(t, p, KCP_FEC_HDR_SIZE + size, kcp_tunnel_peer(t));
+
+    if (b->ndata == g->fec_data) {
+        kcp_fec_flush(t);
+    }
+
+    return rc;
+}
+
+static void
+kcp_fec_flush(kcp_tunnel_t *t)
+{
+    kcp_tunnel_group_t  *g;
+    kcp_fec_block_t     *b;
+    u_char              *p, **shards;
+    ngx_uint_t           i, n, m;
+    size_t               len;
+
+    g = t->group;
+    b = t->fec_enc;
+    n = b->ndata;
+
+    if (0 == n) {
+        return;
+    }
+
+    m = (g->fec_parity * n + g->fec_data - 1) / g->fec_data;
+
+    shards = g->fec_shards;
+
+    for (i = 0; i < n; i++) {
+        p = kcp_fec_shard(kcp_fec_slot(g, b, i));
+        len = 2 + kcp_get_le16(p);
+
+        ngx_memzero(p + len, b->len - len);
+        shards[i] = p;
+    }
+
+    for (i = 0; i < m; i++) {
+        shards[n + i] = kcp_fec_slot(g, b, g->fec_data + i) + KCP_FEC_HDR_SIZE;
+    }
+
+    fec_encode(shards, n, shards + n, m, b->len);
+
+    for (i = 0; i < m; i++) {
+        p = kcp_fec_slot(g, b, g->fec_data + i);
+
+        kcp_fec_header(t, p, KCP_CMD_FEC_PARITY, i, b->seq, n);
+        kcp_batch_queue(t, p, KCP_FEC_HDR_SIZE + b->len, kcp_tunnel_peer(t));
+    }
+
+    b->seq++;
+    b->ndata = 0;
+    b->len = 0;
+}
+
+static void
+kcp_fec_input(kcp_tunnel_t *t, const u_char *buf, size_t size)
+{
+    kcp_tunnel_group_t  *g;
+    kcp_fec_block_t     *b;
+    ngx_uint_t           shard, n;
+    IUINT32              seq;
+    size_t               len;
+
+    g = t->group;
+
+    if (size < KCP_FEC_HDR_SIZE) {
+        return;
+    }
+
+    shard = buf[5];
+    seq = kcp_get_le32(buf + 6);
+    n = kcp_get_le16(buf + 10);
+    len = size - KCP_FEC_HDR_SIZE;
+
+    if (kcp_cmd(buf) == KCP_CMD_FEC_DATA) {
+        if (n != len) {
+            return;
+        }
+
+        /* no waiting for the block, whatever fec is configured here */
+
+        kcp_input(t, buf + KCP_FEC_HDR_SIZE, len);
+    }
+
+    if (NULL == t->fec_dec) {
+        return;
+    }
+
+    b = &t->fec_dec[seq % KCP_FEC_BLOCKS];
+
+    if (!b->used || (IINT32)(seq - b->seq) > 0) {
+        b->seq = seq;
+        b->ndata = 0;
+        b->ndata_have = 0;
+        b->nparity_have = 0;
+        b->len = 0;
+        ngx_memzero(b->have, g->fec_data + g->fec_parity);
+        b->used = 1;
+        b->done = 0;
+
+    } else if (b->seq != seq) {
+        return;
+    }
+
+    if (b->done) {
+        return;
+    }
+
+    if (kcp_cmd(buf) == KCP_CMD_FEC_DATA) {
+        if (shard >= g->fec_data || b->have[shard]) {
+            return;
+        }
+
+        ngx_memcpy(kcp_fec_shard(kcp_fec_slot(g, b, shard)),
+                   buf + KCP_FEC_HDR_SIZE - 2, len + 2);
+
+        b->have[shard] = 1;
+        b->ndata_have++;
+
+    } else {
+        if (shard >= g->fec_parity || 0 == n || n > g->fec_data
+            || b->have[g->fec_data + shard])
+        {
+            return;
+        }
+
+        if (b->len && (b->len != len || b->ndata != n)) {
+            b->done = 1;
+            return;
+        }
+
+        b->len = len;
+        b->ndata = n;
+
+        ngx_memcpy(kcp_fec_slot(g, b, g->fec_data + shard) + KCP_FEC_HDR_SIZE,
+                   buf + KCP_FEC_HDR_SIZE, len);
+
+        b->have[g->fec_data + shard] = 1;
+        b->nparity_have++;
+    }
+
+    if (0 == b->ndata) {
+        return;
+    }
+
+    if (b->ndata_have >= b->ndata) {
+        b->done = 1;
+        return;
+    }
+
+    if (b->ndata_have + b->nparity_have >= b->ndata) {
+        kcp_fec_recover(t, b);
+    }
+}
+
+static void
+kcp_fec_recover(kcp_tunnel_t *t, kcp_fec_block_t *b)
+{
+    kcp_tunnel_group_t  *g;
+    u_char              *p, **shards;
+    ngx_uint_t           i, n;
+    size_t               len;
+
+    g = t->group;
+    shards = g->fec_shards;
+
+    b->done = 1;
+
+    for (i = 0; i < b->ndata; i++) {
+        p = kcp_fec_shard(kcp_fec_slot(g, b, i));
+        shards[i] = p;
+
+        if (!b->have[i]) {
+            continue;
+        }
+
+        len = 2 + kcp_get_le16(p);
+
+        if (len > b->len) {
+            return;
+        }
+
+        ngx_memzero(p + len, b->len - len);
+    }
+
+    for (i = 0; i < g->fec_parity; i++) {
+        shards[b->ndata + i] = kcp_fec_slot(g, b, g->fec_data + i)
+                               + KCP_FEC_HDR_SIZE;
+    }
+
+    if (fec_decode(shards, b->have, b->ndata, shards + b->ndata,
+                   b->have + g->fec_data, g->fec_parity, b->len)
+        != NGX_OK)
+    {
+        return;
+    }
+
+    n = 0;
+
+    for (i = 0; i < b->ndata; i++) {
+        if (b->have[i]) {
+            continue;
+        }
+
+        p = shards[i];
+        len = kcp_get_le16(p);
+
+        if (len + 2 <= b->len) {
+            kcp_input(t, p + 2, len);
+            n++;
+        }
+    }
+
+    g->fec_recovered += n;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, g->log, 0,
+                   "kcp fec conv=%uD block %uD: %ui rebuilt",
+                   t->conv, b->seq, n);
+}
+
+
+#if (NGX_ZLIB)
+
+/* compression */
+
+static ngx_int_t
+kcp_zip_create(kcp_tunnel_t *t)
+{
+    kcp_zip_t  *z;
+
+    z = ngx_pcalloc(t->group->pool, sizeof(kcp_zip_t));
+    if (NULL == z) {
+        return NGX_ERROR;
+    }
+
+    if (deflateInit2(&z->deflate, KCP_ZIP_LEVEL, Z_DEFLATED, -KCP_ZIP_WBITS,
+                     KCP_ZIP_MEMLEVEL, Z_DEFAULT_STRATEGY)
+        != Z_OK)
+    {
+        ngx_pfree(t->group->pool, z);
+        return NGX_ERROR;
+    }
+
+    if (inflateInit2(&z->inflate, -KCP_ZIP_WBITS) != Z_OK) {
+        deflateEnd(&z->deflate);
+        ngx_pfree(t->group->pool, z);
+        return NGX_ERROR;
+    }
+
+    z->backoff = 1;
+
+    t->zip = z;
+
+    return NGX_OK;
+}
+
+
+static void
+kcp_zip_destroy(kcp_tunnel_t *t)
+{
+    deflateEnd(&t->zip->deflate);
+    inflateEnd(&t->zip->inflate);
+
+    ngx_pfree(t->group->pool, t->zip);
+    t->zip = NULL;
+}
+
+
+/* a frame per kcp_msg_max(), where kcp_sndbuf_flush() would split it */
+
+static int
+kcp_zip_send(kcp_tunnel_t *t, const u_char *data, size_t size)
+{
+    size_t  max, n;
+
+    max = kcp_msg_max(t);
+
+    do {
+        n = ngx_min(size, max);
+
+        if (!kcp_zip_frame(t, data, n)) {
+            t->stat.send_errors++;
+            return False;
+        }
+
+        data += n;
+        size -= n;
+
+    } while (size);
+
+    return True;
+}
+
+
+static int
+kcp_zip_frame(kcp_tunnel_t *t, const u_char *data, size_t size)
+{
+    kcp_tunnel_group_t  *g;
+    kcp_zip_t           *z;
+    z_stream            *zs;
+    u_char              *p;
+    size_t               len;
+    int                  rc;
+
+    g = t->group;
+    z = t->zip;
+    p = g->zip_sbuf;
+
+    if (!kcp_zip_pays(t, data, size)) {
+        t->stat.zip_bypassed++;
+
+        *p = KCP_ZIP_RAW;
+        ngx_memcpy(p + 1, data, size);
+
+        return kcp_send_msg(t, p, size + 1);
+    }
+
+    zs = &z->deflate;
+
+    zs->next_in = (u_char *) data;
+    zs->avail_in = size;
+    zs->next_out = p + 1;
+    zs->avail_out = g->zip_sbuf_size - 1;
+
+    rc = deflate(zs, Z_SYNC_FLUSH);
+
+    len = zs->next_out - p;
+
+    /* the stream can't go on without what the peer doesn't get */
+
+    if (rc != Z_OK || zs->avail_in || 0 == zs->avail_out || len < 5
+        || ngx_memcmp(p + len - 4, "\0\0\xff\xff", 4) != 0)
+    {
+        ngx_log_error(NGX_LOG_ALERT, g->log, 0,
+                      "deflate() failed: %d, conv=%uD", rc, t->conv);
+        kcp_tunnel_fail(t);
+        return False;
+    }
+
+    len -= 4;
+    *p = KCP_ZIP_DEFLATE;
+
+    t->stat.zip_in += size;
+    t->stat.zip_out += len - 1;
+
+    /* what doesn't shrink goes as it is for a while, longer each time */
+
+    if (len - 1 > size * KCP_ZIP_GAIN / 16) {
+        z->skip = z->backoff;
+        z->backoff = ngx_min(z->backoff * 2, KCP_ZIP_BACKOFF_MAX);
+
+    } else {
+        z->backoff = 1;
+    }
+
+    /* the history has the message now, the peer's must have it too */
+
+    if (!kcp_send_msg(t, p, len)) {
+        ngx_log_error(NGX_LOG_ALERT, g->log, 0,
+                      "kcp deflated message not sent, conv=%uD", t->conv);
+        kcp_tunnel_fail(t);
+        return False;
+    }
+
+    return True;
+}
+
+
+/*
+ * Compression pays when the link and not the cpu is what data waits for:
+ * always with "on", in "auto" when the rtt is long or messages queue up
+ * for the window.  Compressed or encrypted data looks random, it hits far
+ * more of the byte values than text and protocol headers do.
+ */
+
+static ngx_uint_t
+kcp_zip_pays(kcp_tunnel_t *t, const u_char *data, size_t size)
+{
+    kcp_zip_t   *z;
+    ikcpcb      *kcp;
+    uint32_t     seen[8];
+    ngx_uint_t   i, step, distinct;
+    u_char       c;
+
+    z = t->zip;
+    kcp = t->kcp;
+
+    if (size < KCP_ZIP_MIN) {
+        return 0;
+    }
+
+    if (z->skip) {
+        z->skip--;
+        return 0;
+    }
+
+    if (KCP_ZIP_AUTO == t->group->zip
+        && kcp->rx_srtt < KCP_ZIP_RTT
+        && 0 == kcp->nsnd_que
+        && 0 == t->sndcache->memcache_size + t->sndcache->dcache_size)
+    {
+        return 0;
+    }
+
+    if (size < KCP_ZIP_SAMPLE) {
+        return 1;
+    }
+
+    ngx_memzero(seen, sizeof(seen));
+
+    step = size / KCP_ZIP_SAMPLE;
+    distinct = 0;
+
+    for (i = 0; i < KCP_ZIP_SAMPLE; i++) {
+        c = data[i * step];
+
+        if (!(seen[c >> 5] & (1U << (c & 31)))) {
+            seen[c >> 5] |= 1U << (c & 31);
+            distinct++;
+        }
+    }
+
+    /* random bytes hit about 162 of the 256 values */
+
+    return distinct <= KCP_ZIP_SAMPLE / 2;
+}
+
+
+/*
+ * The fragments without the flag, or the message inflated into the group
+ * buffer, it's reused by later messages.  NULL if the message is lost.
+ */
+
+static ikcpvec *
+kcp_zip_recv(kcp_tunnel_t *t, ikcpvec *vec, int *n)
+{
+    static u_char        tail[4] = { 0, 0, 0xff, 0xff };
+
+    kcp_tunnel_group_t  *g;
+    kcp_zip_t           *z;
+    z_stream            *zs;
+    u_char              *p;
+    size_t               size;
+    int                  i, rc;
+
+    g = t->group;
+    z = t->zip;
+
+    if (0 == *n || 0 == vec[0].len) {
+        return NULL;
+    }
+
+    if (KCP_ZIP_RAW == (u_char) vec[0].data[0]) {
+        vec[0].data++;
+        vec[0].len--;
+
+        if (0 == vec[0].len && *n > 1) {
+            vec++;
+            (*n)--;
+        }
+
+        return vec;
+    }
+
+    if (KCP_ZIP_DEFLATE != (u_char) vec[0].data[0]) {
+        ngx_log_error(NGX_LOG_INFO, g->log, 0,
+                      "kcp unknown compression %d, conv=%uD",
+                      (u_char) vec[0].data[0], t->conv);
+        return NULL;
+    }
+
+    zs = &z->inflate;
+
+    zs->next_out = g->zip_rbuf;
+    zs->avail_out = g->zip_rbuf_size;
+
+    for (i = 0; i <= *n; i++) {
+
+        if (i < *n) {
+            zs->next_in = (u_char *) vec[i].data + (0 == i);
+            zs->avail_in = vec[i].len - (0 == i);
+
+        } else {
+            zs->next_in = tail;
+            zs->avail_in = sizeof(tail);
+        }
+
+        for ( ;; ) {
+            rc = inflate(zs, Z_SYNC_FLUSH);
+
+            if ((rc != Z_OK && rc != Z_BUF_ERROR)
+                || (Z_BUF_ERROR == rc && zs->avail_in && zs->avail_out))
+            {
+                goto broken;
+            }
+
+            if (zs->avail_out) {
+                if (0 == zs->avail_in) {
+                    break;
+                }
+
+                continue;
+            }
+
+            /* the message is larger than any so far */
+
+            size = g->zip_rbuf_size;
+
+            if (size >= KCP_ZIP_RBUF_MAX) {
+                goto broken;
+            }
+
+            p = ngx_palloc(g->pool, size * 2);
+            if (NULL == p) {
+                goto broken;
+            }
+
+            ngx_memcpy(p, g->zip_rbuf, size);
+            ngx_pfree(g->pool, g->zip_rbuf);
+
+            g->zip_rbuf = p;
+            g->zip_rbuf_size = size * 2;
+
+            zs->next_out = p + size;
+            zs->avail_out = size;
+        }
+    }
+
+    g->zip_vec.data = (const char *) g->zip_rbuf;
+    g->zip_vec.len = (int) (zs->next_out - g->zip_rbuf);
+
+    *n = 1;
+
+    return &g->zip_vec;
+
+broken:
+
+    /* the history is gone, so is every message deflated after this one */
+
+    ngx_log_error(NGX_LOG_ALERT, g->log, 0,
+                  "inflate() failed: %d, kcp conv=%uD", rc, t->conv);
+
+    kcp_tunnel_fail(t);
+
+    return NULL;
+}
+
+#endif
+
+
+/* segment allocator */
+
+typedef union {
+    ngx_uint_t      cls;
+    void           *next;
+} kcp_seg_hdr_t;
+
+static void
+kcp_seg_pool_init(kcp_seg_pool_t *sp, size_t max)
+{
+    size_t      size;
+    ngx_uint_t  n;
+
+    /* a segment is never less than its header, with no data */
+
+    for (size = 64; size < sizeof(struct IKCPSEG); size <<= 1) {
+        /* void */
+    }
+
+    n = 0;
+    for ( /* void */ ; size < max && n < KCP_SEG_CLASSES - 1; size <<= 1) {
+        sp->size[n++] = size;
+    }
+
+    sp->size[n++] = max;
+    sp->nclasses = n;
+
+    for (n = 0; n < KCP_SEG_CLASSES; n++) {
+        sp->free[n] = NULL;
+        sp->nfree[n] = 0;
+    }
+
+    sp->max_free = KCP_SEG_POOL_MAX_FREE;
+    sp->hits = 0;
+    sp->misses = 0;
+}
+
+static void *
+kcp_seg_alloc(ikcpcb *kcp, size_t size)
+{
+    kcp_tunnel_t    *t;
+    kcp_seg_pool_t  *sp;
+    kcp_seg_hdr_t   *h;
+    ngx_uint_t       i;
+
+    t = kcp->user;
+    sp = &t->group->segpool;
+
+    for (i = 0; i < sp->nclasses; i++) {
+        if (size <= sp->size[i]) {
+            break;
+        }
+    }
+
+    if (i == sp->nclasses) {
+        sp->misses++;
+
+        h = ngx_alloc(sizeof(kcp_seg_hdr_t) + size, t->group->log);
+        if (NULL == h) {
+            return NULL;
+        }
+
+        h->cls = KCP_SEG_UNPOOLED;
+
+        return (u_char *)h + sizeof(kcp_seg_hdr_t);
+    }
+
+    h = sp->free[i];
+
+    if (h) {
+        sp->free[i] = h->next;
+        sp->nfree[i]--;
+        sp->hits++;
+
+    } else {
+        sp->misses++;
+
+        h = ngx_alloc(sizeof(kcp_seg_hdr_t) + sp->size[i], t->group->log);
+        if (NULL == h) {
+            return NULL;
+        }
+    }
+
+    h->cls = i;
+
+    return (u_char *)h + sizeof(kcp_seg_hdr_t);
+}
+
+static void
+kcp_seg_free(ikcpcb *kcp, void *p)
+{
+    kcp_tunnel_t    *t;
+    kcp_seg_pool_t  *sp;
+    kcp_seg_hdr_t   *h;
+    ngx_uint_t       i;
+
+    t = kcp->user;
+    sp = &t->group->segpool;
+
+    h = (kcp_seg_hdr_t *)((u_char *)p - sizeof(kcp_seg_hdr_t));
+    i = h->cls;
+
+    if (i >= sp->nclasses || sp->nfree[i] >= sp->max_free) {
+        ngx_free(h);
+        return;
+    }
+
+    h->next = sp->free[i];
+    sp->free[i] = h;
+    sp->nfree[i]++;
+}
+
+
+/* batched UDP I/O */
+
+static ngx_int_t
+kcp_batch_init(kcp_tunnel_group_t *g, kcp_batch_t *b, ngx_uint_t n,
+    size_t size)
+{
+#if (NGX_HAVE_MMSG)
+    ngx_uint_t  i;
+#endif
+
+    b->n = 0;
+    b->nalloc = n;
+    b->size = size;
+
+    b->bufs = ngx_palloc(g->pool, n * size);
+    b->addrs = ngx_palloc(g->pool, n * sizeof(ngx_pmap_addr_t));
+    b->lens = ngx_palloc(g->pool, n * sizeof(size_t));
+
+    if (NULL == b->bufs || NULL == b->addrs || NULL == b->lens) {
+        return NGX_ERROR;
+    }
+
+#if (NGX_HAVE_MMSG)
+
+    b->msgs = ngx_pcalloc(g->pool, n * sizeof(struct mmsghdr));
+    b->iovs = ngx_palloc(g->pool, n * sizeof(struct iovec));
+
+    if (NULL == b->msgs || NULL == b->iovs) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        b->iovs[i].iov_base = b->bufs + i * size;
+        b->iovs[i].iov_len = size;
+
+        b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+        b->msgs[i].msg_hdr.msg_name = &b->addrs[i].u.sockaddr;
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i].u);
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+static int
+kcp_batch_queue(kcp_tunnel_t *t, const void *data, size_t size,
+    ngx_pmap_addr_t *addr)
+{
+    kcp_tunnel_group_t  *g;
+    kcp_batch_t         *b;
+    u_char              *slot;
+#if (NGX_OPENSSL)
+    ssize_t              n;
+#endif
+
+    g = t->group;
+    b = &g->txb;
+
+    slot = NULL;
+
+#if (NGX_OPENSSL)
+    if (g->crypt) {
+
+        /* sealed right into its slot, or into crypt_buf */
+
+        if (size + KCP_CRYPT_OVERHEAD <= b->size) {
+            if (b->n == b->nalloc) {
+                kcp_batch_flush(g);
+            }
+
+            slot = b->bufs + b->n * b->size;
+
+        } else if (size + KCP_CRYPT_OVERHEAD <= KCP_CRYPT_BUF_SIZE) {
+            slot = g->crypt_buf;
+        }
+
+        n = slot ? kcp_crypt_seal(g->crypt, &t->crypt_tx, slot, data, size)
+                 : NGX_ERROR;
+
+        if (NGX_ERROR == n) {
+            ngx_log_error(NGX_LOG_ALERT, g->log, 0,
+                          "kcp conv=%uD seal %uz bytes failed", t->conv, size);
+
+            t->stat.send_errors++;
+            g->send_errors++;
+
+            return False;
+        }
+
+        data = slot;
+        size = n;
+    }
+#endif
+
+    t->stat.dgrams_out++;
+    t->stat.bytes_out += size;
+    g->bytes_out += size;
+
+    if (size > b->size) {
+
+        /* does not fit in a slot, send it on its own */
+
+        g->nsyscalls++;
+        g->ndgrams++;
+
+        if (sendto(g->udp_conn->fd, data, size, 0,
+                   &addr->u.sockaddr, addr->socklen) != (ssize_t)size) {
+
+            ngx_log_error(NGX_LOG_ERR, g->log, ngx_socket_errno,
+                          "send error!");
+
+            t->stat.send_errors++;
+            g->send_errors++;
+
+            return False;
+        }
+
+        g->dgrams_out++;
+
+        return True;
+    }
+
+    if (data != slot) {
+        if (b->n == b->nalloc) {
+            kcp_batch_flush(g);
+        }
+
+        ngx_memcpy(b->bufs + b->n * b->size, data, size);
+    }
+
+    ngx_memcpy(&b->addrs[b->n].u.sockaddr, &addr->u.sockaddr, addr->socklen);
+    b->addrs[b->n].socklen = addr->socklen;
+    b->lens[b->n] = size;
+
+    b->n++;
+
+    return True;
+}
+
+static void
+kcp_batch_flush(kcp_tunnel_group_t *g)
+{
+    kcp_batch_t  *b;
+    ngx_uint_t    i;
+    ngx_err_t     err;
+#if (NGX_HAVE_MMSG)
+    int           n;
+#endif
+
+    b = &g->txb;
+
+    if (0 == b->n) {
+        return;
+    }
+
+#if (NGX_HAVE_MMSG)
+
+    for (i = 0; i < b->n; i++) {
+        b->msgs[i].msg_hdr.msg_namelen = b->addrs[i].socklen;
+        b->iovs[i].iov_len = b->lens[i];
+    }
+
+    i = 0;
+    while (i < b->n) {
+        n = sendmmsg(g->udp_conn->fd, &b->msgs[i], b->n - i, 0);
+        g->nsyscalls++;
+
+        if (-1 == n) {
+            err = ngx_socket_errno;
+
+            if (NGX_EINTR == err) {
+                continue;
+            }
+
+            if (NGX_EAGAIN == err || ENOBUFS == err) {
+
+                /* the socket buffer is full, kcp retransmits the rest */
+
+                g->ndropped += b->n - i;
+                break;
+            }
+
+            ngx_log_error(NGX_LOG_ERR, g->log, err, "sendmmsg() failed");
+
+            /* drop the datagram at the head, kcp will retransmit it */
+
+            g->send_errors++;
+
+            i++;
+            continue;
+        }
+
+        i += n;
+        g->ndgrams += n;
+        g->dgrams_out += n;
+    }
+
+#else
+
+    for (i = 0; i < b->n; i++) {
+        g->nsyscalls++;
+        g->ndgrams++;
+
+        if (sendto(g->udp_conn->fd, b->bufs + i * b->size, b->lens[i], 0,
+                   &b->addrs[i].u.sockaddr, b->addrs[i].socklen)
+            != (ssize_t)b->lens[i])
+        {
+            err = ngx_socket_errno;
+
+            if (NGX_EAGAIN == err || ENOBUFS == err) {
+                g->ndropped += b->n - i;
+                break;
+            }
+
+            ngx_log_error(NGX_LOG_ERR, g->log, err, "send error!");
+
+            g->send_errors++;
+            continue;
+        }
+
+        g->dgrams_out++;
+    }
+
+#endif
+
+    b->n = 0;
+}
+
+static ngx_int_t
+kcp_batch_recv(kcp_tunnel_group_t *g)
+{
+    kcp_batch_t  *b;
+    ngx_err_t     err;
+    ngx_int_t     n;
+#if (NGX_HAVE_MMSG)
+    ngx_int_t     i;
+#else
+    ssize_t       rc;
+#endif
+
+    b = &g->rxb;
+    b->n = 0;
+
+#if (NGX_HAVE_MMSG)
+
+    for (i = 0; i < (ngx_int_t)b->nalloc; i++) {
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i].u);
+        b->msgs[i].msg_hdr.msg_flags = 0;
+    }
+
+    for (;;) {
+        n = recvmmsg(g->udp_conn->fd, b->msgs, b->nalloc, 0, NULL);
+        g->nsyscalls++;
+
+        if (n != -1) {
+            break;
+        }
+
+        err = ngx_socket_errno;
+
+        if (NGX_EINTR == err) {
+            continue;
+        }
+
+        if (NGX_EAGAIN == err) {
+            return 0;
+        }
+
+        ngx_connection_error(g->udp_conn, err, "recvmmsg() failed");
+
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        b->addrs[i].socklen = b->msgs[i].msg_hdr.msg_namelen;
+
+        /* truncated datagrams are useless to kcp */
+
+        b->lens[i] = (b->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+                     ? 0 : b->msgs[i].msg_len;
+    }
+
+#else
+
+    n = 0;
+
+    while (n < (ngx_int_t)b->nalloc) {
+        b->addrs[n].socklen = sizeof(b->addrs[n].u);
+
+        rc = recvfrom(g->udp_conn->fd, b->bufs + n * b->size, b->size, 0,
+                      &b->addrs[n].u.sockaddr, &b->addrs[n].socklen);
+        g->nsyscalls++;
+
+        if (-1 == rc) {
+            err = ngx_socket_errno;
+
+            if (NGX_EINTR == err) {
+                continue;
+            }
+
+            if (NGX_EAGAIN == err) {
+                break;
+            }
+
+            ngx_connection_error(g->udp_conn, err, "recv() failed");
+
+            if (0 == n) {
+                return NGX_ERROR;
+            }
+
+            break;
+        }
+
+        b->lens[n++] = rc;
+    }
+
+#endif
+
+    b->n = n;
+    g->ndgrams += n;
+    g->dgrams_in += n;
+
+    return n;
+}
+
+
+/* function for kcp tunnel group */
+
+int
+kcp_group_init(kcp_tunnel_group_t *g)
+{
+    ngx_connection_t        *c;
+    ngx_event_t             *rev, *wev;
+    ngx_pmap_conf_t         *pcf;
+    ngx_pmap_server_conf_t  *scf;
+    ngx_pool_cleanup_t      *cln;
+    ngx_socket_t             s, *sockets;
+    ngx_int_t                event;
+    ngx_uint_t               shared;
+    int                      family;
+    IUINT32                  mtu;
+
+    pcf = ngx_pmap_get_conf(g->cycle->conf_ctx, ngx_pmap_core_module);
+    scf = ngx_pmap_get_conf(g->cycle->conf_ctx, ngx_pmap_server_module);
+
+    g->is_server = (NGX_PMAP_ENDPOINT_SERVER == pcf->endpoint);
+
+    g->nworkers = 1;
+    g->worker = 0;
+    g->conv_seq = 0;
+
+    shared = g->is_server && scf->kcp_sockets;
+
+    if (shared) {
+
+        /* the socket of this worker, opened and bound by the master */
+
+        sockets = scf->kcp_sockets->elts;
+        s = sockets[ngx_worker];
+
+        g->nworkers = scf->kcp_sockets->nelts;
+        g->worker = ngx_worker;
+
+    } else {
+        s = ngx_socket(AF_INET, SOCK_DGRAM, 0);
+    }
+
+    ngx_log_error(NGX_LOG_INFO, g->log, 0,
+                  "create kcp tunnel group! UDP socket %d", s);
+
+    if ((ngx_socket_t)-1 == s) {
+        ngx_log_error(NGX_LOG_ERR, g->log, ngx_socket_errno,
+                      ngx_socket_n " failed");
+        return NGX_ERROR;
+    }
+
+    /* get connection */
+
+    c = ngx_get_connection(s, g->log);
+
+    if (NULL == c) {
+        if (ngx_close_socket(s) == -1) {
+            ngx_log_error(NGX_LOG_ERR, g->log, ngx_socket_errno,
+                          ngx_close_socket_n "failed");
+        }
+
+        return NGX_ERROR;
+    }
+
+    if (ngx_nonblocking(s) == -1) {
+        ngx_log_error(NGX_LOG_ERR, g->log, ngx_socket_errno,
+                      ngx_nonblocking_n " failed");
+
+        goto failed;
+    }
+
+    g->udp_conn = c;
 
-    g->timer = (ngx_uint_t)-1;
-        
-    ngx_rbtree_init(&g->rbtree, &g->sentinel, ngx_rbtree_insert_value);
     g->karg = kcp_prefab_args[2];
 
+    /* adaptive mode may raise the mtu up to what fits in an ethernet frame */
+
+    g->adaptive = pcf->kcp_adaptive;
+    g->mtu_max = g->karg.mtu;
+    g->probe = NULL;
+
+    if (g->adaptive) {
+        family = shared ? g->addr.u.sockaddr.sa_family : AF_INET;
+        mtu = (AF_INET == family) ? 1500 - 20 - 8 : 1500 - 40 - 8;
+
+        g->mtu_max = ngx_max(g->mtu_max, mtu);
+
+        g->probe = ngx_pcalloc(g->pool, g->mtu_max);
+        if (NULL == g->probe) {
+            goto failed;
+        }
+
+        kcp_group_set_df(g, s, family);
+    }
+
+    /* forward error correction, the kcp mtu leaves room for the header */
+
+    g->fec_data = pcf->kcp_fec_data;
+    g->fec_parity = pcf->kcp_fec_parity;
+    g->fec_overhead = 0;
+    g->fec_shards = NULL;
+    g->fec_recovered = 0;
+
+    if (g->fec_data) {
+        fec_init();
+
+        g->fec_overhead = KCP_FEC_OVERHEAD;
+
+        g->fec_shards = ngx_palloc(g->pool, (g->fec_data + g->fec_parity)
+                                            * sizeof(u_char *));
+        if (NULL == g->fec_shards) {
+            goto failed;
+        }
+
+        ngx_log_error(NGX_LOG_INFO, g->log, 0,
+                      "kcp fec %ui data and %ui parity shards, %s kernel",
+                      g->fec_data, g->fec_parity, fec_kernel_name());
+    }
+
+    /* compression, a message is at most 16 mss, mss is below mtu_max */
+
+    g->zip = KCP_ZIP_OFF;
+    g->zip_sbuf = NULL;
+    g->zip_rbuf = NULL;
+
+#if (NGX_ZLIB)
+    g->zip = pcf->kcp_compress;
+
+    if (g->zip) {
+        g->zip_sbuf_size = (size_t) g->mtu_max << 4;
+        g->zip_rbuf_size = (size_t) g->mtu_max << 4;
+
+        g->zip_sbuf = ngx_palloc(g->pool, g->zip_sbuf_size);
+        g->zip_rbuf = ngx_palloc(g->pool, g->zip_rbuf_size);
+
+        if (NULL == g->zip_sbuf || NULL == g->zip_rbuf) {
+            goto failed;
+        }
+    }
+#endif
+
+    /* datagram batches, one slot per mtu */
+
+    if (kcp_batch_init(g, &g->rxb, pcf->kcp_batch, g->mtu_max) != NGX_OK
+        || kcp_batch_init(g, &g->txb, pcf->kcp_batch, g->mtu_max) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_ERR, g->log, 0,
+                      "alloc kcp datagram batch failed!");
+
+        goto failed;
+    }
+
+    g->rvec = ngx_palloc(g->pool, IKCP_FRG_MAX * sizeof(ikcpvec));
+    if (NULL == g->rvec) {
+        goto failed;
+    }
+
+    g->rbuf = NULL;
+    g->rbuf_size = 0;
+
+    kcp_seg_pool_init(&g->segpool, sizeof(struct IKCPSEG) + g->mtu_max);
+
+    g->cache_ring = pcf->kcp_cache_ring;
+    g->spill_path = (const char *)pcf->kcp_spill_path.data;
+    g->spill_max = pcf->kcp_spill_max;
+
+    g->send_high = pcf->kcp_send_high;
+    g->send_low = pcf->kcp_send_low;
+
+    g->pacing = pcf->kcp_pacing;
+    g->pacing_max = pcf->kcp_pacing_max;
+
+    g->nsyscalls = 0;
+    g->ndgrams = 0;
+    g->ndropped = 0;
+    g->saved_last = 0;
+    g->saved_total = 0;
+
+    g->bytes_in = 0;
+    g->bytes_out = 0;
+    g->dgrams_in = 0;
+    g->dgrams_out = 0;
+    g->syscalls = 0;
+    g->send_errors = 0;
+    g->send_dropped = 0;
+
+    /* bind address for server */
+    
+    if (g->is_server && !shared) {
+        
+        if (bind(s, &g->addr.u.sockaddr, g->addr.socklen) < 0) {
+            
+            ngx_log_error(NGX_LOG_ERR, g->log, ngx_socket_errno,
+                          "bind() to %V failed", &g->addr.name);
+            
+            goto failed;
+        }
+    }
+
+    /* register read event */
+
+    rev = c->read;    
+    wev = c->write;
+    
+    rev->log = g->log;
+    rev->handler = kcp_group_on_event;
+            
+    wev->ready = 1; /* UDP sockets are always ready to write */
+    wev->log = g->log;
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+    c->data = g;
+
+    /*
+     * An exiting worker stops reading the socket it shares with the new
+     * one, see kcp_group_shutdown()
+     */
+
+    c->idle = shared;
+
+    event = (ngx_event_flags & NGX_USE_CLEAR_EVENT) ?
+            NGX_CLEAR_EVENT: /* kqueue, epoll */
+            NGX_LEVEL_EVENT; /* select, poll, /dev/poll */
+
+    if (ngx_add_event(rev, NGX_READ_EVENT, event) != NGX_OK) {
+        goto failed;
+    }
+
+    /* the conv table goes with the pool */
+
+    cln = ngx_pool_cleanup_add(g->pool, 0);
+    if (NULL == cln) {
+        goto failed;
+    }
+
+    cln->handler = kcp_group_cleanup;
+    cln->data = g;
+
+    g->crypt = NULL;
+    g->convs = NULL;
+    g->convs_mask = 0;
+    g->ntunnels = 0;
+
+    if (kcp_conv_resize(g, KCP_CONV_SLOTS_MIN) != NGX_OK) {
+        goto failed;
+    }
+
+    ngx_queue_init(&g->tunnels);
+
+    ngx_rbtree_init(&g->timer_rbtree, &g->timer_sentinel,
+                    ngx_rbtree_insert_timer_value);
+
+    ngx_queue_init(&g->burst);
+
+    if (kcp_group_crypt_init(g, pcf) != NGX_OK) {
+        goto failed;
+    }
+
+    g->status = NULL;
+
+    if (pcf->kcp_status_zone) {
+        kcp_status_attach(g, pcf->kcp_status_zone);
+    }
+
+    return NGX_OK;
+
+failed:
+    ngx_close_connection(c);
+    g->udp_conn = NULL;
+
+    return NGX_ERROR;
+}
+
+kcp_tunnel_t *
+kcp_create_tunnel(kcp_tunnel_group_t *g, IUINT32 conv)
+{    
+    kcp_tunnel_t    *t;
+    kcp_arg_t       *arg;
+
+    if (NULL == g->udp_conn) {
+        return NULL;
+    }
+
+    if (kcp_find_tunnel(g, conv)) {
+        ngx_log_error(NGX_LOG_ERR, g->log, 0,
+                      "kcp tunnel already exist! conv=%uD", conv);
+        return NULL;
+    }
+
+    /* create tunnel */
+
+    t = ngx_pcalloc(g->pool, sizeof(kcp_tunnel_t));
+    if (NULL == t) {
+        return NULL;
+    }
+
+    t->conv  = conv;    
+    t->group = g;
+
+    /* the client proves with it that it's the same when its address moves */
+
+    if (g->is_server) {
+        kcp_path_random(t->path.token);
+        t->path.token_set = 1;
+    }
+
+    t->sndcache = kcp_cache_create(g, kcp_sndbuf_flush);
+
+    if (NULL == t->sndcache) {
+        ngx_log_error(NGX_LOG_ALERT, g->log, 0,
+                      "create cache failed! kcp conv=%uD", t->conv);
+
+        ngx_pfree(g->pool, t);
+
+        return NULL;
+    }
+
+    t->sndcache->data = t;
+
+    /* create kcp */
+    
+    t->kcp = ikcp_create(conv, t);
+    if (NULL == t->kcp) {
+        ngx_log_error(NGX_LOG_ERR, g->log, 0,
+                      "ikcp_create()  failed! conv=%uD", conv);
+        return NULL;
+    }
+
+    t->kcp->output = kcp_output_handler;
+    ikcp_segment_allocator(t->kcp, kcp_seg_alloc, kcp_seg_free);
+
+    arg = &g->karg;
+    ikcp_nodelay(t->kcp, arg->nodelay, arg->interval, arg->resend, arg->nc);
+    ikcp_setmtu(t->kcp, arg->mtu - kcp_wire_overhead(g));
+
+    if (g->fec_data && kcp_fec_create(t) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, g->log, 0,
+                      "alloc fec blocks failed! conv=%uD", conv);
+
+        ikcp_release(t->kcp);
+        alg_cache_destroy(t->sndcache);
+        ngx_pfree(g->pool, t);
+
+        return NULL;
+    }
+
+#if (NGX_ZLIB)
+    if (g->zip && kcp_zip_create(t) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, g->log, 0,
+                      "create compression streams failed! conv=%uD", conv);
+
+        if (t->fec_enc) {
+            ngx_free(t->fec_enc);
+        }
+
+        ikcp_release(t->kcp);
+        alg_cache_destroy(t->sndcache);
+        ngx_pfree(g->pool, t);
+
+        return NULL;
+    }
+#endif
+
+    if (g->adaptive) {
+
+        /* the send window grows with the link, the peer may need all of it */
+
+        ikcp_wndsize(t->kcp, KCP_TUNE_WND_MIN, KCP_TUNE_WND_MAX);
+
+        t->tune.next = ngx_current_msec + KCP_TUNE_PERIOD;
+        t->tune.mtu_lo = arg->mtu;
+        t->tune.mtu_hi = g->mtu_max;
+    }
+
+    /* insert kcp to the conv table */
+
+    if (kcp_conv_insert(g, t) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, g->log, 0,
+                      "grow conv table failed! conv=%uD", conv);
+
+        if (t->fec_enc) {
+            ngx_free(t->fec_enc);
+        }
+
+#if (NGX_ZLIB)
+        if (t->zip) {
+            kcp_zip_destroy(t);
+        }
+#endif
+
+        ikcp_release(t->kcp);
+        alg_cache_destroy(t->sndcache);
+        ngx_pfree(g->pool, t);
+
+        return NULL;
+    }
+
+    ngx_queue_insert_tail(&g->tunnels, &t->queue);
+
+#if (NGX_OPENSSL)
+
+    /* the client keys its tunnel when it gets the token, see below */
+
+    if (g->crypt && g->is_server
+        && kcp_crypt_tunnel_init(g->crypt, &t->crypt_tx, &t->crypt_rx, conv,
+                                 t->path.token, KCP_PATH_TOKEN_SIZE, g->log)
+           != NGX_OK)
+    {
+        kcp_destroy_tunnel(g, t);
+        return NULL;
+    }
+
+#endif
+
+    ngx_log_error(NGX_LOG_INFO, g->log, 0,
+                  "create kcp tunnel! conv=%uD", conv);
+
+    /* a fresh kcp wants its first update right away */
+
+    kcp_group_reset_timer(t);
+
+    return t;
+}
+
+void
+kcp_destroy_tunnel(kcp_tunnel_group_t *g, kcp_tunnel_t *t)
+{
+    kcp_conv_delete(g, t);
+    ngx_queue_remove(&t->queue);
+
+    if (t->timer_set) {
+        ngx_rbtree_delete(&g->timer_rbtree, &t->timer);
+        t->timer_set = 0;
+    }
+
+    if (t->in_burst) {
+        ngx_queue_remove(&t->burst);
+        t->in_burst = 0;
+    }
+    
+    alg_cache_destroy(t->sndcache);
+    
+    if (t->output_cache) {
+        alg_cache_destroy(t->output_cache);
+    }
+
+    if (t->pace.queue) {
+        alg_cache_destroy(t->pace.queue);
+    }
+
+    ikcp_release(t->kcp);
+
+    if (t->fec_enc) {
+        ngx_free(t->fec_enc);
+    }
+
+#if (NGX_ZLIB)
+    if (t->zip) {
+        kcp_zip_destroy(t);
+    }
+#endif
+
+#if (NGX_OPENSSL)
+    kcp_crypt_tunnel_cleanup(&t->crypt_tx, &t->crypt_rx);
+#endif
+    
+    ngx_pfree(g->pool, t);
+}
+
+kcp_tunnel_t *
+kcp_find_tunnel(kcp_tunnel_group_t *g, IUINT32 conv)
+{
+    kcp_conv_slot_t  *slot;
+    ngx_uint_t        i;
+
+    /* the conv is in the slot, a miss doesn't touch the tunnel */
+
+    for (i = kcp_conv_hash(conv, g->convs_mask);
+         (slot = &g->convs[i])->tunnel;
+         i = (i + 1) & g->convs_mask)
+    {
+        if (slot->conv == conv) {
+            return slot->tunnel;
+        }
+    }
+
+    return NULL;
+}
+
+IUINT32
+kcp_group_new_conv(kcp_tunnel_group_t *g)
+{
+    ngx_uint_t  span, seq, key;
+    IUINT32     conv;
+
+    /* a conv whose steering key lands on this worker's socket */
+
+    span = 0x10000 / g->nworkers;
+
+    for (;;) {
+        seq = g->conv_seq++;
+
+        key = g->worker + g->nworkers * (seq % span);
+        conv = (IUINT32)(((seq / span + 1) & 0xffff) << 16)
+               | (IUINT32)kcp_conv_steer_key(key);
+
+        if (conv != 0 && NULL == kcp_find_tunnel(g, conv)) {
+            return conv;
+        }
+    }
+}
+
+/*
+ * The conv table is an array of (conv, tunnel) slots, linear probing
+ * from the hash of the conv.  A lookup walks a run of adjacent slots,
+ * usually one cache line, where the rbtree took a miss per level.  The
+ * table doubles when it gets half full, deleting shifts the rest of
+ * the run back so that there are no tombstones.
+ */
+
+static ngx_int_t
+kcp_conv_resize(kcp_tunnel_group_t *g, ngx_uint_t nslots)
+{
+    kcp_conv_slot_t  *old, *slot;
+    ngx_uint_t        i, j, n, mask;
+
+    slot = ngx_calloc(nslots * sizeof(kcp_conv_slot_t), g->log);
+    if (NULL == slot) {
+        return NGX_ERROR;
+    }
+
+    old = g->convs;
+    n = old ? g->convs_mask + 1 : 0;
+    mask = nslots - 1;
+
+    for (i = 0; i < n; i++) {
+        if (NULL == old[i].tunnel) {
+            continue;
+        }
+
+        for (j = kcp_conv_hash(old[i].conv, mask);
+             slot[j].tunnel;
+             j = (j + 1) & mask)
+        {
+            /* void */
+        }
+
+        slot[j] = old[i];
+    }
+
+    if (old) {
+        ngx_free(old);
+    }
+
+    g->convs = slot;
+    g->convs_mask = mask;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+kcp_conv_insert(kcp_tunnel_group_t *g, kcp_tunnel_t *t)
+{
+    kcp_conv_slot_t  *slot;
+    ngx_uint_t        i;
+
+    if ((g->ntunnels + 1) * 2 > g->convs_mask + 1
+        && kcp_conv_resize(g, (g->convs_mask + 1) * 2) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    for (i = kcp_conv_hash(t->conv, g->convs_mask);
+         g->convs[i].tunnel;
+         i = (i + 1) & g->convs_mask)
+    {
+        /* void */
+    }
+
+    slot = &g->convs[i];
+    slot->conv = t->conv;
+    slot->tunnel = t;
+
+    g->ntunnels++;
+
     return NGX_OK;
+}
 
-failed:
-    ngx_close_connection(c);
-    g->udp_conn = NULL;
+static void
+kcp_conv_delete(kcp_tunnel_group_t *g, kcp_tunnel_t *t)
+{
+    kcp_conv_slot_t  *s;
+    ngx_uint_t        i, j, home, mask;
 
-    return NGX_ERROR;
+    s = g->convs;
+    mask = g->convs_mask;
+
+    for (i = kcp_conv_hash(t->conv, mask);
+         s[i].tunnel != t;
+         i = (i + 1) & mask)
+    {
+        if (NULL == s[i].tunnel) {
+            return;
+        }
+    }
+
+    /* a later slot of the run moves into the hole unless it'd pass home */
+
+    for (j = (i + 1) & mask; s[j].tunnel; j = (j + 1) & mask) {
+        home = kcp_conv_hash(s[j].conv, mask);
+
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            s[i] = s[j];
+            i = j;
+        }
+    }
+
+    s[i].tunnel = NULL;
+
+    g->ntunnels--;
 }
 
-kcp_tunnel_t *
-kcp_create_tunnel(kcp_tunnel_group_t *g, IUINT32 conv)
-{    
-    kcp_tunnel_t    *t;
-    kcp_arg_t       *arg;
+static void
+kcp_group_cleanup(void *data)
+{
+    kcp_tunnel_group_t  *g = data;
 
-    if (kcp_find_tunnel(g, conv)) {
-        ngx_log_error(NGX_LOG_ERR, g->log, 0,
-                      "kcp tunnel already exist! conv=%u", conv);
-        return NULL;
+    if (g->convs) {
+        ngx_free(g->convs);
+        g->convs = NULL;
     }
 
-    /* create tunnel */
+#if (NGX_OPENSSL)
+    if (g->crypt) {
+        OPENSSL_cleanse(g->crypt->key, sizeof(g->crypt->key));
+        g->crypt = NULL;
+    }
+#endif
+}
 
-    t = ngx_pcalloc(g->pool, sizeof(kcp_tunnel_t));
-    if (NULL == t) {
-        return NULL;
+/* the group keeps the key, each tunnel derives its own from it */
+
+static ngx_int_t
+kcp_group_crypt_init(kcp_tunnel_group_t *g, ngx_pmap_conf_t *pcf)
+{
+#if (NGX_OPENSSL)
+    kcp_crypt_t  *c;
+#endif
+
+    g->crypt_overhead = 0;
+    g->crypt_buf = NULL;
+
+    if (NGX_ERROR == pcf->kcp_crypt) {
+        return NGX_OK;
     }
 
-    t->conv  = conv;    
-    t->group = g;
+#if (NGX_OPENSSL)
 
-    t->sndcache = alg_cache_create(kcp_sndbuf_flush,
-                                   ngx_pmap_cache_alloc,
-                                   ngx_pmap_cache_dealloc,
-                                   g->pool);
+    c = ngx_pcalloc(g->pool, sizeof(kcp_crypt_t));
+    if (NULL == c) {
+        return NGX_ERROR;
+    }
 
-    if (NULL == t->sndcache) {
-        ngx_log_error(NGX_LOG_ALERT, g->log, 0,
-                      "create cache failed! kcp conv=%u", t->conv);
+    c->is_server = g->is_server;
 
-        ngx_pfree(g->pool, t);
+    if (kcp_crypt_init(c, pcf->kcp_crypt, &pcf->kcp_crypt_key, g->log)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    g->crypt = c;
+
+    g->crypt_buf = ngx_palloc(g->pool, KCP_CRYPT_BUF_SIZE);
+    if (NULL == g->crypt_buf) {
+        return NGX_ERROR;
+    }
 
+    g->crypt_overhead = KCP_CRYPT_OVERHEAD;
+
+#endif
+
+    return NGX_OK;
+}
+
+/*
+ * The sockets of the old cycle are taken over in their order, they keep
+ * their places in the reuseport group, and the exiting workers have them
+ * too.  Fresh sockets would join after them, and conv % n would steer the
+ * new tunnels to the old workers until those exit and the kernel moves the
+ * last sockets of the group into the freed places.
+ */
+
+ngx_array_t *
+kcp_open_reuseport_sockets(ngx_cycle_t *cycle, ngx_pmap_addr_t *addr,
+    ngx_uint_t n, ngx_array_t *old)
+{
+    ngx_array_t         *a;
+    ngx_socket_t        *s, *os;
+    ngx_uint_t           i, nold;
+    int                  reuseport;
+#if (NGX_HAVE_REUSEPORT_CBPF)
+    struct sock_fprog    prog;
+    struct sock_filter   code[] = {
+        /* A = first two bytes of the datagram, the low half of conv */
+        { BPF_LD  | BPF_H   | BPF_ABS, 0, 0, 0 },
+        /* A = A % n */
+        { BPF_ALU | BPF_MOD | BPF_K,   0, 0, (uint32_t) n },
+        /* return A, the index of the socket in the group */
+        { BPF_RET | BPF_A,             0, 0, 0 },
+    };
+#endif
+
+#if !(NGX_HAVE_REUSEPORT_CBPF)
+
+    if (n > 1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "kcp datagrams can't be steered by conv "
+                      "on this platform, use one worker process");
         return NULL;
     }
 
-    t->sndcache->data = t;
+#endif
 
-    /* create kcp */
-    
-    t->kcp = ikcp_create(conv, t);
-    if (NULL == t->kcp) {
-        ngx_log_error(NGX_LOG_ERR, g->log, 0,
-                      "ikcp_create()  failed! conv=%u", conv);
+    a = ngx_array_create(cycle->pool, n, sizeof(ngx_socket_t));
+    if (NULL == a) {
         return NULL;
     }
 
-    t->kcp->output = kcp_output_handler;
+    os = old ? old->elts : NULL;
+    nold = old ? ngx_min(old->nelts, n) : 0;
 
-    arg = &g->karg;
-    ikcp_nodelay(t->kcp, arg->nodelay, arg->interval, arg->resend, arg->nc);
-    ikcp_setmtu(t->kcp, arg->mtu);    
+    /* the sockets join the reuseport group in worker order */
 
-    /* insert kcp to the rbtree */
-    
-    ngx_log_error(NGX_LOG_INFO, g->log, 0,
-                  "create kcp tunnel! conv=%u", conv);
-    ngx_rbtree_insert(&g->rbtree, &t->node);
+    for (i = 0; i < n; i++) {
+        s = ngx_array_push(a);
+        if (NULL == s) {
+            goto failed;
+        }
 
-    return t;
-}
+        if (i < nold) {
+
+            /* the old cycle does not close it then */
+
+            *s = os[i];
+            os[i] = (ngx_socket_t) -1;
+            continue;
+        }
+
+        *s = ngx_socket(addr->u.sockaddr.sa_family, SOCK_DGRAM, 0);
+
+        if ((ngx_socket_t)-1 == *s) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+                          ngx_socket_n " failed");
+            goto failed;
+        }
+
+#if (NGX_HAVE_REUSEPORT)
+
+        reuseport = 1;
+
+        if (setsockopt(*s, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *) &reuseport, sizeof(int))
+            == -1)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+                          "setsockopt(SO_REUSEPORT) failed");
+            goto failed;
+        }
+
+#endif
+
+        if (bind(*s, &addr->u.sockaddr, addr->socklen) == -1) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+                          "bind() to %V failed", &addr->name);
+            goto failed;
+        }
 
-void
-kcp_destroy_tunnel(kcp_tunnel_group_t *g, kcp_tunnel_t *t)
-{
-    ngx_rbtree_delete(&g->rbtree, &t->node);
-    
-    alg_cache_destroy(t->sndcache);
-    
-    if (t->output_cache) {
-        alg_cache_destroy(t->output_cache);
     }
 
-    ikcp_release(t->kcp);
-    
-    ngx_pfree(g->pool, t);
-}
+#if (NGX_HAVE_REUSEPORT_CBPF)
 
-kcp_tunnel_t *
-kcp_find_tunnel(kcp_tunnel_group_t *g, IUINT32 conv)
-{
-    ngx_rbtree_node_t  *node, *sentinel;
+    /*
+     * The program is the group's, attached again on every cycle, the
+     * number of workers may have changed.  The tunnels of a worker are
+     * unreachable without it.
+     */
 
-    node = g->rbtree.root;
-    sentinel = &g->sentinel;
+    if (n > 1) {
+        s = a->elts;
 
-    while (node != sentinel && node->key != conv) {
-        node = conv < node->key ? node->left : node->right;
+        prog.len = sizeof(code) / sizeof(code[0]);
+        prog.filter = code;
+
+        if (setsockopt(s[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                       &prog, sizeof(struct sock_fprog))
+            == -1)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+                          "setsockopt(SO_ATTACH_REUSEPORT_CBPF) failed");
+            goto failed;
+        }
     }
 
-    if (node != sentinel)
-        return (kcp_tunnel_t *)node;
+#endif
+
+    return a;
+
+failed:
+
+    /* the old cycle goes on, it gets back what was taken */
+
+    s = a->elts;
+
+    for (i = 0; i < a->nelts; i++) {
+        if (i < nold) {
+            os[i] = s[i];
+
+        } else if (s[i] != (ngx_socket_t)-1) {
+            (void) ngx_close_socket(s[i]);
+        }
+    }
 
     return NULL;
 }
@@ -443,15 +3184,23 @@ kcp_group_on_event(ngx_event_t *ev)
 {
     kcp_tunnel_group_t *g;
     kcp_tunnel_t       *t;
+    kcp_batch_t        *b;
     ngx_connection_t   *c;
-    ngx_pmap_addr_t     addr;
-    char               *buf;
-    int                 maxlen, n;
-    ngx_err_t           err;
+    u_char             *buf;
+    size_t              size;
+    ngx_int_t           i, n;
     IUINT32             conv;
+#if (NGX_OPENSSL)
+    u_char              nonce[KCP_CRYPT_NONCE_SIZE];
+#endif
 
     c = ev->data;
     g = c->data;
+
+    if (c->close) {
+        kcp_group_shutdown(g);
+        return;
+    }
     
     if (ev->timedout) {
         kcp_group_update(g);
@@ -459,121 +3208,345 @@ kcp_group_on_event(ngx_event_t *ev)
         return;
     }
     
-    /* recv data from internet */
+    /* recv data from internet, a batch of datagrams per syscall */
     
-    maxlen = g->karg.mtu;
-    
-    buf = (char *)ngx_palloc(g->pool, maxlen);
-    if (NULL == buf) {
-        ngx_log_error(NGX_LOG_ERR, g->log, 0, "malloc buf failed when recv!");
-        return;
-    }
+    b = &g->rxb;
 
     for (;;) {
-        addr.socklen = sizeof(addr.u);
-        n = recvfrom(g->udp_conn->fd, buf, maxlen, 0, &addr.u.sockaddr, &addr.socklen);
-        err = ngx_socket_errno;
+        n = kcp_batch_recv(g);
 
-        if (-1 == n) {
-            if (NGX_EINTR == err) {
-                continue;
-            } else {
-                ngx_connection_error(c, err, "recv() failed");
-            }
-            
+        if (n <= 0) { /* drained or error */
             break;
         }
 
-        /* input into kcp and update */        
+        for (i = 0; i < n; i++) {
+            buf = b->bufs + i * b->size;
+            size = b->lens[i];
+
+            g->bytes_in += size;
+
+            /* only input here, see kcp_group_end_burst() */
+
+            conv = 0;
+            if (!ikcp_get_conv((const char *)buf, size, &conv)) {
+                continue;
+            }
+
+            t = kcp_find_tunnel(g, conv);
+
+#if (NGX_OPENSSL)
+
+            /* the key is the tunnel's, nothing opens without one */
+
+            if (g->crypt) {
+                if (NULL == t) {
+                    g->crypt->failed++;
+                    continue;
+                }
 
-        conv = 0;
-        ikcp_get_conv(buf, n, &conv);
+                if (kcp_crypt_open(g->crypt, &t->crypt_rx, &buf, &size, nonce)
+                    != NGX_OK
+                    || !ikcp_get_conv((const char *)buf, size, &conv))
+                {
+                    continue;
+                }
 
-        t = kcp_find_tunnel(g, conv);
+                if (kcp_crypt_replay(&t->crypt_rx, nonce) != NGX_OK) {
+                    t->stat.replayed++;
+                    continue;
+                }
+            }
+#endif
+
+            if (t) {
+                t->stat.dgrams_in++;
+                t->stat.bytes_in += b->lens[i];
+            }
+
+            if (t && size >= KCP_HDR_SIZE
+                && (kcp_cmd(buf) == KCP_CMD_PROBE
+                    || kcp_cmd(buf) == KCP_CMD_PROBE_ACK))
+            {
+                kcp_pmtu_input(t, buf, size, &b->addrs[i]);
+                continue;
+            }
+
+            if (t && (kcp_cmd(buf) == KCP_CMD_PATH_CHALLENGE
+                      || kcp_cmd(buf) == KCP_CMD_PATH_RESPONSE))
+            {
+                kcp_path_input(t, buf, size, &b->addrs[i]);
+                continue;
+            }
             
-        if (t) {            
-            kcp_input(t, buf, n);
+            if (t) {            
+                if (kcp_cmd(buf) == KCP_CMD_FEC_DATA
+                    || kcp_cmd(buf) == KCP_CMD_FEC_PARITY)
+                {
+                    kcp_fec_input(t, buf, size);
+
+                } else {
+                    kcp_input(t, buf, size);
+                }
             
-            if (g->is_server && !t->addr_settled) {
-                t->addr_settled = 1;
-                t->addr = addr;
+                if (g->is_server) {
+                    if (!t->addr_settled) {
+                        t->addr_settled = 1;
+                        t->addr = b->addrs[i];
+
+                    } else {
+                        kcp_path_check(t, &b->addrs[i]);
+                    }
+                }
+
+                if (!t->in_burst) {
+                    ngx_queue_insert_tail(&g->burst, &t->burst);
+                    t->in_burst = 1;
+                }
             }
+        }
 
-            kcp_update(t, ngx_current_msec);
-
-            kcp_group_reset_timer(t);
+        if (n < (ngx_int_t)b->nalloc) {
+            break;
         }
     }
-    
-    ngx_pfree(g->pool, buf);    
+
+    kcp_group_end_burst(g);
+
+    kcp_group_arm_timer(g);
+    kcp_batch_flush(g);
+    kcp_group_end_tick(g);
 
     return;
 }
 
+/*
+ * Each tunnel the burst touched is updated once, instead of once per
+ * datagram.  The acks are sent now only as far as they fill whole
+ * packets, the rest goes out with the data on the next ikcp_flush().
+ */
+
+static void
+kcp_group_end_burst(kcp_tunnel_group_t *g)
+{
+    ngx_queue_t   *q;
+    kcp_tunnel_t  *t;
+
+    while (!ngx_queue_empty(&g->burst)) {
+        q = ngx_queue_head(&g->burst);
+        t = ngx_queue_data(q, kcp_tunnel_t, burst);
+
+        ngx_queue_remove(q);
+        t->in_burst = 0;
+
+        ikcp_flush_ack(t->kcp);
+
+        kcp_update(t, ngx_current_msec);
+    }
+}
+
+/* DF on, and the kernel sends probes larger than the path mtu it knows */
+
+static void
+kcp_group_set_df(kcp_tunnel_group_t *g, ngx_socket_t s, int family)
+{
+#if (NGX_HAVE_IP_MTU_DISCOVER || NGX_HAVE_IPV6_MTU_DISCOVER)
+    int  val;
+#endif
+
+#if (NGX_HAVE_IPV6_MTU_DISCOVER)
+    if (AF_INET6 == family) {
+        val = IPV6_PMTUDISC_PROBE;
+
+        if (setsockopt(s, IPPROTO_IPV6, IPV6_MTU_DISCOVER,
+                       (const void *) &val, sizeof(int)) == -1)
+        {
+            ngx_log_error(NGX_LOG_WARN, g->log, ngx_socket_errno,
+                          "setsockopt(IPV6_MTU_DISCOVER) failed, "
+                          "probes may be fragmented");
+        }
+
+        return;
+    }
+#endif
+
+#if (NGX_HAVE_IP_MTU_DISCOVER)
+    val = IP_PMTUDISC_PROBE;
+
+    if (setsockopt(s, IPPROTO_IP, IP_MTU_DISCOVER,
+                   (const void *) &val, sizeof(int)) == -1)
+    {
+        ngx_log_error(NGX_LOG_WARN, g->log, ngx_socket_errno,
+                      "setsockopt(IP_MTU_DISCOVER) failed, "
+                      "probes may be fragmented");
+    }
+#else
+    ngx_log_error(NGX_LOG_WARN, g->log, 0,
+                  "DF can not be set on this platform, "
+                  "kcp mtu probes may be fragmented");
+#endif
+}
+
+static void
+kcp_group_end_tick(kcp_tunnel_group_t *g)
+{
+    g->saved_last = g->ndgrams > g->nsyscalls ? g->ndgrams - g->nsyscalls : 0;
+    g->saved_total += g->saved_last;
+    g->syscalls += g->nsyscalls;
+
+    if (g->ndropped) {
+        ngx_log_error(NGX_LOG_INFO, g->log, 0,
+                      "kcp group dropped %ui datagrams, "
+                      "socket send buffer is full", g->ndropped);
+
+        g->send_dropped += g->ndropped;
+        g->ndropped = 0;
+    }
+
+    ngx_log_debug5(NGX_LOG_DEBUG_EVENT, g->log, 0,
+                   "kcp group tick: %ui datagrams, %ui syscalls, %ui saved, "
+                   "segment pool hits:%ui misses:%ui",
+                   g->ndgrams, g->nsyscalls, g->saved_last,
+                   g->segpool.hits, g->segpool.misses);
+
+    g->ndgrams = 0;
+    g->nsyscalls = 0;
+}
+
 static void
 kcp_group_reset_timer(kcp_tunnel_t *t)
 {
-    kcp_tunnel_group_t *g;
-    ngx_event_t        *ev;
-    ngx_msec_t          nxt_call_time, interval;
+    kcp_group_schedule(t, ngx_current_msec);
+    kcp_group_arm_timer(t->group);
+}
 
-    nxt_call_time = ikcp_check(t->kcp, ngx_current_msec);
-    interval = nxt_call_time-ngx_current_msec;
-    if (0 == interval)
-        interval = 1;
+static void
+kcp_group_schedule(kcp_tunnel_t *t, ngx_msec_t curtime)
+{
+    kcp_tunnel_group_t *g;
+    ngx_msec_t          key, next;
 
     g = t->group;
-    ev = g->udp_conn->read;
-    
-    if (interval < g->timer) {
-        if (ev->timer_set) {
-            ngx_del_timer(ev);
+
+    key = ikcp_check(t->kcp, curtime);
+
+    if (t->pace.queue && !alg_cache_empty(t->pace.queue)) {
+        next = kcp_pace_next(t, curtime);
+
+        if ((ngx_msec_int_t)(next - key) < 0) {
+            key = next;
+        }
+    }
+
+    if (t->failed || (ngx_msec_int_t)(key - curtime) <= 0) {
+        key = curtime + 1;
+    }
+
+    if (t->timer_set) {
+        if (t->timer.key == key) {
+            return;
         }
 
-        g->timer = interval;
-        ngx_add_timer(ev, g->timer);
+        ngx_rbtree_delete(&g->timer_rbtree, &t->timer);
     }
+
+    t->timer.key = key;
+    ngx_rbtree_insert(&g->timer_rbtree, &t->timer);
+    t->timer_set = 1;
 }
 
 static void
-kcp_group_update(kcp_tunnel_group_t *g)
+kcp_group_arm_timer(kcp_tunnel_group_t *g)
 {
-    ngx_rbtree_node_t  *root, *node, *sentinel, *s[KCP_STACK_SIZE];
+    ngx_rbtree_node_t  *node, *root, *sentinel;
     ngx_event_t        *ev;
-    kcp_tunnel_t       *t;
-    ngx_int_t           top;
-    ngx_msec_t          maxwait, interval;
+    ngx_msec_int_t      timer;
 
-    root = g->rbtree.root;
-    sentinel = &g->sentinel;
-    
     ev = g->udp_conn->read;
+    root = g->timer_rbtree.root;
+    sentinel = g->timer_rbtree.sentinel;
 
     if (root == sentinel) {
+        if (ev->timer_set) {
+            ngx_del_timer(ev);
+        }
+
         return;
     }
 
-    maxwait = (ngx_uint_t)-1;
-    s[top=1] = root;    
-    while (top > 0) {
-        node = s[top--];
-        t = (kcp_tunnel_t *)node;
+    node = ngx_rbtree_min(root, sentinel);
 
-        interval = kcp_update(t, ngx_current_msec);
-        if (interval < maxwait)
-            maxwait = interval;
+    /* ngx_add_timer() is lazy, so re-arm only when the deadline moved */
 
-        if (node->right != sentinel && top < KCP_STACK_SIZE-1) {
-            s[++top] = node->right;
-        }
-        if (node->left != sentinel && top < KCP_STACK_SIZE-1) {
-            s[++top] = node->left;
-        }
+    if (ev->timer_set && ev->timer.key == node->key) {
+        return;
+    }
+
+    timer = (ngx_msec_int_t)(node->key - ngx_current_msec);
+    if (timer <= 0) {
+        timer = 1;
+    }
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    ngx_add_timer(ev, (ngx_msec_t)timer);
+}
+
+/*
+ * The worker is exiting.  The new worker of the same index reads the
+ * socket too, so the tunnels are closed, their clients come back through
+ * the new worker, and the socket is left to it.
+ */
+
+static void
+kcp_group_shutdown(kcp_tunnel_group_t *g)
+{
+    ngx_queue_t   *q;
+    kcp_tunnel_t  *t;
+
+    ngx_log_error(NGX_LOG_INFO, g->log, 0,
+                  "kcp group closes %ui tunnels, the worker is exiting",
+                  g->ntunnels);
+
+    while (!ngx_queue_empty(&g->tunnels)) {
+        q = ngx_queue_head(&g->tunnels);
+        t = ngx_queue_data(q, kcp_tunnel_t, queue);
+
+        kcp_tunnel_close(t);
     }
 
-    g->timer = (ngx_uint_t)-1;
-    if (maxwait != (ngx_uint_t)-1) {
-        g->timer = maxwait != 0 ? maxwait : 1;
-        ngx_add_timer(ev, g->timer);
+    kcp_batch_flush(g);
+
+    ngx_close_connection(g->udp_conn);
+    g->udp_conn = NULL;
+}
+
+static void
+kcp_group_update(kcp_tunnel_group_t *g)
+{
+    ngx_rbtree_node_t  *node, *sentinel;
+    kcp_tunnel_t       *t;
+    ngx_msec_t          now;
+
+    sentinel = g->timer_rbtree.sentinel;
+    now = ngx_current_msec;
+
+    /* only touch the tunnels that are due, earliest first */
+
+    while (g->timer_rbtree.root != sentinel) {
+        node = ngx_rbtree_min(g->timer_rbtree.root, sentinel);
+
+        if ((ngx_msec_int_t)(node->key - now) > 0) {
+            break;
+        }
+
+        t = kcp_timer_tunnel(node);
+
+        kcp_update(t, now);
     }
+
+    kcp_group_arm_timer(g);
+    kcp_batch_flush(g);
+    kcp_group_end_tick(g);
 }
@@ -4,10 +4,17 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_rbtree.h>
+#include <ngx_event.h>
 
 #include "alg_cache.h"
 #include "ngx_pmap.h"
 #include "ikcp.h"
+#include "fec.h"
+#include "kcp_crypt.h"
+
+#if (NGX_ZLIB)
+#include <zlib.h>
+#endif
 
 #ifndef True
 # define True  1
@@ -18,6 +25,15 @@
 
 
 typedef struct kcp_arg_s            kcp_arg_t;
+typedef struct kcp_batch_s          kcp_batch_t;
+typedef struct kcp_seg_pool_s       kcp_seg_pool_t;
+typedef struct kcp_tune_s           kcp_tune_t;
+typedef struct kcp_path_s           kcp_path_t;
+typedef struct kcp_pace_s           kcp_pace_t;
+typedef struct kcp_fec_block_s      kcp_fec_block_t;
+typedef struct kcp_zip_s            kcp_zip_t;
+typedef struct kcp_conv_slot_s      kcp_conv_slot_t;
+typedef struct kcp_tunnel_stat_s    kcp_tunnel_stat_t;
 typedef struct kcp_tunnel_s         kcp_tunnel_t;
 typedef struct kcp_tunnel_group_s   kcp_tunnel_group_t;
 
@@ -33,9 +49,148 @@ struct kcp_arg_s
 };
 
 
+/* datagram batch for recvmmsg()/sendmmsg() */
+struct kcp_batch_s {
+    ngx_uint_t              n;      /* datagrams in the batch */
+    ngx_uint_t              nalloc;
+    size_t                  size;   /* size of each slot */
+
+    u_char                 *bufs;
+    ngx_pmap_addr_t        *addrs;
+    size_t                 *lens;
+
+#if (NGX_HAVE_MMSG)
+    struct mmsghdr         *msgs;
+    struct iovec           *iovs;
+#endif
+};
+
+
+#define KCP_SEG_CLASSES     6
+
+/* freelists of kcp segments by size class, the last class fits an mtu */
+struct kcp_seg_pool_s {
+    ngx_uint_t              nclasses;
+    size_t                  size[KCP_SEG_CLASSES];
+    void                   *free[KCP_SEG_CLASSES];
+    ngx_uint_t              nfree[KCP_SEG_CLASSES];
+    ngx_uint_t              max_free;   /* per class */
+
+    ngx_uint_t              hits;
+    ngx_uint_t              misses;
+};
+
+
+/* adaptive mode: what the last period measured, and the path mtu search */
+struct kcp_tune_s {
+    ngx_msec_t              next;       /* next tuning */
+    IUINT32                 last_una;
+    IUINT32                 last_xmit;
+    ngx_uint_t              loss;       /* retransmitted in last period, % */
+
+    IUINT32                 mtu_lo;     /* confirmed */
+    IUINT32                 mtu_hi;     /* not known to fail */
+    IUINT32                 probe;      /* size in flight, 0 for none */
+    ngx_uint_t              probe_tries;
+    ngx_msec_t              search;     /* next search once converged */
+};
+
+
+#define KCP_PATH_TOKEN_SIZE 8
+
+/*
+ * Server: the peer address a tunnel may move to, once the client proves
+ * it is there with the token of the handshake, see kcp_path_check().
+ */
+struct kcp_path_s {
+    u_char                  token[KCP_PATH_TOKEN_SIZE];
+    u_char                  nonce[KCP_PATH_TOKEN_SIZE];
+    ngx_pmap_addr_t         addr;       /* being validated */
+    ngx_msec_t              sent;       /* last challenge */
+    ngx_msec_t              moved;      /* last migration */
+    unsigned                token_set:1;
+    unsigned                validating:1;
+};
+
+
+/*
+ * Pacing: a token bucket of the bytes kcp may send, filled at rate.
+ * Datagrams that find it short wait in queue for the group timer.
+ */
+struct kcp_pace_s {
+    uint64_t                rate;       /* bytes/s, 0 until there's an rtt */
+    size_t                  tokens;
+    ngx_msec_t              last;       /* filled up to */
+    IUINT32                 rtt_min;    /* least srtt since rtt_stamp */
+    ngx_msec_t              rtt_stamp;
+    alg_cache_t            *queue;      /* NULL until one had to wait */
+};
+
+
+/*
+ * A block of fec shards, the one being encoded or one being received.
+ * A slot is a datagram: the fec header, and the shard the code is
+ * computed over, see kcp_fec_output().
+ */
+struct kcp_fec_block_s {
+    IUINT32                 seq;
+    ngx_uint_t              ndata;      /* data shards, 0 if not known yet */
+    ngx_uint_t              ndata_have;
+    ngx_uint_t              nparity_have;
+    size_t                  len;        /* shard length, 0 if not known yet */
+    u_char                 *have;       /* by shard, data then parity */
+    u_char                 *slots;      /* by shard, mtu_max each */
+    unsigned                used:1;
+    unsigned                done:1;     /* nothing left to rebuild */
+};
+
+
+/* counters of a tunnel, those of kcp itself are in the ikcpcb */
+struct kcp_tunnel_stat_s {
+    uint64_t                bytes_in;       /* datagrams, as on the wire */
+    uint64_t                bytes_out;
+    ngx_uint_t              dgrams_in;
+    ngx_uint_t              dgrams_out;
+    ngx_uint_t              send_errors;    /* refused by kcp_send() or
+                                               the socket */
+    uint64_t                zip_in;         /* sent through deflate */
+    uint64_t                zip_out;
+    ngx_uint_t              zip_bypassed;   /* messages sent as they are */
+    ngx_uint_t              replayed;       /* authentic, but seen before */
+    ngx_uint_t              send_paused;    /* times past the high water */
+    ngx_uint_t              migrations;     /* validated address changes */
+    ngx_uint_t              paced;          /* datagrams that had to wait */
+};
+
+
+/* "kcp_compress", on and auto frame the messages the same way */
+#define KCP_ZIP_OFF         0
+#define KCP_ZIP_ON          1
+#define KCP_ZIP_AUTO        2   /* when the tunnel waits for the link */
+
+/* a stream each way, a message is one deflate flush of the send one */
+struct kcp_zip_s {
+#if (NGX_ZLIB)
+    z_stream                deflate;
+    z_stream                inflate;
+#endif
+    ngx_uint_t              skip;       /* messages to send as they are */
+    ngx_uint_t              backoff;    /* skip after the next bad one */
+};
+
+
+/* a slot of the conv table, tunnel is NULL if it's free */
+struct kcp_conv_slot_s {
+    IUINT32                 conv;
+    kcp_tunnel_t           *tunnel;
+};
+
+
 /* kcp tunnel */
 struct kcp_tunnel_s {
-    ngx_rbtree_node_t       node;
+    ngx_queue_t             queue;  /* in group->tunnels */
+    ngx_rbtree_node_t       timer;  /* keyed by next ikcp_check() time */
+    ngx_queue_t             burst;  /* in group->burst */
 
     void                   *data;
     
@@ -46,14 +201,45 @@ struct kcp_tunnel_s {
 
     void                  (*recv_handler)(kcp_tunnel_t *, const void *, size_t);
 
+    /* if set, gets messages as the fragment list, without reassembly */
+    void                  (*recvv_handler)(kcp_tunnel_t *, const ikcpvec *,
+                                           int, size_t);
+
+    /*
+     * If set, told to stop reading what it sends when the send cache holds
+     * more than the group's send_high, and to go on below send_low.
+     */
+    void                  (*pressure_handler)(kcp_tunnel_t *, ngx_uint_t);
+
+    /* if set, told the tunnel can't go on, it destroys the tunnel then */
+    void                  (*close_handler)(kcp_tunnel_t *);
+
     ngx_int_t               sent_count;
     ngx_int_t               recv_count;
 
+    kcp_tunnel_stat_t       stat;
+
     alg_cache_t            *sndcache;
 
+    unsigned                timer_set:1;
+    unsigned                in_burst:1;
     unsigned                addr_settled:1;
+    unsigned                paused:1;   /* past the high water */
+    unsigned                failed:1;   /* closed on its next update */
     ngx_pmap_addr_t         addr; /* peer addr */
     alg_cache_t            *output_cache;
+
+    kcp_tune_t              tune;
+    kcp_path_t              path;
+    kcp_pace_t              pace;
+
+    kcp_fec_block_t        *fec_enc;
+    kcp_fec_block_t        *fec_dec;    /* KCP_FEC_BLOCKS, by seq */
+
+    kcp_zip_t              *zip;        /* NULL without compression */
+
+    kcp_crypt_tx_t          crypt_tx;
+    kcp_crypt_rx_t          crypt_rx;
 };
 
 
@@ -64,24 +250,147 @@ struct kcp_tunnel_group_s {
     ngx_log_t              *log;
 
     unsigned                is_server:1;
+    unsigned                adaptive:1;
 
     ngx_pmap_addr_t         addr;
     ngx_connection_t       *udp_conn;
 
-    ngx_msec_t              timer;
+    /* batched UDP I/O */
+    kcp_batch_t             rxb;
+    kcp_batch_t             txb;
+
+    kcp_seg_pool_t          segpool;
+
+    size_t                  cache_ring;     /* ring size of tunnel caches */
+    const char             *spill_path;
+    size_t                  spill_max;
 
-    /* rbtree to strore kcp tunnel */
-    ngx_rbtree_t            rbtree;
-    ngx_rbtree_node_t       sentinel;
+    /* send cache watermarks of a tunnel, send_high is 0 for none */
+    size_t                  send_high;
+    size_t                  send_low;
+
+    /* pacing of what kcp sends, pacing_max is 0 for no cap, bytes/s */
+    ngx_uint_t              pacing;
+    size_t                  pacing_max;
+
+    /* receive path, shared by all tunnels of the group */
+    ikcpvec                *rvec;           /* IKCP_FRG_MAX fragments */
+    u_char                 *rbuf;           /* reassembly for recv_handler */
+    size_t                  rbuf_size;
+
+    ngx_uint_t              nsyscalls;      /* issued in current tick */
+    ngx_uint_t              ndgrams;        /* transferred in current tick */
+    ngx_uint_t              ndropped;       /* on a full socket buffer */
+    ngx_uint_t              saved_last;     /* syscalls saved, last tick */
+    ngx_uint_t              saved_total;
+
+    /* totals, for the status zone */
+    uint64_t                bytes_in;
+    uint64_t                bytes_out;
+    ngx_uint_t              dgrams_in;
+    ngx_uint_t              dgrams_out;
+    ngx_uint_t              syscalls;
+    ngx_uint_t              send_errors;    /* datagrams the socket refused */
+    ngx_uint_t              send_dropped;   /* with the socket buffer full */
+
+    /* this worker's part of the status zone, NULL without one */
+    struct kcp_status_worker_s  *status;
+    ngx_event_t             status_event;
+
+    /* tunnels by conv, open addressing with linear probing */
+    kcp_conv_slot_t        *convs;
+    ngx_uint_t              convs_mask;     /* slots - 1, slots is 2^n */
+    ngx_uint_t              ntunnels;
+
+    /* all tunnels, to walk them */
+    ngx_queue_t             tunnels;
+
+    /* tunnels ordered by the time they need kcp_update() */
+    ngx_rbtree_t            timer_rbtree;
+    ngx_rbtree_node_t       timer_sentinel;
+
+    /* tunnels that got datagrams in the current receive burst */
+    ngx_queue_t             burst;
 
     kcp_arg_t               karg;
+
+    /* adaptive mode */
+    IUINT32                 mtu_max;        /* largest datagram probed */
+    u_char                 *probe;          /* mtu_max zeroes, probe body */
+
+    /* forward error correction, fec_data is 0 without */
+    ngx_uint_t              fec_data;
+    ngx_uint_t              fec_parity;
+    IUINT32                 fec_overhead;   /* taken from the kcp mtu */
+    u_char                **fec_shards;     /* data then parity, for codec */
+    ngx_uint_t              fec_recovered;  /* datagrams rebuilt */
+
+    /* compression, a buffer each way, messages may be sent on delivery */
+    ngx_uint_t              zip;            /* KCP_ZIP_* */
+    u_char                 *zip_sbuf;
+    size_t                  zip_sbuf_size;
+    u_char                 *zip_rbuf;
+    size_t                  zip_rbuf_size;
+    ikcpvec                 zip_vec;
+
+    /* datagram sealing, crypt is NULL without */
+    kcp_crypt_t            *crypt;
+    IUINT32                 crypt_overhead; /* taken from the kcp mtu */
+    u_char                 *crypt_buf;      /* for what fits in no slot */
+
+    /* conv steering when the server socket is shared with SO_REUSEPORT */
+    ngx_uint_t              nworkers;
+    ngx_uint_t              worker;
+    IUINT32                 conv_seq;
 };
 
 
+/*
+ * The reuseport program picks the socket by the first two bytes of the
+ * datagram loaded as a big-endian halfword, that is the byte-swapped low
+ * half of the little-endian conv.  The swap is its own inverse.
+ */
+#define kcp_conv_steer_key(conv)                                        \
+    ((((conv) & 0xff) << 8) | (((conv) >> 8) & 0xff))
+
+#define kcp_conv_worker(conv, n)    (kcp_conv_steer_key(conv) % (n))
+
+/* larger messages are split by kcp_send(), they're not one message then */
+#define kcp_msg_max(t)                                                  \
+    (((size_t)(t)->kcp->mss << 4) - ((t)->zip ? KCP_ZIP_OVERHEAD : 0))
+
+/* the frame flag, and what deflate may add to what doesn't compress */
+#define KCP_ZIP_OVERHEAD            64
+
+
+/* the arg profiles, a group uses the third */
+
+#define KCP_PREFAB_ARGS             4
+
+extern kcp_arg_t kcp_prefab_args[KCP_PREFAB_ARGS];
+
+/*
+ * The group pool recycles what ngx_pfree() gives back, the tunnels and
+ * the alg cache segments come and go for as long as the worker runs.
+ */
+#define KCP_GROUP_POOL_SIZE         NGX_DEFAULT_POOL_SIZE
+
+extern ngx_pool_stat_t kcp_group_pool_stat;
+
+
 /* function for kcp tunnel */
 
 int kcp_send(kcp_tunnel_t *t, const void *data, size_t size);
 
+/* what kcp_send() has queued and kcp did not take yet */
+size_t kcp_send_queued(kcp_tunnel_t *t);
+
+/*
+ * A server tunnel makes its token, the client gets it in the handshake.
+ * The sealing keys of the tunnel are derived with it.
+ */
+ngx_int_t kcp_tunnel_set_token(kcp_tunnel_t *t, const u_char *token);
+
 
 /* function for kcp tunnel group */
 
@@ -92,4 +401,10 @@ void kcp_destroy_tunnel(kcp_tunnel_group_t *g, kcp_tunnel_t *t);
 
 kcp_tunnel_t *kcp_find_tunnel(kcp_tunnel_group_t *g, IUINT32 conv);
 
+IUINT32 kcp_group_new_conv(kcp_tunnel_group_t *g);
+
+/* old is what the old cycle had on the same address, or NULL */
+ngx_array_t *kcp_open_reuseport_sockets(ngx_cycle_t *cycle,
+    ngx_pmap_addr_t *addr, ngx_uint_t n, ngx_array_t *old);
+
 #endif /* _KCP_TUNNEL_H_INCLUDED_ */
@@ -0,0 +1,421 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "kcp_status.h"
+
+
+/*
+ * "kcp_status [text|json]" in a location serves what the workers
+ * publish to the "kcp_status_zone" of the port_map block, like
+ * stub_status does for the http connections.
+ */
+
+#define NGX_HTTP_KCP_STATUS_TEXT    0
+#define NGX_HTTP_KCP_STATUS_JSON    1
+
+/* the most a worker or a tunnel prints, labels and numbers */
+#define NGX_HTTP_KCP_STATUS_WORKER_LEN  (720 + 24 * NGX_INT64_LEN)
+#define NGX_HTTP_KCP_STATUS_TUNNEL_LEN                                  \
+    (672 + NGX_SOCKADDR_STRLEN + 42 * NGX_INT64_LEN)
+
+
+typedef struct {
+    ngx_uint_t                 format;
+} ngx_http_kcp_status_loc_conf_t;
+
+
+static ngx_int_t ngx_http_kcp_status_handler(ngx_http_request_t *r);
+static u_char *ngx_http_kcp_status_text(u_char *p, u_char *last,
+    ngx_uint_t n, kcp_status_worker_t *w);
+static u_char *ngx_http_kcp_status_json(u_char *p, u_char *last,
+    ngx_uint_t n, kcp_status_worker_t *w);
+static void *ngx_http_kcp_status_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_kcp_status(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_kcp_status_commands[] = {
+
+    { ngx_string("kcp_status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_kcp_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_kcp_status_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_kcp_status_create_loc_conf,   /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_kcp_status_module = {
+    NGX_MODULE_V1,
+    &ngx_http_kcp_status_module_ctx,       /* module context */
+    ngx_http_kcp_status_commands,          /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static const char  *ngx_http_kcp_status_limits[] = {
+    "none", "cwnd", "rmt_wnd", "snd_wnd"
+};
+
+
+static ngx_int_t
+ngx_http_kcp_status_handler(ngx_http_request_t *r)
+{
+    size_t                           size;
+    ngx_int_t                        rc;
+    ngx_buf_t                       *b;
+    ngx_uint_t                       n;
+    ngx_chain_t                      out;
+    ngx_pmap_conf_t                 *corecf;
+    ngx_slab_pool_t                 *shpool;
+    kcp_status_shm_t                *sh;
+    kcp_status_worker_t             *w;
+    ngx_http_kcp_status_loc_conf_t  *kscf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if (ngx_get_conf(ngx_cycle->conf_ctx, ngx_pmap_module) == NULL) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    corecf = ngx_pmap_get_conf(ngx_cycle->conf_ctx, ngx_pmap_core_module);
+
+    if (NULL == corecf->kcp_status_zone) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "\"kcp_status\" needs \"kcp_status_zone\" "
+                      "in the port_map block");
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    kscf = ngx_http_get_module_loc_conf(r, ngx_http_kcp_status_module);
+
+    if (NGX_HTTP_KCP_STATUS_JSON == kscf->format) {
+        r->headers_out.content_type_len = sizeof("application/json") - 1;
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+
+    } else {
+        r->headers_out.content_type_len = sizeof("text/plain") - 1;
+        ngx_str_set(&r->headers_out.content_type, "text/plain");
+    }
+
+    r->headers_out.content_type_lowcase = NULL;
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+    }
+
+    shpool = (ngx_slab_pool_t *) corecf->kcp_status_zone->shm.addr;
+    sh = shpool->data;
+
+    size = sizeof("{\"workers\":[]}\n")
+           + sh->nworkers * (NGX_HTTP_KCP_STATUS_WORKER_LEN
+                             + sh->max_tunnels
+                               * NGX_HTTP_KCP_STATUS_TUNNEL_LEN);
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* a copy of a worker at a time, it may be writing */
+
+    w = ngx_palloc(r->pool, sh->worker_size);
+    if (w == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    if (NGX_HTTP_KCP_STATUS_JSON == kscf->format) {
+        b->last = ngx_cpymem(b->last, "{\"workers\":[",
+                             sizeof("{\"workers\":[") - 1);
+    }
+
+    for (n = 0; n < sh->nworkers; n++) {
+
+        if (kcp_status_read(sh, n, w) != NGX_OK) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                          "kcp status of worker %ui is busy", n);
+            w->updated = 0;
+        }
+
+        if (NGX_HTTP_KCP_STATUS_JSON == kscf->format) {
+            if (n) {
+                *b->last++ = ',';
+            }
+
+            b->last = ngx_http_kcp_status_json(b->last, b->end, n, w);
+
+        } else {
+            b->last = ngx_http_kcp_status_text(b->last, b->end, n, w);
+        }
+    }
+
+    if (NGX_HTTP_KCP_STATUS_JSON == kscf->format) {
+        b->last = ngx_cpymem(b->last, "]}\n", sizeof("]}\n") - 1);
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static u_char *
+ngx_http_kcp_status_text(u_char *p, u_char *last, ngx_uint_t n,
+    kcp_status_worker_t *w)
+{
+    ngx_uint_t            i, ratio;
+    kcp_status_tunnel_t  *t;
+
+    if (w->updated == 0) {
+        return ngx_slprintf(p, last, "worker %ui: no kcp group\n", n);
+    }
+
+    i = w->pool_cache_hits + w->pool_cache_misses;
+    ratio = i ? w->pool_cache_hits * 100 / i : 0;
+
+    p = ngx_slprintf(p, last,
+                     "worker %ui: pid %P %s, %ui tunnels, updated %T\n"
+                     " bytes in/out: %uL %uL\n"
+                     " datagrams in/out: %ui %ui, syscalls: %ui, saved: %ui\n"
+                     " send errors: %ui, dropped: %ui, fec recovered: %ui, "
+                     "segment pool hits/misses: %ui %ui\n"
+                     " not authentic: %ui\n"
+                     " pool wasted: %uz, free: %uz, reused: %ui\n"
+                     " pool cache hits/misses: %ui %ui (%ui%%), cached: %uz\n",
+                     n, w->pid, w->is_server ? "server" : "client",
+                     w->ntunnels, w->updated,
+                     w->bytes_in, w->bytes_out,
+                     w->dgrams_in, w->dgrams_out, w->syscalls,
+                     w->syscalls_saved,
+                     w->send_errors, w->send_dropped, w->fec_recovered,
+                     w->seg_hits, w->seg_misses, w->crypt_failed,
+                     w->pool_wasted, w->pool_free, w->pool_reused,
+                     w->pool_cache_hits, w->pool_cache_misses, ratio,
+                     w->pool_cache_size);
+
+    for (i = 0; i < w->nlisted; i++) {
+        t = &w->tunnels[i];
+
+        p = ngx_slprintf(p, last,
+                         " conv %uD %*s\n"
+                         "  bytes in/out: %uL %uL, datagrams in/out: %ui %ui\n"
+                         "  messages in/out: %ui %ui, segments in/out: %ui %ui\n"
+                         "  retransmits: %ui, fast: %ui, dup acks: %ui, "
+                         "send errors: %ui\n"
+                         "  srtt: %i rttvar: %i rto: %i, "
+                         "cwnd: %ui snd_wnd: %ui rmt_wnd: %ui mtu: %ui\n"
+                         "  snd que/buf: %ui %ui, rcv que/buf: %ui %ui, "
+                         "limited by: %s\n"
+                         "  cache memory: %uz, spilled: %uz, "
+                         "send paused: %ui\n"
+                         "  pacing rate: %uL, paced: %ui\n"
+                         "  compressed in/out: %uL %uL, bypassed: %ui\n"
+                         "  replayed: %ui, migrations: %ui\n",
+                         t->conv, t->peer_len, t->peer,
+                         t->bytes_in, t->bytes_out,
+                         t->dgrams_in, t->dgrams_out,
+                         t->msgs_in, t->msgs_out, t->segs_in, t->segs_out,
+                         t->retrans, t->fast_retrans, t->dup_acks,
+                         t->send_errors,
+                         t->srtt, t->rttvar, t->rto,
+                         t->cwnd, t->snd_wnd, t->rmt_wnd, t->mtu,
+                         t->snd_que, t->snd_buf, t->rcv_que, t->rcv_buf,
+                         ngx_http_kcp_status_limits[t->limit],
+                         t->cache_mem, t->cache_spill, t->send_paused,
+                         t->pace_rate, t->paced,
+                         t->zip_in, t->zip_out, t->zip_bypassed,
+                         t->replayed, t->migrations);
+    }
+
+    if (w->nlisted < w->ntunnels) {
+        p = ngx_slprintf(p, last, " %ui more tunnels not listed\n",
+                         w->ntunnels - w->nlisted);
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_kcp_status_json(u_char *p, u_char *last, ngx_uint_t n,
+    kcp_status_worker_t *w)
+{
+    ngx_uint_t            i;
+    kcp_status_tunnel_t  *t;
+
+    if (w->updated == 0) {
+        return ngx_slprintf(p, last, "{\"worker\":%ui}", n);
+    }
+
+    p = ngx_slprintf(p, last,
+                     "{\"worker\":%ui,\"pid\":%P,\"role\":\"%s\","
+                     "\"updated\":%T,\"tunnels\":%ui,"
+                     "\"bytes_in\":%uL,\"bytes_out\":%uL,"
+                     "\"dgrams_in\":%ui,\"dgrams_out\":%ui,"
+                     "\"syscalls\":%ui,\"syscalls_saved\":%ui,"
+                     "\"send_errors\":%ui,\"send_dropped\":%ui,"
+                     "\"fec_recovered\":%ui,"
+                     "\"seg_hits\":%ui,\"seg_misses\":%ui,"
+                     "\"crypt_failed\":%ui,"
+                     "\"pool_wasted\":%uz,\"pool_free\":%uz,"
+                     "\"pool_reused\":%ui,"
+                     "\"pool_cache_hits\":%ui,\"pool_cache_misses\":%ui,"
+                     "\"pool_cache_size\":%uz,"
+                     "\"conns\":[",
+                     n, w->pid, w->is_server ? "server" : "client",
+                     w->updated, w->ntunnels,
+                     w->bytes_in, w->bytes_out,
+                     w->dgrams_in, w->dgrams_out,
+                     w->syscalls, w->syscalls_saved,
+                     w->send_errors, w->send_dropped, w->fec_recovered,
+                     w->seg_hits, w->seg_misses, w->crypt_failed,
+                     w->pool_wasted, w->pool_free, w->pool_reused,
+                     w->pool_cache_hits, w->pool_cache_misses,
+                     w->pool_cache_size);
+
+    for (i = 0; i < w->nlisted; i++) {
+        t = &w->tunnels[i];
+
+        p = ngx_slprintf(p, last,
+                         "%s{\"conv\":%uD,\"peer\":\"%*s\","
+                         "\"bytes_in\":%uL,\"bytes_out\":%uL,"
+                         "\"dgrams_in\":%ui,\"dgrams_out\":%ui,"
+                         "\"msgs_in\":%ui,\"msgs_out\":%ui,"
+                         "\"segs_in\":%ui,\"segs_out\":%ui,"
+                         "\"retrans\":%ui,\"fast_retrans\":%ui,"
+                         "\"dup_acks\":%ui,\"send_errors\":%ui,"
+                         "\"srtt\":%i,\"rttvar\":%i,\"rto\":%i,"
+                         "\"cwnd\":%ui,\"snd_wnd\":%ui,\"rmt_wnd\":%ui,"
+                         "\"mtu\":%ui,"
+                         "\"snd_que\":%ui,\"snd_buf\":%ui,"
+                         "\"rcv_que\":%ui,\"rcv_buf\":%ui,"
+                         "\"limit\":\"%s\","
+                         "\"cache_mem\":%uz,\"cache_spill\":%uz,"
+                         "\"send_paused\":%ui,"
+                         "\"pace_rate\":%uL,\"paced\":%ui,"
+                         "\"zip_in\":%uL,\"zip_out\":%uL,"
+                         "\"zip_bypassed\":%ui,\"replayed\":%ui,"
+                         "\"migrations\":%ui}",
+                         i ? "," : "",
+                         t->conv, t->peer_len, t->peer,
+                         t->bytes_in, t->bytes_out,
+                         t->dgrams_in, t->dgrams_out,
+                         t->msgs_in, t->msgs_out, t->segs_in, t->segs_out,
+                         t->retrans, t->fast_retrans, t->dup_acks,
+                         t->send_errors,
+                         t->srtt, t->rttvar, t->rto,
+                         t->cwnd, t->snd_wnd, t->rmt_wnd, t->mtu,
+                         t->snd_que, t->snd_buf, t->rcv_que, t->rcv_buf,
+                         ngx_http_kcp_status_limits[t->limit],
+                         t->cache_mem, t->cache_spill, t->send_paused,
+                         t->pace_rate, t->paced,
+                         t->zip_in, t->zip_out, t->zip_bypassed,
+                         t->replayed, t->migrations);
+    }
+
+    return ngx_slprintf(p, last, "],\"unlisted\":%ui}",
+                        w->ntunnels - w->nlisted);
+}
+
+
+static void *
+ngx_http_kcp_status_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_kcp_status_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_kcp_status_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->format = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_kcp_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_kcp_status_loc_conf_t *kscf = conf;
+
+    ngx_str_t                 *value;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    if (kscf->format != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    kscf->format = NGX_HTTP_KCP_STATUS_TEXT;
+
+    if (cf->args->nelts == 2) {
+        if (ngx_strcmp(value[1].data, "json") == 0) {
+            kscf->format = NGX_HTTP_KCP_STATUS_JSON;
+
+        } else if (ngx_strcmp(value[1].data, "text") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid value \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_kcp_status_handler;
+
+    return NGX_CONF_OK;
+}
@@ -4,6 +4,10 @@
 
 #include "ngx_pmap.h"
 #include "ngx_pmap_client_module.h"
+#include "ngx_pmap_server_module.h"
+#include "fec.h"
+#include "kcp_status.h"
+#include "alg_disk_cache.h"
 
 extern ngx_module_t ngx_pmap_client_module;
 
@@ -14,6 +18,17 @@ static void *ngx_pmap_core_init_conf(ngx_cycle_t *cycle, void *conf);
 
 static char *ngx_pmap_parse_client(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_pmap_parse_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_pmap_kcp_spill_path(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_pmap_kcp_fec(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_pmap_kcp_send_watermark(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_pmap_kcp_pacing(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_pmap_kcp_crypt(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_pmap_kcp_status_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 static ngx_listening_t *
 ngx_pmap_add_listening(ngx_conf_t *cf, ngx_pmap_listen_t *lscf, ngx_connection_handler_pt handler);
@@ -56,6 +71,17 @@ ngx_module_t ngx_pmap_module = {
 
 static ngx_str_t pmap_core_name = ngx_string("port_map");
 
+static ngx_conf_num_bounds_t ngx_pmap_kcp_batch_bounds = {
+    ngx_conf_check_num_bounds, 1, 1024
+};
+
+static ngx_conf_enum_t ngx_pmap_kcp_compress[] = {
+    { ngx_string("off"), KCP_ZIP_OFF },
+    { ngx_string("on"), KCP_ZIP_ON },
+    { ngx_string("auto"), KCP_ZIP_AUTO },
+    { ngx_null_string, 0 }
+};
+
 static ngx_command_t ngx_pmap_core_commands[] = {
     { ngx_string("endpoint"),
       NGX_PMAP_CONF|NGX_CONF_TAKE1,
@@ -63,6 +89,83 @@ static ngx_command_t ngx_pmap_core_commands[] = {
       0,
       offsetof(ngx_pmap_conf_t, endpoint),
       NULL },
+
+    { ngx_string("kcp_batch"),
+      NGX_PMAP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_pmap_conf_t, kcp_batch),
+      &ngx_pmap_kcp_batch_bounds },
+
+    { ngx_string("kcp_cache_ring"),
+      NGX_PMAP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      0,
+      offsetof(ngx_pmap_conf_t, kcp_cache_ring),
+      NULL },
+
+    { ngx_string("kcp_spill_path"),
+      NGX_PMAP_CONF|NGX_CONF_TAKE1,
+      ngx_pmap_kcp_spill_path,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("kcp_spill_max"),
+      NGX_PMAP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      0,
+      offsetof(ngx_pmap_conf_t, kcp_spill_max),
+      NULL },
+
+    { ngx_string("kcp_send_watermark"),
+      NGX_PMAP_CONF|NGX_CONF_TAKE12,
+      ngx_pmap_kcp_send_watermark,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("kcp_pacing"),
+      NGX_PMAP_CONF|NGX_CONF_TAKE1,
+      ngx_pmap_kcp_pacing,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("kcp_adaptive"),
+      NGX_PMAP_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_pmap_conf_t, kcp_adaptive),
+      NULL },
+
+    { ngx_string("kcp_fec"),
+      NGX_PMAP_CONF|NGX_CONF_TAKE12,
+      ngx_pmap_kcp_fec,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("kcp_compress"),
+      NGX_PMAP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      0,
+      offsetof(ngx_pmap_conf_t, kcp_compress),
+      &ngx_pmap_kcp_compress },
+
+    { ngx_string("kcp_crypt"),
+      NGX_PMAP_CONF|NGX_CONF_TAKE12,
+      ngx_pmap_kcp_crypt,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("kcp_status_zone"),
+      NGX_PMAP_CONF|NGX_CONF_TAKE1,
+      ngx_pmap_kcp_status_zone,
+      0,
+      0,
+      NULL },
     
     { ngx_string("client"),
       NGX_PMAP_CONF|NGX_CONF_BLOCK|NGX_CONF_NOARGS,
@@ -114,6 +217,7 @@ ngx_pmap_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_conf_t                pcf;
     ngx_pmap_conf_t          *corecf;
     ngx_pmap_client_conf_t   *clientcf;
+    ngx_pmap_server_conf_t   *servercf;
     
     if (*(void **)conf) {
         return "is duplicate";
@@ -192,9 +296,40 @@ ngx_pmap_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     if (NGX_PMAP_ENDPOINT_CLIENT == corecf->endpoint) { /* for client */
         clientcf = ngx_pmap_get_conf(cf->cycle->conf_ctx, ngx_pmap_client_module);
-        
-        ngx_pmap_add_listening(cf, &clientcf->listen, ngx_pmap_client_init_connection);
-    } 
+
+        if (0 == clientcf->server_addr.socklen
+            || 0 == clientcf->kcp_addr.socklen)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "client needs \"server_addr\" and \"kcp_addr\"");
+            return NGX_CONF_ERROR;
+        }
+
+        if (NULL == ngx_pmap_add_listening(cf, &clientcf->listen,
+                                           ngx_pmap_client_init_connection))
+        {
+            return NGX_CONF_ERROR;
+        }
+
+    } else { /* for server */
+        servercf = ngx_pmap_get_conf(cf->cycle->conf_ctx, ngx_pmap_server_module);
+
+        if (0 == servercf->listen.socklen
+            || 0 == servercf->proxy_pass.socklen
+            || 0 == servercf->kcp_addr.socklen)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "server needs \"listen\", \"proxy_pass\" "
+                               "and \"kcp_listen\"");
+            return NGX_CONF_ERROR;
+        }
+
+        if (NULL == ngx_pmap_add_listening(cf, &servercf->listen,
+                                           ngx_pmap_server_init_connection))
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
 
     return NGX_CONF_OK;
 }
@@ -211,6 +346,21 @@ ngx_pmap_core_create_conf(ngx_cycle_t *cycle)
 
     corecf->endpoint = NGX_CONF_UNSET;
     corecf->error_log = &cycle->new_log;
+    corecf->kcp_batch = NGX_CONF_UNSET_UINT;
+    corecf->kcp_cache_ring = NGX_CONF_UNSET_SIZE;
+    ngx_str_null(&corecf->kcp_spill_path);
+    corecf->kcp_spill_max = NGX_CONF_UNSET_SIZE;
+    corecf->kcp_send_high = NGX_CONF_UNSET_SIZE;
+    corecf->kcp_send_low = NGX_CONF_UNSET_SIZE;
+    corecf->kcp_pacing = NGX_CONF_UNSET;
+    corecf->kcp_pacing_max = NGX_CONF_UNSET_SIZE;
+    corecf->kcp_adaptive = NGX_CONF_UNSET;
+    corecf->kcp_fec_data = NGX_CONF_UNSET_UINT;
+    corecf->kcp_fec_parity = NGX_CONF_UNSET_UINT;
+    corecf->kcp_compress = NGX_CONF_UNSET_UINT;
+    corecf->kcp_crypt = NGX_CONF_UNSET;
+    ngx_str_null(&corecf->kcp_crypt_key);
+    corecf->kcp_status_zone = NULL;
 
     return corecf;
 }
@@ -218,6 +368,33 @@ ngx_pmap_core_create_conf(ngx_cycle_t *cycle)
 static void *
 ngx_pmap_core_init_conf(ngx_cycle_t *cycle, void *conf)
 {
+    ngx_pmap_conf_t *corecf = conf;
+
+    ngx_conf_init_uint_value(corecf->kcp_batch, 16);
+    ngx_conf_init_size_value(corecf->kcp_cache_ring, 256 * 1024);
+    ngx_conf_init_size_value(corecf->kcp_spill_max, 64 * 1024 * 1024);
+    ngx_conf_init_size_value(corecf->kcp_send_high, 1024 * 1024);
+    ngx_conf_init_size_value(corecf->kcp_send_low, corecf->kcp_send_high / 2);
+    ngx_conf_init_value(corecf->kcp_pacing, 0);
+    ngx_conf_init_size_value(corecf->kcp_pacing_max, 0);
+    ngx_conf_init_value(corecf->kcp_adaptive, 0);
+    ngx_conf_init_uint_value(corecf->kcp_fec_data, 0);
+    ngx_conf_init_uint_value(corecf->kcp_fec_parity, 0);
+    ngx_conf_init_uint_value(corecf->kcp_compress, KCP_ZIP_OFF);
+    ngx_conf_init_value(corecf->kcp_crypt, NGX_ERROR);
+
+#if !(NGX_ZLIB)
+    if (corecf->kcp_compress != KCP_ZIP_OFF) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "\"kcp_compress\" needs zlib");
+        return NGX_CONF_ERROR;
+    }
+#endif
+
+    if (NULL == corecf->kcp_spill_path.data) {
+        ngx_str_set(&corecf->kcp_spill_path, "/tmp");
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -239,7 +416,355 @@ ngx_pmap_parse_client(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
 static char *
 ngx_pmap_parse_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{       
+{
+    ngx_conf_t   save;
+    char        *rv;
+
+    save = *cf;
+    cf->cmd_type = NGX_PMAP_SERVER_CONF;
+
+    rv = ngx_conf_parse(cf, NULL);
+
+    *cf = save;
+
+    return rv;
+}
+
+/*
+ * kcp_spill_path <dir>, relative to the prefix, with room left for the
+ * names of the spill files
+ */
+
+static char *
+ngx_pmap_kcp_spill_path(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_pmap_conf_t  *corecf = conf;
+    ngx_str_t        *value;
+
+    if (corecf->kcp_spill_path.data) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_conf_full_name(cf->cycle, &value[1], 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (value[1].len > ALG_DISK_DIR_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"kcp_spill_path\" \"%V\" is longer than %uz",
+                           &value[1], (size_t) ALG_DISK_DIR_MAX);
+        return NGX_CONF_ERROR;
+    }
+
+    corecf->kcp_spill_path = value[1];
+
+    return NGX_CONF_OK;
+}
+
+/* kcp_fec off | <data shards> <parity shards>, the same on both ends */
+
+static char *
+ngx_pmap_kcp_fec(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_pmap_conf_t  *corecf = conf;
+    ngx_str_t        *value;
+    ngx_int_t         data, parity;
+
+    if (corecf->kcp_fec_data != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2) {
+        if (ngx_strcmp(value[1].data, "off") == 0) {
+            corecf->kcp_fec_data = 0;
+            corecf->kcp_fec_parity = 0;
+            return NGX_CONF_OK;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    data = ngx_atoi(value[1].data, value[1].len);
+    parity = ngx_atoi(value[2].data, value[2].len);
+
+    if (data < 1 || data > FEC_DATA_MAX
+        || parity < 1 || parity > FEC_PARITY_MAX)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"kcp_fec\" takes 1..%d data "
+                           "and 1..%d parity shards",
+                           FEC_DATA_MAX, FEC_PARITY_MAX);
+        return NGX_CONF_ERROR;
+    }
+
+    corecf->kcp_fec_data = data;
+    corecf->kcp_fec_parity = parity;
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * kcp_send_watermark off | <high> [<low>], a tunnel stops reading its
+ * streams when its send cache holds high, and goes on at low, half of
+ * high by default
+ */
+
+static char *
+ngx_pmap_kcp_send_watermark(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_pmap_conf_t  *corecf = conf;
+    ngx_str_t        *value;
+    ssize_t           high, low;
+
+    if (corecf->kcp_send_high != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+        corecf->kcp_send_high = 0;
+        corecf->kcp_send_low = 0;
+        return NGX_CONF_OK;
+    }
+
+    high = ngx_parse_size(&value[1]);
+
+    if (NGX_ERROR == high || 0 == high) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    low = high / 2;
+
+    if (cf->args->nelts == 3) {
+        low = ngx_parse_size(&value[2]);
+
+        if (NGX_ERROR == low || low >= high) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "low watermark \"%V\" must be below "
+                               "the high one", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    corecf->kcp_send_high = high;
+    corecf->kcp_send_low = low;
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * kcp_pacing off | on | <max rate>, a tunnel sends its window over the
+ * rtt instead of all at once, at most max rate bytes a second if given
+ */
+
+static char *
+ngx_pmap_kcp_pacing(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_pmap_conf_t  *corecf = conf;
+    ngx_str_t        *value;
+    ssize_t           rate;
+
+    if (corecf->kcp_pacing != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        corecf->kcp_pacing = 0;
+        corecf->kcp_pacing_max = 0;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[1].data, "on") == 0) {
+        corecf->kcp_pacing = 1;
+        corecf->kcp_pacing_max = 0;
+        return NGX_CONF_OK;
+    }
+
+    rate = ngx_parse_size(&value[1]);
+
+    if (NGX_ERROR == rate || 0 == rate) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    corecf->kcp_pacing = 1;
+    corecf->kcp_pacing_max = rate;
+
+    return NGX_CONF_OK;
+}
+
+/* kcp_crypt off | <cipher> <key file>, the same key on both ends */
+
+static char *
+ngx_pmap_kcp_crypt(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_OPENSSL)
+    ngx_pmap_conf_t  *corecf = conf;
+    ngx_str_t        *value;
+    ngx_file_t        file;
+    ngx_file_info_t   fi;
+    ngx_int_t         cipher;
+    size_t            key_size;
+    ssize_t           n;
+
+    if (corecf->kcp_crypt != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2) {
+        if (ngx_strcmp(value[1].data, "off") == 0) {
+            corecf->kcp_crypt = NGX_ERROR;
+            return NGX_CONF_OK;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    cipher = kcp_crypt_cipher(&value[1], &key_size);
+
+    if (NGX_ERROR == cipher) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown kcp cipher \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* the key file holds the raw key, nothing else */
+
+    if (ngx_conf_full_name(cf->cycle, &value[2], 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+    file.name = value[2];
+    file.log = cf->log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY,
+                            NGX_FILE_OPEN, 0);
+
+    if (NGX_INVALID_FILE == file.fd) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_open_file_n " \"%V\" failed", &file.name);
+        return NGX_CONF_ERROR;
+    }
+
+    corecf->kcp_crypt_key.data = ngx_pnalloc(cf->pool, KCP_CRYPT_KEY_MAX);
+    if (NULL == corecf->kcp_crypt_key.data) {
+        goto failed;
+    }
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno,
+                           ngx_fd_info_n " \"%V\" failed", &file.name);
+        goto failed;
+    }
+
+    if (ngx_file_size(&fi) != (off_t) key_size) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must be %uz bytes for \"%V\"",
+                           &file.name, key_size, &value[1]);
+        goto failed;
+    }
+
+    n = ngx_read_file(&file, corecf->kcp_crypt_key.data, key_size, 0);
+
+    if (NGX_ERROR == n) {
+        goto failed;
+    }
+
+    if ((size_t) n != key_size) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           ngx_read_file_n " \"%V\" returned only "
+                           "%z bytes instead of %uz", &file.name, n, key_size);
+        goto failed;
+    }
+
+    corecf->kcp_crypt_key.len = key_size;
+    corecf->kcp_crypt = cipher;
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &file.name);
+    }
+
+    return NGX_CONF_OK;
+
+failed:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &file.name);
+    }
+
+    return NGX_CONF_ERROR;
+
+#else
+
+    ngx_str_t  *value;
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+        return NGX_CONF_OK;
+    }
+
+    return "needs OpenSSL";
+
+#endif
+}
+
+/* kcp_status_zone <size>, the workers publish their tunnels there */
+
+static char *
+ngx_pmap_kcp_status_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_pmap_conf_t  *corecf = conf;
+    ngx_str_t        *value, name;
+    ssize_t           size;
+
+    if (corecf->kcp_status_zone) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[1]);
+
+    if (NGX_ERROR == size || size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_set(&name, KCP_STATUS_ZONE_NAME);
+
+    corecf->kcp_status_zone = ngx_shared_memory_add(cf, &name, size,
+                                                    &ngx_pmap_core_module);
+    if (NULL == corecf->kcp_status_zone) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* the number of workers may change with a reload */
+
+    corecf->kcp_status_zone->init = kcp_status_init_zone;
+    corecf->kcp_status_zone->data = cf->cycle;
+    corecf->kcp_status_zone->noreuse = 1;
+
     return NGX_CONF_OK;
 }
 
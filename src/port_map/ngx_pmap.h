@@ -66,6 +66,22 @@ typedef struct {
 typedef struct {
     ngx_int_t    endpoint;
     ngx_log_t   *error_log;
+
+    ngx_uint_t   kcp_batch;     /* datagrams per recvmmsg()/sendmmsg() */
+    size_t       kcp_cache_ring;    /* 0 for the list cache */
+    ngx_str_t    kcp_spill_path;    /* where full caches spill to */
+    size_t       kcp_spill_max;     /* per cache, 0 for no limit */
+    size_t       kcp_send_high;     /* send cache watermarks, 0 for none */
+    size_t       kcp_send_low;
+    ngx_flag_t   kcp_pacing;        /* spread a tunnel's sends over the rtt */
+    size_t       kcp_pacing_max;    /* bytes/s, 0 for no cap */
+    ngx_flag_t   kcp_adaptive;      /* tune each tunnel from rtt and loss */
+    ngx_uint_t   kcp_fec_data;      /* shards per fec block, 0 for no fec */
+    ngx_uint_t   kcp_fec_parity;
+    ngx_uint_t   kcp_compress;      /* KCP_ZIP_*, the same on both ends */
+    ngx_int_t    kcp_crypt;         /* cipher index, NGX_ERROR for none */
+    ngx_str_t    kcp_crypt_key;
+    ngx_shm_zone_t  *kcp_status_zone;   /* NULL for no status */
 } ngx_pmap_conf_t;
 
 
@@ -3,6 +3,8 @@
 #include <ngx_event.h>
 
 #include "ngx_pmap_client_module.h"
+#include "kcp_tunnel.h"
+#include "fast_tunnel.h"
 
 static void *ngx_pmap_client_create_conf(ngx_cycle_t *cycle);
 static void *ngx_pmap_client_init_conf(ngx_cycle_t *cycle, void *conf);
@@ -11,7 +13,14 @@ static char *ngx_pmap_client_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *co
 static char *ngx_pmap_client_set_server_addr(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_pmap_client_set_kcp_addr(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
-static void ngx_pmap_client_on_recv(ngx_event_t *rev);
+static ngx_int_t ngx_pmap_client_init_process(ngx_cycle_t *cycle);
+
+static fast_tunnel_t *ngx_pmap_client_get_tunnel(void);
+static void ngx_pmap_client_on_disconnect(fast_tunnel_t *ft);
+
+/* the kcp tunnel group and the fast tunnel of this worker */
+static kcp_tunnel_group_t *ngx_pmap_client_group;
+static fast_tunnel_t *ngx_pmap_client_tunnel;
 
 static ngx_str_t client_name = ngx_string("pmap_client");
 
@@ -62,7 +71,7 @@ ngx_module_t ngx_pmap_client_module = {
     NGX_PMAP_MODULE,
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_pmap_client_init_process,          /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -76,7 +85,7 @@ ngx_pmap_client_create_conf(ngx_cycle_t *cycle)
 {
     ngx_pmap_client_conf_t *clientcf;
 
-    clientcf = ngx_palloc(cycle->pool, sizeof(ngx_pmap_client_conf_t));
+    clientcf = ngx_pcalloc(cycle->pool, sizeof(ngx_pmap_client_conf_t));
     if (NULL == clientcf) {
         return NULL;
     }
@@ -89,6 +98,10 @@ ngx_pmap_client_create_conf(ngx_cycle_t *cycle)
 static void *
 ngx_pmap_client_init_conf(ngx_cycle_t *cycle, void *conf)
 {
+    ngx_pmap_client_conf_t *clientcf = conf;
+
+    ngx_conf_init_value(clientcf->use_kcp, 1);
+
     return NGX_CONF_OK;
 }
 
@@ -112,104 +125,124 @@ ngx_pmap_client_set_server_addr(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 static char *
 ngx_pmap_client_set_kcp_addr(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    return NGX_CONF_OK;
+    ngx_pmap_client_conf_t *clientcf = (ngx_pmap_client_conf_t *)conf;
+
+    return ngx_pmap_parse_addr(cf, &clientcf->kcp_addr);
 }
 
-void
-ngx_pmap_client_init_connection(ngx_connection_t *c)
+static ngx_int_t
+ngx_pmap_client_init_process(ngx_cycle_t *cycle)
 {
-    ngx_pmap_client_hub_t   *hub;
-    ngx_event_t             *rev, *wev;    
+    ngx_pmap_conf_t         *corecf;
+    ngx_pmap_client_conf_t  *clientcf;
+    kcp_tunnel_group_t      *g;
+    ngx_pool_t              *pool;
 
-    hub = ngx_pcalloc(c->pool, sizeof(ngx_pmap_client_hub_t));    
-    if (NULL == hub) {
-        ngx_pmap_close_connection(c);
-        return;
+    if (ngx_get_conf(cycle->conf_ctx, ngx_pmap_module) == NULL) {
+        return NGX_OK;
     }
 
-    c->data = hub;
+    corecf = ngx_pmap_get_conf(cycle->conf_ctx, ngx_pmap_core_module);
+    clientcf = ngx_pmap_get_conf(cycle->conf_ctx, ngx_pmap_client_module);
 
-    /* todo: set c->log  */
+    if (corecf->endpoint != NGX_PMAP_ENDPOINT_CLIENT) {
+        return NGX_OK;
+    }
 
-    rev = c->read;
-    wev = c->write;
-    rev->handler = ngx_pmap_client_on_recv;
-    wev->handler = ngx_pmap_empty_write_handler;
+    pool = ngx_create_recycle_pool(KCP_GROUP_POOL_SIZE, &kcp_group_pool_stat,
+                                   cycle->log);
+    if (NULL == pool) {
+        return NGX_ERROR;
+    }
 
-    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
-        ngx_pmap_close_connection(c);
-        return;
+    g = ngx_pcalloc(pool, sizeof(kcp_tunnel_group_t));
+    if (NULL == g) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    g->cycle = cycle;
+    g->pool = pool;
+    g->log = cycle->log;
+    g->addr = clientcf->kcp_addr;
+
+    if (kcp_group_init(g) != NGX_OK) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
     }
+
+    ngx_pmap_client_group = g;
+
+    return NGX_OK;
 }
 
-void
-ngx_pmap_client_on_recv(ngx_event_t *rev)
+/* all connections of the worker share one tunnel, it's opened on demand */
+
+static fast_tunnel_t *
+ngx_pmap_client_get_tunnel(void)
 {
-    ngx_connection_t    *c;    
-    ngx_buf_t           *b;
-    size_t               size;
-    ssize_t              n;
+    ngx_pmap_client_conf_t  *clientcf;
+    fast_tunnel_t           *ft;
+    ngx_pool_t              *pool;
 
-    c = rev->data;
+    if (ngx_pmap_client_tunnel) {
+        return ngx_pmap_client_tunnel;
+    }
 
-    if (rev->timedout) {
-        ngx_pmap_close_connection(c);
-        return;
+    if (NULL == ngx_pmap_client_group) {
+        return NULL;
     }
 
-    if (c->close) {
-        ngx_pmap_close_connection(c);
-        return;
+    clientcf = ngx_pmap_get_conf(ngx_cycle->conf_ctx, ngx_pmap_client_module);
+
+    pool = ngx_create_pool(1024, ngx_cycle->log);
+    if (NULL == pool) {
+        return NULL;
     }
 
-    size = 512;
-    b = c->buffer;
-    if (NULL == b) {
-        b = ngx_create_temp_buf(c->pool, size);
-        
-        if (NULL == b) {
-            ngx_pmap_close_connection(c);
-            return;
-        }
-
-        c->buffer = b;
-    } else if (NULL == b->start) {
-        b->start = ngx_palloc(c->pool, size);
-        
-        if (NULL == b->start) {
-            ngx_pmap_close_connection(c);
-            return;
-        }
-
-        b->pos = b->start;
-        b->last = b->start;
-        b->end = b->last+size;
+    ft = ngx_pcalloc(pool, sizeof(fast_tunnel_t));
+    if (NULL == ft) {
+        ngx_destroy_pool(pool);
+        return NULL;
     }
 
-    n = c->recv(c, b->last, size);
+    ft->pool = pool;
+    ft->log = ngx_cycle->log;
+    ft->kcp_group = ngx_pmap_client_group;
+    ft->disconnect_handler = ngx_pmap_client_on_disconnect;
 
-    if (NGX_AGAIN == n) {
-        if (ngx_handle_read_event(rev, 0) != NGX_OK) {
-            ngx_pmap_close_connection(c);
-            return;
-        }
+    if (fast_tunnel_connect(ft, &clientcf->server_addr.u.sockaddr,
+                            clientcf->server_addr.socklen)
+        == NGX_ERROR)
+    {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
 
-        if (ngx_pfree(c->pool, b->start) == NGX_OK) {
-            b->start = NULL;
-        }
+    ngx_pmap_client_tunnel = ft;
 
-        return;
-    }
+    return ft;
+}
 
-    if (NGX_ERROR == n) {
-        ngx_pmap_close_connection(c);
-        return;
+static void
+ngx_pmap_client_on_disconnect(fast_tunnel_t *ft)
+{
+    if (ngx_pmap_client_tunnel == ft) {
+        ngx_pmap_client_tunnel = NULL;
     }
+}
+
+void
+ngx_pmap_client_init_connection(ngx_connection_t *c)
+{
+    fast_tunnel_t  *ft;
 
-    if (0 == n) {
+    /* the connection becomes a stream of the tunnel */
+
+    ft = ngx_pmap_client_get_tunnel();
+
+    if (NULL == ft || fast_tunnel_open_stream(ft, c) != NGX_OK) {
         ngx_pmap_close_connection(c);
         return;
     }
-
-    b->last += n;
 }
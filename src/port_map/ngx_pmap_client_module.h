@@ -17,12 +17,6 @@ typedef struct {
 } ngx_pmap_client_conf_t;
 
 
-/* a hub for proxied client */
-typedef struct {
-    ngx_connection_t  *c;
-} ngx_pmap_client_hub_t;
-
-
 void ngx_pmap_client_init_connection(ngx_connection_t *c);
 
 #endif /* _NGX_PMAP_CLIENT_MODULE_H_INCLUDED_ */
@@ -0,0 +1,374 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_connect.h>
+
+#include "ngx_pmap_server_module.h"
+#include "kcp_tunnel.h"
+#include "fast_tunnel.h"
+
+static void *ngx_pmap_server_create_conf(ngx_cycle_t *cycle);
+static void *ngx_pmap_server_init_conf(ngx_cycle_t *cycle, void *conf);
+
+static char *ngx_pmap_server_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_pmap_server_proxy_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_pmap_server_kcp_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+static ngx_int_t ngx_pmap_server_init_module(ngx_cycle_t *cycle);
+static ngx_array_t *ngx_pmap_server_old_sockets(ngx_cycle_t *cycle,
+    ngx_pmap_addr_t *addr);
+static ngx_int_t ngx_pmap_server_init_process(ngx_cycle_t *cycle);
+static void ngx_pmap_server_close_sockets(void *data);
+
+static ngx_int_t ngx_pmap_server_open_stream(fast_tunnel_t *ft, fast_stream_t *st);
+
+/* the kcp tunnel group of this worker */
+static kcp_tunnel_group_t *ngx_pmap_server_group;
+
+static ngx_str_t server_name = ngx_string("pmap_server");
+
+
+static ngx_command_t ngx_pmap_server_commands[] = {
+    { ngx_string("listen"),
+      NGX_PMAP_SERVER_CONF|NGX_CONF_1MORE,
+      ngx_pmap_server_listen,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("proxy_pass"),
+      NGX_PMAP_SERVER_CONF|NGX_CONF_TAKE1,
+      ngx_pmap_server_proxy_pass,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("kcp_listen"),
+      NGX_PMAP_SERVER_CONF|NGX_CONF_TAKE12,
+      ngx_pmap_server_kcp_listen,
+      0,
+      0,
+      NULL },
+
+    ngx_null_command
+};
+
+static ngx_pmap_module_t ngx_pmap_server_module_ctx = {
+    &server_name,
+
+    ngx_pmap_server_create_conf,
+    ngx_pmap_server_init_conf,
+};
+
+ngx_module_t ngx_pmap_server_module = {
+    NGX_MODULE_V1,
+    &ngx_pmap_server_module_ctx,
+    ngx_pmap_server_commands,
+    NGX_PMAP_MODULE,
+    NULL,                                  /* init master */
+    ngx_pmap_server_init_module,           /* init module */
+    ngx_pmap_server_init_process,          /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void *
+ngx_pmap_server_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_pmap_server_conf_t *servercf;
+
+    servercf = ngx_pcalloc(cycle->pool, sizeof(ngx_pmap_server_conf_t));
+    if (NULL == servercf) {
+        return NULL;
+    }
+
+    servercf->kcp_reuseport = NGX_CONF_UNSET;
+
+    return servercf;
+}
+
+static void *
+ngx_pmap_server_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_pmap_server_conf_t *servercf = conf;
+
+    ngx_conf_init_value(servercf->kcp_reuseport, 0);
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_pmap_server_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_pmap_server_conf_t *servercf = conf;
+
+    return ngx_pmap_parse_listen_addr(cf, &servercf->listen);
+}
+
+static char *
+ngx_pmap_server_proxy_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_pmap_server_conf_t *servercf = conf;
+
+    return ngx_pmap_parse_addr(cf, &servercf->proxy_pass);
+}
+
+static char *
+ngx_pmap_server_kcp_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_pmap_server_conf_t *servercf = conf;
+    ngx_str_t              *value;
+    char                   *rv;
+
+    rv = ngx_pmap_parse_addr(cf, &servercf->kcp_addr);
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    if (cf->args->nelts == 2) {
+        return NGX_CONF_OK;
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[2].data, "reuseport") == 0) {
+#if (NGX_HAVE_REUSEPORT)
+        servercf->kcp_reuseport = 1;
+        return NGX_CONF_OK;
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "reuseport is not supported "
+                           "on this platform, ignored");
+        return NGX_CONF_OK;
+#endif
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "the invalid \"%V\" parameter", &value[2]);
+    return NGX_CONF_ERROR;
+}
+
+/*
+ * With "reuseport" the sockets are opened here, in the master, so that
+ * they join the reuseport group in worker order and the steering program
+ * can pick a worker by index.  On reload they are inherited from the old
+ * cycle, as the listening sockets are.
+ */
+
+static ngx_int_t
+ngx_pmap_server_init_module(ngx_cycle_t *cycle)
+{
+    ngx_pmap_conf_t         *corecf;
+    ngx_pmap_server_conf_t  *servercf;
+    ngx_core_conf_t         *ccf;
+    ngx_pool_cleanup_t      *cln;
+    ngx_array_t             *old;
+
+    if (ngx_get_conf(cycle->conf_ctx, ngx_pmap_module) == NULL) {
+        return NGX_OK;
+    }
+
+    corecf = ngx_pmap_get_conf(cycle->conf_ctx, ngx_pmap_core_module);
+    servercf = ngx_pmap_get_conf(cycle->conf_ctx, ngx_pmap_server_module);
+
+    if (corecf->endpoint != NGX_PMAP_ENDPOINT_SERVER) {
+        return NGX_OK;
+    }
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    if (!servercf->kcp_reuseport) {
+
+        /* the workers would fight over one port, and over the convs */
+
+        if (ccf->master && ccf->worker_processes > 1) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                          "\"kcp_listen\" needs \"reuseport\" "
+                          "with more than one worker process");
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    old = ngx_pmap_server_old_sockets(cycle, &servercf->kcp_addr);
+
+    servercf->kcp_sockets = kcp_open_reuseport_sockets(cycle,
+                                                       &servercf->kcp_addr,
+                                                       ccf->worker_processes,
+                                                       old);
+    if (NULL == servercf->kcp_sockets) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cycle->pool, 0);
+    if (NULL == cln) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_pmap_server_close_sockets;
+    cln->data = servercf->kcp_sockets;
+
+    return NGX_OK;
+}
+
+static ngx_array_t *
+ngx_pmap_server_old_sockets(ngx_cycle_t *cycle, ngx_pmap_addr_t *addr)
+{
+    ngx_cycle_t             *old;
+    ngx_pmap_conf_t         *corecf;
+    ngx_pmap_server_conf_t  *servercf;
+
+    old = cycle->old_cycle;
+
+    if (ngx_is_init_cycle(old)
+        || ngx_get_conf(old->conf_ctx, ngx_pmap_module) == NULL)
+    {
+        return NULL;
+    }
+
+    corecf = ngx_pmap_get_conf(old->conf_ctx, ngx_pmap_core_module);
+    servercf = ngx_pmap_get_conf(old->conf_ctx, ngx_pmap_server_module);
+
+    if (corecf->endpoint != NGX_PMAP_ENDPOINT_SERVER
+        || NULL == servercf->kcp_sockets
+        || ngx_cmp_sockaddr(&servercf->kcp_addr.u.sockaddr,
+                            servercf->kcp_addr.socklen,
+                            &addr->u.sockaddr, addr->socklen, 1)
+           != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return servercf->kcp_sockets;
+}
+
+static ngx_int_t
+ngx_pmap_server_init_process(ngx_cycle_t *cycle)
+{
+    ngx_pmap_conf_t         *corecf;
+    ngx_pmap_server_conf_t  *servercf;
+    kcp_tunnel_group_t      *g;
+    ngx_pool_t              *pool;
+
+    if (ngx_get_conf(cycle->conf_ctx, ngx_pmap_module) == NULL) {
+        return NGX_OK;
+    }
+
+    corecf = ngx_pmap_get_conf(cycle->conf_ctx, ngx_pmap_core_module);
+    servercf = ngx_pmap_get_conf(cycle->conf_ctx, ngx_pmap_server_module);
+
+    if (corecf->endpoint != NGX_PMAP_ENDPOINT_SERVER) {
+        return NGX_OK;
+    }
+
+    /* one kcp group per worker, all fast tunnels of the worker share it */
+
+    pool = ngx_create_recycle_pool(KCP_GROUP_POOL_SIZE, &kcp_group_pool_stat,
+                                   cycle->log);
+    if (NULL == pool) {
+        return NGX_ERROR;
+    }
+
+    g = ngx_pcalloc(pool, sizeof(kcp_tunnel_group_t));
+    if (NULL == g) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    g->cycle = cycle;
+    g->pool = pool;
+    g->log = cycle->log;
+    g->addr = servercf->kcp_addr;
+
+    if (kcp_group_init(g) != NGX_OK) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    ngx_pmap_server_group = g;
+
+    return NGX_OK;
+}
+
+void
+ngx_pmap_server_init_connection(ngx_connection_t *c)
+{
+    fast_tunnel_t  *ft;
+
+    if (NULL == ngx_pmap_server_group) {
+        ngx_pmap_close_connection(c);
+        return;
+    }
+
+    ft = ngx_pcalloc(c->pool, sizeof(fast_tunnel_t));
+    if (NULL == ft) {
+        ngx_pmap_close_connection(c);
+        return;
+    }
+
+    ft->data = ngx_pmap_get_conf(ngx_cycle->conf_ctx, ngx_pmap_server_module);
+    ft->kcp_group = ngx_pmap_server_group;
+    ft->open_handler = ngx_pmap_server_open_stream;
+
+    if (fast_tunnel_accept(ft, c) != NGX_OK) {
+        ngx_pmap_close_connection(c);
+        return;
+    }
+}
+
+static ngx_int_t
+ngx_pmap_server_open_stream(fast_tunnel_t *ft, fast_stream_t *st)
+{
+    ngx_pmap_server_conf_t  *servercf = ft->data;
+    ngx_peer_connection_t    pc;
+    ngx_pool_t              *pool;
+    ngx_int_t                rc;
+
+    pool = ngx_create_pool(256, ft->log);
+    if (NULL == pool) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
+
+    pc.sockaddr = &servercf->proxy_pass.u.sockaddr;
+    pc.socklen = servercf->proxy_pass.socklen;
+    pc.name = &servercf->proxy_pass.name;
+    pc.get = ngx_event_get_peer;
+    pc.log = ft->log;
+    pc.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&pc);
+
+    if (NGX_ERROR == rc || NGX_BUSY == rc || NGX_DECLINED == rc) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    pc.connection->pool = pool;
+
+    fast_stream_attach(st, pc.connection, NGX_AGAIN == rc);
+
+    return NGX_OK;
+}
+
+static void
+ngx_pmap_server_close_sockets(void *data)
+{
+    ngx_array_t   *a = data;
+    ngx_socket_t  *s;
+    ngx_uint_t     i;
+
+    s = a->elts;
+
+    for (i = 0; i < a->nelts; i++) {
+        if (s[i] != (ngx_socket_t) -1) {
+            (void) ngx_close_socket(s[i]);
+        }
+    }
+}
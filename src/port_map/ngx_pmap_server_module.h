@@ -0,0 +1,27 @@
+#ifndef _NGX_PMAP_SERVER_MODULE_H_INCLUDED_
+#define _NGX_PMAP_SERVER_MODULE_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include "ngx_pmap.h"
+
+
+/* conf structure of ngx_pmap_server_module */
+typedef struct {
+    ngx_pmap_listen_t    listen;        /* fast tunnel control connections */
+    ngx_pmap_addr_t      proxy_pass;    /* where the streams are mapped to */
+
+    ngx_pmap_addr_t      kcp_addr;
+    ngx_flag_t           kcp_reuseport;
+
+    ngx_array_t         *kcp_sockets;   /* of ngx_socket_t, one per worker */
+} ngx_pmap_server_conf_t;
+
+
+extern ngx_module_t ngx_pmap_server_module;
+
+
+void ngx_pmap_server_init_connection(ngx_connection_t *c);
+
+#endif /* _NGX_PMAP_SERVER_MODULE_H_INCLUDED_ */